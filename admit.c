@@ -0,0 +1,315 @@
+/**
+ * @file admit.c
+ * @brief Admission of client connections
+ *
+ * Description: admit_accept() wraps accept() for both front ends so that no
+ * failure takes the proxy, and its warm cache, down. Errors the peer caused
+ * (a connection aborted before it was accepted, network errors Linux passes
+ * on from the new socket) are retried at once. Running out of descriptors is
+ * met with a descriptor held in reserve: it is closed to accept the oldest
+ * waiting connection, which is answered 503 and closed, then reopened, so
+ * clients get an answer instead of piling up in the backlog. Anything else
+ * makes the caller pause accepting for ACCEPT_PAUSE_MSEC.
+ *
+ * Accepted connections are counted against a global limit, while it is
+ * reached the front ends stop accepting and leave new connections in the
+ * listen backlog, and against a per client IP address limit, over which a
+ * connection is shed with a 503. Per client counts live in a hash table with
+ * a mutex per bucket, entries are freed as their last connection closes.
+ *
+ *
+ * @author Abhishek Basrithaya <abasrith@andrew.cmu.edu>
+ */
+#include "admit.h"
+#include "csapp.h"
+#include "log.h"
+#include "proxy.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Open client connections at most, 0 for no limit */
+static size_t admitMaxConns;
+/* Open connections of one client IP address at most, 0 for no limit */
+static size_t admitMaxPerClient;
+/* Open client connections counted against admitMaxConns */
+static size_t admitConns;
+static admit_bucket admitBuckets[ADMIT_BUCKETS];
+
+/**
+ * @brief Sets the connection limits
+ *
+ *
+ * @param[in]   maxConns        Open client connections at most, 0 for no limit
+ * @param[in]   maxPerClient    Open connections of one client IP address at
+ * most, 0 for no limit
+ *
+ * @return      void
+ */
+void admit_init(size_t maxConns, size_t maxPerClient) {
+    size_t i;
+
+    admitMaxConns = maxConns;
+    admitMaxPerClient = maxPerClient;
+    for (i = 0; i < ADMIT_BUCKETS; i++) {
+        if ((pthread_mutex_init(&admitBuckets[i].mutex, NULL)) != 0) {
+            fprintf(stderr, "Error: Initizing admission mutex");
+        }
+        admitBuckets[i].head = NULL;
+    }
+}
+
+/**
+ * @brief Opens a descriptor to hold in reserve for admit_accept()
+ *
+ *
+ * @return      int             Reserved descriptor, -1 if none could be opened
+ */
+int admit_reserve_fd(void) {
+    return open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+/**
+ * @brief Accepts a connection, retrying errors of that connection alone and
+ * shedding one waiting connection when out of descriptors
+ *
+ *
+ * @param[in]   listenfd        Listening socket
+ * @param[out]  *addr           Client address
+ * @param[in,out] *addrLen      Room in addr, then size of the address
+ * @param[in,out] *reserveFd    Descriptor from admit_reserve_fd(), -1 while
+ * none is held, in which case it is opened again first
+ *
+ * @return      int             Connected socket, -1 with errno EAGAIN when a
+ * non-blocking listenfd has nothing waiting, -1 with another errno when the
+ * caller should pause accepting
+ */
+int admit_accept(int listenfd, struct sockaddr *addr, socklen_t *addrLen,
+                 int *reserveFd) {
+    socklen_t room = *addrLen;
+    int connfd, err;
+
+    /* A reserve lost while out of descriptors comes back once some close */
+    if (*reserveFd < 0) {
+        *reserveFd = admit_reserve_fd();
+    }
+    while (1) {
+        *addrLen = room;
+        if ((connfd = accept(listenfd, addr, addrLen)) >= 0) {
+            return connfd;
+        }
+        err = errno;
+        switch (err) {
+        case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+        case EWOULDBLOCK:
+#endif
+            return -1;
+        case EINTR:
+        case ECONNABORTED:
+        case EPROTO:
+        case ENETDOWN:
+        case ENOPROTOOPT:
+        case EHOSTDOWN:
+        case ENONET:
+        case EHOSTUNREACH:
+        case EOPNOTSUPP:
+        case ENETUNREACH:
+            /* The connection went wrong, not the listening socket */
+            continue;
+        case EMFILE:
+        case ENFILE:
+            if (*reserveFd >= 0) {
+                close(*reserveFd);
+                *addrLen = room;
+                if ((connfd = accept(listenfd, addr, addrLen)) >= 0) {
+                    admit_shed(connfd);
+                }
+                *reserveFd = admit_reserve_fd();
+            }
+            log_printf(LOG_LEVEL_ERROR, "Out of descriptors, shedding load\n");
+            break;
+        default:
+            log_printf(LOG_LEVEL_ERROR, "Failed to accept request: %s\n",
+                       strerror(err));
+            break;
+        }
+        errno = err;
+        return -1;
+    }
+}
+
+/**
+ * @brief Tells whether the global connection limit is reached
+ *
+ *
+ * @return      bool            true when no connection should be accepted
+ */
+bool admit_full(void) {
+    return admitMaxConns > 0 &&
+           __atomic_load_n(&admitConns, __ATOMIC_RELAXED) >= admitMaxConns;
+}
+
+/**
+ * @brief Sleeps while accepting is paused
+ *
+ *
+ * @return      void
+ */
+void admit_pause(void) {
+    struct timespec pause = {0, ACCEPT_PAUSE_MSEC * 1000000L};
+    nanosleep(&pause, NULL);
+}
+
+/**
+ * @brief Extracts the IP address a client is counted under
+ *
+ *
+ * @param[in]   *addr           Client address
+ * @param[out]  *client         Gets the address
+ *
+ * @return      bool            false for an address family not counted
+ */
+static bool admit_key(const struct sockaddr *addr, admit_client *client) {
+    if (addr->sa_family == AF_INET) {
+        memcpy(client->addr, &((const struct sockaddr_in *)addr)->sin_addr, 4);
+        client->addrLen = 4;
+    } else if (addr->sa_family == AF_INET6) {
+        memcpy(client->addr, &((const struct sockaddr_in6 *)addr)->sin6_addr,
+               16);
+        client->addrLen = 16;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Hashes a client address to its bucket
+ *
+ *
+ * @param[in]   *client         Client with its address set
+ *
+ * @return      admit_bucket*   Bucket of the client
+ */
+static admit_bucket *admit_bucket_of(const admit_client *client) {
+    uint32_t hash = 2166136261u;
+    uint8_t i;
+
+    for (i = 0; i < client->addrLen; i++) {
+        hash ^= client->addr[i];
+        hash *= 16777619u;
+    }
+    return &admitBuckets[hash % ADMIT_BUCKETS];
+}
+
+/**
+ * @brief Counts an accepted connection against the limits
+ *
+ *
+ * @param[in]   *addr           Client address from accept()
+ * @param[out]  *client         Gets what was counted, for admit_client_end()
+ *
+ * @return      bool            true if admitted, false when over a limit and
+ * the connection should be shed with admit_shed()
+ */
+bool admit_client_begin(const struct sockaddr *addr, admit_client *client) {
+    admit_bucket *bucket;
+    admit_entry *entry;
+
+    client->addrLen = 0;
+    client->counted = false;
+    if (admitMaxConns > 0) {
+        if (__atomic_add_fetch(&admitConns, 1, __ATOMIC_RELAXED) >
+            admitMaxConns) {
+            __atomic_sub_fetch(&admitConns, 1, __ATOMIC_RELAXED);
+            return false;
+        }
+        client->counted = true;
+    }
+    if (admitMaxPerClient == 0 || !admit_key(addr, client)) {
+        return true;
+    }
+
+    bucket = admit_bucket_of(client);
+    pthread_mutex_lock(&bucket->mutex);
+    for (entry = bucket->head; entry != NULL; entry = entry->next) {
+        if (entry->addrLen == client->addrLen &&
+            memcmp(entry->addr, client->addr, client->addrLen) == 0) {
+            break;
+        }
+    }
+    if (entry == NULL) {
+        entry = Calloc(1, sizeof(admit_entry));
+        memcpy(entry->addr, client->addr, client->addrLen);
+        entry->addrLen = client->addrLen;
+        entry->next = bucket->head;
+        bucket->head = entry;
+    }
+    if (entry->conns >= admitMaxPerClient) {
+        pthread_mutex_unlock(&bucket->mutex);
+        client->addrLen = 0;
+        admit_client_end(client);
+        return false;
+    }
+    entry->conns++;
+    pthread_mutex_unlock(&bucket->mutex);
+    return true;
+}
+
+/**
+ * @brief Uncounts a closed connection, does nothing the second time
+ *
+ *
+ * @param[in,out] *client       What admit_client_begin() counted
+ *
+ * @return      void
+ */
+void admit_client_end(admit_client *client) {
+    admit_bucket *bucket;
+    admit_entry *entry, **link;
+
+    if (client->counted) {
+        __atomic_sub_fetch(&admitConns, 1, __ATOMIC_RELAXED);
+        client->counted = false;
+    }
+    if (client->addrLen == 0) {
+        return;
+    }
+    bucket = admit_bucket_of(client);
+    pthread_mutex_lock(&bucket->mutex);
+    for (link = &bucket->head; (entry = *link) != NULL; link = &entry->next) {
+        if (entry->addrLen == client->addrLen &&
+            memcmp(entry->addr, client->addr, client->addrLen) == 0) {
+            if (--entry->conns == 0) {
+                *link = entry->next;
+                Free(entry);
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&bucket->mutex);
+    client->addrLen = 0;
+}
+
+/**
+ * @brief Answers a connection the proxy has no room for with 503 Service
+ * Unavailable, without waiting on the client, and closes it
+ *
+ *
+ * @param[in]   fd              Accepted client socket
+ *
+ * @return      void
+ */
+void admit_shed(int fd) {
+    const char *response;
+    size_t len;
+
+    response = clienterror_response(CLIENT_ERROR_UNAVAILABLE, &len);
+    send(fd, response, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(fd);
+}
@@ -0,0 +1,56 @@
+/**
+ * @file admit.h
+ * @brief Header file for the admission of client connections
+ *
+ * Description: Accepts client connections through transient errors and
+ * descriptor exhaustion and enforces the global and per client connection
+ * limits, defines, structures and function prototypes.
+ *
+ *
+ * @author Abhishek Basrithaya <abasrith@andrew.cmu.edu>
+ */
+#ifndef ADMIT_H
+#define ADMIT_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/* Accepting stops this long when it fails or the proxy is full */
+#define ACCEPT_PAUSE_MSEC 100
+/* Buckets of the per client connection counts */
+#define ADMIT_BUCKETS 1024
+
+/* Client connection as counted against the limits */
+typedef struct {
+    uint8_t addr[16]; /* client IP address */
+    uint8_t addrLen;  /* bytes of addr used, 0 when not counted per client */
+    bool counted;     /* counted against the global limit */
+} admit_client;
+
+typedef struct admit_entry {
+    uint8_t addr[16];         /* client IP address */
+    uint8_t addrLen;          /* bytes of addr used */
+    size_t conns;             /* open connections of the client */
+    struct admit_entry *next; /* next client in the bucket */
+} admit_entry;
+
+typedef struct {
+    pthread_mutex_t mutex; /* protects head */
+    admit_entry *head;     /* clients hashing here */
+} admit_bucket;
+
+/* Function prototyping */
+void admit_init(size_t maxConns, size_t maxPerClient);
+int admit_reserve_fd(void);
+int admit_accept(int listenfd, struct sockaddr *addr, socklen_t *addrLen,
+                 int *reserveFd);
+bool admit_full(void);
+void admit_pause(void);
+bool admit_client_begin(const struct sockaddr *addr, admit_client *client);
+void admit_client_end(admit_client *client);
+void admit_shed(int fd);
+
+#endif /* ADMIT_H */
@@ -0,0 +1,493 @@
+/**
+ * @file bench.c
+ * @brief Load generator measuring the throughput and latency of the proxy
+ *
+ * Description: Worker threads issue HTTP/1.0 GETs through the proxy, one
+ * connection per request, as fast as the proxy answers them. Requests are
+ * split deterministically between a hot set of objects picked with Zipf
+ * popularity and cold objects each requested only once, in the proportion
+ * the hit ratio target asks for. Every hot object is fetched once before
+ * the clock starts, so hot requests hit the cache and cold ones miss it.
+ *
+ * The run reports requests per second, latency percentiles, proxy CPU time
+ * per request read from /proc and the hit ratio the proxy's metrics
+ * endpoint saw, one "name value" line each for bench.sh to compare against
+ * a baseline.
+ *
+ *
+ * @author Abhishek Basrithaya <abasrith@andrew.cmu.edu>
+ */
+#include <errno.h>
+#include <math.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Defaults of the command line options */
+#define DEFAULT_CONCURRENCY 32
+#define DEFAULT_REQUESTS 20000
+#define DEFAULT_OBJECTS 1000
+#define DEFAULT_ZIPF 0.9
+#define DEFAULT_HIT_PERCENT 90
+/* Longest request line and headers sent */
+#define REQUEST_SIZE 1024
+/* Bytes read from the proxy at a time */
+#define READ_SIZE (64 * 1024)
+
+/* Run parameters shared by the worker threads */
+typedef struct {
+    struct sockaddr_storage proxyAddr; /* where requests are sent */
+    socklen_t proxyAddrLen;
+    const char *origin;  /* host:port of the end server */
+    size_t requests;     /* timed requests */
+    size_t objects;      /* hot objects */
+    unsigned hitPercent; /* share of requests for hot objects */
+    double *zipfCdf;     /* cumulative popularity of the hot objects */
+    uint64_t *latencies; /* usec of every timed request */
+    size_t nextRequest;  /* next request index to claim, atomic */
+    size_t errors;       /* failed requests, atomic */
+    bool warming;        /* fetching every hot object once, untimed */
+} bench_run;
+
+typedef struct {
+    bench_run *run;
+    unsigned int seed; /* rand_r() state of the thread */
+} bench_worker_arg;
+
+/**
+ * @brief Reads a monotonic clock
+ *
+ *
+ * @return      uint64_t        Microseconds since an arbitrary point
+ */
+static uint64_t bench_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief Sends a request to the proxy on a new connection and reads the
+ * response up to EOF
+ *
+ *
+ * @param[in]   *run            Run parameters
+ * @param[in]   *request        Request head
+ * @param[out]  *response       Gets the start of the response, at least 16
+ * bytes
+ * @param[in]   size            Room in response, the rest is read and dropped
+ *
+ * @return      ssize_t         Bytes of the response, -1 on a socket error
+ */
+static ssize_t bench_exchange(bench_run *run, const char *request,
+                              char *response, size_t size) {
+    char scratch[READ_SIZE];
+    size_t len = strlen(request), sent = 0, total = 0;
+    ssize_t n;
+    int fd;
+
+    if ((fd = socket(run->proxyAddr.ss_family, SOCK_STREAM, 0)) < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&run->proxyAddr, run->proxyAddrLen) <
+        0) {
+        close(fd);
+        return -1;
+    }
+    while (sent < len) {
+        if ((n = write(fd, request + sent, len - sent)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            close(fd);
+            return -1;
+        }
+        sent += (size_t)n;
+    }
+    while (1) {
+        if (total < size) {
+            n = read(fd, response + total, size - total);
+        } else {
+            n = read(fd, scratch, sizeof(scratch));
+        }
+        if (n > 0) {
+            total += (size_t)n;
+        } else if (n == 0) {
+            break;
+        } else if (errno != EINTR) {
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+    if (total < size) {
+        response[total] = '\0';
+    } else {
+        response[size - 1] = '\0';
+    }
+    return (ssize_t)total;
+}
+
+/**
+ * @brief Fetches one object through the proxy
+ *
+ *
+ * @param[in]   *run            Run parameters
+ * @param[in]   *path           Path of the object on the end server
+ *
+ * @return      bool            true if the proxy answered 200
+ */
+static bool bench_fetch(bench_run *run, const char *path) {
+    char request[REQUEST_SIZE], status[64];
+    int code;
+
+    snprintf(request, sizeof(request),
+             "GET http://%s%s HTTP/1.0\r\nHost: %s\r\n\r\n", run->origin,
+             path, run->origin);
+    if (bench_exchange(run, request, status, sizeof(status)) < 0 ||
+        sscanf(status, "HTTP/1.%*c %d", &code) != 1) {
+        return false;
+    }
+    return code == 200;
+}
+
+/**
+ * @brief Picks a hot object with Zipf popularity
+ *
+ *
+ * @param[in]   *run            Run parameters
+ * @param[in,out] *seed         rand_r() state
+ *
+ * @return      size_t          Index of the object
+ */
+static size_t bench_zipf(bench_run *run, unsigned int *seed) {
+    double u = (double)rand_r(seed) / ((double)RAND_MAX + 1);
+    size_t lo = 0, hi = run->objects - 1, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (run->zipfCdf[mid] < u) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/**
+ * @brief Worker thread: claims requests until none are left
+ *
+ * Request i is cold when the number of cold requests among the first i + 1
+ * goes up, so exactly the miss share of requests is cold and cold request i
+ * asks for object i * (100 - hitPercent) / 100, which no other request does.
+ *
+ *
+ * @param[in]   *vargp          bench_worker_arg of the thread
+ *
+ * @return      void*           NULL
+ */
+static void *bench_worker(void *vargp) {
+    bench_worker_arg *arg = vargp;
+    bench_run *run = arg->run;
+    size_t total = run->warming ? run->objects : run->requests;
+    size_t missPercent = 100 - run->hitPercent, idx, cold;
+    char path[64];
+    uint64_t start;
+
+    while ((idx = __atomic_fetch_add(&run->nextRequest, 1,
+                                     __ATOMIC_RELAXED)) < total) {
+        cold = idx * missPercent / 100;
+        if (run->warming) {
+            snprintf(path, sizeof(path), "/hot/%zu", idx);
+        } else if ((idx + 1) * missPercent / 100 > cold) {
+            snprintf(path, sizeof(path), "/cold/%zu", cold);
+        } else {
+            snprintf(path, sizeof(path), "/hot/%zu",
+                     bench_zipf(run, &arg->seed));
+        }
+        start = bench_now();
+        if (!bench_fetch(run, path)) {
+            __atomic_fetch_add(&run->errors, 1, __ATOMIC_RELAXED);
+        }
+        if (!run->warming) {
+            run->latencies[idx] = bench_now() - start;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Runs the worker threads over all requests of a phase
+ *
+ *
+ * @param[in]   *run            Run parameters, warming set for the phase
+ * @param[in]   concurrency     Number of worker threads
+ *
+ * @return      void
+ */
+static void bench_phase(bench_run *run, size_t concurrency) {
+    pthread_t *tids = calloc(concurrency, sizeof(pthread_t));
+    bench_worker_arg *args = calloc(concurrency, sizeof(bench_worker_arg));
+    size_t i;
+
+    if (tids == NULL || args == NULL) {
+        fprintf(stderr, "Error: Initizing %zu workers\n", concurrency);
+        exit(1);
+    }
+    run->nextRequest = 0;
+    for (i = 0; i < concurrency; i++) {
+        args[i].run = run;
+        args[i].seed = (unsigned int)i + 1;
+        if (pthread_create(&tids[i], NULL, bench_worker, &args[i]) != 0) {
+            fprintf(stderr, "Error: Initizing worker %zu\n", i);
+            exit(1);
+        }
+    }
+    for (i = 0; i < concurrency; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    free(tids);
+    free(args);
+}
+
+/**
+ * @brief Reads the CPU time a process used so far from /proc
+ *
+ *
+ * @param[in]   pid             Process, 0 when not known
+ *
+ * @return      double          User and system seconds, -1 if unknown
+ */
+static double bench_cpu_seconds(long pid) {
+    char path[64], stat[1024], *fields;
+    unsigned long utime, stime;
+    FILE *fp;
+    size_t n;
+
+    if (pid <= 0) {
+        return -1;
+    }
+    snprintf(path, sizeof(path), "/proc/%ld/stat", pid);
+    if ((fp = fopen(path, "r")) == NULL) {
+        return -1;
+    }
+    n = fread(stat, 1, sizeof(stat) - 1, fp);
+    fclose(fp);
+    stat[n] = '\0';
+    /* The command name may hold blanks, fields resume after its ')' */
+    if ((fields = strrchr(stat, ')')) == NULL ||
+        sscanf(fields + 1,
+               " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime,
+               &stime) != 2) {
+        return -1;
+    }
+    return (double)(utime + stime) / (double)sysconf(_SC_CLK_TCK);
+}
+
+/**
+ * @brief Reads the proxy's cache lookup and hit counters from its metrics
+ * endpoint
+ *
+ *
+ * @param[in]   *run            Run parameters
+ * @param[out]  *lookups        proxy_cache_lookups_total
+ * @param[out]  *hits           proxy_cache_hits_total
+ *
+ * @return      bool            false when the proxy did not report them
+ */
+static bool bench_cache_counters(bench_run *run, double *lookups,
+                                 double *hits) {
+    static char response[4 * READ_SIZE];
+    const char *line;
+
+    if (bench_exchange(run, "GET /metrics HTTP/1.0\r\n\r\n", response,
+                       sizeof(response)) < 0 ||
+        (line = strstr(response, "\nproxy_cache_lookups_total ")) == NULL ||
+        sscanf(line, " proxy_cache_lookups_total %lf", lookups) != 1 ||
+        (line = strstr(response, "\nproxy_cache_hits_total ")) == NULL ||
+        sscanf(line, " proxy_cache_hits_total %lf", hits) != 1) {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Orders latencies for qsort()
+ *
+ *
+ * @param[in]   *a              First latency
+ * @param[in]   *b              Second latency
+ *
+ * @return      int             Sign of a - b
+ */
+static int bench_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Reads a latency percentile off the sorted latencies
+ *
+ *
+ * @param[in]   *run            Run with latencies sorted
+ * @param[in]   permille        Percentile in tenths of a percent
+ *
+ * @return      uint64_t        Latency in usec
+ */
+static uint64_t bench_percentile(bench_run *run, size_t permille) {
+    size_t idx = (run->requests * permille + 999) / 1000;
+
+    return run->latencies[idx > 0 ? idx - 1 : 0];
+}
+
+/**
+ * @brief prints the command line usage and exits
+ *
+ *
+ * @param[in]   *prog               Program name
+ *
+ * @return      void
+ */
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage :%s [-c concurrency] [-n requests] [-u hot objects] "
+            "[-s zipf exponent] [-H hit ratio percent] [-p proxy pid] "
+            "<proxy host> <proxy port> <origin host:port>\n",
+            prog);
+    exit(1);
+}
+
+/**
+ * @brief main
+ *
+ *
+ * @param[in]   argc                Number of arguments passed
+ * @param[in]   **argv              Array of arguments
+ *
+ * @return      int                 0 when every request succeeded
+ */
+int main(int argc, char **argv) {
+    bench_run run;
+    struct addrinfo hints, *addr;
+    long concurrency = DEFAULT_CONCURRENCY, requests = DEFAULT_REQUESTS;
+    long objects = DEFAULT_OBJECTS, hitPercent = DEFAULT_HIT_PERCENT;
+    long proxyPid = 0;
+    double zipf = DEFAULT_ZIPF, weight = 0, cpuStart, cpuEnd, seconds;
+    double lookupsStart, hitsStart, lookupsEnd, hitsEnd;
+    bool haveCounters;
+    uint64_t start;
+    size_t i;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:n:u:s:H:p:")) != -1) {
+        switch (opt) {
+        case 'c':
+            concurrency = atol(optarg);
+            break;
+        case 'n':
+            requests = atol(optarg);
+            break;
+        case 'u':
+            objects = atol(optarg);
+            break;
+        case 's':
+            zipf = atof(optarg);
+            break;
+        case 'H':
+            hitPercent = atol(optarg);
+            break;
+        case 'p':
+            proxyPid = atol(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if ((argc - optind) != 3 || concurrency <= 0 || requests <= 0 ||
+        objects <= 0 || zipf < 0 || hitPercent < 0 || hitPercent > 100) {
+        usage(argv[0]);
+    }
+
+    memset(&run, 0, sizeof(run));
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(argv[optind], argv[optind + 1], &hints, &addr) != 0) {
+        fprintf(stderr, "Failed to resolve proxy %s:%s\n", argv[optind],
+                argv[optind + 1]);
+        exit(1);
+    }
+    memcpy(&run.proxyAddr, addr->ai_addr, addr->ai_addrlen);
+    run.proxyAddrLen = addr->ai_addrlen;
+    freeaddrinfo(addr);
+    run.origin = argv[optind + 2];
+    run.requests = (size_t)requests;
+    run.objects = (size_t)objects;
+    run.hitPercent = (unsigned)hitPercent;
+    run.zipfCdf = calloc(run.objects, sizeof(double));
+    run.latencies = calloc(run.requests, sizeof(uint64_t));
+    if (run.zipfCdf == NULL || run.latencies == NULL) {
+        fprintf(stderr, "Error: Initizing %zu requests\n", run.requests);
+        exit(1);
+    }
+    for (i = 0; i < run.objects; i++) {
+        weight += 1 / pow((double)(i + 1), zipf);
+        run.zipfCdf[i] = weight;
+    }
+    for (i = 0; i < run.objects; i++) {
+        run.zipfCdf[i] /= weight;
+    }
+
+    /* Fill the cache with the hot set before anything is timed */
+    run.warming = true;
+    bench_phase(&run, (size_t)concurrency);
+    if (run.errors > 0) {
+        fprintf(stderr, "Warning: %zu hot objects failed to load\n",
+                run.errors);
+        run.errors = 0;
+    }
+
+    run.warming = false;
+    haveCounters = bench_cache_counters(&run, &lookupsStart, &hitsStart);
+    cpuStart = bench_cpu_seconds(proxyPid);
+    start = bench_now();
+    bench_phase(&run, (size_t)concurrency);
+    seconds = (double)(bench_now() - start) / 1e6;
+    cpuEnd = bench_cpu_seconds(proxyPid);
+    haveCounters = haveCounters &&
+                   bench_cache_counters(&run, &lookupsEnd, &hitsEnd);
+
+    qsort(run.latencies, run.requests, sizeof(uint64_t), bench_cmp);
+    printf("requests %zu\n", run.requests);
+    printf("errors %zu\n", run.errors);
+    printf("concurrency %ld\n", concurrency);
+    printf("seconds %.3f\n", seconds);
+    printf("req_per_sec %.1f\n", (double)run.requests / seconds);
+    printf("p50_usec %llu\n",
+           (unsigned long long)bench_percentile(&run, 500));
+    printf("p99_usec %llu\n",
+           (unsigned long long)bench_percentile(&run, 990));
+    printf("p999_usec %llu\n",
+           (unsigned long long)bench_percentile(&run, 999));
+    if (cpuStart >= 0 && cpuEnd >= 0) {
+        printf("cpu_usec_per_req %.1f\n",
+               (cpuEnd - cpuStart) * 1e6 / (double)run.requests);
+    }
+    if (haveCounters && lookupsEnd > lookupsStart) {
+        printf("hit_percent %.1f\n", (hitsEnd - hitsStart) * 100 /
+                                         (lookupsEnd - lookupsStart));
+    }
+    free(run.zipfCdf);
+    free(run.latencies);
+    return run.errors > 0;
+}
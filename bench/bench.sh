@@ -0,0 +1,132 @@
+#!/usr/bin/env bash
+#
+# Benchmarks the proxy against the Tiny web server and compares the results
+# with a baseline. Run through "make bench" from the top directory.
+#
+# usage: ./bench.sh [-b]
+#   -b  save the results as the new baseline instead of comparing
+#
+# Every knob is an environment variable, see the defaults below. The object
+# size mix is a list of size:weight pairs, sizes in bytes, weights relative.
+# A run fails when throughput drops or p99 latency rises by more than
+# BENCH_TOLERANCE percent against baseline.txt, or when requests fail.
+
+cd "$(dirname "$0")"
+
+PROXY=${BENCH_PROXY:-../proxy}
+PROXY_ARGS=${BENCH_PROXY_ARGS:-"-m 67108864"}
+TINY=${BENCH_TINY:-../tiny/tiny}
+CONCURRENCY=${BENCH_CONCURRENCY:-32}
+REQUESTS=${BENCH_REQUESTS:-20000}
+OBJECTS=${BENCH_OBJECTS:-1000}
+ZIPF=${BENCH_ZIPF:-0.9}
+HIT=${BENCH_HIT:-90}
+SIZES=${BENCH_SIZES:-"512:50 4096:30 32768:15 90000:5"}
+TOLERANCE=${BENCH_TOLERANCE:-10}
+
+RESULTS=results.txt
+BASELINE=baseline.txt
+
+save_baseline=0
+if [ "$1" == "-b" ]; then
+  save_baseline=1
+fi
+
+# Random unused port
+free_port() {
+  local port
+  while true; do
+    port=$((20000 + RANDOM % 10000))
+    if ! (exec 3<>/dev/tcp/localhost/${port}) 2>/dev/null; then
+      echo ${port}
+      return
+    fi
+  done
+}
+
+# Wait until something listens on a port
+wait_port() {
+  local i
+  for i in $(seq 1 50); do
+    if (exec 3<>/dev/tcp/localhost/$1) 2>/dev/null; then
+      return 0
+    fi
+    sleep 0.1
+  done
+  echo "Nothing listening on port $1"
+  return 1
+}
+
+# Hot objects get sizes drawn from the mix, cold ones are hard links to
+# them, one per cold request the hit ratio target leaves
+echo "Generating ${OBJECTS} hot objects"
+rm -rf www
+mkdir -p www/hot www/cold
+echo "${SIZES}" | tr ' ' '\n' | awk -F: -v n=${OBJECTS} '
+  NF == 2 { size[++k] = $1; weight[k] = $2; total += $2 }
+  END {
+    srand(1)
+    for (i = 0; i < n; i++) {
+      r = rand() * total
+      for (j = 1; j < k && r >= weight[j]; j++)
+        r -= weight[j]
+      print i, size[j]
+    }
+  }' | while read obj size; do
+  head -c ${size} /dev/zero | tr '\0' 'x' > www/hot/${obj}
+done
+cold=$((REQUESTS * (100 - HIT) / 100))
+echo "Linking ${cold} cold objects"
+for ((i = 0; i < cold; i++)); do
+  ln www/hot/$((i % OBJECTS)) www/cold/${i}
+done
+
+tiny_port=$(free_port)
+proxy_port=$(free_port)
+# Tiny serves the files of its working directory
+tiny_path=$(readlink -f ${TINY})
+(cd www && exec ${tiny_path} ${tiny_port} > /dev/null 2>&1) &
+tiny_pid=$!
+${PROXY} ${PROXY_ARGS} ${proxy_port} > /dev/null 2>&1 &
+proxy_pid=$!
+trap 'kill ${tiny_pid} ${proxy_pid} 2>/dev/null' EXIT
+wait_port ${tiny_port} || exit 1
+wait_port ${proxy_port} || exit 1
+
+echo "Running ${REQUESTS} requests, concurrency ${CONCURRENCY}," \
+  "zipf ${ZIPF}, hit target ${HIT}%"
+./bench -c ${CONCURRENCY} -n ${REQUESTS} -u ${OBJECTS} -s ${ZIPF} \
+  -H ${HIT} -p ${proxy_pid} localhost ${proxy_port} \
+  localhost:${tiny_port} > ${RESULTS}
+status=$?
+cat ${RESULTS}
+if [ ${status} -ne 0 ]; then
+  echo "FAILED: requests failed"
+  exit 1
+fi
+
+if [ ${save_baseline} -eq 1 ]; then
+  cp ${RESULTS} ${BASELINE}
+  echo "Saved baseline to bench/${BASELINE}"
+  exit 0
+fi
+if [ ! -f ${BASELINE} ]; then
+  echo "No baseline yet, run make bench-baseline to save one"
+  exit 0
+fi
+
+# Worse by more than the tolerance in the direction that hurts
+awk -v tol=${TOLERANCE} '
+  FNR == NR { base[$1] = $2; next }
+  $1 == "req_per_sec" && $2 < base[$1] * (1 - tol / 100) { bad = 1 }
+  $1 == "p99_usec" && $2 > base[$1] * (1 + tol / 100) { bad = 1 }
+  $1 in base && ($1 == "req_per_sec" || $1 ~ /_usec/) {
+    printf "%-18s %12s -> %12s (%+.1f%%)\n", $1, base[$1], $2,
+           base[$1] ? ($2 - base[$1]) * 100 / base[$1] : 0
+  }
+  END { exit bad }' ${BASELINE} ${RESULTS}
+if [ $? -ne 0 ]; then
+  echo "REGRESSION: worse than bench/${BASELINE} by more than ${TOLERANCE}%"
+  exit 1
+fi
+echo "Within ${TOLERANCE}% of bench/${BASELINE}"
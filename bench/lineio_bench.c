@@ -0,0 +1,200 @@
+/**
+ * @file lineio_bench.c
+ * @brief Microbenchmark of lineio_readline() against rio_readlineb()
+ *
+ * Description: Writes a stream of browser-like request heads to a temporary
+ * file and reads it back line by line through a rio buffer, once with
+ * rio_readlineb() from csapp.c, which moves one byte per rio_read() call, and
+ * once with lineio_readline(), which finds the line feed with memchr() and
+ * copies the whole line at once. Both readers must return the same lines.
+ *
+ * The run reports nanoseconds per line of each reader, the best of several
+ * rounds, and the speedup, one "name value" line each like bench.c.
+ *
+ *
+ * @author Abhishek Basrithaya <abasrith@andrew.cmu.edu>
+ */
+#include "csapp.h"
+#include "lineio.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Defaults of the command line options */
+#define DEFAULT_REQUESTS 100000
+#define DEFAULT_ROUNDS 5
+
+/* Header lines of every request head, after its request line */
+static const char *bench_hdrs[] = {
+    "Host: www.example.com\r\n",
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 "
+    "Firefox/115.0\r\n",
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+    "image/avif,image/webp,*/*;q=0.8\r\n",
+    "Accept-Language: en-US,en;q=0.5\r\n",
+    "Accept-Encoding: gzip, deflate, br\r\n",
+    "Referer: http://www.example.com/index.html\r\n",
+    "Cookie: session=4f2a9c1e7b3d8a60; theme=dark; lang=en\r\n",
+    "Connection: keep-alive\r\n",
+    "Cache-Control: max-age=0\r\n",
+    "\r\n",
+};
+
+/* Reader under test, rio_readlineb() or lineio_readline() */
+typedef ssize_t (*bench_reader)(rio_t *rp, void *usrbuf, size_t maxlen);
+
+/**
+ * @brief Reads a monotonic clock
+ *
+ *
+ * @return      uint64_t        Nanoseconds since an arbitrary point
+ */
+static uint64_t bench_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * @brief lineio_readline() with the signature of rio_readlineb()
+ *
+ *
+ * @param[in,out] *rp           rio buffer
+ * @param[out]  *usrbuf         NUL terminated line
+ * @param[in]   maxlen          Room in usrbuf
+ *
+ * @return      ssize_t         Bytes read, 0 at EOF, -1 on error
+ */
+static ssize_t bench_lineio(rio_t *rp, void *usrbuf, size_t maxlen) {
+    return lineio_readline(rp, usrbuf, maxlen);
+}
+
+/**
+ * @brief Writes the request stream to an unlinked temporary file
+ *
+ *
+ * @param[in]   requests        Request heads to write
+ * @param[out]  *lines          Lines written
+ *
+ * @return      int             Descriptor of the file
+ */
+static int bench_stream(size_t requests, size_t *lines) {
+    char path[] = "/tmp/lineio_benchXXXXXX", line[MAXLINE];
+    size_t i, h, hdrCnt = sizeof(bench_hdrs) / sizeof(bench_hdrs[0]);
+    int fd, len;
+
+    if ((fd = mkstemp(path)) < 0) {
+        perror("mkstemp");
+        exit(1);
+    }
+    unlink(path);
+    *lines = 0;
+    for (i = 0; i < requests; i++) {
+        len = snprintf(line, sizeof(line),
+                       "GET http://www.example.com/static/img/%zu.png "
+                       "HTTP/1.1\r\n",
+                       i);
+        rio_writen(fd, line, (size_t)len);
+        for (h = 0; h < hdrCnt; h++) {
+            rio_writen(fd, bench_hdrs[h], strlen(bench_hdrs[h]));
+        }
+        *lines += 1 + hdrCnt;
+    }
+    return fd;
+}
+
+/**
+ * @brief Reads the whole stream line by line with one reader
+ *
+ *
+ * @param[in]   fd              Stream written by bench_stream()
+ * @param[in]   reader          Reader under test
+ * @param[out]  *lines          Lines read
+ * @param[out]  *sum            Checksum of the bytes read
+ *
+ * @return      uint64_t        Nanoseconds the reads took
+ */
+static uint64_t bench_read(int fd, bench_reader reader, size_t *lines,
+                           uint64_t *sum) {
+    char buf[MAXLINE];
+    rio_t rio;
+    ssize_t n, i;
+    uint64_t start;
+
+    lseek(fd, 0, SEEK_SET);
+    rio_readinitb(&rio, fd);
+    *lines = 0;
+    *sum = 0;
+    start = bench_now();
+    while ((n = reader(&rio, buf, MAXLINE)) > 0) {
+        (*lines)++;
+        for (i = 0; i < n; i++) {
+            *sum = *sum * 31 + (unsigned char)buf[i];
+        }
+    }
+    return bench_now() - start;
+}
+
+/**
+ * @brief Times both readers over the same stream and reports the best round
+ * of each
+ *
+ * usage: lineio_bench [-n requests] [-r rounds]
+ */
+int main(int argc, char **argv) {
+    size_t requests = DEFAULT_REQUESTS, rounds = DEFAULT_ROUNDS, round;
+    size_t written, rioLines, lineioLines;
+    uint64_t rioSum, lineioSum, rioBest = UINT64_MAX, lineioBest = UINT64_MAX;
+    uint64_t elapsed;
+    int opt, fd;
+
+    while ((opt = getopt(argc, argv, "n:r:")) != -1) {
+        switch (opt) {
+        case 'n':
+            requests = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            rounds = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n requests] [-r rounds]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (requests == 0 || rounds == 0) {
+        fprintf(stderr, "Error: requests and rounds must be positive\n");
+        exit(1);
+    }
+
+    fd = bench_stream(requests, &written);
+    for (round = 0; round < rounds; round++) {
+        elapsed = bench_read(fd, rio_readlineb, &rioLines, &rioSum);
+        if (elapsed < rioBest) {
+            rioBest = elapsed;
+        }
+        elapsed = bench_read(fd, bench_lineio, &lineioLines, &lineioSum);
+        if (elapsed < lineioBest) {
+            lineioBest = elapsed;
+        }
+    }
+    close(fd);
+    if (rioLines != written || lineioLines != written ||
+        rioSum != lineioSum) {
+        fprintf(stderr,
+                "Error: readers disagree, %zu lines written, rio_readlineb "
+                "read %zu, lineio_readline read %zu\n",
+                written, rioLines, lineioLines);
+        exit(1);
+    }
+
+    printf("lines %zu\n", written);
+    printf("rio_readlineb_ns_per_line %.1f\n", (double)rioBest / written);
+    printf("lineio_readline_ns_per_line %.1f\n",
+           (double)lineioBest / written);
+    printf("speedup %.2f\n", (double)rioBest / (double)lineioBest);
+    return 0;
+}
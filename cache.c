@@ -2,64 +2,579 @@
  * @file cache.c
  * @brief Basic LRU cache definition to handle client web requests
  *
- * Description: An LRU cache with max cache size of MAX_CACHE_SIZE, where each
- * object cached has a max size of MAX_OBJECT_SIZE each, a doubly linked list is
+ * Description: An LRU cache with a max cache size and max object size set at
+ * startup (DEFAULT_MAX_CACHE_SIZE and DEFAULT_MAX_OBJECT_SIZE unless
+ * overridden), a doubly linked list is
  * utlised to add to cache line and evit from cache line. new server response
  * objects are cached at the tail and evicction is carried out from the head of
- * the implicit list. Single global mutex lock is utilised for thread
- * synchronisation.
+ * the implicit list. A chained hash table keyed by the URI indexes the same
+ * blocks, so lookups do not scan the list; every block stores its precomputed
+ * URI hash to skip string compares against other chains' keys.
+ *
+ * The cache is split into independently locked shards selected by URI hash.
+ * Each shard owns its LRU list, hash index, size accounting and eviction, and
+ * an equal share of the max cache size, so lookups of different URIs only contend
+ * when they land on the same shard. One reader-writer lock per shard is
+ * utilised for thread synchronisation.
+ *
+ * Hits only take the shard lock shared and bump the block reference count
+ * atomically. Promotion to the tail is sampled: a block that already sits in
+ * the youngest quarter of the list is left in place, and an older one is only
+ * relinked if the shard's LRU list mutex can be taken without waiting, so
+ * concurrent readers of a hot object never serialize on it. Recency is exact
+ * without contention and approximate under it.
+ *
+ * Eviction never waits for readers: the cache owns one reference to every
+ * linked block, eviction unlinks the block and drops that reference, and
+ * whoever drops the last reference frees the block.
+ *
+ * Blocks, URI keys and objects come from the size-class slab allocator in
+ * slab.c rather than straight from the heap.
+ *
+ * Which block goes is up to the eviction policy picked at startup. Strict LRU
+ * keeps the behaviour above. SLRU splits a shard into a probation list new
+ * blocks enter and a protected list a second hit moves them to, so a scan of
+ * one-off objects only cycles through probation. W-TinyLFU puts a small LRU
+ * admission window in front of SLRU and lets a block leaving the window into
+ * the main area only if a count-min sketch of recent lookups rates it more
+ * popular than every block it would displace. GDSF ignores recency and keeps
+ * a min-heap keyed on an inflation clock plus hits per byte, so one large
+ * object goes before many small hot ones; LFU-DA is the same with misses
+ * costing their size, which favours byte hit ratio instead. Independently of
+ * the policy, size-aware admission can turn a new object away with a
+ * probability growing with its size. Each shard counts lookups, hits and
+ * bytes so policies can be compared on object and byte hit ratio.
+ *
+ * With the disk tier of disk.c enabled, evicted blocks are written there and
+ * a lookup missing in memory tries the disk before giving up, publishing the
+ * object back into memory on success. A block loaded that way is known to
+ * still be on disk and is not written again when evicted.
+ *
+ * Every block carries the freshness of its response as read by fresh.c when
+ * it was published: until freshUntil it is served as is, until staleUntil
+ * (stale-while-revalidate) it may be served while one background
+ * revalidation claimed with cache_claim_revalidation() runs, and after that
+ * it must be revalidated first. A 304 passed to cache_refresh() makes the
+ * block fresh again in place, a full response published for the same URI
+ * replaces it. Responses fresh.c says a shared cache must not store are
+ * handed back as private blocks.
+ *
+ * With compression enabled, a fill encoding.c finds compressible is stored
+ * gzip coded in a block of its own, while the identity coded original goes
+ * back to the filling client as a private block. Blocks remember whether
+ * they hold a gzip coded response, so the front ends know when a client
+ * needs it decoded.
+ *
+ * snapshot.c saves the cached blocks in eviction order with cache_collect()
+ * and restores them on startup with cache_restore(), keeping the freshness
+ * they were saved with. A lookup missing in memory tries the snapshot of
+ * the previous run before the disk tier while a restore is under way.
  *
  *
  * @author Abhishek Basrithaya <abasrith@andrew.cmu.edu>
  */
 #include "cache.h"
 #include "csapp.h"
+#include "disk.h"
+#include "encoding.h"
+#include "fresh.h"
+#include "metrics.h"
+#include "slab.h"
+#include "snapshot.h"
+#include <math.h>
+#include <stdlib.h>
 #include <string.h>
 
 /* Global cache structure */
 Cache cache;
 
+/* Function prototyping */
+static cache_block *cache_publish(const char *uri, char *buf, size_t buffSize,
+                                  bool onDisk, time_t storedAt);
+
+/**
+ * @brief Sizes the count-min sketch of a shard after the number of objects
+ * its share of the cache is expected to hold
+ *
+ *
+ * @param[in]   *sketch         Sketch to initialise
+ * @param[in]   cacheSize       Bytes the shard may hold
+ *
+ * @return      void
+ */
+static void cache_sketch_init(cache_sketch *sketch, size_t cacheSize) {
+    size_t width = 64;
+
+    while (width < cacheSize / CACHE_SKETCH_OBJECT_SIZE)
+        width *= 2;
+    sketch->width = width;
+    sketch->counters = Calloc(CACHE_SKETCH_DEPTH * width, sizeof(uint8_t));
+    sketch->additions = 0;
+    sketch->resetAt = CACHE_SKETCH_RESET_FACTOR * width;
+}
+
 /**
- * @brief Initialises an LRU cache
+ * @brief Initialises an LRU cache split into shardCnt independently locked
+ * shards
+ *
+ * The shard count is lowered when an equal share of maxCacheSize could not
+ * hold an object of maxObjectSize.
  *
  *
+ * @param[in]   shardCnt        Requested number of shards
+ * @param[in]   *policy         Eviction policy from cache_policy_by_name()
+ * @param[in]   maxCacheSize    Bytes all shards may hold together
+ * @param[in]   maxObjectSize   Largest response to cache, at most
+ * maxCacheSize
+ * @param[in]   admitSize       Objects are admitted with probability
+ * exp(-size / admitSize), 0 admits every object
+ * @param[in]   compress        Store compressible responses gzip coded
+ *
  * @return      void
  */
-void cache_init() {
-    cache.cache_size = 0;
-    cache.cacheBlockHead = NULL;
-    cache.cacheBlockTail = NULL;
-    if ((pthread_mutex_init(&cache.rwMutex, NULL)) != 0) {
-        fprintf(stderr, "Error: Initizing mutex");
+void cache_init(size_t shardCnt, const cache_policy *policy,
+                size_t maxCacheSize, size_t maxObjectSize, size_t admitSize,
+                bool compress) {
+    size_t i;
+    cache_shard *shard;
+
+    if (shardCnt == 0)
+        shardCnt = 1;
+    if (shardCnt > maxCacheSize / maxObjectSize) {
+        fprintf(stderr, "Warning: %zu cache shards too small, using %zu\n",
+                shardCnt, maxCacheSize / maxObjectSize);
+        shardCnt = maxCacheSize / maxObjectSize;
+    }
+    slab_init();
+    cache.shardCnt = shardCnt;
+    cache.policy = policy;
+    cache.maxCacheSize = maxCacheSize;
+    cache.maxObjectSize = maxObjectSize;
+    cache.admitSize = admitSize;
+    cache.compress = compress;
+    cache.shards = Calloc(shardCnt, sizeof(cache_shard));
+    for (i = 0; i < shardCnt; i++) {
+        shard = &cache.shards[i];
+        shard->cache_size = 0;
+        shard->max_cache_size = maxCacheSize / shardCnt;
+        /* Lists start empty, Calloc zeroed them */
+        shard->windowCap = 0;
+        if (policy->countsFrequency) {
+            shard->windowCap =
+                shard->max_cache_size * CACHE_WINDOW_PERCENT / 100;
+            cache_sketch_init(&shard->sketch, shard->max_cache_size);
+        }
+        shard->protectedCap = (shard->max_cache_size - shard->windowCap) *
+                              CACHE_PROTECTED_PERCENT / 100;
+        shard->hashBucketCnt = CACHE_HASH_INIT_BUCKETS;
+        shard->hashBuckets =
+            Calloc(shard->hashBucketCnt, sizeof(cache_block *));
+        shard->blockCnt = 0;
+        shard->lruTick = 0;
+        /* The GDSF heap and clock start empty, Calloc zeroed them */
+        shard->admitSeed = (unsigned int)i + 1;
+        if ((pthread_mutex_init(&shard->lruMutex, NULL)) != 0) {
+            fprintf(stderr, "Error: Initizing mutex");
+        }
+        if ((pthread_rwlock_init(&shard->rwMutex, NULL)) != 0) {
+            fprintf(stderr, "Error: Initizing rwlock");
+        }
     }
 }
 
 /**
- * @brief Acquires lock to global mutex for thread synchronisation
+ * @brief Returns the largest response size the cache takes
+ *
+ *
+ * @return      size_t          Max object size given to cache_init()
+ */
+size_t cache_max_object_size(void) { return cache.maxObjectSize; }
+
+/**
+ * @brief Computes the 32-bit FNV-1a hash of a URI key
+ *
  *
+ * @param[in]   *url            URL key to hash
+ *
+ * @return      uint32_t        Hash of the key
+ */
+uint32_t cache_hash(const char *url) {
+    uint32_t hash = 2166136261u;
+    while (*url != '\0') {
+        hash ^= (unsigned char)*url++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * @brief Returns the shard responsible for a URI hash
+ *
+ * The shard is picked from the upper hash bits, the bucket inside the shard
+ * from the lower ones, so the two choices stay independent.
+ *
+ *
+ * @param[in]   hash            URI hash from cache_hash()
+ *
+ * @return      cache_shard*    Owning shard
+ */
+cache_shard *cache_shard_of(uint32_t hash) {
+    return &cache.shards[(hash >> 16) % cache.shardCnt];
+}
+
+/**
+ * @brief Acquires exclusive lock to a shard for thread synchronisation
+ *
+ *
+ * @param[in]   *shard          Shard to lock
  *
  * @return      void
  */
-void lockMutex() {
-    if ((pthread_mutex_lock(&cache.rwMutex)) != 0) {
+void lockMutex(cache_shard *shard) {
+    if ((pthread_rwlock_wrlock(&shard->rwMutex)) != 0) {
         fprintf(stderr, "Error: Locking mutex");
     }
 }
 /**
- * @brief Releases lock to global mutex for thread synchronisation
+ * @brief Acquires shared lock to a shard, enough for lookups
  *
  *
+ * @param[in]   *shard          Shard to lock
+ *
  * @return      void
  */
-void unLockMutex() {
-    if ((pthread_mutex_unlock(&cache.rwMutex)) != 0) {
+void readLockMutex(cache_shard *shard) {
+    if ((pthread_rwlock_rdlock(&shard->rwMutex)) != 0) {
+        fprintf(stderr, "Error: Locking mutex");
+    }
+}
+/**
+ * @brief Releases a shared or exclusive lock to a shard
+ *
+ *
+ * @param[in]   *shard          Shard to unlock
+ *
+ * @return      void
+ */
+void unLockMutex(cache_shard *shard) {
+    if ((pthread_rwlock_unlock(&shard->rwMutex)) != 0) {
         fprintf(stderr, "Error: Unlocking mutex");
     }
 }
+/**
+ * @brief Unlinks a cache block from the LRU list holding it
+ *
+ *
+ * @param[in]   *shard          Shard owning the block
+ * @param[in]   *cacheLinePtr   Cache block to unlink
+ *
+ * @return      void
+ */
+static void cache_list_unlink(cache_shard *shard, cache_block *cacheLinePtr) {
+    cache_list *list = &shard->segments[cacheLinePtr->segment];
+    cache_block *prevPtr = cacheLinePtr->previousBlock;
+    cache_block *nextPtr = cacheLinePtr->nextBlock;
+
+    if (prevPtr != NULL)
+        prevPtr->nextBlock = nextPtr;
+    else
+        list->cacheBlockHead = nextPtr;
+    if (nextPtr != NULL)
+        nextPtr->previousBlock = prevPtr;
+    else
+        list->cacheBlockTail = prevPtr;
+    list->listSize -= cacheLinePtr->cache_obj_size;
+    cacheLinePtr->nextBlock = NULL;
+    cacheLinePtr->previousBlock = NULL;
+}
+
+/**
+ * @brief Appends a cache block at the tail (most recently used end) of one of
+ * the shard's LRU lists
+ *
+ *
+ * @param[in]   *shard          Shard owning the block
+ * @param[in]   *cacheLinePtr   Cache block to append
+ * @param[in]   segment         List to append to, one of CACHE_SEG_*
+ *
+ * @return      void
+ */
+static void cache_list_append(cache_shard *shard, cache_block *cacheLinePtr,
+                              int segment) {
+    cache_list *list = &shard->segments[segment];
+
+    cacheLinePtr->nextBlock = NULL;
+    cacheLinePtr->previousBlock = list->cacheBlockTail;
+    if (list->cacheBlockTail != NULL)
+        ((cache_block *)list->cacheBlockTail)->nextBlock = cacheLinePtr;
+    else
+        list->cacheBlockHead = cacheLinePtr;
+    list->cacheBlockTail = cacheLinePtr;
+    list->listSize += cacheLinePtr->cache_obj_size;
+    __atomic_store_n(&cacheLinePtr->segment, (unsigned char)segment,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&cacheLinePtr->lruTick,
+                     __atomic_add_fetch(&shard->lruTick, 1, __ATOMIC_RELAXED),
+                     __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Tells whether a block sits in the youngest quarter of the shard's
+ * lists, where its position barely matters
+ *
+ *
+ * @param[in]   *shard          Shard owning the block
+ * @param[in]   *cacheLinePtr   Cache block that was hit
+ *
+ * @return      bool            true if moving it to a tail can be skipped
+ */
+static bool cache_block_recent(cache_shard *shard, cache_block *cacheLinePtr) {
+    unsigned long now = __atomic_load_n(&shard->lruTick, __ATOMIC_RELAXED);
+    unsigned long age =
+        now - __atomic_load_n(&cacheLinePtr->lruTick, __ATOMIC_RELAXED);
+
+    return age < (shard->blockCnt / 4) + 1;
+}
+
+/**
+ * @brief Strict LRU: moves a block that was just hit to the tail of its list,
+ * unless it is recent enough already or another reader is relinking the list
+ *
+ * Called with the shard lock held shared. Readers that do promote serialise on
+ * lruMutex; writers hold the shard lock exclusively and so never overlap them.
+ *
+ *
+ * @param[in]   *shard          Shard owning the block
+ * @param[in]   *cacheLinePtr   Cache block that was hit
+ *
+ * @return      void
+ */
+static void lru_touch(cache_shard *shard, cache_block *cacheLinePtr) {
+    int segment;
+
+    if (cache_block_recent(shard, cacheLinePtr))
+        return;
+    if (pthread_mutex_trylock(&shard->lruMutex) != 0)
+        return;
+    segment = cacheLinePtr->segment;
+    if (cacheLinePtr != shard->segments[segment].cacheBlockTail) {
+        cache_list_unlink(shard, cacheLinePtr);
+        cache_list_append(shard, cacheLinePtr, segment);
+    }
+    pthread_mutex_unlock(&shard->lruMutex);
+}
+
+/**
+ * @brief SLRU: moves a block hit on probation to the protected list, demoting
+ * the oldest protected blocks back to probation once it outgrows its share;
+ * blocks on any other list are promoted like under strict LRU
+ *
+ * Called with the shard lock held shared, relinks under lruMutex.
+ *
+ *
+ * @param[in]   *shard          Shard owning the block
+ * @param[in]   *cacheLinePtr   Cache block that was hit
+ *
+ * @return      void
+ */
+static void slru_touch(cache_shard *shard, cache_block *cacheLinePtr) {
+    cache_list *protectedList = &shard->segments[CACHE_SEG_PROTECTED];
+    cache_block *demoted;
+
+    if (__atomic_load_n(&cacheLinePtr->segment, __ATOMIC_RELAXED) !=
+        CACHE_SEG_PROBATION) {
+        lru_touch(shard, cacheLinePtr);
+        return;
+    }
+    if (pthread_mutex_trylock(&shard->lruMutex) != 0)
+        return;
+    if (cacheLinePtr->segment == CACHE_SEG_PROBATION) {
+        cache_list_unlink(shard, cacheLinePtr);
+        cache_list_append(shard, cacheLinePtr, CACHE_SEG_PROTECTED);
+        while (protectedList->listSize > shard->protectedCap &&
+               protectedList->cacheBlockHead != cacheLinePtr) {
+            demoted = protectedList->cacheBlockHead;
+            cache_list_unlink(shard, demoted);
+            cache_list_append(shard, demoted, CACHE_SEG_PROBATION);
+        }
+    }
+    pthread_mutex_unlock(&shard->lruMutex);
+}
+
+/**
+ * @brief Counts one lookup of a URI in the shard's count-min sketch
+ *
+ * Called with the shard lock held shared or exclusively; counters saturate
+ * at CACHE_SKETCH_MAX_COUNT and are bumped atomically.
+ *
+ *
+ * @param[in]   *sketch         Shard's sketch
+ * @param[in]   hash            URI hash from cache_hash()
+ *
+ * @return      void
+ */
+static void cache_sketch_add(cache_sketch *sketch, uint32_t hash) {
+    uint8_t *counter;
+    uint32_t mix;
+    size_t row;
+
+    for (row = 0; row < CACHE_SKETCH_DEPTH; row++) {
+        /* An independent index per row from one hash */
+        mix = (hash + (uint32_t)row * 0x9e3779b9u) * 0x85ebca6bu;
+        counter = &sketch->counters[row * sketch->width +
+                                    ((mix ^ (mix >> 15)) & (sketch->width - 1))];
+        if (__atomic_load_n(counter, __ATOMIC_RELAXED) < CACHE_SKETCH_MAX_COUNT)
+            __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&sketch->additions, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Estimates how often a URI was looked up recently, the smallest of
+ * its counters
+ *
+ *
+ * @param[in]   *sketch         Shard's sketch
+ * @param[in]   hash            URI hash from cache_hash()
+ *
+ * @return      unsigned int    Estimated lookups since the last halvings
+ */
+static unsigned int cache_sketch_estimate(cache_sketch *sketch,
+                                          uint32_t hash) {
+    unsigned int count, minCount = CACHE_SKETCH_MAX_COUNT;
+    uint32_t mix;
+    size_t row;
+
+    for (row = 0; row < CACHE_SKETCH_DEPTH; row++) {
+        mix = (hash + (uint32_t)row * 0x9e3779b9u) * 0x85ebca6bu;
+        count = __atomic_load_n(
+            &sketch->counters[row * sketch->width +
+                              ((mix ^ (mix >> 15)) & (sketch->width - 1))],
+            __ATOMIC_RELAXED);
+        if (count < minCount)
+            minCount = count;
+    }
+    return minCount;
+}
+
+/**
+ * @brief Halves every counter once enough lookups were counted, so the
+ * sketch follows changes in popularity. Called with the shard lock held
+ * exclusively
+ *
+ *
+ * @param[in]   *sketch         Shard's sketch
+ *
+ * @return      void
+ */
+static void cache_sketch_age(cache_sketch *sketch) {
+    size_t i;
+
+    if (sketch->additions < sketch->resetAt)
+        return;
+    for (i = 0; i < CACHE_SKETCH_DEPTH * sketch->width; i++)
+        sketch->counters[i] >>= 1;
+    sketch->additions /= 2;
+}
+
+/**
+ * @brief Doubles the number of hash buckets and rehashes every block
+ *
+ *
+ * @param[in]   *shard          Shard to grow
+ *
+ * @return      void
+ */
+static void cache_hash_grow(cache_shard *shard) {
+    size_t newBucketCnt = shard->hashBucketCnt * 2;
+    cache_block **newBuckets = Calloc(newBucketCnt, sizeof(cache_block *));
+    cache_block *cacheLinePtr;
+    size_t idx;
+    int segment;
+
+    /* Every block is on an LRU list, so rebuild the chains from them */
+    for (segment = 0; segment < CACHE_SEG_CNT; segment++) {
+        cacheLinePtr = shard->segments[segment].cacheBlockHead;
+        while (cacheLinePtr != NULL) {
+            idx = cacheLinePtr->cache_uri_hash & (newBucketCnt - 1);
+            cacheLinePtr->hashNext = newBuckets[idx];
+            newBuckets[idx] = cacheLinePtr;
+            cacheLinePtr = cacheLinePtr->nextBlock;
+        }
+    }
+    Free(shard->hashBuckets);
+    shard->hashBuckets = newBuckets;
+    shard->hashBucketCnt = newBucketCnt;
+}
+
+/**
+ * @brief Adds a cache block to its hash chain
+ *
+ *
+ * @param[in]   *shard          Shard owning the block
+ * @param[in]   *cacheLinePtr   Cache block to index
+ *
+ * @return      void
+ */
+static void cache_hash_insert(cache_shard *shard, cache_block *cacheLinePtr) {
+    size_t idx = cacheLinePtr->cache_uri_hash & (shard->hashBucketCnt - 1);
+    cacheLinePtr->hashNext = shard->hashBuckets[idx];
+    shard->hashBuckets[idx] = cacheLinePtr;
+}
+
+/**
+ * @brief Removes a cache block from its hash chain
+ *
+ *
+ * @param[in]   *shard          Shard owning the block
+ * @param[in]   *cacheLinePtr   Cache block to drop from the index
+ *
+ * @return      void
+ */
+static void cache_hash_remove(cache_shard *shard, cache_block *cacheLinePtr) {
+    size_t idx = cacheLinePtr->cache_uri_hash & (shard->hashBucketCnt - 1);
+    cache_block **linkPtr = &shard->hashBuckets[idx];
+
+    while (*linkPtr != NULL) {
+        if (*linkPtr == cacheLinePtr) {
+            *linkPtr = cacheLinePtr->hashNext;
+            cacheLinePtr->hashNext = NULL;
+            return;
+        }
+        linkPtr = (cache_block **)&(*linkPtr)->hashNext;
+    }
+}
+
+/**
+ * @brief Walks the hash chain of a shard for a URI, with the shard locked
+ *
+ *
+ * @param[in]   *shard          Shard owning the URI
+ * @param[in]   hash            Precomputed hash of the URI
+ * @param[in]   *url            URL key to search for
+ *
+ * @return      cache_block*    Matching block, NULL if none
+ */
+static cache_block *cache_hash_lookup(cache_shard *shard, uint32_t hash,
+                                      const char *url) {
+    cache_block *cacheLinePtr =
+        shard->hashBuckets[hash & (shard->hashBucketCnt - 1)];
+    while (cacheLinePtr != NULL) {
+        if ((cacheLinePtr->cache_uri_hash == hash) &&
+            (strcmp(url, cacheLinePtr->cache_uri_key) == 0)) {
+            break;
+        }
+        cacheLinePtr = cacheLinePtr->hashNext;
+    }
+    return cacheLinePtr;
+}
+
 /**
  * @brief returns a cache block if server object was present in the cache or
  * else returns NULL
  *
+ * A miss in memory falls through to the disk tier, if enabled.
+ *
  *
  * @param[in]   *char           URL key to search in the LRU cache
  *
@@ -67,168 +582,1007 @@ void unLockMutex() {
  * object, NULL for cache miss
  */
 cache_block *cache_find(char *url) {
+    uint64_t startUsec = metrics_now();
+    uint32_t hash = cache_hash(url);
+    cache_shard *shard = cache_shard_of(hash);
 
-    lockMutex();
-    cache_block *cacheLinePtr = cache.cacheBlockHead;
-    cache_block *tempCachePtr = NULL;
-    while (cacheLinePtr != NULL) {
-        if (strcmp(url, cacheLinePtr->cache_uri_key) == 0) {
-            cacheLinePtr->readReferenceCnt++;
-            /* Implicit list update */
-            /* cache hit at head */
-            if ((cacheLinePtr == cache.cacheBlockHead) &&
-                (cacheLinePtr->nextBlock != NULL)) {
-                cache.cacheBlockHead = cacheLinePtr->nextBlock;
-                tempCachePtr = cacheLinePtr->nextBlock;
-                tempCachePtr->previousBlock = NULL;
-
-                tempCachePtr = cache.cacheBlockTail;
-                cache.cacheBlockTail = cacheLinePtr;
-                tempCachePtr->nextBlock = cacheLinePtr;
-                cacheLinePtr->nextBlock = NULL;
-                cacheLinePtr->previousBlock = tempCachePtr;
-
-            }
-            /* cache hit at tail */
-            else if ((cacheLinePtr == cache.cacheBlockTail) &&
-                     (cacheLinePtr->previousBlock != NULL)) {
-                /* cache hit at tail, do nothing */
-            }
-            /* cache hit in the middle */
-            else if ((cacheLinePtr->previousBlock != NULL) &&
-                     (cacheLinePtr->nextBlock != NULL)) {
-                tempCachePtr = cacheLinePtr->nextBlock;
-                tempCachePtr->previousBlock = cacheLinePtr->previousBlock;
-
-                tempCachePtr = cacheLinePtr->previousBlock;
-                tempCachePtr->nextBlock = cacheLinePtr->nextBlock;
-
-                tempCachePtr = cache.cacheBlockTail;
-                cache.cacheBlockTail = cacheLinePtr;
-                tempCachePtr->nextBlock = cacheLinePtr;
-                cacheLinePtr->nextBlock = NULL;
-                cacheLinePtr->previousBlock = tempCachePtr;
-            } else {
-                /* cache hit only block, do nothing */
-            }
-            break;
-        }
-        cacheLinePtr = cacheLinePtr->nextBlock;
+    readLockMutex(shard);
+    __atomic_fetch_add(&shard->stats.lookups, 1, __ATOMIC_RELAXED);
+    if (cache.policy->countsFrequency)
+        cache_sketch_add(&shard->sketch, hash);
+    cache_block *cacheLinePtr = cache_hash_lookup(shard, hash, url);
+    if (cacheLinePtr != NULL) {
+        __atomic_fetch_add(&cacheLinePtr->readReferenceCnt, 1,
+                           __ATOMIC_ACQ_REL);
+        __atomic_fetch_add(&shard->stats.hits, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&shard->stats.hitBytes, cacheLinePtr->cache_obj_size,
+                           __ATOMIC_RELAXED);
+        cache.policy->touch(shard, cacheLinePtr);
     }
-
-    if (cacheLinePtr == NULL) {
-        unLockMutex();
-        return NULL; /*can not find url in the cache*/
-    } else {
-        unLockMutex();
+    unLockMutex(shard);
+    if (cacheLinePtr == NULL &&
+        (cacheLinePtr = snapshot_find(url, hash)) != NULL) {
+        metrics_observe(METRICS_CACHE_LOOKUP, startUsec);
         return cacheLinePtr;
     }
+    if (cacheLinePtr == NULL && disk_enabled()) {
+        char *buf = cache_fill_reserve();
+        size_t size;
+        time_t storedAt;
+        if (disk_load(url, hash, buf, cache.maxObjectSize, &size,
+                      &storedAt)) {
+            __atomic_fetch_add(&shard->stats.diskHits, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&shard->stats.diskHitBytes, size,
+                               __ATOMIC_RELAXED);
+            cacheLinePtr = cache_publish(url, buf, size, true, storedAt);
+            metrics_observe(METRICS_CACHE_LOOKUP, startUsec);
+            return cacheLinePtr;
+        }
+        cache_fill_abandon(buf);
+    }
+    metrics_observe(METRICS_CACHE_LOOKUP, startUsec);
+    return cacheLinePtr; /*NULL if can not find url in the cache*/
+}
+/**
+ * @brief Frees a cache block together with its object and URI key
+ *
+ *
+ * @param[in]   *cacheLinePtr   Unlinked cache block without references
+ *
+ * @return      void
+ */
+static void cache_block_free(cache_block *cacheLinePtr) {
+    slab_free(cacheLinePtr->cache_obj, cacheLinePtr->cache_obj_size);
+    slab_free(cacheLinePtr->cache_uri_key,
+              strlen(cacheLinePtr->cache_uri_key) + 1);
+    slab_free(cacheLinePtr, sizeof(cache_block));
+}
+/**
+ * @brief Takes another reference to a block the caller already holds one to
+ *
+ *
+ * @param[in]   *cacheBlock     Cache block returned by cache_find()
+ *
+ * @return      void
+ */
+void cache_retain(cache_block *cacheBlock) {
+    __atomic_fetch_add(&cacheBlock->readReferenceCnt, 1, __ATOMIC_ACQ_REL);
+}
+/**
+ * @brief Drops a reference to a cache block and frees the block once the last
+ * one is gone
+ *
+ * The cache holds one reference for as long as a block is linked, so a block
+ * can only reach zero here after eviction has unlinked it.
+ *
+ *
+ * @param[in]   *cacheBlock     Cache block returned by cache_find()
+ *
+ * @return      void
+ */
+void cache_release(cache_block *cacheBlock) {
+    if (__atomic_sub_fetch(&cacheBlock->readReferenceCnt, 1,
+                           __ATOMIC_ACQ_REL) == 0) {
+        cache_block_free(cacheBlock);
+    }
+}
+/**
+ * @brief Unlinks a block from its list and the index and drops the cache's
+ * reference to it
+ *
+ *
+ * @param[in]   *shard          Shard owning the block
+ * @param[in]   *cacheLinePtr   Linked cache block
+ *
+ * @return      void
+ */
+static void cache_block_drop(cache_shard *shard, cache_block *cacheLinePtr) {
+    cache_list_unlink(shard, cacheLinePtr);
+    cache_hash_remove(shard, cacheLinePtr);
+    if (cache.policy->forget != NULL)
+        cache.policy->forget(shard, cacheLinePtr);
+    shard->blockCnt--;
+    shard->cache_size -= cacheLinePtr->cache_obj_size;
+    cache_release(cacheLinePtr);
 }
 /**
- * @brief Performs cache eviction till required cache size is freed. Cache
- * eviction starts at the head
+ * @brief Performs cache eviction till required cache size is freed, taking
+ * victims in the order the policy names them and queueing them for the disk
+ * tier unless it has them already
+ *
+ * Victims are unlinked and accounted for at once and only lose the cache's own
+ * reference, so eviction never waits on in-flight readers; the last reader
+ * frees a block it was still writing out. A victim queued for the disk tier
+ * keeps a reference until cache_disk_store() wrote it out, after the shard
+ * lock is released.
  *
  *
+ * @param[in]   *shard               Shard to evict from
  * @param[in]   reqBufSize           Size to be evicted
  *
  * @return      void
  */
-void cache_eviction(size_t reqBufSize) {
-    cache_block *tempCacheLinePtr = NULL;
+void cache_eviction(cache_shard *shard, size_t reqBufSize) {
     size_t sizeFreed = 0;
-    cache_block *cacheLinePtr = cache.cacheBlockHead;
-    while ((sizeFreed < reqBufSize) && (cacheLinePtr != NULL)) {
+    cache_block *cacheLinePtr;
 
-        /* Busy wait till reference count becomes 0 */
-        while (cacheLinePtr->readReferenceCnt != 0) {
-            unLockMutex();
-            lockMutex();
-        }
-        Free(cacheLinePtr->cache_obj);
-        Free(cacheLinePtr->cache_uri_key);
-        /* Implicit list update */
-        /* not the only block present */
-        if (cacheLinePtr->nextBlock != NULL) {
-            cache.cacheBlockHead = cacheLinePtr->nextBlock;
-            tempCacheLinePtr = cacheLinePtr->nextBlock;
-            tempCacheLinePtr->previousBlock = NULL;
-        }
-        /* only block present */
-        else {
-            cache.cacheBlockHead = NULL;
-            cache.cacheBlockTail = NULL;
-        }
-        cache.cache_size -= cacheLinePtr->cache_obj_size;
+    while ((sizeFreed < reqBufSize) &&
+           ((cacheLinePtr = cache.policy->victim(shard)) != NULL)) {
         sizeFreed += cacheLinePtr->cache_obj_size;
-        Free(cacheLinePtr);
-
-        cacheLinePtr = cache.cacheBlockHead;
+        if (disk_enabled() && !cacheLinePtr->onDisk) {
+            cache_retain(cacheLinePtr);
+            cache_block_drop(shard, cacheLinePtr);
+            cacheLinePtr->nextBlock = shard->diskQueue;
+            shard->diskQueue = cacheLinePtr;
+        } else {
+            cache_block_drop(shard, cacheLinePtr);
+        }
+        shard->stats.evicted++;
     }
     if (sizeFreed < reqBufSize)
         fprintf(stderr, "Error: Size freed=%ld, size required=%ld\n", sizeFreed,
                 reqBufSize);
 }
 /**
- * @brief Performs cache addition starting at the head
+ * @brief Writes victims cache_eviction() queued to the disk tier and drops
+ * their references, with no shard lock held
  *
  *
- * @param[in]   *uri          URL to be cached
- * @param[in]   *buf          Server response to be cached
- * @param[in]   buffSize      Server response size to be cached
+ * @param[in]   *shard          Shard the victims were evicted from
+ * @param[in]   *victims        Queue taken from shard->diskQueue under the
+ * shard lock
  *
  * @return      void
  */
-void cache_uri(char *uri, char *buf, size_t buffSize) {
+static void cache_disk_store(cache_shard *shard, cache_block *victims) {
+    cache_block *next;
 
-    lockMutex();
-    cache_block *cacheLinePtr = NULL;
-    cache_block *tempCacheLinePtr = NULL;
-    size_t updatedtotalCacheSize = cache.cache_size + buffSize;
-    if (updatedtotalCacheSize > MAX_CACHE_SIZE) {
-        cache_eviction((cache.cache_size + buffSize) - MAX_CACHE_SIZE);
-    }
-    /* Allocate memory for cache block and object */
-    cacheLinePtr = Malloc(sizeof(cache_block));
-    cacheLinePtr->cache_obj = Malloc(buffSize);
-
-    /* Update implicit list */
-    /* If head & tail are NULL - Initialise */
-    if ((cache.cacheBlockHead == NULL) && (cache.cacheBlockTail == NULL)) {
-        cache.cacheBlockTail = cacheLinePtr;
-        cache.cacheBlockHead = cache.cacheBlockTail;
-        cacheLinePtr->previousBlock = NULL;
-        cacheLinePtr->nextBlock = NULL;
+    for (; victims != NULL; victims = next) {
+        next = victims->nextBlock;
+        disk_store(victims->cache_uri_key, victims->cache_uri_hash,
+                   victims->cache_obj, victims->cache_obj_size,
+                   __atomic_load_n(&victims->storedAt, __ATOMIC_RELAXED));
+        __atomic_fetch_add(&shard->stats.diskStores, 1, __ATOMIC_RELAXED);
+        cache_release(victims);
+    }
+}
+/**
+ * @brief Links a new block at the tail of one of the shard's lists and into
+ * the index
+ *
+ *
+ * @param[in]   *shard          Shard locked exclusively
+ * @param[in]   *cacheLinePtr   Cache block to link
+ * @param[in]   segment         List to append to, one of CACHE_SEG_*
+ *
+ * @return      void
+ */
+static void cache_block_link(cache_shard *shard, cache_block *cacheLinePtr,
+                             int segment) {
+    /* Update implicit list and index */
+    cache_list_append(shard, cacheLinePtr, segment);
+    if (++shard->blockCnt > shard->hashBucketCnt) {
+        cache_hash_grow(shard);
     } else {
-        tempCacheLinePtr = cache.cacheBlockTail;
-        cache.cacheBlockTail = cacheLinePtr;
-        cacheLinePtr->previousBlock = tempCacheLinePtr;
-        tempCacheLinePtr->nextBlock = cacheLinePtr;
-        cacheLinePtr->nextBlock = NULL;
-    }
-    /* Copy object and URL */
-    memcpy(cacheLinePtr->cache_obj, buf, buffSize);
+        cache_hash_insert(shard, cacheLinePtr);
+    }
+    shard->cache_size += cacheLinePtr->cache_obj_size;
+}
+/**
+ * @brief LRU and SLRU: links a new block on probation after evicting as much
+ * as it needs
+ *
+ *
+ * @param[in]   *shard          Shard locked exclusively
+ * @param[in]   *cacheLinePtr   Cache block to admit
+ *
+ * @return      void
+ */
+static void main_admit(cache_shard *shard, cache_block *cacheLinePtr) {
+    size_t updatedtotalCacheSize =
+        shard->cache_size + cacheLinePtr->cache_obj_size;
+    if (updatedtotalCacheSize > shard->max_cache_size) {
+        cache_eviction(shard, updatedtotalCacheSize - shard->max_cache_size);
+    }
+    cache_block_link(shard, cacheLinePtr, CACHE_SEG_PROBATION);
+}
+/**
+ * @brief LRU family: the oldest block on probation, then on the protected
+ * list, then in the admission window
+ *
+ *
+ * @param[in]   *shard          Shard locked exclusively
+ *
+ * @return      cache_block*    Block to evict next, NULL if the shard is empty
+ */
+static cache_block *lru_victim(cache_shard *shard) {
+    static const int victimOrder[] = {CACHE_SEG_PROBATION, CACHE_SEG_PROTECTED,
+                                      CACHE_SEG_WINDOW};
+    size_t i;
+
+    for (i = 0; i < CACHE_SEG_CNT; i++) {
+        if (shard->segments[victimOrder[i]].cacheBlockHead != NULL)
+            return shard->segments[victimOrder[i]].cacheBlockHead;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Computes the GDSF key of a block: the shard's clock plus its hits
+ * per byte, weighted by the cost of missing it
+ *
+ *
+ * @param[in]   *shard          Shard owning the block
+ * @param[in]   *cacheLinePtr   Cache block
+ *
+ * @return      double          Priority, higher stays longer
+ */
+static double gdsf_priority(cache_shard *shard, cache_block *cacheLinePtr) {
+    double freq =
+        (double)__atomic_load_n(&cacheLinePtr->hitCnt, __ATOMIC_RELAXED) + 1;
+
+    if (cache.policy->bytesCost)
+        return shard->inflation + freq;
+    return shard->inflation + freq / (double)cacheLinePtr->cache_obj_size;
+}
+
+/**
+ * @brief Puts a block into a heap slot and records the slot in the block
+ *
+ *
+ * @param[in]   *shard          Shard owning the heap
+ * @param[in]   idx             Heap slot
+ * @param[in]   *cacheLinePtr   Cache block
+ *
+ * @return      void
+ */
+static void gdsf_heap_set(cache_shard *shard, size_t idx,
+                          cache_block *cacheLinePtr) {
+    shard->heap[idx] = cacheLinePtr;
+    cacheLinePtr->heapIdx = idx;
+}
+
+/**
+ * @brief Moves the block in a heap slot towards the root while its parent
+ * has a larger priority
+ *
+ *
+ * @param[in]   *shard          Shard owning the heap
+ * @param[in]   idx             Heap slot
+ *
+ * @return      void
+ */
+static void gdsf_sift_up(cache_shard *shard, size_t idx) {
+    cache_block *cacheLinePtr = shard->heap[idx];
+    size_t parent;
+
+    while (idx > 0) {
+        parent = (idx - 1) / 2;
+        if (shard->heap[parent]->priority <= cacheLinePtr->priority)
+            break;
+        gdsf_heap_set(shard, idx, shard->heap[parent]);
+        idx = parent;
+    }
+    gdsf_heap_set(shard, idx, cacheLinePtr);
+}
+
+/**
+ * @brief Moves the block in a heap slot towards the leaves while a child has
+ * a smaller priority
+ *
+ *
+ * @param[in]   *shard          Shard owning the heap
+ * @param[in]   idx             Heap slot
+ *
+ * @return      void
+ */
+static void gdsf_sift_down(cache_shard *shard, size_t idx) {
+    cache_block *cacheLinePtr = shard->heap[idx];
+    size_t child;
+
+    while ((child = 2 * idx + 1) < shard->heapCnt) {
+        if (child + 1 < shard->heapCnt &&
+            shard->heap[child + 1]->priority < shard->heap[child]->priority)
+            child++;
+        if (cacheLinePtr->priority <= shard->heap[child]->priority)
+            break;
+        gdsf_heap_set(shard, idx, shard->heap[child]);
+        idx = child;
+    }
+    gdsf_heap_set(shard, idx, cacheLinePtr);
+}
+
+/**
+ * @brief GDSF: counts the hit and raises the block's priority
+ *
+ * The hit is always counted; the heap is only reordered if lruMutex can be
+ * taken without waiting, otherwise the block catches up on its next hit.
+ * Priorities only grow, so the block can only sink in the heap.
+ *
+ *
+ * @param[in]   *shard          Shard locked shared
+ * @param[in]   *cacheLinePtr   Cache block that was hit
+ *
+ * @return      void
+ */
+static void gdsf_touch(cache_shard *shard, cache_block *cacheLinePtr) {
+    __atomic_fetch_add(&cacheLinePtr->hitCnt, 1, __ATOMIC_RELAXED);
+    if (pthread_mutex_trylock(&shard->lruMutex) != 0)
+        return;
+    cacheLinePtr->priority = gdsf_priority(shard, cacheLinePtr);
+    gdsf_sift_down(shard, cacheLinePtr->heapIdx);
+    pthread_mutex_unlock(&shard->lruMutex);
+}
+
+/**
+ * @brief GDSF: evicts the lowest priorities until the block fits, then links
+ * it and pushes it on the heap
+ *
+ *
+ * @param[in]   *shard          Shard locked exclusively
+ * @param[in]   *cacheLinePtr   Cache block to admit
+ *
+ * @return      void
+ */
+static void gdsf_admit(cache_shard *shard, cache_block *cacheLinePtr) {
+    size_t updatedtotalCacheSize =
+        shard->cache_size + cacheLinePtr->cache_obj_size;
+    if (updatedtotalCacheSize > shard->max_cache_size) {
+        cache_eviction(shard, updatedtotalCacheSize - shard->max_cache_size);
+    }
+    /* The list only serves the index and cachePrint(), order is the heap's */
+    cache_block_link(shard, cacheLinePtr, CACHE_SEG_PROBATION);
+    if (shard->heapCnt == shard->heapCap) {
+        shard->heapCap = shard->heapCap ? shard->heapCap * 2 : 64;
+        shard->heap =
+            Realloc(shard->heap, shard->heapCap * sizeof(cache_block *));
+    }
+    cacheLinePtr->priority = gdsf_priority(shard, cacheLinePtr);
+    gdsf_heap_set(shard, shard->heapCnt++, cacheLinePtr);
+    gdsf_sift_up(shard, cacheLinePtr->heapIdx);
+}
+
+/**
+ * @brief GDSF: the block with the lowest priority, whose priority becomes the
+ * shard's clock as it is about to be evicted
+ *
+ *
+ * @param[in]   *shard          Shard locked exclusively
+ *
+ * @return      cache_block*    Block to evict next, NULL if the shard is empty
+ */
+static cache_block *gdsf_victim(cache_shard *shard) {
+    if (shard->heapCnt == 0)
+        return NULL;
+    shard->inflation = shard->heap[0]->priority;
+    return shard->heap[0];
+}
+
+/**
+ * @brief GDSF: takes a block leaving the cache off the heap
+ *
+ *
+ * @param[in]   *shard          Shard locked exclusively
+ * @param[in]   *cacheLinePtr   Cache block on the heap
+ *
+ * @return      void
+ */
+static void gdsf_forget(cache_shard *shard, cache_block *cacheLinePtr) {
+    size_t idx = cacheLinePtr->heapIdx;
+
+    if (idx == --shard->heapCnt)
+        return;
+    gdsf_heap_set(shard, idx, shard->heap[shard->heapCnt]);
+    gdsf_sift_up(shard, idx);
+    gdsf_sift_down(shard, idx);
+}
+
+/**
+ * @brief TinyLFU filter: whether a block leaving the admission window was
+ * looked up more often than every main area block it would displace
+ *
+ *
+ * @param[in]   *shard          Shard locked exclusively
+ * @param[in]   *candidate      Oldest block of the admission window
+ * @param[in]   needed          Bytes the main area has to free for it
+ *
+ * @return      bool            true if the candidate may enter the main area
+ */
+static bool tinylfu_admits(cache_shard *shard, cache_block *candidate,
+                           size_t needed) {
+    static const int victimOrder[] = {CACHE_SEG_PROBATION, CACHE_SEG_PROTECTED};
+    unsigned int candidateFreq =
+        cache_sketch_estimate(&shard->sketch, candidate->cache_uri_hash);
+    cache_block *victim;
+    size_t sizeFreed = 0, i;
+
+    for (i = 0; i < 2 && sizeFreed < needed; i++) {
+        victim = shard->segments[victimOrder[i]].cacheBlockHead;
+        for (; victim != NULL && sizeFreed < needed;
+             victim = victim->nextBlock) {
+            if (cache_sketch_estimate(&shard->sketch, victim->cache_uri_hash) >=
+                candidateFreq)
+                return false;
+            sizeFreed += victim->cache_obj_size;
+        }
+    }
+    return sizeFreed >= needed;
+}
+/**
+ * @brief W-TinyLFU: links a new block into the admission window, then moves
+ * the window's oldest blocks into the main area for as long as it is over its
+ * share, evicting those the TinyLFU filter turns away
+ *
+ *
+ * @param[in]   *shard          Shard locked exclusively
+ * @param[in]   *cacheLinePtr   Cache block to admit
+ *
+ * @return      void
+ */
+static void window_admit(cache_shard *shard, cache_block *cacheLinePtr) {
+    cache_list *window = &shard->segments[CACHE_SEG_WINDOW];
+    size_t mainCap = shard->max_cache_size - shard->windowCap;
+    size_t mainSize, needed;
+    cache_block *candidate;
+
+    cache_sketch_age(&shard->sketch);
+    cache_block_link(shard, cacheLinePtr, CACHE_SEG_WINDOW);
+    while (window->listSize > shard->windowCap) {
+        candidate = window->cacheBlockHead;
+        mainSize = shard->cache_size - window->listSize;
+        needed = (mainSize + candidate->cache_obj_size > mainCap)
+                     ? mainSize + candidate->cache_obj_size - mainCap
+                     : 0;
+        if (needed > 0 && !tinylfu_admits(shard, candidate, needed)) {
+            cache_block_drop(shard, candidate);
+            shard->stats.rejected++;
+            continue;
+        }
+        cache_list_unlink(shard, candidate);
+        if (needed > 0) {
+            cache_eviction(shard, needed);
+        }
+        cache_list_append(shard, candidate, CACHE_SEG_PROBATION);
+    }
+}
+
+/* Eviction policies selectable with cache_policy_by_name() */
+static const cache_policy cachePolicies[] = {
+    {"lru", lru_touch, main_admit, lru_victim, NULL, false, false},
+    {"slru", slru_touch, main_admit, lru_victim, NULL, false, false},
+    {"wtinylfu", slru_touch, window_admit, lru_victim, NULL, true, false},
+    {"gdsf", gdsf_touch, gdsf_admit, gdsf_victim, gdsf_forget, false, false},
+    {"lfuda", gdsf_touch, gdsf_admit, gdsf_victim, gdsf_forget, false, true},
+};
+
+/**
+ * @brief Looks an eviction policy up by name
+ *
+ *
+ * @param[in]   *name           "lru", "slru", "wtinylfu", "gdsf" or "lfuda"
+ *
+ * @return      cache_policy*   Matching policy, NULL if unknown
+ */
+const cache_policy *cache_policy_by_name(const char *name) {
+    size_t i;
+    for (i = 0; i < sizeof(cachePolicies) / sizeof(cachePolicies[0]); i++) {
+        if (strcasecmp(name, cachePolicies[i].name) == 0)
+            return &cachePolicies[i];
+    }
+    return NULL;
+}
+/**
+ * @brief Reserves a buffer the relay can receive a response into in place
+ *
+ *
+ * @return      char*         Buffer of max object size bytes, to be handed to
+ * cache_fill_publish() or cache_fill_abandon()
+ */
+char *cache_fill_reserve(void) { return slab_alloc(cache.maxObjectSize); }
+/**
+ * @brief Returns a fill buffer whose response will not be cached
+ *
+ *
+ * @param[in]   *buf          Buffer from cache_fill_reserve()
+ *
+ * @return      void
+ */
+void cache_fill_abandon(char *buf) { slab_free(buf, cache.maxObjectSize); }
+/**
+ * @brief Size-aware admission: admits an object with probability
+ * exp(-size / admitSize), so small objects almost always get in and ones far
+ * above admitSize rarely do
+ *
+ *
+ * @param[in]   *shard        Shard locked exclusively
+ * @param[in]   buffSize      Object size
+ *
+ * @return      bool          true if the object may be cached
+ */
+static bool cache_size_admits(cache_shard *shard, size_t buffSize) {
+    double chance;
+
+    if (cache.admitSize == 0)
+        return true;
+    chance = exp(-(double)buffSize / (double)cache.admitSize);
+    return rand_r(&shard->admitSeed) < chance * ((double)RAND_MAX + 1);
+}
+/**
+ * @brief Sets when a block stops being fresh and when it stops being
+ * servable stale
+ *
+ *
+ * @param[in]   *cacheLinePtr   Cache block
+ * @param[in]   storedAt        When the response was received or revalidated
+ * @param[in]   lifetime        Freshness lifetime in seconds
+ * @param[in]   age             Age of the response at storedAt
+ * @param[in]   staleSecs       stale-while-revalidate window in seconds
+ *
+ * @return      void
+ */
+static void cache_block_set_fresh(cache_block *cacheLinePtr, time_t storedAt,
+                                  time_t lifetime, time_t age,
+                                  time_t staleSecs) {
+    time_t freshUntil = storedAt + lifetime - age;
+
+    __atomic_store_n(&cacheLinePtr->storedAt, storedAt, __ATOMIC_RELAXED);
+    __atomic_store_n(&cacheLinePtr->freshUntil, freshUntil, __ATOMIC_RELAXED);
+    __atomic_store_n(&cacheLinePtr->staleUntil, freshUntil + staleSecs,
+                     __ATOMIC_RELAXED);
+}
+/**
+ * @brief Tells whether a block may be served as is, served while it is
+ * revalidated, or must be revalidated first
+ *
+ *
+ * @param[in]   *cacheBlock     Cache block returned by cache_find()
+ *
+ * @return      cache_freshness One of CACHE_FRESH, CACHE_STALE_OK or
+ * CACHE_STALE
+ */
+cache_freshness cache_block_freshness(cache_block *cacheBlock) {
+    time_t now = time(NULL);
+
+    if (now < __atomic_load_n(&cacheBlock->freshUntil, __ATOMIC_RELAXED))
+        return CACHE_FRESH;
+    if (now < __atomic_load_n(&cacheBlock->staleUntil, __ATOMIC_RELAXED))
+        return CACHE_STALE_OK;
+    return CACHE_STALE;
+}
+/**
+ * @brief Claims the background revalidation of a stale block, so only one
+ * is queued however many requests hit it
+ *
+ *
+ * @param[in]   *cacheBlock     Cache block returned by cache_find()
+ *
+ * @return      bool            true if the caller got the claim and must
+ * hand it back with cache_end_revalidation()
+ */
+bool cache_claim_revalidation(cache_block *cacheBlock) {
+    return __atomic_exchange_n(&cacheBlock->revalidating, 1,
+                               __ATOMIC_ACQ_REL) == 0;
+}
+/**
+ * @brief Hands back a claim taken with cache_claim_revalidation()
+ *
+ *
+ * @param[in]   *cacheBlock     Cache block
+ *
+ * @return      void
+ */
+void cache_end_revalidation(cache_block *cacheBlock) {
+    __atomic_store_n(&cacheBlock->revalidating, 0, __ATOMIC_RELEASE);
+}
+/**
+ * @brief Makes a stale block fresh again after the origin answered its
+ * revalidation with 304 Not Modified
+ *
+ * The 304 only updates the freshness, the stored response is kept. Its own
+ * Cache-Control or Expires wins over the stored one, and without them the
+ * stored response's lifetime starts over from now.
+ *
+ *
+ * @param[in]   *cacheBlock     Cache block returned by cache_find()
+ * @param[in]   *response       304 response head
+ * @param[in]   len             Bytes held in response
+ *
+ * @return      void
+ */
+void cache_refresh(cache_block *cacheBlock, const char *response, size_t len) {
+    cache_shard *shard = cache_shard_of(cacheBlock->cache_uri_hash);
+    time_t now = time(NULL);
+    fresh_info notModified, stored;
+
+    fresh_parse(response, len, now, &notModified);
+    if (!notModified.explicitLife) {
+        fresh_parse(cacheBlock->cache_obj, cacheBlock->cache_obj_size,
+                    __atomic_load_n(&cacheBlock->storedAt, __ATOMIC_RELAXED),
+                    &stored);
+        notModified.lifetime = stored.lifetime;
+        notModified.staleSecs = stored.staleSecs;
+    }
+    cache_block_set_fresh(cacheBlock, now, notModified.lifetime,
+                          notModified.age, notModified.staleSecs);
+    __atomic_fetch_add(&shard->stats.refreshed, 1, __ATOMIC_RELAXED);
+}
+/**
+ * @brief Makes a gzip coded copy of a fresh fill to be cached in its place
+ *
+ *
+ * @param[in]   *shard          Shard owning the URI
+ * @param[in]   *cacheLinePtr   Block holding the identity coded response
+ *
+ * @return      cache_block*    Copy with the same key and freshness and a
+ * reference for the caller, NULL when the response is not worth compressing
+ */
+static cache_block *cache_block_compress(cache_shard *shard,
+                                         cache_block *cacheLinePtr) {
+    size_t keySize = strlen(cacheLinePtr->cache_uri_key) + 1, size;
+    cache_block *compressed;
+    char *buf;
+
+    if (!encoding_compressible(cacheLinePtr->cache_obj,
+                               cacheLinePtr->cache_obj_size))
+        return NULL;
+    buf = slab_alloc(cache.maxObjectSize);
+    size = encoding_compress(cacheLinePtr->cache_obj,
+                             cacheLinePtr->cache_obj_size, buf,
+                             cache.maxObjectSize);
+    if (size == 0) {
+        slab_free(buf, cache.maxObjectSize);
+        return NULL;
+    }
+    compressed = slab_alloc(sizeof(cache_block));
+    *compressed = *cacheLinePtr;
+    compressed->cache_obj = slab_shrink(buf, cache.maxObjectSize, size);
+    compressed->cache_obj_size = size;
+    compressed->cache_uri_key = slab_alloc(keySize);
+    memcpy(compressed->cache_uri_key, cacheLinePtr->cache_uri_key, keySize);
+    compressed->compressed = true;
+    __atomic_fetch_add(&shard->stats.compressed, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&shard->stats.compressSaved,
+                       cacheLinePtr->cache_obj_size - size, __ATOMIC_RELAXED);
+    return compressed;
+}
+/**
+ * @brief Links a block into the shard owning its URI through the eviction
+ * policy, unless a newer block is cached or admission turns it away
+ *
+ * A response fetched from the origin replaces a block already cached for the
+ * URI without going through size-aware admission, one loaded from the disk
+ * tier or a snapshot is older than any such block and is left out instead.
+ *
+ *
+ * @param[in]   *shard          Shard owning the URI
+ * @param[in]   *cacheLinePtr   Block with a reference held by the caller
+ * @param[in]   fromOrigin      Block holds a response just fetched
+ *
+ * @return      void
+ */
+static void cache_block_admit(cache_shard *shard, cache_block *cacheLinePtr,
+                              bool fromOrigin) {
+    cache_block *existing, *victims;
+
+    lockMutex(shard);
+    if (fromOrigin) {
+        shard->stats.fills++;
+        shard->stats.fillBytes += cacheLinePtr->cache_obj_size;
+    }
+    if ((existing = cache_hash_lookup(shard, cacheLinePtr->cache_uri_hash,
+                                      cacheLinePtr->cache_uri_key)) != NULL) {
+        if (!fromOrigin) {
+            /* another request cached it first */
+            unLockMutex(shard);
+            return;
+        }
+        /* The URI is already cached, no admission draw can uncache it */
+        cache_block_drop(shard, existing);
+    } else if (!cache_size_admits(shard, cacheLinePtr->cache_obj_size)) {
+        shard->stats.rejected++;
+        unLockMutex(shard);
+        return;
+    }
+    cacheLinePtr->readReferenceCnt++; /* held by the cache itself */
+    cache.policy->admit(shard, cacheLinePtr);
+    victims = shard->diskQueue;
+    shard->diskQueue = NULL;
+    unLockMutex(shard);
+    cache_disk_store(shard, victims);
+}
+/**
+ * @brief Sets up a block adopting a filled buffer, with its freshness read
+ * from the response
+ *
+ *
+ * @param[in]   *uri          URL to be cached, copied into the block
+ * @param[in]   *buf          Buffer from cache_fill_reserve() holding the
+ * response, owned by the block from now on
+ * @param[in]   buffSize      Server response size, below the max object size
+ * @param[in]   onDisk        Object was loaded from the disk tier
+ * @param[in]   storedAt      When the response was received or last
+ * revalidated
+ * @param[out]  *info         Freshness of the response
+ *
+ * @return      cache_block*  Unlinked block with a reference for the caller
+ */
+static cache_block *cache_block_new(const char *uri, char *buf,
+                                    size_t buffSize, bool onDisk,
+                                    time_t storedAt, fresh_info *info) {
+    size_t keySize = strlen(uri) + 1;
+
+    /* Set up block and URL before taking the lock */
+    cache_block *cacheLinePtr = slab_alloc(sizeof(cache_block));
+    cacheLinePtr->cache_obj = slab_shrink(buf, cache.maxObjectSize, buffSize);
+    cacheLinePtr->cache_uri_key = slab_alloc(keySize);
+    memcpy(cacheLinePtr->cache_uri_key, uri, keySize);
     cacheLinePtr->cache_obj_size = buffSize;
-    cacheLinePtr->cache_uri_key = uri;
-    cacheLinePtr->readReferenceCnt = 0;
-    cache.cache_size += buffSize;
-    unLockMutex();
+    cacheLinePtr->cache_uri_hash = cache_hash(uri);
+    cacheLinePtr->readReferenceCnt = 1; /* held by the caller */
+    cacheLinePtr->hitCnt = 0;
+    cacheLinePtr->onDisk = onDisk;
+    /* Origin gzip is only decoded for clients when -z asked for coding */
+    cacheLinePtr->compressed =
+        cache.compress && encoding_is_gzip(cacheLinePtr->cache_obj, buffSize);
+    cacheLinePtr->revalidating = 0;
+    fresh_parse(cacheLinePtr->cache_obj, buffSize, storedAt, info);
+    cache_block_set_fresh(cacheLinePtr, storedAt, info->lifetime, info->age,
+                          info->staleSecs);
+    return cacheLinePtr;
 }
 /**
- * @brief Prints the LRU cache structure
+ * @brief Hands a filled buffer to the eviction policy of the shard owning
+ * the URI, adopting it as the cached object without copying it
+ *
+ * The buffer only moves when the object fits a smaller slab class. A response
+ * a shared cache must not store stays private and is freed on its last
+ * release, as is a block size-aware admission or the policy does not admit.
+ * A response fetched from the origin replaces a block already cached for the
+ * URI, which is stale or being revalidated; one loaded from the disk tier is
+ * older than such a block and stays private instead. With compression
+ * enabled, a compressible response fetched from the origin is cached as a
+ * gzip coded copy and the identity coded block stays private.
+ *
+ *
+ * @param[in]   *uri          URL to be cached, copied into the cache
+ * @param[in]   *buf          Buffer from cache_fill_reserve() holding the
+ * response, owned by the cache from now on
+ * @param[in]   buffSize      Server response size, below the max object size
+ * @param[in]   onDisk        Object was loaded from the disk tier
+ * @param[in]   storedAt      When the response was received or last
+ * revalidated
+ *
+ * @return      cache_block*  Block holding the response as received, with a
+ * reference for the caller to drop with cache_release()
+ */
+static cache_block *cache_publish(const char *uri, char *buf, size_t buffSize,
+                                  bool onDisk, time_t storedAt) {
+    cache_shard *shard;
+    cache_block *cacheLinePtr, *compressed;
+    fresh_info info;
+
+    cacheLinePtr = cache_block_new(uri, buf, buffSize, onDisk, storedAt, &info);
+    shard = cache_shard_of(cacheLinePtr->cache_uri_hash);
+    if (!info.cacheable) {
+        __atomic_fetch_add(&shard->stats.uncacheable, 1, __ATOMIC_RELAXED);
+        return cacheLinePtr;
+    }
+
+    if (cache.compress && !onDisk && !cacheLinePtr->compressed &&
+        (compressed = cache_block_compress(shard, cacheLinePtr)) != NULL) {
+        cache_block_admit(shard, compressed, true);
+        cache_release(compressed);
+        return cacheLinePtr;
+    }
+    cache_block_admit(shard, cacheLinePtr, !onDisk);
+    return cacheLinePtr;
+}
+/**
+ * @brief Publishes a response received into a buffer from
+ * cache_fill_reserve(), see cache_publish()
+ *
+ *
+ * @param[in]   *uri          URL to be cached, copied into the cache
+ * @param[in]   *buf          Buffer from cache_fill_reserve() holding the
+ * response, owned by the cache from now on
+ * @param[in]   buffSize      Server response size, below the max object size
+ *
+ * @return      cache_block*  Block holding the response, with a reference
+ * for the caller to drop with cache_release()
+ */
+cache_block *cache_fill_publish(const char *uri, char *buf, size_t buffSize) {
+    return cache_publish(uri, buf, buffSize, false, time(NULL));
+}
+/**
+ * @brief Publishes an object restored from a snapshot with the freshness it
+ * was saved with, unless the URI got cached meanwhile
+ *
+ *
+ * @param[in]   *uri          URL to be cached, copied into the cache
+ * @param[in]   *buf          Buffer from cache_fill_reserve() holding the
+ * response, owned by the cache from now on
+ * @param[in]   buffSize      Server response size, below the max object size
+ * @param[in]   storedAt      When the response was received or last
+ * revalidated
+ * @param[in]   freshUntil    Served as is until then
+ * @param[in]   staleUntil    Served stale while revalidating until then
+ *
+ * @return      cache_block*  Block holding the response, with a reference
+ * for the caller to drop with cache_release()
+ */
+cache_block *cache_restore(const char *uri, char *buf, size_t buffSize,
+                           time_t storedAt, time_t freshUntil,
+                           time_t staleUntil) {
+    cache_block *cacheLinePtr;
+    cache_shard *shard;
+    fresh_info info;
+
+    cacheLinePtr = cache_block_new(uri, buf, buffSize, false, storedAt, &info);
+    shard = cache_shard_of(cacheLinePtr->cache_uri_hash);
+    cacheLinePtr->freshUntil = freshUntil;
+    cacheLinePtr->staleUntil = staleUntil;
+    __atomic_fetch_add(&shard->stats.restored, 1, __ATOMIC_RELAXED);
+    cache_block_admit(shard, cacheLinePtr, false);
+    return cacheLinePtr;
+}
+/**
+ * @brief Takes a reference to every cached block, shard by shard and in the
+ * order the LRU family would evict them, so publishing them again in that
+ * order rebuilds the same recency
+ *
+ *
+ * @param[out]  *blockCnt     Number of blocks
+ *
+ * @return      cache_block** Blocks to be released with cache_release(),
+ * the array to be freed with Free()
+ */
+cache_block **cache_collect(size_t *blockCnt) {
+    static const int collectOrder[] = {CACHE_SEG_PROBATION,
+                                       CACHE_SEG_PROTECTED, CACHE_SEG_WINDOW};
+    cache_block **blocks = NULL, *cacheLinePtr;
+    cache_shard *shard;
+    size_t shardIdx, cnt = 0, i;
+
+    for (shardIdx = 0; shardIdx < cache.shardCnt; shardIdx++) {
+        shard = &cache.shards[shardIdx];
+        /* Exclusively, readers relink the lists on hits */
+        lockMutex(shard);
+        blocks = Realloc(blocks, (cnt + shard->blockCnt + 1) *
+                                     sizeof(cache_block *));
+        for (i = 0; i < CACHE_SEG_CNT; i++) {
+            cacheLinePtr = shard->segments[collectOrder[i]].cacheBlockHead;
+            while (cacheLinePtr != NULL) {
+                cache_retain(cacheLinePtr);
+                blocks[cnt++] = cacheLinePtr;
+                cacheLinePtr = cacheLinePtr->nextBlock;
+            }
+        }
+        unLockMutex(shard);
+    }
+    *blockCnt = cnt;
+    return blocks;
+}
+/**
+ * @brief Sums the counters of every shard
+ *
+ * Counters are read without the shard locks, so the sum is only as
+ * consistent as the cache was quiet.
+ *
+ *
+ * @param[out]  *stats          Totals over the whole cache
+ *
+ * @return      void
+ */
+void cache_get_stats(cache_stats *stats) {
+    cache_stats *shardStats;
+    size_t shardIdx;
+
+    memset(stats, 0, sizeof(*stats));
+    for (shardIdx = 0; shardIdx < cache.shardCnt; shardIdx++) {
+        shardStats = &cache.shards[shardIdx].stats;
+        stats->lookups +=
+            __atomic_load_n(&shardStats->lookups, __ATOMIC_RELAXED);
+        stats->hits += __atomic_load_n(&shardStats->hits, __ATOMIC_RELAXED);
+        stats->hitBytes +=
+            __atomic_load_n(&shardStats->hitBytes, __ATOMIC_RELAXED);
+        stats->fills += __atomic_load_n(&shardStats->fills, __ATOMIC_RELAXED);
+        stats->fillBytes +=
+            __atomic_load_n(&shardStats->fillBytes, __ATOMIC_RELAXED);
+        stats->evicted +=
+            __atomic_load_n(&shardStats->evicted, __ATOMIC_RELAXED);
+        stats->rejected +=
+            __atomic_load_n(&shardStats->rejected, __ATOMIC_RELAXED);
+        stats->diskHits +=
+            __atomic_load_n(&shardStats->diskHits, __ATOMIC_RELAXED);
+        stats->diskHitBytes +=
+            __atomic_load_n(&shardStats->diskHitBytes, __ATOMIC_RELAXED);
+        stats->diskStores +=
+            __atomic_load_n(&shardStats->diskStores, __ATOMIC_RELAXED);
+        stats->uncacheable +=
+            __atomic_load_n(&shardStats->uncacheable, __ATOMIC_RELAXED);
+        stats->refreshed +=
+            __atomic_load_n(&shardStats->refreshed, __ATOMIC_RELAXED);
+        stats->compressed +=
+            __atomic_load_n(&shardStats->compressed, __ATOMIC_RELAXED);
+        stats->compressSaved +=
+            __atomic_load_n(&shardStats->compressSaved, __ATOMIC_RELAXED);
+        stats->restored +=
+            __atomic_load_n(&shardStats->restored, __ATOMIC_RELAXED);
+    }
+}
+/**
+ * @brief Sums what every shard holds, read without the shard locks like the
+ * counters of cache_get_stats()
+ *
+ *
+ * @param[out]  *bytes          Bytes of cached objects
+ * @param[out]  *blocks         Number of cached objects
+ * @param[out]  *capacity       Max cache size
+ *
+ * @return      void
+ */
+void cache_get_occupancy(size_t *bytes, size_t *blocks, size_t *capacity) {
+    size_t shardIdx;
+
+    *bytes = 0;
+    *blocks = 0;
+    for (shardIdx = 0; shardIdx < cache.shardCnt; shardIdx++) {
+        *bytes += __atomic_load_n(&cache.shards[shardIdx].cache_size,
+                                  __ATOMIC_RELAXED);
+        *blocks += __atomic_load_n(&cache.shards[shardIdx].blockCnt,
+                                   __ATOMIC_RELAXED);
+    }
+    *capacity = cache.maxCacheSize;
+}
+/**
+ * @brief Prints the LRU cache structure, shard by shard and list by list,
+ * followed by the hit ratio counters of the policy in use
  *
  *
  * @return      void
  */
 void cachePrint() {
-    cache_block *cacheLinePtr = cache.cacheBlockHead;
-    int i = 0;
-    while (cacheLinePtr != NULL) {
-        sio_printf("cacheLine-URL[%d] size:%ld = %s\n", i,
-                   cacheLinePtr->cache_obj_size, cacheLinePtr->cache_uri_key);
-        /*sio_printf("CacheLine-Object[%d] = %s\n", i,
-         * cacheLinePtr->cache_obj);*/
-        cacheLinePtr = cacheLinePtr->nextBlock;
-        i++;
-    }
-    /*sio_printf("cache.cache_size=%ld\n", cache.cache_size);*/
+    static const char *segmentNames[] = {"window", "probation", "protected"};
+    cache_block *cacheLinePtr = NULL;
+    cache_stats stats;
+    size_t shardIdx;
+    int i, segment;
+    for (shardIdx = 0; shardIdx < cache.shardCnt; shardIdx++) {
+        for (segment = 0; segment < CACHE_SEG_CNT; segment++) {
+            cacheLinePtr =
+                cache.shards[shardIdx].segments[segment].cacheBlockHead;
+            i = 0;
+            while (cacheLinePtr != NULL) {
+                sio_printf("shard[%zu] %s cacheLine-URL[%d] size:%ld = %s\n",
+                           shardIdx, segmentNames[segment], i,
+                           cacheLinePtr->cache_obj_size,
+                           cacheLinePtr->cache_uri_key);
+                cacheLinePtr = cacheLinePtr->nextBlock;
+                i++;
+            }
+        }
+        /*sio_printf("cache_size=%ld\n", cache.shards[shardIdx].cache_size);*/
+    }
+    cache_get_stats(&stats);
+    /* Byte hit ratio is over the bytes of cacheable responses only */
+    sio_printf("policy:%s lookups:%zu hits:%zu (object hit ratio %zu%%) "
+               "hit bytes:%zu fill bytes:%zu (byte hit ratio %zu%%) "
+               "evicted:%zu rejected:%zu\n",
+               cache.policy->name, stats.lookups, stats.hits,
+               stats.lookups ? stats.hits * 100 / stats.lookups : 0,
+               stats.hitBytes, stats.fillBytes,
+               (stats.hitBytes + stats.fillBytes)
+                   ? stats.hitBytes * 100 / (stats.hitBytes + stats.fillBytes)
+                   : 0,
+               stats.evicted, stats.rejected);
+    sio_printf("uncacheable:%zu refreshed:%zu restored:%zu\n",
+               stats.uncacheable, stats.refreshed, stats.restored);
+    if (cache.compress) {
+        sio_printf("compressed:%zu saved bytes:%zu\n", stats.compressed,
+                   stats.compressSaved);
+    }
+    if (disk_enabled()) {
+        sio_printf("disk hits:%zu hit bytes:%zu stores:%zu\n", stats.diskHits,
+                   stats.diskHitBytes, stats.diskStores);
+    }
 }
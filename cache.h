@@ -3,44 +3,192 @@
  * @brief Header file for cache implementation
  *
  * Description: Max cache size, object size defines, function prototypes and
- * cache block structures defined here
+ * cache block, shard, eviction policy and cache structures defined here
  *
  *
  * @author Abhishek Basrithaya <abasrith@andrew.cmu.edu>
  */
+#ifndef CACHE_H
+#define CACHE_H
+
 #include "csapp.h"
 #include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <strings.h>
+#include <time.h>
 /*
- * Max cache and object sizes
+ * Default max cache and object sizes, overridable from the command line
  */
-#define MAX_CACHE_SIZE (1024 * 1024)
-#define MAX_OBJECT_SIZE (100 * 1024)
+#define DEFAULT_MAX_CACHE_SIZE (1024 * 1024)
+#define DEFAULT_MAX_OBJECT_SIZE (100 * 1024)
+/* Initial number of hash buckets, doubled whenever blocks outnumber them */
+#define CACHE_HASH_INIT_BUCKETS 64
+/* Share of a shard the admission window of W-TinyLFU may hold */
+#define CACHE_WINDOW_PERCENT 10
+/* Share of a shard's main area the protected segment of SLRU may hold */
+#define CACHE_PROTECTED_PERCENT 80
+/* Frequency sketch rows, counter ceiling and bytes per expected object */
+#define CACHE_SKETCH_DEPTH 4
+#define CACHE_SKETCH_MAX_COUNT 15
+#define CACHE_SKETCH_OBJECT_SIZE 1024
+/* Sketch counters are halved after this many increments per counter column */
+#define CACHE_SKETCH_RESET_FACTOR 10
+
+/*
+ * LRU lists a shard keeps its blocks on. Strict LRU only uses the probation
+ * list, SLRU adds the protected one and W-TinyLFU the admission window.
+ */
+enum {
+    CACHE_SEG_WINDOW,    /* recent arrivals not yet admitted to the main area */
+    CACHE_SEG_PROBATION, /* main area, hit at most once since admission */
+    CACHE_SEG_PROTECTED, /* main area, hit again while on probation */
+    CACHE_SEG_CNT
+};
 
 typedef struct {
-    char *cache_obj; /* point to web object with max size of MAX_OBJECT_SIZE */
-    size_t cache_obj_size; /* Cache object size */
-    char *cache_uri_key;   /* point to URI key */
+    char *cache_obj; /* point to web object of at most the max object size */
+    size_t cache_obj_size;   /* Cache object size */
+    char *cache_uri_key;     /* point to URI key */
+    uint32_t cache_uri_hash; /* precomputed hash of the URI key */
 
-    int readReferenceCnt; /*count of references to the block */
-    void *nextBlock;      /* Points to next cache block */
-    void *previousBlock;  /* Points to previous cache block */
+    int readReferenceCnt;  /*references, one held while linked, atomic */
+    unsigned long lruTick; /* shard tick when last moved to the tail */
+    unsigned char segment; /* LRU list holding the block, atomic */
+    unsigned long hitCnt;  /* hits since admission, atomic */
+    double priority;       /* GDSF key, smallest is evicted first */
+    size_t heapIdx;        /* position in the shard's GDSF heap */
+    bool onDisk;           /* loaded from the disk tier, which still has it */
+    bool compressed;       /* object is a gzip coded response */
+    time_t storedAt;       /* received or last revalidated, atomic */
+    time_t freshUntil;     /* served as is until then, atomic */
+    time_t staleUntil;     /* served stale while revalidating until then */
+    int revalidating;      /* a background revalidation is queued, atomic */
+    void *nextBlock;       /* Points to next cache block */
+    void *previousBlock;   /* Points to previous cache block */
+    void *hashNext;        /* Points to next cache block in the same bucket */
 } cache_block;
 
 typedef struct {
-    cache_block *cacheBlockHead;
-    cache_block *cacheBlockTail;
+    cache_block *cacheBlockHead; /* least recently used end, evicted first */
+    cache_block *cacheBlockTail; /* most recently used end */
+    size_t listSize;             /* bytes of the objects on the list */
+} cache_list;
+
+typedef struct {
+    uint8_t *counters;       /* CACHE_SKETCH_DEPTH rows of width counters */
+    size_t width;            /* counters per row, a power of two */
+    unsigned long additions; /* increments since the last halving, atomic */
+    unsigned long resetAt;   /* additions that halve every counter */
+} cache_sketch;
+
+typedef struct {
+    size_t lookups;   /* cache_find() calls */
+    size_t hits;      /* lookups that found the uri */
+    size_t hitBytes;  /* object bytes served from hits */
+    size_t fills;     /* misses published into the cache */
+    size_t fillBytes; /* object bytes fetched for those misses */
+    size_t evicted;   /* blocks evicted to make room */
+    size_t rejected;  /* blocks the admission filter turned away */
+    size_t diskHits;      /* misses served from the disk tier */
+    size_t diskHitBytes;  /* object bytes served from the disk tier */
+    size_t diskStores;    /* evicted blocks written to the disk tier */
+    size_t uncacheable;   /* responses not stored for their status or
+                             Cache-Control */
+    size_t refreshed;     /* stale blocks a 304 made fresh again */
+    size_t compressed;    /* fills stored gzip coded by the proxy */
+    size_t compressSaved; /* object bytes those fills saved */
+    size_t restored;      /* blocks restored from a snapshot */
+} cache_stats;
+
+typedef struct {
+    cache_list segments[CACHE_SEG_CNT]; /* LRU lists, see CACHE_SEG_* */
     size_t cache_size;
-    pthread_mutex_t rwMutex; /*protects accesses to cache*/
+    size_t max_cache_size;     /* this shard's share of the max cache size */
+    size_t windowCap;          /* bytes the admission window may hold */
+    size_t protectedCap;       /* bytes the protected segment may hold */
+    cache_sketch sketch;       /* access frequencies, W-TinyLFU only */
+    cache_block **heap;        /* min-heap on priority, GDSF only */
+    size_t heapCnt;            /* blocks on the heap */
+    size_t heapCap;            /* slots allocated for the heap */
+    double inflation;          /* GDSF clock, priority of the last victim */
+    unsigned int admitSeed;    /* rand_r() state of size-aware admission */
+    cache_stats stats;         /* counters of the shard, atomic */
+    cache_block *diskQueue;    /* evicted blocks the disk tier gets once the
+                                  shard is unlocked, linked by nextBlock */
+    cache_block **hashBuckets; /* chained hash index over the blocks */
+    size_t hashBucketCnt;      /* number of buckets, a power of two */
+    size_t blockCnt;           /* number of cached blocks */
+    unsigned long lruTick;     /* bumped on every move to the tail */
+    pthread_mutex_t lruMutex;  /* serialises promotions by readers */
+    pthread_rwlock_t rwMutex;  /*protects accesses to the shard*/
+} cache_shard;
+
+/*
+ * Eviction policy. touch() runs on every hit with the shard lock held shared
+ * and may only relink lists or reorder the heap under lruMutex. The others
+ * run with the shard lock held exclusively: admit() links a newly published
+ * block, evicting as it sees fit, victim() names the block cache_eviction()
+ * takes next and forget(), if set, is told about every block leaving the
+ * cache.
+ */
+typedef struct {
+    const char *name;                                 /* -p option value */
+    void (*touch)(cache_shard *shard, cache_block *block); /* after a hit */
+    void (*admit)(cache_shard *shard, cache_block *block); /* on publish */
+    cache_block *(*victim)(cache_shard *shard);       /* NULL when empty */
+    void (*forget)(cache_shard *shard, cache_block *block);
+    bool countsFrequency; /* lookups feed the shard's frequency sketch */
+    bool bytesCost;       /* GDSF misses cost their size, not one fetch */
+} cache_policy;
+
+/* What a hit may be used for, see cache_block_freshness() */
+typedef enum {
+    CACHE_FRESH,    /* serve as is */
+    CACHE_STALE_OK, /* serve, and revalidate in the background */
+    CACHE_STALE     /* revalidate before serving */
+} cache_freshness;
+
+typedef struct {
+    cache_shard *shards;         /* independently locked shards */
+    size_t shardCnt;             /* number of shards, selected by URI hash */
+    const cache_policy *policy;  /* eviction policy shared by every shard */
+    size_t maxCacheSize;         /* bytes all shards may hold together */
+    size_t maxObjectSize;        /* largest response that gets cached */
+    size_t admitSize;            /* size-aware admission scale, 0 admits all */
+    bool compress;               /* store compressible responses gzip coded */
 } Cache;
 
 /* Function prototyping */
-void cache_init();
+const cache_policy *cache_policy_by_name(const char *name);
+void cache_init(size_t shardCnt, const cache_policy *policy,
+                size_t maxCacheSize, size_t maxObjectSize, size_t admitSize,
+                bool compress);
+size_t cache_max_object_size(void);
+uint32_t cache_hash(const char *url);
+cache_shard *cache_shard_of(uint32_t hash);
 cache_block *cache_find(char *url);
-void cache_eviction(size_t reqBufSize);
-void cache_uri(char *uri, char *buf, size_t bufLen);
+void cache_retain(cache_block *cacheBlock);
+void cache_release(cache_block *cacheBlock);
+void cache_eviction(cache_shard *shard, size_t reqBufSize);
+char *cache_fill_reserve(void);
+void cache_fill_abandon(char *buf);
+cache_block *cache_fill_publish(const char *uri, char *buf, size_t bufLen);
+cache_block *cache_restore(const char *uri, char *buf, size_t buffSize,
+                           time_t storedAt, time_t freshUntil,
+                           time_t staleUntil);
+cache_block **cache_collect(size_t *blockCnt);
+cache_freshness cache_block_freshness(cache_block *cacheBlock);
+bool cache_claim_revalidation(cache_block *cacheBlock);
+void cache_end_revalidation(cache_block *cacheBlock);
+void cache_refresh(cache_block *cacheBlock, const char *response, size_t len);
+void cache_get_stats(cache_stats *stats);
+void cache_get_occupancy(size_t *bytes, size_t *blocks, size_t *capacity);
 void cachePrint();
-void lockMutex();
-void unLockMutex();
+void lockMutex(cache_shard *shard);
+void readLockMutex(cache_shard *shard);
+void unLockMutex(cache_shard *shard);
+
+#endif /* CACHE_H */
@@ -0,0 +1,173 @@
+/**
+ * @file coalesce.c
+ * @brief Collapsed forwarding of concurrent misses on the same URI
+ *
+ * Description: A miss calls coalesce_begin() before contacting the end
+ * server. Without a fetch of the URI in the air the caller becomes the leader
+ * of a new flight, fetches as usual and calls coalesce_end() once the response
+ * was published into the cache or turned out not to be cacheable. Every other
+ * miss on the URI meanwhile waits for the flight to land and then retries the
+ * cache, so a burst of requests for one uncached object costs a single end
+ * server fetch. Only a response that did not get cached, too big or failed,
+ * sends the waiters to the end server themselves; they do not queue up again.
+ *
+ * Worker threads block on a condition variable until their flight landed,
+ * or for at most COALESCE_WAIT_SECS, so a leader stuck on an end server that
+ * stopped answering does not hold its waiters; they then fetch themselves.
+ * The event loops cannot block, they register a coalesce_waiter instead whose
+ * callback hands the connection back to its loop. One mutex lock protects the
+ * table; callbacks run after releasing it.
+ *
+ * Coalescing is off unless enabled from the command line, since every client
+ * request then no longer reaches the end server.
+ *
+ *
+ * @author Abhishek Basrithaya <abasrith@andrew.cmu.edu>
+ */
+#include "coalesce.h"
+#include "cache.h"
+#include "csapp.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/* Flights shared by every front end thread */
+static Coalescer coalescer;
+
+/**
+ * @brief Initialises the empty flight table
+ *
+ *
+ * @param[in]   enabled         Concurrent misses are to be coalesced
+ *
+ * @return      void
+ */
+void coalesce_init(bool enabled) {
+    memset(&coalescer, 0, sizeof(Coalescer));
+    coalescer.enabled = enabled;
+    if ((pthread_mutex_init(&coalescer.mutex, NULL)) != 0 ||
+        (pthread_cond_init(&coalescer.landed, NULL)) != 0) {
+        fprintf(stderr, "Error: Initizing coalescer locks");
+    }
+}
+
+/**
+ * @brief Tells whether concurrent misses are coalesced
+ *
+ *
+ * @return      bool            true when coalesce_init() enabled coalescing
+ */
+bool coalesce_enabled(void) {
+    return coalescer.enabled;
+}
+
+/**
+ * @brief Drops a reference to a flight and frees it once the last one is gone,
+ * caller holds the mutex
+ *
+ *
+ * @param[in]   *flight         Landed flight
+ *
+ * @return      void
+ */
+static void coalesce_put(coalesce_flight *flight) {
+    if (--flight->refCnt == 0) {
+        Free(flight->uri);
+        Free(flight);
+    }
+}
+
+/**
+ * @brief Joins the flight fetching a URI, or starts one
+ *
+ * Without a waiter the caller blocks until the flight in the air landed, or
+ * COALESCE_WAIT_SECS passed. With one the call returns at once and
+ * waiter->wake() runs once it landed; the waiter must stay valid until then.
+ *
+ *
+ * @param[in]   *uri            URI that missed in the cache
+ * @param[in]   *waiter         Callback for callers that cannot block, NULL
+ * to block
+ *
+ * @return      coalesce_flight*    New flight the caller leads and has to end
+ * with coalesce_end(), NULL when another request was fetching the URI, the
+ * caller then retries the cache and fetches a miss itself
+ */
+coalesce_flight *coalesce_begin(const char *uri, coalesce_waiter *waiter) {
+    uint32_t hash = cache_hash(uri);
+    size_t bucket = hash % COALESCE_HASH_BUCKETS;
+    coalesce_flight *flight;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&coalescer.mutex);
+    for (flight = coalescer.buckets[bucket]; flight != NULL;
+         flight = flight->hashNext) {
+        if (flight->hash == hash && strcmp(flight->uri, uri) == 0) {
+            break;
+        }
+    }
+    if (flight == NULL) {
+        flight = Calloc(1, sizeof(coalesce_flight));
+        flight->uri = Malloc(strlen(uri) + 1);
+        strcpy(flight->uri, uri);
+        flight->hash = hash;
+        flight->refCnt = 1; /* held by the leader */
+        flight->hashNext = coalescer.buckets[bucket];
+        coalescer.buckets[bucket] = flight;
+        pthread_mutex_unlock(&coalescer.mutex);
+        return flight;
+    }
+    if (waiter != NULL) {
+        waiter->next = flight->waiters;
+        flight->waiters = waiter;
+    } else {
+        flight->refCnt++;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += COALESCE_WAIT_SECS;
+        while (!flight->landed &&
+               pthread_cond_timedwait(&coalescer.landed, &coalescer.mutex,
+                                      &deadline) != ETIMEDOUT)
+            ;
+        coalesce_put(flight);
+    }
+    pthread_mutex_unlock(&coalescer.mutex);
+    return NULL;
+}
+
+/**
+ * @brief Lands a flight, its response is in the cache or will not be, and
+ * releases every request waiting for it
+ *
+ *
+ * @param[in]   *flight         Flight from coalesce_begin(), NULL is ignored
+ *
+ * @return      void
+ */
+void coalesce_end(coalesce_flight *flight) {
+    coalesce_flight **link;
+    coalesce_waiter *waiter, *next;
+
+    if (flight == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&coalescer.mutex);
+    link = &coalescer.buckets[flight->hash % COALESCE_HASH_BUCKETS];
+    while (*link != flight) {
+        link = &(*link)->hashNext;
+    }
+    *link = flight->hashNext;
+    flight->landed = true;
+    waiter = flight->waiters;
+    flight->waiters = NULL;
+    pthread_cond_broadcast(&coalescer.landed);
+    coalesce_put(flight);
+    pthread_mutex_unlock(&coalescer.mutex);
+
+    /* A woken waiter may be gone as soon as its callback returns */
+    while (waiter != NULL) {
+        next = waiter->next;
+        waiter->wake(waiter->arg);
+        waiter = next;
+    }
+}
@@ -0,0 +1,54 @@
+/**
+ * @file coalesce.h
+ * @brief Header file for collapsing concurrent misses on the same URI into a
+ * single end server fetch
+ *
+ * Description: The first miss on a URI leads a flight, later misses on it
+ * wait for the flight to land and then look the URI up in the cache again,
+ * defines, structures and function prototypes.
+ *
+ *
+ * @author Abhishek Basrithaya <abasrith@andrew.cmu.edu>
+ */
+#ifndef COALESCE_H
+#define COALESCE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Fetches in flight at once are few, the table does not grow */
+#define COALESCE_HASH_BUCKETS 64
+/* A blocked waiter gives up on a flight after this long and fetches itself */
+#define COALESCE_WAIT_SECS 30
+
+/* Waiter that cannot block, woken through a callback once the flight lands */
+typedef struct coalesce_waiter {
+    void (*wake)(void *arg);      /* called without any coalescer lock held */
+    void *arg;                    /* argument to wake */
+    struct coalesce_waiter *next; /* next waiter of the same flight */
+} coalesce_waiter;
+
+typedef struct coalesce_flight {
+    char *uri;                        /* URI being fetched */
+    uint32_t hash;                    /* cache_hash() of the URI */
+    bool landed;                      /* leader published or gave up */
+    int refCnt;                       /* leader plus blocked waiters */
+    coalesce_waiter *waiters;         /* callbacks to run once landed */
+    struct coalesce_flight *hashNext; /* next flight in the same bucket */
+} coalesce_flight;
+
+typedef struct {
+    coalesce_flight *buckets[COALESCE_HASH_BUCKETS]; /* flights in the air */
+    bool enabled;                                    /* misses coalesced */
+    pthread_mutex_t mutex;                           /* protects the table */
+    pthread_cond_t landed;                           /* some flight landed */
+} Coalescer;
+
+/* Function prototyping */
+void coalesce_init(bool enabled);
+bool coalesce_enabled(void);
+coalesce_flight *coalesce_begin(const char *uri, coalesce_waiter *waiter);
+void coalesce_end(coalesce_flight *flight);
+
+#endif /* COALESCE_H */
@@ -0,0 +1,408 @@
+/**
+ * @file disk.c
+ * @brief Disk-backed second cache tier behind the in-memory cache
+ *
+ * Description: The tier is a ring of DISK_SEGMENT_SIZE segment files mapped
+ * shared into memory. Objects the in-memory cache evicts are appended as
+ * records to the active segment; once it is full the next segment in the
+ * ring is restarted under a new sequence number, dropping whatever it held,
+ * so the oldest objects go first. An in-memory chained hash table maps every
+ * URI to its newest record, and a miss in memory copies the object straight
+ * out of the mapping back into the in-memory cache.
+ *
+ * Every record carries the sequence number of its segment and gets its magic
+ * stored last, so on restart the index is rebuilt by scanning the segments
+ * oldest first and stopping at the first record that is incomplete or left
+ * over from before the segment was restarted. One mutex lock protects the
+ * index and the segments.
+ *
+ *
+ * @author Abhishek Basrithaya <abasrith@andrew.cmu.edu>
+ */
+#include "disk.h"
+#include "csapp.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Tier shared by every front end thread, disabled while segmentCnt is 0 */
+static Disk disk;
+
+/**
+ * @brief Rounds a record size up to the record alignment
+ *
+ *
+ * @param[in]   keyLen          Bytes of the key
+ * @param[in]   objLen          Bytes of the object
+ *
+ * @return      size_t          Bytes the record takes in its segment
+ */
+static size_t disk_record_size(size_t keyLen, size_t objLen) {
+    size_t size = sizeof(disk_record) + keyLen + objLen;
+    return (size + DISK_RECORD_ALIGN - 1) & ~(size_t)(DISK_RECORD_ALIGN - 1);
+}
+
+/**
+ * @brief Returns the record at an offset of a segment
+ *
+ *
+ * @param[in]   segIdx          Segment index
+ * @param[in]   offset          Record offset
+ *
+ * @return      disk_record*    Record inside the mapping
+ */
+static disk_record *disk_record_at(size_t segIdx, size_t offset) {
+    return (disk_record *)(disk.segments[segIdx].map + offset);
+}
+
+/**
+ * @brief Finds the index entry of a URI, with the tier locked
+ *
+ *
+ * @param[in]   *uri            URI key
+ * @param[in]   hash            cache_hash() of the key
+ *
+ * @return      disk_entry**    Link pointing to the entry, or to NULL at the
+ * end of the bucket if there is none
+ */
+static disk_entry **disk_lookup(const char *uri, uint32_t hash) {
+    disk_entry **linkPtr = &disk.buckets[hash & (disk.bucketCnt - 1)];
+    size_t keyLen = strlen(uri);
+    disk_record *rec;
+
+    while (*linkPtr != NULL) {
+        if ((*linkPtr)->hash == hash) {
+            rec = disk_record_at((*linkPtr)->segIdx, (*linkPtr)->offset);
+            if (rec->keyLen == keyLen &&
+                memcmp((char *)(rec + 1), uri, keyLen) == 0) {
+                break;
+            }
+        }
+        linkPtr = &(*linkPtr)->hashNext;
+    }
+    return linkPtr;
+}
+
+/**
+ * @brief Points the index entry of a record's key at the record, creating
+ * the entry if the key is new
+ *
+ *
+ * @param[in]   segIdx          Segment holding the record
+ * @param[in]   offset          Record offset
+ *
+ * @return      void
+ */
+static void disk_index(size_t segIdx, size_t offset) {
+    disk_record *rec = disk_record_at(segIdx, offset);
+    char uri[MAXLINE];
+    disk_entry **linkPtr, *entry;
+
+    if (rec->keyLen >= MAXLINE) {
+        return;
+    }
+    memcpy(uri, (char *)(rec + 1), rec->keyLen);
+    uri[rec->keyLen] = '\0';
+    linkPtr = disk_lookup(uri, rec->hash);
+    if ((entry = *linkPtr) == NULL) {
+        entry = Malloc(sizeof(disk_entry));
+        entry->hash = rec->hash;
+        entry->hashNext = NULL;
+        *linkPtr = entry;
+    }
+    entry->segIdx = segIdx;
+    entry->offset = offset;
+}
+
+/**
+ * @brief Drops every index entry pointing into a segment about to be reused
+ *
+ *
+ * @param[in]   segIdx          Segment index
+ *
+ * @return      void
+ */
+static void disk_unindex_segment(size_t segIdx) {
+    disk_entry **linkPtr, *entry;
+    size_t i;
+
+    for (i = 0; i < disk.bucketCnt; i++) {
+        linkPtr = &disk.buckets[i];
+        while ((entry = *linkPtr) != NULL) {
+            if (entry->segIdx == segIdx) {
+                *linkPtr = entry->hashNext;
+                Free(entry);
+            } else {
+                linkPtr = &entry->hashNext;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Indexes the complete records of a segment and finds where the next
+ * record goes
+ *
+ *
+ * @param[in]   segIdx          Segment with a valid header
+ *
+ * @return      void
+ */
+static void disk_scan_segment(size_t segIdx) {
+    disk_segment *seg = &disk.segments[segIdx];
+    size_t offset = sizeof(disk_segment_header), recSize;
+    disk_record *rec;
+
+    while (offset + sizeof(disk_record) <= DISK_SEGMENT_SIZE) {
+        rec = disk_record_at(segIdx, offset);
+        if (rec->magic != DISK_RECORD_MAGIC || rec->seq != seg->seq) {
+            break;
+        }
+        recSize = disk_record_size(rec->keyLen, rec->objLen);
+        if (recSize > DISK_SEGMENT_SIZE - offset) {
+            break;
+        }
+        disk_index(segIdx, offset);
+        offset += recSize;
+    }
+    seg->used = offset;
+}
+
+/**
+ * @brief Compares two segments by sequence number, for qsort()
+ *
+ *
+ * @param[in]   *a              Pointer to a segment index
+ * @param[in]   *b              Pointer to a segment index
+ *
+ * @return      int             Negative, zero or positive like strcmp()
+ */
+static int disk_seq_cmp(const void *a, const void *b) {
+    uint32_t seqA = disk.segments[*(const size_t *)a].seq;
+    uint32_t seqB = disk.segments[*(const size_t *)b].seq;
+    return (seqA > seqB) - (seqA < seqB);
+}
+
+/**
+ * @brief Maps a segment file, creating it at full size if needed
+ *
+ *
+ * @param[in]   *path           Segment file path
+ *
+ * @return      char*           Shared mapping, NULL on error
+ */
+static char *disk_map_segment(const char *path) {
+    struct stat st;
+    char *map;
+    int fd;
+
+    if ((fd = open(path, O_RDWR | O_CREAT, 0600)) < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0 ||
+        (st.st_size < DISK_SEGMENT_SIZE && ftruncate(fd, DISK_SEGMENT_SIZE) < 0)) {
+        close(fd);
+        return NULL;
+    }
+    map = mmap(NULL, DISK_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+               0);
+    /* The mapping keeps the file alive */
+    close(fd);
+    return (map == MAP_FAILED) ? NULL : map;
+}
+
+/**
+ * @brief Maps the segment files of a directory and rebuilds the index from
+ * the records they hold; a NULL directory leaves the tier disabled
+ *
+ *
+ * @param[in]   *dir            Directory of the segment files, created if
+ * missing
+ * @param[in]   totalSize       Bytes of all segments together
+ *
+ * @return      void
+ */
+void disk_init(const char *dir, size_t totalSize) {
+    char path[MAXLINE];
+    disk_segment_header *hdr;
+    size_t i, *order, segmentCnt;
+
+    memset(&disk, 0, sizeof(Disk));
+    if (dir == NULL) {
+        return;
+    }
+    if ((pthread_mutex_init(&disk.mutex, NULL)) != 0) {
+        fprintf(stderr, "Error: Initizing disk mutex");
+    }
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+        fprintf(stderr, "Warning: disk tier disabled, mkdir %s: %s\n", dir,
+                strerror(errno));
+        return;
+    }
+    segmentCnt = totalSize / DISK_SEGMENT_SIZE;
+    if (segmentCnt < DISK_MIN_SEGMENTS) {
+        segmentCnt = DISK_MIN_SEGMENTS;
+    }
+    disk.segments = Calloc(segmentCnt, sizeof(disk_segment));
+    for (i = 0; i < segmentCnt; i++) {
+        snprintf(path, sizeof(path), "%s/segment-%03zu", dir, i);
+        if ((disk.segments[i].map = disk_map_segment(path)) == NULL) {
+            fprintf(stderr, "Warning: disk tier disabled, segment %s: %s\n",
+                    path, strerror(errno));
+            while (i-- > 0) {
+                munmap(disk.segments[i].map, DISK_SEGMENT_SIZE);
+            }
+            Free(disk.segments);
+            disk.segments = NULL;
+            return;
+        }
+        hdr = (disk_segment_header *)disk.segments[i].map;
+        disk.segments[i].seq = (hdr->magic == DISK_SEGMENT_MAGIC) ? hdr->seq : 0;
+        disk.segments[i].used = sizeof(disk_segment_header);
+    }
+    disk.segmentCnt = segmentCnt;
+    disk.bucketCnt = 64;
+    while (disk.bucketCnt < segmentCnt * DISK_SEGMENT_SIZE / DISK_OBJECT_SIZE) {
+        disk.bucketCnt *= 2;
+    }
+    disk.buckets = Calloc(disk.bucketCnt, sizeof(disk_entry *));
+
+    /* Oldest segment first, so newer records of a key win */
+    order = Malloc(segmentCnt * sizeof(size_t));
+    for (i = 0; i < segmentCnt; i++) {
+        order[i] = i;
+    }
+    qsort(order, segmentCnt, sizeof(size_t), disk_seq_cmp);
+    disk.nextSeq = 1;
+    for (i = 0; i < segmentCnt; i++) {
+        if (disk.segments[order[i]].seq == 0) {
+            continue;
+        }
+        disk_scan_segment(order[i]);
+        disk.active = order[i];
+        disk.nextSeq = disk.segments[order[i]].seq + 1;
+    }
+    Free(order);
+}
+
+/**
+ * @brief Tells whether the disk tier is in use
+ *
+ *
+ * @return      bool            true when disk_init() mapped the segments
+ */
+bool disk_enabled(void) { return disk.segmentCnt > 0; }
+
+/**
+ * @brief Restarts the segment after the active one, dropping its records, and
+ * makes it the active segment. Called with the tier locked
+ *
+ *
+ * @return      void
+ */
+static void disk_next_segment(void) {
+    disk_segment *seg;
+    disk_segment_header *hdr;
+
+    disk.active = (disk.active + 1) % disk.segmentCnt;
+    seg = &disk.segments[disk.active];
+    if (seg->seq != 0) {
+        disk_unindex_segment(disk.active);
+    }
+    seg->seq = disk.nextSeq++;
+    seg->used = sizeof(disk_segment_header);
+    hdr = (disk_segment_header *)seg->map;
+    hdr->seq = seg->seq;
+    __atomic_store_n(&hdr->magic, DISK_SEGMENT_MAGIC, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Appends an object to the active segment and indexes it, replacing
+ * any older record of the same URI
+ *
+ * Objects that could not fit an empty segment are not stored.
+ *
+ *
+ * @param[in]   *uri            URI key
+ * @param[in]   hash            cache_hash() of the key
+ * @param[in]   *obj            Object bytes
+ * @param[in]   objSize         Object size
+ * @param[in]   storedAt        When the object was received or revalidated
+ *
+ * @return      void
+ */
+void disk_store(const char *uri, uint32_t hash, const char *obj,
+                size_t objSize, time_t storedAt) {
+    size_t keyLen = strlen(uri);
+    size_t recSize = disk_record_size(keyLen, objSize);
+    disk_segment *seg;
+    disk_record *rec;
+
+    if (!disk_enabled() || keyLen >= MAXLINE ||
+        recSize > DISK_SEGMENT_SIZE - sizeof(disk_segment_header)) {
+        return;
+    }
+    pthread_mutex_lock(&disk.mutex);
+    seg = &disk.segments[disk.active];
+    if (seg->seq == 0 || recSize > DISK_SEGMENT_SIZE - seg->used) {
+        disk_next_segment();
+        seg = &disk.segments[disk.active];
+    }
+    rec = disk_record_at(disk.active, seg->used);
+    /* A reused segment may hold an old record magic at this offset */
+    __atomic_store_n(&rec->magic, 0, __ATOMIC_RELEASE);
+    rec->seq = seg->seq;
+    rec->hash = hash;
+    rec->keyLen = (uint32_t)keyLen;
+    rec->objLen = (uint32_t)objSize;
+    rec->pad = 0;
+    rec->storedAt = (int64_t)storedAt;
+    memcpy((char *)(rec + 1), uri, keyLen);
+    memcpy((char *)(rec + 1) + keyLen, obj, objSize);
+    /* Only a complete record is found by a later scan */
+    __atomic_store_n(&rec->magic, DISK_RECORD_MAGIC, __ATOMIC_RELEASE);
+    disk_index(disk.active, seg->used);
+    seg->used += recSize;
+    pthread_mutex_unlock(&disk.mutex);
+}
+
+/**
+ * @brief Copies the newest stored object of a URI into a buffer
+ *
+ *
+ * @param[in]   *uri            URI key
+ * @param[in]   hash            cache_hash() of the key
+ * @param[out]  *buf            Destination buffer
+ * @param[in]   bufSize         Room in buf
+ * @param[out]  *objSize        Size of the object copied
+ * @param[out]  *storedAt       When the object was received or revalidated
+ *
+ * @return      bool            true if the object was found and fit buf
+ */
+bool disk_load(const char *uri, uint32_t hash, char *buf, size_t bufSize,
+               size_t *objSize, time_t *storedAt) {
+    disk_entry *entry;
+    disk_record *rec;
+    bool found = false;
+
+    if (!disk_enabled()) {
+        return false;
+    }
+    pthread_mutex_lock(&disk.mutex);
+    if ((entry = *disk_lookup(uri, hash)) != NULL) {
+        rec = disk_record_at(entry->segIdx, entry->offset);
+        if (rec->objLen <= bufSize) {
+            memcpy(buf, (char *)(rec + 1) + rec->keyLen, rec->objLen);
+            *objSize = rec->objLen;
+            *storedAt = (time_t)rec->storedAt;
+            found = true;
+        }
+    }
+    pthread_mutex_unlock(&disk.mutex);
+    return found;
+}
@@ -0,0 +1,80 @@
+/**
+ * @file disk.h
+ * @brief Header file for the disk-backed second cache tier
+ *
+ * Description: Objects evicted from the in-memory cache are appended to
+ * memory-mapped, log-structured segment files indexed in memory by URI,
+ * defines, on-disk record layout, structures and function prototypes.
+ *
+ *
+ * @author Abhishek Basrithaya <abasrith@andrew.cmu.edu>
+ */
+#ifndef DISK_H
+#define DISK_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Disk tier defines, the total size is overridable from the command line */
+#define DEFAULT_DISK_SIZE (64 * 1024 * 1024)
+#define DISK_SEGMENT_SIZE (8 * 1024 * 1024)
+#define DISK_MIN_SEGMENTS 2
+/* Bytes per expected object, sizes the index */
+#define DISK_OBJECT_SIZE 4096
+#define DISK_SEGMENT_MAGIC 0x5053454du /* "PSEG" */
+#define DISK_RECORD_MAGIC 0x50524532u  /* "PRE2" */
+/* Records start on this alignment inside a segment */
+#define DISK_RECORD_ALIGN 8
+
+/* First bytes of every segment file */
+typedef struct {
+    uint32_t magic; /* DISK_SEGMENT_MAGIC once the segment was written */
+    uint32_t seq;   /* order the segments were (re)started in, 0 never */
+} disk_segment_header;
+
+/* Head of every record, followed by the URI key and then the object */
+typedef struct {
+    uint32_t magic;  /* DISK_RECORD_MAGIC, stored last once complete */
+    uint32_t seq;    /* seq of the segment the record was written under */
+    uint32_t hash;   /* cache_hash() of the key */
+    uint32_t keyLen; /* bytes of the key, without terminator */
+    uint32_t objLen; /* bytes of the object */
+    uint32_t pad;    /* keeps storedAt and the key 8 byte aligned */
+    int64_t storedAt; /* when the object was received or revalidated */
+} disk_record;
+
+typedef struct disk_entry {
+    uint32_t hash;               /* cache_hash() of the key */
+    size_t segIdx;               /* segment holding the newest record */
+    size_t offset;               /* offset of that record in the segment */
+    struct disk_entry *hashNext; /* next entry in the same bucket */
+} disk_entry;
+
+typedef struct {
+    char *map;    /* shared mapping of the whole segment file */
+    uint32_t seq; /* seq of the header, 0 while never written */
+    size_t used;  /* bytes taken by the header and records */
+} disk_segment;
+
+typedef struct {
+    disk_segment *segments; /* segment files, reused oldest first */
+    size_t segmentCnt;      /* number of segment files */
+    size_t active;          /* segment records are appended to */
+    uint32_t nextSeq;       /* seq of the next segment started */
+    disk_entry **buckets;   /* index of the newest record of every key */
+    size_t bucketCnt;       /* number of buckets, a power of two */
+    pthread_mutex_t mutex;  /* protects the index and the segments */
+} Disk;
+
+/* Function prototyping */
+void disk_init(const char *dir, size_t totalSize);
+bool disk_enabled(void);
+void disk_store(const char *uri, uint32_t hash, const char *obj,
+                size_t objSize, time_t storedAt);
+bool disk_load(const char *uri, uint32_t hash, char *buf, size_t bufSize,
+               size_t *objSize, time_t *storedAt);
+
+#endif /* DISK_H */
@@ -0,0 +1,503 @@
+/**
+ * @file dns.c
+ * @brief In-process cache of end server host lookups
+ *
+ * Description: dns_getaddrinfo() stands in for getaddrinfo() on the miss path.
+ * Answers are kept per hostname, independent of the port, for DNS_TTL_SECS
+ * and failures for DNS_NEGATIVE_TTL_SECS. The first lookup of a hostname is
+ * made by the caller that missed while concurrent callers for the same
+ * hostname wait for its answer instead of resolving it again. Once an answer
+ * expires it keeps being served for up to DNS_STALE_SECS while a background
+ * resolver thread refreshes it, so only the very first lookup of a hostname,
+ * or one that failed or went unused for too long, waits for the resolver.
+ * Callers that must not block, the event loops, use dns_getaddrinfo_nowait()
+ * instead: a lookup that would wait is handed to the resolver thread and the
+ * caller is called back once it is answered.
+ * One mutex lock protects the table; getaddrinfo() always runs outside it.
+ *
+ *
+ * @author Abhishek Basrithaya <abasrith@andrew.cmu.edu>
+ */
+#include "dns.h"
+#include "csapp.h"
+#include "log.h"
+#include "proxy.h"
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Cache shared by every front end thread */
+static DnsCache dnsCache;
+
+/* Function prototyping */
+static void *dns_refresh_thread(void *vargp);
+
+/**
+ * @brief Initialises the empty cache and starts the refresh thread
+ *
+ *
+ * @return      void
+ */
+void dns_init(void) {
+    pthread_t tid;
+    memset(&dnsCache, 0, sizeof(DnsCache));
+    if ((pthread_mutex_init(&dnsCache.mutex, NULL)) != 0 ||
+        (pthread_cond_init(&dnsCache.resolved, NULL)) != 0 ||
+        (pthread_cond_init(&dnsCache.refreshReady, NULL)) != 0) {
+        fprintf(stderr, "Error: Initizing dns cache locks");
+    }
+    Pthread_create(&tid, NULL, dns_refresh_thread, NULL);
+}
+
+/**
+ * @brief Hashes a hostname to its bucket, FNV-1a
+ *
+ *
+ * @param[in]   *hostname       Hostname
+ *
+ * @return      size_t          Bucket index
+ */
+static size_t dns_bucket(const char *hostname) {
+    uint32_t hash = 2166136261u;
+    while (*hostname != '\0') {
+        hash ^= (unsigned char)*hostname++;
+        hash *= 16777619u;
+    }
+    return hash % DNS_HASH_BUCKETS;
+}
+
+/**
+ * @brief Finds the entry of a hostname, caller holds the mutex
+ *
+ *
+ * @param[in]   *hostname       Hostname
+ *
+ * @return      dns_entry*      Entry, NULL when missing
+ */
+static dns_entry *dns_find(const char *hostname) {
+    dns_entry *entry;
+    for (entry = dnsCache.buckets[dns_bucket(hostname)]; entry != NULL;
+         entry = entry->hashNext) {
+        if (strcmp(entry->hostname, hostname) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Drops every expired entry nobody is resolving to make room, caller
+ * holds the mutex
+ *
+ *
+ * @param[in]   now             Current time
+ *
+ * @return      void
+ */
+static void dns_evict_expired(time_t now) {
+    size_t i;
+    dns_entry **link, *entry;
+    for (i = 0; i < DNS_HASH_BUCKETS; i++) {
+        link = &dnsCache.buckets[i];
+        while ((entry = *link) != NULL) {
+            if (entry->state == DNS_RESOLVING || entry->refreshing ||
+                now < entry->expires) {
+                link = &entry->hashNext;
+                continue;
+            }
+            *link = entry->hashNext;
+            dnsCache.entryCnt--;
+            Free(entry->hostname);
+            Free(entry);
+        }
+    }
+}
+
+/**
+ * @brief Adds a hostname whose first lookup the caller is about to make,
+ * caller holds the mutex
+ *
+ *
+ * @param[in]   *hostname       Hostname
+ * @param[in]   now             Current time
+ *
+ * @return      dns_entry*      New entry in DNS_RESOLVING
+ */
+static dns_entry *dns_insert(const char *hostname, time_t now) {
+    size_t bucket = dns_bucket(hostname);
+    dns_entry *entry;
+    if (dnsCache.entryCnt >= DNS_MAX_ENTRIES) {
+        dns_evict_expired(now);
+    }
+    entry = Calloc(1, sizeof(dns_entry));
+    entry->hostname = Malloc(strlen(hostname) + 1);
+    strcpy(entry->hostname, hostname);
+    entry->state = DNS_RESOLVING;
+    entry->hashNext = dnsCache.buckets[bucket];
+    dnsCache.buckets[bucket] = entry;
+    dnsCache.entryCnt++;
+    return entry;
+}
+
+/**
+ * @brief Resolves a hostname with getaddrinfo(), without holding the mutex
+ *
+ *
+ * @param[in]   *hostname       Hostname
+ * @param[out]  *answer         Addresses with port 0, or the error
+ *
+ * @return      void
+ */
+static void dns_resolve(const char *hostname, dns_answer *answer) {
+    struct addrinfo hints, *listp, *p;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM; /* Open a connection */
+    hints.ai_flags = AI_ADDRCONFIG;  /* Recommended for connections */
+    answer->addrCnt = 0;
+    if ((answer->error = getaddrinfo(hostname, NULL, &hints, &listp)) != 0) {
+        return;
+    }
+    for (p = listp; p != NULL && answer->addrCnt < DNS_MAX_ADDRS;
+         p = p->ai_next) {
+        if (p->ai_addrlen > sizeof(struct sockaddr_storage)) {
+            continue;
+        }
+        memcpy(&answer->addrs[answer->addrCnt], p->ai_addr, p->ai_addrlen);
+        answer->addrLens[answer->addrCnt] = p->ai_addrlen;
+        answer->addrCnt++;
+    }
+    freeaddrinfo(listp);
+    if (answer->addrCnt == 0) {
+        answer->error = EAI_NONAME;
+    }
+}
+
+/**
+ * @brief Stores a fresh answer and its expiry, caller holds the mutex
+ *
+ *
+ * @param[in]   *entry          Entry of the resolved hostname
+ * @param[in]   *answer         Answer from dns_resolve()
+ *
+ * @return      void
+ */
+static void dns_store(dns_entry *entry, const dns_answer *answer) {
+    entry->answer = *answer;
+    entry->expires = time(NULL) + ((answer->error == 0)
+                                       ? DNS_TTL_SECS
+                                       : DNS_NEGATIVE_TTL_SECS);
+    entry->state = DNS_READY;
+}
+
+/**
+ * @brief Queues an entry for the resolver thread, caller holds the mutex
+ *
+ *
+ * @param[in]   *entry          Entry to resolve
+ *
+ * @return      void
+ */
+static void dns_queue(dns_entry *entry) {
+    if (entry->refreshing) {
+        return;
+    }
+    entry->refreshing = true;
+    entry->refreshNext = dnsCache.refreshHead;
+    dnsCache.refreshHead = entry;
+    pthread_cond_signal(&dnsCache.refreshReady);
+}
+
+/**
+ * @brief Runs the callbacks of waiters taken off an entry, without the mutex
+ *
+ *
+ * @param[in]   *waiter         First waiter
+ *
+ * @return      void
+ */
+static void dns_wake(dns_waiter *waiter) {
+    dns_waiter *next;
+    while (waiter != NULL) {
+        /* The callback may reuse the waiter */
+        next = waiter->next;
+        waiter->wake(waiter->arg);
+        waiter = next;
+    }
+}
+
+/**
+ * @brief Resolver thread, re-resolves expired answers that are still in use
+ * and makes the first lookups handed over by dns_getaddrinfo_nowait()
+ *
+ * A failed refresh keeps the stale answer until DNS_STALE_SECS ran out, the
+ * next lookup queues the hostname again.
+ *
+ *
+ * @param[in]   vargp           Unused
+ *
+ * @return      void*           Never returns
+ */
+static void *dns_refresh_thread(void *vargp) {
+    char hostname[MAXLINE];
+    dns_entry *entry;
+    dns_answer answer;
+    dns_waiter *waiters;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        pthread_mutex_lock(&dnsCache.mutex);
+        while (dnsCache.refreshHead == NULL) {
+            pthread_cond_wait(&dnsCache.refreshReady, &dnsCache.mutex);
+        }
+        entry = dnsCache.refreshHead;
+        dnsCache.refreshHead = entry->refreshNext;
+        snprintf(hostname, sizeof(hostname), "%s", entry->hostname);
+        pthread_mutex_unlock(&dnsCache.mutex);
+
+        /* The entry stays put while refreshing is set */
+        dns_resolve(hostname, &answer);
+
+        pthread_mutex_lock(&dnsCache.mutex);
+        if (entry->state == DNS_RESOLVING) {
+            /* A first lookup, its failure is an answer too */
+            dns_store(entry, &answer);
+            pthread_cond_broadcast(&dnsCache.resolved);
+        } else if (answer.error == 0) {
+            dns_store(entry, &answer);
+        }
+        entry->refreshing = false;
+        waiters = entry->waiters;
+        entry->waiters = NULL;
+        pthread_mutex_unlock(&dnsCache.mutex);
+        dns_wake(waiters);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Builds an addrinfo list for the answer's addresses on a port, in a
+ * single allocation
+ *
+ *
+ * @param[in]   *answer         Answer with at least one address
+ * @param[in]   *port           Numeric port
+ *
+ * @return      struct addrinfo*    List, freed with dns_freeaddrinfo()
+ */
+static struct addrinfo *dns_build_list(const dns_answer *answer,
+                                       const char *port) {
+    struct dns_node {
+        struct addrinfo ai; /* first, so the list head frees the array */
+        struct sockaddr_storage addr;
+    } *nodes;
+    uint16_t portNum = htons((uint16_t)atoi(port));
+    size_t i;
+
+    nodes = Calloc(answer->addrCnt, sizeof(struct dns_node));
+    for (i = 0; i < answer->addrCnt; i++) {
+        memcpy(&nodes[i].addr, &answer->addrs[i], answer->addrLens[i]);
+        if (nodes[i].addr.ss_family == AF_INET) {
+            ((struct sockaddr_in *)&nodes[i].addr)->sin_port = portNum;
+        } else if (nodes[i].addr.ss_family == AF_INET6) {
+            ((struct sockaddr_in6 *)&nodes[i].addr)->sin6_port = portNum;
+        }
+        nodes[i].ai.ai_family = nodes[i].addr.ss_family;
+        nodes[i].ai.ai_socktype = SOCK_STREAM;
+        nodes[i].ai.ai_addrlen = answer->addrLens[i];
+        nodes[i].ai.ai_addr = (struct sockaddr *)&nodes[i].addr;
+        nodes[i].ai.ai_next =
+            (i + 1 < answer->addrCnt) ? &nodes[i + 1].ai : NULL;
+    }
+    return &nodes[0].ai;
+}
+
+/**
+ * @brief Looks up the addresses of an end server through the cache, a
+ * getaddrinfo() replacement for SOCK_STREAM connections on a numeric port
+ *
+ *
+ * @param[in]   *hostname       End server host
+ * @param[in]   *port           Numeric end server port
+ * @param[out]  **res           Address list, freed with dns_freeaddrinfo()
+ *
+ * @return      int             0 on success, a getaddrinfo() error otherwise
+ */
+int dns_getaddrinfo(const char *hostname, const char *port,
+                    struct addrinfo **res) {
+    dns_entry *entry;
+    dns_answer answer;
+    dns_waiter *waiters = NULL;
+    time_t now = time(NULL);
+    bool resolve = false;
+
+    pthread_mutex_lock(&dnsCache.mutex);
+    if ((entry = dns_find(hostname)) == NULL) {
+        entry = dns_insert(hostname, now);
+        resolve = true;
+    } else {
+        /* Share the lookup already in flight */
+        while (entry->state == DNS_RESOLVING) {
+            pthread_cond_wait(&dnsCache.resolved, &dnsCache.mutex);
+        }
+        if (now >= entry->expires) {
+            if (entry->answer.error == 0 &&
+                now < entry->expires + DNS_STALE_SECS) {
+                /* Serve the stale answer, refresh it in the background */
+                dns_queue(entry);
+            } else if (!entry->refreshing) {
+                entry->state = DNS_RESOLVING;
+                resolve = true;
+            }
+        }
+    }
+    if (!resolve) {
+        answer = entry->answer;
+    }
+    pthread_mutex_unlock(&dnsCache.mutex);
+
+    if (resolve) {
+        dns_resolve(hostname, &answer);
+        pthread_mutex_lock(&dnsCache.mutex);
+        dns_store(entry, &answer);
+        pthread_cond_broadcast(&dnsCache.resolved);
+        waiters = entry->waiters;
+        entry->waiters = NULL;
+        pthread_mutex_unlock(&dnsCache.mutex);
+        dns_wake(waiters);
+    }
+    if (answer.error != 0) {
+        return answer.error;
+    }
+    *res = dns_build_list(&answer, port);
+    return 0;
+}
+
+/**
+ * @brief dns_getaddrinfo() for callers that must not block: answers from the
+ * cache when it can, otherwise hands the lookup to the resolver thread and
+ * calls the waiter back once it is answered, after which a new call answers
+ * from the cache
+ *
+ *
+ * @param[in]   *hostname       End server host
+ * @param[in]   *port           Numeric end server port
+ * @param[out]  **res           Address list, freed with dns_freeaddrinfo()
+ * @param[out]  *error          0 on success, a getaddrinfo() error otherwise
+ * @param[in]   *waiter         Callback registered when the lookup is pending
+ *
+ * @return      bool            true when answered, false when waiter was
+ * registered instead
+ */
+bool dns_getaddrinfo_nowait(const char *hostname, const char *port,
+                            struct addrinfo **res, int *error,
+                            dns_waiter *waiter) {
+    dns_entry *entry;
+    dns_answer answer;
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&dnsCache.mutex);
+    if ((entry = dns_find(hostname)) == NULL) {
+        entry = dns_insert(hostname, now);
+        dns_queue(entry);
+    } else if (entry->state == DNS_READY && now >= entry->expires) {
+        if (entry->answer.error == 0 &&
+            now < entry->expires + DNS_STALE_SECS) {
+            dns_queue(entry);
+        } else if (!entry->refreshing) {
+            entry->state = DNS_RESOLVING;
+            dns_queue(entry);
+        }
+    }
+    if (entry->state == DNS_RESOLVING) {
+        waiter->next = entry->waiters;
+        entry->waiters = waiter;
+        pthread_mutex_unlock(&dnsCache.mutex);
+        return false;
+    }
+    answer = entry->answer;
+    pthread_mutex_unlock(&dnsCache.mutex);
+
+    if ((*error = answer.error) == 0) {
+        *res = dns_build_list(&answer, port);
+    }
+    return true;
+}
+
+/**
+ * @brief Frees a list returned by dns_getaddrinfo()
+ *
+ *
+ * @param[in]   *res            Address list
+ *
+ * @return      void
+ */
+void dns_freeaddrinfo(struct addrinfo *res) {
+    Free(res);
+}
+
+/**
+ * @brief open_clientfd() over the cached lookup, opens a connection to an end
+ * server
+ *
+ *
+ * @param[in]   *hostname       End server host
+ * @param[in]   *port           Numeric end server port
+ *
+ * @return      int             Connected socket, -2 when the lookup failed, -1
+ * when every connect failed
+ */
+int dns_open_clientfd(const char *hostname, const char *port) {
+    return dns_open_clientfd_timeout(hostname, port, NULL);
+}
+
+/**
+ * @brief dns_open_clientfd() giving up on each address after a timeout, which
+ * also bounds every later send and receive on the socket
+ *
+ *
+ * @param[in]   *hostname       End server host
+ * @param[in]   *port           Numeric end server port
+ * @param[in]   *timeout        Connect, send and receive timeout, NULL to
+ * block for as long as the kernel does
+ *
+ * @return      int             Connected socket, -2 when the lookup failed, -1
+ * when every connect failed
+ */
+int dns_open_clientfd_timeout(const char *hostname, const char *port,
+                              const struct timeval *timeout) {
+    int clientfd = -1, rc;
+    struct addrinfo *listp, *p;
+
+    if ((rc = dns_getaddrinfo(hostname, port, &listp)) != 0) {
+        log_printf(LOG_LEVEL_ERROR, "getaddrinfo failed (%s:%s): %s\n",
+                   hostname, port, gai_strerror(rc));
+        return -2;
+    }
+
+    /* Walk the list for one that we can successfully connect to */
+    for (p = listp; p; p = p->ai_next) {
+        clientfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (clientfd < 0) {
+            continue; /* Socket failed, try the next */
+        }
+        if (timeout != NULL) {
+            /* Linux bounds connect() by the send timeout */
+            setsockopt(clientfd, SOL_SOCKET, SO_SNDTIMEO, timeout,
+                       sizeof(*timeout));
+            setsockopt(clientfd, SOL_SOCKET, SO_RCVTIMEO, timeout,
+                       sizeof(*timeout));
+        }
+        if (connect(clientfd, p->ai_addr, p->ai_addrlen) != -1) {
+            break; /* Success */
+        }
+        close(clientfd);
+    }
+
+    dns_freeaddrinfo(listp);
+    return (p != NULL) ? clientfd : -1;
+}
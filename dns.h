@@ -0,0 +1,84 @@
+/**
+ * @file dns.h
+ * @brief Header file for the in-process cache of end server host lookups
+ *
+ * Description: Resolved addresses are kept per hostname for DNS_TTL_SECS,
+ * failed lookups for DNS_NEGATIVE_TTL_SECS, defines, structures and function
+ * prototypes.
+ *
+ *
+ * @author Abhishek Basrithaya <abasrith@andrew.cmu.edu>
+ */
+#ifndef DNS_H
+#define DNS_H
+
+#include <netdb.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+
+/* DNS cache defines */
+#define DNS_HASH_BUCKETS 256
+#define DNS_MAX_ENTRIES 1024
+#define DNS_MAX_ADDRS 8
+/* getaddrinfo() reports no record TTL, so every answer gets the same one */
+#define DNS_TTL_SECS 60
+#define DNS_NEGATIVE_TTL_SECS 5
+/* An expired answer is still served, while refreshed, for this long */
+#define DNS_STALE_SECS 300
+
+/* Lookup that cannot block, woken through a callback once answered */
+typedef struct dns_waiter {
+    void (*wake)(void *arg); /* called without the cache lock held */
+    void *arg;               /* argument to wake */
+    struct dns_waiter *next; /* next waiter on the same hostname */
+} dns_waiter;
+
+typedef enum {
+    DNS_RESOLVING, /* first lookup in flight, callers wait for it */
+    DNS_READY      /* answer or failure cached */
+} dns_state;
+
+typedef struct {
+    int error;                                    /* getaddrinfo() error, 0 */
+    size_t addrCnt;                               /* addresses held */
+    struct sockaddr_storage addrs[DNS_MAX_ADDRS]; /* resolved, port 0 */
+    socklen_t addrLens[DNS_MAX_ADDRS];            /* length of each address */
+} dns_answer;
+
+typedef struct dns_entry {
+    char *hostname;                /* lookup key */
+    dns_state state;               /* lookup progress */
+    dns_answer answer;             /* last answer, valid once DNS_READY */
+    time_t expires;                /* end of the answer's TTL */
+    bool refreshing;               /* queued for or held by the resolver */
+    dns_waiter *waiters;           /* callbacks to run once resolved */
+    struct dns_entry *hashNext;    /* next entry in the bucket */
+    struct dns_entry *refreshNext; /* next entry to refresh */
+} dns_entry;
+
+typedef struct {
+    dns_entry *buckets[DNS_HASH_BUCKETS]; /* cached hostnames */
+    size_t entryCnt;                      /* entries in the table */
+    dns_entry *refreshHead;               /* expired entries to re-resolve */
+    pthread_mutex_t mutex;                /* protects the table */
+    pthread_cond_t resolved;              /* a first lookup completed */
+    pthread_cond_t refreshReady;          /* refreshHead became non-empty */
+} DnsCache;
+
+/* Function prototyping */
+void dns_init(void);
+int dns_getaddrinfo(const char *hostname, const char *port,
+                    struct addrinfo **res);
+bool dns_getaddrinfo_nowait(const char *hostname, const char *port,
+                            struct addrinfo **res, int *error,
+                            dns_waiter *waiter);
+void dns_freeaddrinfo(struct addrinfo *res);
+int dns_open_clientfd(const char *hostname, const char *port);
+int dns_open_clientfd_timeout(const char *hostname, const char *port,
+                              const struct timeval *timeout);
+
+#endif /* DNS_H */
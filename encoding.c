@@ -0,0 +1,422 @@
+/**
+ * @file encoding.c
+ * @brief gzip content coding of cached responses
+ *
+ * Description: With compression enabled, the cache stores compressible
+ * responses gzip coded: a 200 with a textual Content-Type, no coding of its
+ * own, no Cache-Control: no-transform, and a body big enough to be worth it.
+ * encoding_compress() rewrites such a response as a complete gzip coded one,
+ * its Content-Length recomputed and Vary: Accept-Encoding added, and gives
+ * up when the result would not be markedly smaller.
+ *
+ * A gzip coded object, compressed here or sent that way by the end server,
+ * is served as stored to clients whose Accept-Encoding allows gzip and is
+ * turned back into an identity coded response by encoding_decompress() for
+ * any other client, so only those clients pay for a coding they cannot read.
+ *
+ *
+ * @author Abhishek Basrithaya <abasrith@andrew.cmu.edu>
+ */
+#include "encoding.h"
+#include "cache.h"
+#include "csapp.h"
+#include "framing.h"
+#include <ctype.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <zlib.h>
+
+/* Content-Type substrings of textual media types beyond text/ */
+static const char *compressibleTypes[] = {"json", "javascript", "xml",
+                                          "ecmascript"};
+
+/**
+ * @brief Copies the next line of a response head, CRLF stripped and truncated
+ * to ENCODING_LINE_SIZE
+ *
+ *
+ * @param[in]   *pos            Start of the line
+ * @param[in]   *end            End of the response
+ * @param[out]  *line           Line copy
+ *
+ * @return      const char*     Start of the following line, NULL when the
+ * response ended without a line feed
+ */
+static const char *encoding_next_line(const char *pos, const char *end,
+                                      char *line) {
+    const char *lf = memchr(pos, '\n', (size_t)(end - pos));
+    size_t len;
+
+    if (lf == NULL) {
+        return NULL;
+    }
+    len = (size_t)(lf - pos);
+    if (len > 0 && pos[len - 1] == '\r') {
+        len--;
+    }
+    if (len > ENCODING_LINE_SIZE - 1) {
+        len = ENCODING_LINE_SIZE - 1;
+    }
+    memcpy(line, pos, len);
+    line[len] = '\0';
+    return lf + 1;
+}
+
+/**
+ * @brief Finds where the body of a response starts
+ *
+ *
+ * @param[in]   *response       Response headers and body
+ * @param[in]   len             Bytes held in response
+ *
+ * @return      size_t          Length of the head including the empty line
+ * ending it, 0 when the head is incomplete
+ */
+static size_t encoding_head_len(const char *response, size_t len) {
+    char line[ENCODING_LINE_SIZE];
+    const char *pos = response, *end = response + len;
+
+    while ((pos = encoding_next_line(pos, end, line)) != NULL) {
+        if (line[0] == '\0' && pos - response > 2) {
+            return (size_t)(pos - response);
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Copies the status line and headers of a response, leaving out its
+ * Content-Length and Content-Encoding and the empty line ending the head. A
+ * strong ETag is copied as a weak one, the bytes it named were rewritten.
+ *
+ *
+ * @param[in]   *response       Response whose head is complete
+ * @param[in]   headLen         Length from encoding_head_len()
+ * @param[out]  *out            Destination
+ * @param[in]   size            Room in out
+ *
+ * @return      size_t          Bytes copied, 0 when out is too small
+ */
+static size_t encoding_copy_head(const char *response, size_t headLen,
+                                 char *out, size_t size) {
+    char line[ENCODING_LINE_SIZE];
+    const char *pos = response, *end = response + headLen, *next, *value;
+    size_t copied = 0, lineLen;
+
+    while ((next = encoding_next_line(pos, end, line)) != NULL &&
+           (line[0] != '\0' || pos == response)) {
+        if ((value = framing_header_value(line, "ETag")) != NULL &&
+            strncmp(value, "W/", 2) != 0) {
+            lineLen = strlen("ETag: W/\r\n") + strlen(value);
+            if (copied + lineLen >= size) {
+                return 0;
+            }
+            copied += (size_t)snprintf(out + copied, size - copied,
+                                       "ETag: W/%s\r\n", value);
+        } else if (framing_header_value(line, "Content-Length") == NULL &&
+                   framing_header_value(line, "Content-Encoding") == NULL) {
+            if (copied + (size_t)(next - pos) > size) {
+                return 0;
+            }
+            memcpy(out + copied, pos, (size_t)(next - pos));
+            copied += (size_t)(next - pos);
+        }
+        pos = next;
+    }
+    return copied;
+}
+
+/**
+ * @brief Tells whether a Content-Type names a textual media type
+ *
+ *
+ * @param[in]   *value          Content-Type value
+ *
+ * @return      bool            true if the type compresses well
+ */
+static bool encoding_type_compressible(const char *value) {
+    char type[ENCODING_LINE_SIZE];
+    size_t len = strcspn(value, "; \t"), i;
+
+    for (i = 0; i < len; i++) {
+        type[i] = (char)tolower((unsigned char)value[i]);
+    }
+    type[len] = '\0';
+    if (strncmp(type, "text/", 5) == 0) {
+        return true;
+    }
+    for (i = 0; i < sizeof(compressibleTypes) / sizeof(compressibleTypes[0]);
+         i++) {
+        if (strstr(type, compressibleTypes[i]) != NULL) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Tells whether a client's request headers allow a gzip coded
+ * response, from an explicit gzip or x-gzip coding or else from *
+ *
+ *
+ * @param[in]   *client_hdrs    Client header lines
+ *
+ * @return      bool            true if a gzip coded response may be sent
+ */
+bool encoding_accepts_gzip(const char *client_hdrs) {
+    const char *line = client_hdrs, *value, *itemEnd, *param;
+    double gzipQ = -1, anyQ = -1, q;
+    size_t codingLen;
+
+    while (line != NULL && *line != '\0') {
+        value = framing_header_value(line, "Accept-Encoding");
+        while (value != NULL) {
+            while (*value == ' ' || *value == '\t') {
+                value++;
+            }
+            codingLen = strcspn(value, ";, \t\r\n");
+            itemEnd = value + strcspn(value, ",\r\n");
+            q = 1;
+            for (param = value + codingLen; param < itemEnd; param++) {
+                if (*param == ';') {
+                    while (param[1] == ' ' || param[1] == '\t') {
+                        param++;
+                    }
+                    if ((param[1] == 'q' || param[1] == 'Q') &&
+                        param[2] == '=') {
+                        q = strtod(param + 3, NULL);
+                    }
+                }
+            }
+            if ((codingLen == 4 && strncasecmp(value, "gzip", 4) == 0) ||
+                (codingLen == 6 && strncasecmp(value, "x-gzip", 6) == 0)) {
+                gzipQ = q;
+            } else if (codingLen == 1 && *value == '*') {
+                anyQ = q;
+            }
+            value = (*itemEnd == ',') ? itemEnd + 1 : NULL;
+        }
+        if ((line = strchr(line, '\n')) != NULL) {
+            line++;
+        }
+    }
+    return (gzipQ >= 0) ? gzipQ > 0 : anyQ > 0;
+}
+
+/**
+ * @brief Tells whether a complete response should be stored compressed
+ *
+ *
+ * @param[in]   *response       Response headers and body
+ * @param[in]   len             Bytes held in response
+ *
+ * @return      bool            true for a complete identity coded 200 with a
+ * textual type, a body of at least ENCODING_MIN_SIZE and no no-transform
+ */
+bool encoding_compressible(const char *response, size_t len) {
+    char line[ENCODING_LINE_SIZE];
+    const char *pos = response, *end = response + len, *value;
+    size_t headLen = encoding_head_len(response, len);
+    bool textual = false;
+    long contentLength = -1;
+    int status;
+
+    if (headLen == 0 || len - headLen < ENCODING_MIN_SIZE ||
+        (pos = encoding_next_line(pos, end, line)) == NULL ||
+        sscanf(line, "HTTP/1.%*c %d", &status) != 1 || status != 200) {
+        return false;
+    }
+    while ((pos = encoding_next_line(pos, end, line)) != NULL &&
+           line[0] != '\0') {
+        if ((value = framing_header_value(line, "Content-Type")) != NULL) {
+            textual = encoding_type_compressible(value);
+        } else if ((value = framing_header_value(line, "Content-Length")) !=
+                   NULL) {
+            contentLength = strtol(value, NULL, 10);
+        } else if ((value = framing_header_value(line, "Cache-Control")) !=
+                   NULL) {
+            if (framing_header_has_token(value, "no-transform")) {
+                return false;
+            }
+        } else if (framing_header_value(line, "Content-Encoding") != NULL ||
+                   framing_header_value(line, "Transfer-Encoding") != NULL ||
+                   framing_header_value(line, "Content-Range") != NULL) {
+            return false;
+        }
+    }
+    return textual &&
+           (contentLength < 0 || (size_t)contentLength == len - headLen);
+}
+
+/**
+ * @brief Rewrites a response encoding_compressible() accepted as a gzip
+ * coded one
+ *
+ *
+ * @param[in]   *response       Response headers and body
+ * @param[in]   len             Bytes held in response
+ * @param[out]  *out            Destination of the rewritten response
+ * @param[in]   size            Room in out
+ *
+ * @return      size_t          Length of the rewritten response, 0 when it
+ * does not fit or would not save ENCODING_MAX_PERCENT
+ */
+size_t encoding_compress(const char *response, size_t len, char *out,
+                         size_t size) {
+    size_t headLen = encoding_head_len(response, len), headOut, bodyAt;
+    size_t bodyLen, extraLen, total;
+    char extra[ENCODING_HEAD_EXTRA];
+    z_stream zs;
+    int rc;
+
+    if (headLen == 0 ||
+        (headOut = encoding_copy_head(response, headLen, out, size)) == 0 ||
+        (bodyAt = headOut + ENCODING_HEAD_EXTRA) >= size) {
+        return 0;
+    }
+    memset(&zs, 0, sizeof(zs));
+    /* 16 added to the window bits asks for a gzip wrapper */
+    if (deflateInit2(&zs, ENCODING_LEVEL, Z_DEFLATED, 15 + 16, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        return 0;
+    }
+    zs.next_in = (Bytef *)(response + headLen);
+    zs.avail_in = (uInt)(len - headLen);
+    zs.next_out = (Bytef *)(out + bodyAt);
+    zs.avail_out = (uInt)(size - bodyAt);
+    rc = deflate(&zs, Z_FINISH);
+    bodyLen = zs.total_out;
+    deflateEnd(&zs);
+    if (rc != Z_STREAM_END) {
+        return 0;
+    }
+
+    extraLen = (size_t)snprintf(extra, sizeof(extra),
+                                "Content-Encoding: gzip\r\n"
+                                "Content-Length: %zu\r\n"
+                                "Vary: Accept-Encoding\r\n\r\n",
+                                bodyLen);
+    memmove(out + headOut + extraLen, out + bodyAt, bodyLen);
+    memcpy(out + headOut, extra, extraLen);
+    total = headOut + extraLen + bodyLen;
+    if (total * 100 >= len * ENCODING_MAX_PERCENT) {
+        return 0;
+    }
+    return total;
+}
+
+/**
+ * @brief Tells whether a stored response carries a gzip coded body that
+ * encoding_decompress() can turn back into identity
+ *
+ *
+ * @param[in]   *response       Response headers and body
+ * @param[in]   len             Bytes held in response
+ *
+ * @return      bool            true when gzip is its only content coding and
+ * no transfer coding wraps the body
+ */
+bool encoding_is_gzip(const char *response, size_t len) {
+    char line[ENCODING_LINE_SIZE];
+    const char *pos = response, *end = response + len, *value;
+    bool gzip = false;
+    size_t valueLen;
+
+    if ((pos = encoding_next_line(pos, end, line)) == NULL) {
+        return false;
+    }
+    while ((pos = encoding_next_line(pos, end, line)) != NULL &&
+           line[0] != '\0') {
+        if ((value = framing_header_value(line, "Content-Encoding")) != NULL) {
+            valueLen = strcspn(value, " \t");
+            gzip = value[valueLen + strspn(value + valueLen, " \t")] ==
+                       '\0' &&
+                   ((valueLen == 4 && strncasecmp(value, "gzip", 4) == 0) ||
+                    (valueLen == 6 && strncasecmp(value, "x-gzip", 6) == 0));
+            if (!gzip) {
+                return false;
+            }
+        } else if (framing_header_value(line, "Transfer-Encoding") != NULL) {
+            return false;
+        }
+    }
+    return gzip && pos != NULL;
+}
+
+/**
+ * @brief Rewrites a gzip coded response as an identity coded one
+ *
+ *
+ * @param[in]   *response       Response encoding_is_gzip() accepted
+ * @param[in]   len             Bytes held in response
+ * @param[out]  *outLen         Length of the rewritten response
+ *
+ * @return      char*           Rewritten response to be freed with Free(),
+ * NULL when the body is not valid gzip or inflates past the largest object
+ * the cache holds
+ */
+char *encoding_decompress(const char *response, size_t len, size_t *outLen) {
+    size_t headLen = encoding_head_len(response, len), headOut, bodyAt;
+    size_t cap, maxCap, bodyLen, extraLen, room;
+    char extra[ENCODING_HEAD_EXTRA];
+    char *out;
+    z_stream zs;
+    int rc;
+
+    if (headLen == 0) {
+        return NULL;
+    }
+    /* Decoding stops at the object size limit, gzip bombs included */
+    maxCap = headLen + 2 * ENCODING_HEAD_EXTRA + cache_max_object_size();
+    cap = headLen + 2 * ENCODING_HEAD_EXTRA + 4 * (len - headLen);
+    if (cap > maxCap) {
+        cap = maxCap;
+    }
+    out = Malloc(cap);
+    if ((headOut = encoding_copy_head(response, headLen, out,
+                                      headLen + ENCODING_HEAD_EXTRA)) == 0) {
+        Free(out);
+        return NULL;
+    }
+    bodyAt = headOut + ENCODING_HEAD_EXTRA;
+    memset(&zs, 0, sizeof(zs));
+    /* 32 added to the window bits detects the gzip wrapper */
+    if (inflateInit2(&zs, 15 + 32) != Z_OK) {
+        Free(out);
+        return NULL;
+    }
+    zs.next_in = (Bytef *)(response + headLen);
+    zs.avail_in = (uInt)(len - headLen);
+    while (1) {
+        room = cap - bodyAt - zs.total_out;
+        zs.next_out = (Bytef *)(out + bodyAt + zs.total_out);
+        zs.avail_out = (room > UINT_MAX) ? UINT_MAX : (uInt)room;
+        rc = inflate(&zs, Z_NO_FLUSH);
+        if (rc == Z_STREAM_END) {
+            break;
+        }
+        if (rc != Z_OK || (zs.avail_out > 0 && zs.avail_in == 0) ||
+            (bodyAt + zs.total_out == cap && cap == maxCap)) {
+            /* Corrupt, cut short or too big */
+            inflateEnd(&zs);
+            Free(out);
+            return NULL;
+        }
+        if (bodyAt + zs.total_out == cap) {
+            cap = (cap > maxCap / 2) ? maxCap : 2 * cap;
+            out = Realloc(out, cap);
+        }
+    }
+    bodyLen = zs.total_out;
+    inflateEnd(&zs);
+
+    extraLen = (size_t)snprintf(extra, sizeof(extra),
+                                "Content-Length: %zu\r\n\r\n", bodyLen);
+    memmove(out + headOut + extraLen, out + bodyAt, bodyLen);
+    memcpy(out + headOut, extra, extraLen);
+    *outLen = headOut + extraLen + bodyLen;
+    return out;
+}
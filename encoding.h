@@ -0,0 +1,37 @@
+/**
+ * @file encoding.h
+ * @brief Header file for the gzip content coding of cached responses
+ *
+ * Description: Rewrites complete responses between the identity and the
+ * gzip content coding and reads which codings a client accepts, defines and
+ * function prototypes.
+ *
+ *
+ * @author Abhishek Basrithaya <abasrith@andrew.cmu.edu>
+ */
+#ifndef ENCODING_H
+#define ENCODING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Bodies smaller than this are not worth compressing */
+#define ENCODING_MIN_SIZE 256
+/* Compressed responses must come in below this share of the original */
+#define ENCODING_MAX_PERCENT 90
+/* zlib compression level, traded between fill latency and memory saved */
+#define ENCODING_LEVEL 6
+/* Longest header line inspected, the rest is skipped */
+#define ENCODING_LINE_SIZE 512
+/* Room for the headers a rewrite adds */
+#define ENCODING_HEAD_EXTRA 128
+
+/* Function prototyping */
+bool encoding_accepts_gzip(const char *client_hdrs);
+bool encoding_compressible(const char *response, size_t len);
+size_t encoding_compress(const char *response, size_t len, char *out,
+                         size_t size);
+bool encoding_is_gzip(const char *response, size_t len);
+char *encoding_decompress(const char *response, size_t len, size_t *outLen);
+
+#endif /* ENCODING_H */
@@ -0,0 +1,2001 @@
+/**
+ * @file event.c
+ * @brief Event-driven front end multiplexing many client/origin pairs per
+ * thread over epoll
+ *
+ * Description: Every event loop thread owns one epoll instance and shares the
+ * non-blocking listening socket with its siblings (EPOLLEXCLUSIVE, so only one
+ * loop is woken per incoming connection). Asked for, each loop instead gets a
+ * SO_REUSEPORT listener of its own, among which the kernel spreads incoming
+ * connections, and runs pinned to a CPU, so accepting scales with the loops
+ * and a connection stays on the core that accepted it. Client and origin
+ * sockets are
+ * non-blocking and registered edge-triggered for both directions, and each
+ * connection carries a small state machine:
+ *
+ *   CONN_READ_REQUEST -> CONN_CONNECT -> CONN_SEND_REQUEST -> CONN_RELAY
+ *            |  \              ^
+ *            |   `-> CONN_WAIT_FLIGHT (miss on a uri already being fetched)
+ *             \               |
+ *              `-> CONN_WRITE_CLIENT (cache hit or error response)
+ *
+ * A persistent client connection returns to CONN_READ_REQUEST once its
+ * response is delivered, with any pipelined bytes still in reqBuf, so the
+ * requests of a connection are answered in order.
+ *
+ * Responses too big for the cache are relayed with splice() through a
+ * per-connection pipe, falling back to copying through outBuf when the kernel
+ * refuses to splice the sockets.
+ *
+ * A miss on a uri another connection is already fetching waits in
+ * CONN_WAIT_FLIGHT instead of contacting the end server. The fetching
+ * connection's loop, possibly another thread, queues it back on its own loop
+ * through the loop's eventfd once the response was cached or found not to be
+ * cacheable, and it then retries the cache. An end server lookup the DNS
+ * cache cannot answer at once is made by the resolver thread in the same
+ * way: the connection waits in CONN_RESOLVE and is queued back through the
+ * eventfd once the answer is cached, before going on to CONN_CONNECT, so no
+ * lookup ever blocks a loop.
+ *
+ * With keep-alive end server connections, CONN_CONNECT is skipped when an idle
+ * pooled connection exists, and a response ends where its framing says; its
+ * connection then goes back to the pool instead of being closed. The end
+ * server's Connection header only concerns that hop: nothing is relayed
+ * before the response head is complete, and the client gets it in headBuf
+ * with the proxy's own Connection header, keeping the connection whenever the
+ * client asked to and the body is self-delimiting.
+ *
+ * A client that takes no response bytes for CLIENT_WRITE_TIMEOUT_SECS is
+ * dropped by a once a second sweep over the loop's stalled connections. A
+ * cache hit is written straight from its block until the client first stalls;
+ * the rest is then copied into the connection's own buffer and the block
+ * released, so a slow reader never keeps a cache object pinned.
+ *
+ * A hit too stale to serve is kept in staleBlock while the request goes to
+ * the end server with its validators. Nothing is relayed before the response
+ * status is known: a 304 refreshes the block and serves it as a hit, anything
+ * else replaces it.
+ *
+ * Because notifications are edge-triggered, conn_progress() keeps advancing a
+ * connection until a socket reports EAGAIN; any later readiness change on
+ * either end re-enters it. Connections closed while processing a batch of
+ * events are parked on a per-loop list and only freed once the whole batch has
+ * been handled, so stale events never touch freed memory.
+ *
+ *
+ * @author Abhishek Basrithaya <abasrith@andrew.cmu.edu>
+ */
+#define _GNU_SOURCE
+#include "event.h"
+#include "admit.h"
+#include "cache.h"
+#include "coalesce.h"
+#include "csapp.h"
+#include "dns.h"
+#include "encoding.h"
+#include "framing.h"
+#include "fresh.h"
+#include "log.h"
+#include "metrics.h"
+#include "pool.h"
+#include "proxy.h"
+#include "range.h"
+#include "relay.h"
+#include "revalidate.h"
+#include "upstream.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Event loop defines */
+#define MAX_EVENTS 256
+#define REQUEST_BUF_SIZE MAXLINE
+/* Large enough for any rewritten request, also reused as relay buffer */
+#define OUT_BUF_SIZE (4 * MAXLINE)
+
+/* Typedef for convenience */
+typedef struct sockaddr SA;
+
+typedef enum {
+    CONN_READ_REQUEST, /* accumulating the request line and headers */
+    CONN_WAIT_FLIGHT,  /* waiting for another fetch of the same uri */
+    CONN_RESOLVE,      /* waiting for the end server lookup */
+    CONN_CONNECT,      /* non-blocking connect to the end server pending */
+    CONN_SEND_REQUEST, /* writing the rewritten request to the end server */
+    CONN_RELAY,        /* relaying the end server response to the client */
+    CONN_WRITE_CLIENT, /* writing a cached object or an error to the client */
+    CONN_CLOSED        /* waiting to be reclaimed at the end of the batch */
+} conn_state;
+
+typedef struct conn conn_t;
+typedef struct event_loop event_loop;
+
+typedef struct {
+    conn_t *conn; /* owning connection */
+    int fd;       /* socket descriptor, -1 once closed */
+} conn_end;
+
+struct conn {
+    conn_state state;
+    event_loop *loop;          /* loop the connection belongs to */
+    conn_end client;           /* client side socket */
+    conn_end origin;           /* end server side socket */
+    bool originReady;          /* origin reported writable since connect() */
+    char *reqBuf;              /* client request line and headers */
+    size_t reqLen;             /* bytes held in reqBuf */
+    size_t reqHeadLen;         /* bytes of reqBuf of the current request */
+    bool keepAlive;            /* client asked for a persistent connection */
+    bool acceptsGzip;          /* client accepts a gzip coded response */
+    range_request range;       /* ranges the client asked for */
+    bool persist;              /* connection stays open after the response */
+    char *uri;                 /* request uri, used as the cache key */
+    char *outBuf;              /* request to origin, relay data or response */
+    size_t outLen;             /* bytes held in outBuf */
+    size_t outOff;             /* bytes of outBuf already written */
+    char *originHost;          /* end server host, the pool key */
+    char *originPort;          /* end server port, the pool key */
+    upstream_peer *peer;       /* sibling the miss is routed to, if any */
+    bool pooledOrigin;         /* origin connection was taken from the pool */
+    size_t requestLen;         /* length of the request, kept for a resend */
+    http_framing frame;        /* framing of the end server response */
+    bool headDone;             /* response head handed to the client */
+    char *headBuf;             /* response head rewritten for the client */
+    size_t headLen;            /* bytes held in headBuf */
+    size_t headOff;            /* bytes of headBuf already written */
+    struct addrinfo *addrList; /* end server addresses */
+    struct addrinfo *nextAddr; /* address currently being connected to */
+    cache_block *hitBlock;     /* referenced cache hit that outBuf points to */
+    cache_block *staleBlock;   /* referenced stale hit being revalidated */
+    char *fillBuf;             /* reserved cache buffer, NULL once too big */
+    size_t fillSize;           /* bytes received into fillBuf */
+    size_t fillSent;           /* bytes of fillBuf written to the client */
+    int relayPipe[2];          /* splice() pipe for uncacheable responses */
+    size_t pipeLen;            /* bytes held in relayPipe */
+    bool spliced;              /* bytes have moved through relayPipe */
+    bool copyRelay;            /* splice() unusable, relay through outBuf */
+    coalesce_flight *flight;   /* fetch this connection leads, if any */
+    coalesce_waiter waiter;    /* registration while in CONN_WAIT_FLIGHT */
+    dns_waiter dnsWaiter;      /* registration while in CONN_RESOLVE */
+    conn_t *nextWoken;         /* link in the loop's woken list */
+    bool stalled;              /* on the loop's stalled list */
+    time_t stallSince;         /* last time the client took response bytes */
+    conn_t *prevStalled;       /* links in the loop's stalled list */
+    conn_t *nextStalled;
+    conn_t *nextClosed;        /* link in the loop's reclamation list */
+    metrics_request metrics;   /* timestamps of the current request */
+    admit_client admitted;     /* client as counted against the limits */
+};
+
+/* What an event loop thread starts with */
+typedef struct {
+    int listenfd; /* listening socket, shared or the loop's own */
+    int cpu;      /* CPU to run on, -1 to run anywhere */
+} event_loop_arg;
+
+struct event_loop {
+    int epfd;                   /* epoll instance owned by this loop */
+    int listenfd;               /* listening socket, possibly shared */
+    conn_t *closedList;         /* connections to free after this batch */
+    int wakefd;                 /* eventfd signalled when wokenList grows */
+    conn_end wakeEnd;           /* epoll registration of wakefd */
+    pthread_mutex_t wokenMutex; /* protects wokenList, taken by any thread */
+    conn_t *wokenList;          /* waiters whose flight or lookup landed */
+    conn_t *stalledList;        /* clients not taking response bytes */
+    time_t lastSweep;           /* last sweep of stalledList */
+    int reserveFd;              /* descriptor given up to shed a client */
+    uint64_t acceptPausedAt;    /* when accepting paused, 0 while accepting */
+};
+
+/* Function prototyping */
+static void conn_progress(event_loop *loop, conn_t *c);
+static int connect_origin(event_loop *loop, conn_t *c);
+static void wake_conn(void *arg);
+
+/**
+ * @brief puts a descriptor into non-blocking mode
+ *
+ *
+ * @param[in]   fd              Descriptor to modify
+ *
+ * @return      int             0 on success, -1 on error
+ */
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/**
+ * @brief registers one end of a connection with the loop, edge-triggered for
+ * both directions
+ *
+ *
+ * @param[in]   *loop           Owning event loop
+ * @param[in]   *end            Connection end to watch
+ *
+ * @return      int             0 on success, -1 on error
+ */
+static int watch_end(event_loop *loop, conn_end *end) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = end;
+    return epoll_ctl(loop->epfd, EPOLL_CTL_ADD, end->fd, &ev);
+}
+
+/**
+ * @brief closes the origin socket of a connection, if open
+ *
+ *
+ * @param[in]   *c              Connection
+ *
+ * @return      void
+ */
+static void close_origin(conn_t *c) {
+    if (c->origin.fd >= 0) {
+        close(c->origin.fd);
+        c->origin.fd = -1;
+    }
+}
+
+/**
+ * @brief ends the use of the origin socket once its response is complete,
+ * returning it to the pool when the response ended on its own framing
+ *
+ *
+ * @param[in]   *loop           Owning event loop
+ * @param[in]   *c              Connection
+ *
+ * @return      void
+ */
+static void release_origin(event_loop *loop, conn_t *c) {
+    if (c->origin.fd >= 0 && framing_done(&c->frame) &&
+        c->frame.reusable &&
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, c->origin.fd, NULL) == 0) {
+        pool_put(c->originHost, c->originPort, c->origin.fd);
+        c->origin.fd = -1;
+        return;
+    }
+    close_origin(c);
+}
+
+/**
+ * @brief notes that the client did not take all pending response bytes,
+ * putting the connection on the loop's stalled list
+ *
+ *
+ * @param[in]   *loop           Owning event loop
+ * @param[in]   *c              Connection
+ * @param[in]   progressed      Some bytes were taken before the client
+ * stalled, restarting its timeout
+ *
+ * @return      void
+ */
+static void client_blocked(event_loop *loop, conn_t *c, bool progressed) {
+    if (c->stalled) {
+        if (progressed) {
+            c->stallSince = time(NULL);
+        }
+        return;
+    }
+    c->stalled = true;
+    c->stallSince = time(NULL);
+    c->prevStalled = NULL;
+    c->nextStalled = loop->stalledList;
+    if (loop->stalledList != NULL) {
+        loop->stalledList->prevStalled = c;
+    }
+    loop->stalledList = c;
+}
+
+/**
+ * @brief takes the connection off the loop's stalled list, if on it, once the
+ * client took every pending byte
+ *
+ *
+ * @param[in]   *loop           Owning event loop
+ * @param[in]   *c              Connection
+ *
+ * @return      void
+ */
+static void client_unblocked(event_loop *loop, conn_t *c) {
+    if (!c->stalled) {
+        return;
+    }
+    if (c->prevStalled != NULL) {
+        c->prevStalled->nextStalled = c->nextStalled;
+    } else {
+        loop->stalledList = c->nextStalled;
+    }
+    if (c->nextStalled != NULL) {
+        c->nextStalled->prevStalled = c->prevStalled;
+    }
+    c->stalled = false;
+}
+
+/**
+ * @brief lands the flight the connection leads, if any, releasing the
+ * connections waiting for the same uri
+ *
+ *
+ * @param[in]   *c              Connection
+ *
+ * @return      void
+ */
+static void end_flight(conn_t *c) {
+#if CACHE_USED
+    coalesce_end(c->flight);
+    c->flight = NULL;
+#endif
+}
+
+/**
+ * @brief closes both sockets of a connection and parks it on the loop's
+ * reclamation list
+ *
+ *
+ * @param[in]   *loop           Owning event loop
+ * @param[in]   *c              Connection to close
+ *
+ * @return      void
+ */
+static void conn_close(event_loop *loop, conn_t *c) {
+    if (c->state == CONN_CLOSED) {
+        return;
+    }
+    end_flight(c);
+    client_unblocked(loop, c);
+    close_origin(c);
+    if (c->client.fd >= 0) {
+        close(c->client.fd);
+        c->client.fd = -1;
+    }
+    admit_client_end(&c->admitted);
+    c->state = CONN_CLOSED;
+    c->nextClosed = loop->closedList;
+    loop->closedList = c;
+}
+
+/**
+ * @brief frees a closed connection and every buffer it still owns
+ *
+ *
+ * @param[in]   *c              Connection to free
+ *
+ * @return      void
+ */
+static void conn_free(conn_t *c) {
+    if (c->addrList != NULL) {
+        dns_freeaddrinfo(c->addrList);
+    }
+    Free(c->reqBuf);
+    Free(c->uri);
+    Free(c->originHost);
+    Free(c->originPort);
+    Free(c->headBuf);
+    if (c->hitBlock != NULL) {
+        cache_release(c->hitBlock);
+    } else {
+        Free(c->outBuf);
+    }
+    if (c->staleBlock != NULL) {
+        cache_release(c->staleBlock);
+    }
+    if (c->fillBuf != NULL) {
+        cache_fill_abandon(c->fillBuf);
+    }
+    relay_pipe_close(c->relayPipe);
+    Free(c);
+}
+
+/**
+ * @brief ends a delivered response: a persistent connection is reset for the
+ * client's next request, keeping the bytes it already sent, any other one is
+ * closed
+ *
+ *
+ * @param[in]   *loop           Owning event loop
+ * @param[in]   *c              Connection whose response was delivered
+ *
+ * @return      void
+ */
+static void conn_finish(event_loop *loop, conn_t *c) {
+    metrics_request_end(&c->metrics);
+    if (!c->persist) {
+        conn_close(loop, c);
+        return;
+    }
+    end_flight(c);
+    client_unblocked(loop, c);
+    close_origin(c);
+    if (c->addrList != NULL) {
+        dns_freeaddrinfo(c->addrList);
+        c->addrList = NULL;
+    }
+    if (c->hitBlock != NULL) {
+        cache_release(c->hitBlock);
+        c->hitBlock = NULL;
+    } else {
+        Free(c->outBuf);
+    }
+    if (c->staleBlock != NULL) {
+        cache_release(c->staleBlock);
+        c->staleBlock = NULL;
+    }
+    c->outBuf = NULL;
+    c->outLen = 0;
+    c->outOff = 0;
+    Free(c->headBuf);
+    c->headBuf = NULL;
+    c->headDone = false;
+    Free(c->uri);
+    Free(c->originHost);
+    Free(c->originPort);
+    c->uri = c->originHost = c->originPort = NULL;
+    c->peer = NULL;
+    c->pooledOrigin = false;
+    c->persist = false;
+    /* Pipelined requests move to the front of reqBuf */
+    c->reqLen -= c->reqHeadLen;
+    memmove(c->reqBuf, c->reqBuf + c->reqHeadLen, c->reqLen);
+    c->reqBuf[c->reqLen] = '\0';
+    c->reqHeadLen = 0;
+    /* The next request is timed from its arrival */
+    metrics_request_begin(&c->metrics, (c->reqLen > 0) ? metrics_now() : 0);
+    c->state = CONN_READ_REQUEST;
+}
+
+/**
+ * @brief queues a prebuilt error response for the client and switches the
+ * connection to writing it
+ *
+ *
+ * @param[in]   *c              Connection
+ * @param[in]   err             Error to answer
+ *
+ * @return      void
+ */
+static void respond_error(conn_t *c, client_error err) {
+    const char *response = clienterror_response(err, &c->outLen);
+
+    c->outBuf = Malloc(c->outLen);
+    memcpy(c->outBuf, response, c->outLen);
+    c->outOff = 0;
+    c->state = CONN_WRITE_CLIENT;
+}
+
+/**
+ * @brief starts a non-blocking connect to the next candidate end server
+ * address, moving on to the following address on immediate failure
+ *
+ *
+ * @param[in]   *loop           Owning event loop
+ * @param[in]   *c              Connection
+ *
+ * @return      int             0 when connected or in progress, -1 when every
+ * address failed
+ */
+static int start_connect(event_loop *loop, conn_t *c) {
+    struct addrinfo *p;
+    int fd;
+
+    for (p = c->nextAddr; p != NULL; p = p->ai_next) {
+        fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        if (set_nonblocking(fd) < 0) {
+            close(fd);
+            continue;
+        }
+        if (connect(fd, p->ai_addr, p->ai_addrlen) == 0 ||
+            errno == EINPROGRESS) {
+            c->origin.fd = fd;
+            c->nextAddr = p;
+            c->originReady = false;
+            if (watch_end(loop, &c->origin) < 0) {
+                close_origin(c);
+                continue;
+            }
+            c->state = CONN_CONNECT;
+            return 0;
+        }
+        close(fd);
+    }
+    c->nextAddr = NULL;
+    return -1;
+}
+
+/**
+ * @brief rewrites the head at the start of a response into headBuf for the
+ * client, with the proxy's own Connection header in place of the end server's
+ * hop-by-hop headers
+ *
+ *
+ * @param[in]   *c              Connection, persist telling whether it stays
+ * open after the response
+ * @param[in]   *response       Response bytes
+ * @param[in]   len             Bytes held in response
+ *
+ * @return      size_t          Bytes of response the head took, 0 when it
+ * holds no complete head and goes out as is
+ */
+static size_t client_head(conn_t *c, const char *response, size_t len) {
+    size_t headLen = framing_head_len(response, len);
+
+    c->headDone = true;
+    if (headLen > 0) {
+        c->headBuf = Malloc(headLen + FRAMING_CONN_EXTRA);
+        c->headLen =
+            framing_client_head(response, headLen, c->headBuf, c->persist);
+        c->headOff = 0;
+    }
+    return headLen;
+}
+
+#if CACHE_USED
+/**
+ * @brief switches a connection to writing a cache hit
+ *
+ * The hit is written straight from the cache block; the reference keeps it
+ * alive across iterations even if it is evicted meanwhile, and is dropped
+ * once the response is delivered. A gzip coded hit is decoded into outBuf
+ * instead for a client that does not accept gzip, and the ranges of a range
+ * request are cut out into outBuf, the hit being released at once. The head
+ * always goes out from headBuf.
+ *
+ *
+ * @param[in]   *c              Connection
+ * @param[in]   *reqCachePtr    Block returned by cache_find()
+ *
+ * @return      void
+ */
+static void serve_hit(conn_t *c, cache_block *reqCachePtr) {
+    if ((c->outBuf = range_respond_stored(
+             &c->range, reqCachePtr->cache_obj, reqCachePtr->cache_obj_size,
+             reqCachePtr->compressed, &c->outLen)) != NULL ||
+        (reqCachePtr->compressed && !c->acceptsGzip &&
+         (c->outBuf = encoding_decompress(reqCachePtr->cache_obj,
+                                          reqCachePtr->cache_obj_size,
+                                          &c->outLen)) != NULL)) {
+        cache_release(reqCachePtr);
+    } else {
+        c->hitBlock = reqCachePtr;
+        c->outBuf = reqCachePtr->cache_obj;
+        c->outLen = reqCachePtr->cache_obj_size;
+    }
+    c->persist =
+        c->keepAlive && framing_stored_keeps_alive(c->outBuf, c->outLen);
+    c->outOff = client_head(c, c->outBuf, c->outLen);
+    c->state = CONN_WRITE_CLIENT;
+}
+#endif
+
+/**
+ * @brief sends a rewritten request on its way to the end server, over an idle
+ * pooled connection if there is one, otherwise over a new one
+ *
+ *
+ * @param[in]   *loop           Owning event loop
+ * @param[in]   *c              Connection with outBuf, originHost and
+ * originPort set
+ *
+ * @return      void
+ */
+static void start_origin(event_loop *loop, conn_t *c) {
+    /* An idle keep-alive connection to the end server skips the connect */
+    if ((c->origin.fd = pool_get(c->originHost, c->originPort)) >= 0) {
+        if (set_nonblocking(c->origin.fd) == 0 &&
+            watch_end(loop, &c->origin) == 0) {
+            c->pooledOrigin = true;
+            c->state = CONN_SEND_REQUEST;
+            return;
+        }
+        close_origin(c);
+    }
+    if (connect_origin(loop, c) < 0) {
+        conn_close(loop, c);
+    }
+}
+
+/**
+ * @brief rewrites a miss for the node it is fetched from: the sibling owning
+ * its uri, or the end server named in the request
+ *
+ * A miss routed to a sibling is sent as a proxy request and not revalidated
+ * here, the sibling keeps the object fresh.
+ *
+ *
+ * @param[in]   *c              Connection with reqBuf and uri set
+ *
+ * @return      int             0 on success, -1 when the request line does
+ * not parse
+ */
+static int prepare_origin(conn_t *c) {
+    char buf[MAXLINE], hostname[MAXLINE], path[MAXLINE], portStr[MAXLINE];
+    const char *hdrs, *serverHost, *serverPort;
+    char *lineEnd;
+    size_t lineLen;
+    int port = DEFAULT_PORT_NUM;
+
+    /* handle_request() made sure the request line fits */
+    lineEnd = strchr(c->reqBuf, '\n');
+    lineLen = (lineEnd != NULL) ? (size_t)(lineEnd - c->reqBuf) + 1 : c->reqLen;
+    memcpy(buf, c->reqBuf, lineLen);
+    buf[lineLen] = '\0';
+    hdrs = c->reqBuf + lineLen;
+
+    /*parse the uri to get hostname,file path ,port*/
+    if (parse_request_target(buf, hostname, path, &port) < 0) {
+        return -1;
+    }
+    sprintf(portStr, "%d", port);
+    c->peer = upstream_route(c->uri, hdrs, c->client.fd);
+
+    /*build the http header which will send to the node*/
+    Free(c->outBuf);
+    c->outBuf = Malloc(OUT_BUF_SIZE);
+    if (c->peer != NULL) {
+        build_server_http_request(c->outBuf, OUT_BUF_SIZE, hostname, c->uri,
+                                  hdrs);
+        c->outLen = upstream_add_hop(c->outBuf, OUT_BUF_SIZE);
+        serverHost = c->peer->host;
+        serverPort = c->peer->port;
+#if CACHE_USED
+        if (c->staleBlock != NULL) {
+            cache_release(c->staleBlock);
+            c->staleBlock = NULL;
+        }
+#endif
+    } else {
+        c->outLen = build_server_http_request(c->outBuf, OUT_BUF_SIZE,
+                                              hostname, path, hdrs);
+#if CACHE_USED
+        /* The whole object is fetched, ranges are cut out of it */
+        c->outLen = range_strip(c->outBuf);
+        /* A stale hit is only sent again if it changed */
+        if (c->staleBlock != NULL) {
+            c->outLen = fresh_add_validators(c->outBuf, OUT_BUF_SIZE,
+                                             c->staleBlock->cache_obj,
+                                             c->staleBlock->cache_obj_size);
+        }
+#endif
+        serverHost = hostname;
+        serverPort = portStr;
+    }
+    c->outOff = 0;
+    Free(c->originHost);
+    Free(c->originPort);
+    c->originHost = Malloc(strlen(serverHost) + 1);
+    strcpy(c->originHost, serverHost);
+    c->originPort = Malloc(strlen(serverPort) + 1);
+    strcpy(c->originPort, serverPort);
+    return 0;
+}
+
+/**
+ * @brief handles a complete request head: validates the request line, serves
+ * cache hits, otherwise rewrites the request and starts the origin connect
+ *
+ *
+ * @param[in]   *loop           Owning event loop
+ * @param[in]   *c              Connection
+ *
+ * @return      void
+ */
+static void handle_request(event_loop *loop, conn_t *c) {
+    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+    char *lineEnd, *hdrPtr;
+    size_t lineLen;
+
+    /* Split off the request line */
+    lineEnd = strchr(c->reqBuf, '\n');
+    lineLen = (lineEnd != NULL) ? (size_t)(lineEnd - c->reqBuf) + 1 : c->reqLen;
+    if (lineLen >= MAXLINE) {
+        respond_error(c, CLIENT_ERROR_MALFORMED);
+        return;
+    }
+    memcpy(buf, c->reqBuf, lineLen);
+    buf[lineLen] = '\0';
+
+    /*parse request line */
+    if (sscanf(buf, "%s %s HTTP/1.%c", method, uri, version) != 3 ||
+        (*version != '0' && *version != '1')) {
+        respond_error(c, CLIENT_ERROR_MALFORMED);
+        return;
+    }
+
+    /* Returning on non GET methods */
+    if (strcmp(method, "GET") != 0) {
+        respond_error(c, CLIENT_ERROR_NOT_IMPLEMENTED);
+        return;
+    }
+
+    /* Header block ends at the first empty line */
+    hdrPtr = c->reqBuf + lineLen;
+    while (*hdrPtr != '\0') {
+        if (hdrPtr[0] == '\n' || (hdrPtr[0] == '\r' && hdrPtr[1] == '\n')) {
+            *hdrPtr = '\0';
+            break;
+        }
+        lineEnd = strchr(hdrPtr, '\n');
+        if (lineEnd == NULL) {
+            break;
+        }
+        hdrPtr = lineEnd + 1;
+    }
+    c->keepAlive = client_keepalive(*version == '1', c->reqBuf + lineLen);
+    c->acceptsGzip = encoding_accepts_gzip(c->reqBuf + lineLen);
+    range_parse(c->reqBuf + lineLen, &c->range);
+    metrics_count(METRICS_REQUESTS, 1);
+
+    /* Scrapes of the proxy's own metrics never reach an end server */
+    if (strcmp(uri, METRICS_URI) == 0) {
+        c->outBuf = metrics_render(&c->outLen);
+        c->outOff = 0;
+        c->state = CONN_WRITE_CLIENT;
+        return;
+    }
+
+#if CACHE_USED
+    cache_block *reqCachePtr = NULL;
+    if ((reqCachePtr = cache_find(uri)) != NULL) {
+        if (revalidate_hit(reqCachePtr)) {
+            serve_hit(c, reqCachePtr);
+            return;
+        }
+        c->staleBlock = reqCachePtr;
+    }
+#endif
+
+    c->uri = Malloc(strlen(uri) + 1);
+    strcpy(c->uri, uri);
+    if (prepare_origin(c) < 0) {
+        conn_close(loop, c);
+        return;
+    }
+
+#if CACHE_USED
+    /* Wait for a fetch of the same uri in flight instead of starting one */
+    c->waiter.wake = wake_conn;
+    c->waiter.arg = c;
+    if (c->peer == NULL && c->staleBlock == NULL && coalesce_enabled() &&
+        (c->flight = coalesce_begin(uri, &c->waiter)) == NULL) {
+        c->state = CONN_WAIT_FLIGHT;
+        return;
+    }
+#endif
+    start_origin(loop, c);
+}
+
+#if CACHE_USED
+/**
+ * @brief retries the cache for a connection whose flight landed, fetching
+ * from the end server itself when the response did not get cached
+ *
+ *
+ * @param[in]   *loop           Owning event loop
+ * @param[in]   *c              Connection in CONN_WAIT_FLIGHT
+ *
+ * @return      void
+ */
+static void resume_request(event_loop *loop, conn_t *c) {
+    cache_block *reqCachePtr = NULL;
+    if ((reqCachePtr = cache_find(c->uri)) != NULL &&
+        revalidate_hit(reqCachePtr)) {
+        Free(c->outBuf);
+        serve_hit(c, reqCachePtr);
+    } else {
+        if (reqCachePtr != NULL) {
+            c->staleBlock = reqCachePtr;
+            c->outLen = fresh_add_validators(c->outBuf, OUT_BUF_SIZE,
+                                             reqCachePtr->cache_obj,
+                                             reqCachePtr->cache_obj_size);
+        }
+        start_origin(loop, c);
+    }
+    conn_progress(loop, c);
+}
+#endif
+
+/**
+ * @brief connects a connection once its end server lookup was answered
+ *
+ *
+ * @param[in]   *loop           Owning event loop
+ * @param[in]   *c              Connection in CONN_RESOLVE
+ *
+ * @return      void
+ */
+static void resume_connect(event_loop *loop, conn_t *c) {
+    if (connect_origin(loop, c) < 0) {
+        conn_close(loop, c);
+        return;
+    }
+    conn_progress(loop, c);
+}
+
+/**
+ * @brief coalesce_waiter and dns_waiter callback, queues a connection whose
+ * flight landed or whose lookup was answered back on its own loop; runs on
+ * whichever thread ended the flight or made the lookup
+ *
+ *
+ * @param[in]   *arg            Connection in CONN_WAIT_FLIGHT or CONN_RESOLVE
+ *
+ * @return      void
+ */
+static void wake_conn(void *arg) {
+    conn_t *c = arg;
+    event_loop *loop = c->loop;
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&loop->wokenMutex);
+    c->nextWoken = loop->wokenList;
+    loop->wokenList = c;
+    pthread_mutex_unlock(&loop->wokenMutex);
+    if (write(loop->wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        fprintf(stderr, "eventfd write failed: %s\n", strerror(errno));
+    }
+}
+
+/**
+ * @brief resumes every connection queued on the loop by wake_conn()
+ *
+ *
+ * @param[in]   *loop           Owning event loop
+ *
+ * @return      void
+ */
+static void resume_woken(event_loop *loop) {
+    uint64_t cnt;
+    conn_t *c;
+
+    while (read(loop->wakefd, &cnt, sizeof(cnt)) < 0 && errno == EINTR)
+        ;
+    pthread_mutex_lock(&loop->wokenMutex);
+    c = loop->wokenList;
+    loop->wokenList = NULL;
+    pthread_mutex_unlock(&loop->wokenMutex);
+    while (c != NULL) {
+        conn_t *next = c->nextWoken;
+        switch (c->state) {
+        case CONN_RESOLVE:
+            resume_connect(loop, c);
+            break;
+#if CACHE_USED
+        case CONN_WAIT_FLIGHT:
+            resume_request(loop, c);
+            break;
+#endif
+        default:
+            break;
+        }
+        c = next;
+    }
+}
+
+/**
+ * @brief moves a miss on along the ring once the sibling it was routed to
+ * could not be reached, down to the end server when no sibling is left
+ *
+ *
+ * @param[in]   *loop           Owning event loop
+ * @param[in]   *c              Connection whose connect failed
+ *
+ * @return      int             0 when connecting to the next node, -1 when
+ * the end server itself failed
+ */
+static int failover_origin(event_loop *loop, conn_t *c) {
+    if (c->peer == NULL) {
+        return -1;
+    }
+    upstream_failed(c->peer);
+    close_origin(c);
+    if (c->addrList != NULL) {
+        dns_freeaddrinfo(c->addrList);
+        c->addrList = NULL;
+    }
+    if (prepare_origin(c) < 0) {
+        return -1;
+    }
+    return connect_origin(loop, c);
+}
+
+/**
+ * @brief resolves the end server and starts connecting to it, or leaves the
+ * connection in CONN_RESOLVE until the resolver thread answered
+ *
+ *
+ * @param[in]   *loop           Owning event loop
+ * @param[in]   *c              Connection with originHost and originPort set
+ *
+ * @return      int             0 when connecting, -1 on failure
+ */
+static int connect_origin(event_loop *loop, conn_t *c) {
+    int rc;
+
+    /* Timed from the lookup, as the threaded path's connect includes it */
+    if (c->state != CONN_RESOLVE) {
+        c->metrics.connectUsec = metrics_now();
+    }
+    /* A lookup the cache cannot answer yet is made off the loop */
+    c->dnsWaiter.wake = wake_conn;
+    c->dnsWaiter.arg = c;
+    if (!dns_getaddrinfo_nowait(c->originHost, c->originPort, &c->addrList,
+                                &rc, &c->dnsWaiter)) {
+        c->state = CONN_RESOLVE;
+        return 0;
+    }
+    if (rc != 0) {
+        log_printf(LOG_LEVEL_ERROR, "getaddrinfo failed (%s:%s): %s\n",
+                   c->originHost, c->originPort, gai_strerror(rc));
+        c->addrList = NULL;
+        return failover_origin(loop, c);
+    }
+    c->nextAddr = c->addrList;
+    if (start_connect(loop, c) < 0) {
+        log_printf(LOG_LEVEL_ERROR, "connection attempt to %s at %s failed\n",
+                   c->originHost, c->originPort);
+        return failover_origin(loop, c);
+    }
+    return 0;
+}
+
+/**
+ * @brief resends the request over a fresh connection when a pooled one turned
+ * out to be closed by the end server before answering
+ *
+ *
+ * @param[in]   *loop           Owning event loop
+ * @param[in]   *c              Connection whose origin failed
+ *
+ * @return      bool            true if the request is being resent, or the
+ * connection was closed trying
+ */
+static bool retry_origin(event_loop *loop, conn_t *c) {
+    if (!c->pooledOrigin || c->frame.seen > 0) {
+        return false;
+    }
+    close_origin(c);
+    c->pooledOrigin = false;
+#if CACHE_USED
+    if (c->fillBuf != NULL) {
+        cache_fill_abandon(c->fillBuf);
+        c->fillBuf = NULL;
+    }
+#endif
+    c->outLen = c->requestLen;
+    c->outOff = 0;
+    if (connect_origin(loop, c) < 0) {
+        conn_close(loop, c);
+    }
+    return true;
+}
+
+/**
+ * @brief reads end server bytes into buf, up to the end of the response
+ *
+ *
+ * @param[in]   *c              Connection
+ * @param[out]  *buf            Destination buffer
+ * @param[in]   n               Room left in buf
+ *
+ * @return      ssize_t         Bytes read, 0 at the end of the response, -1
+ * on error or EAGAIN
+ */
+static ssize_t read_origin(conn_t *c, char *buf, size_t n) {
+    ssize_t rc;
+    size_t used;
+
+    if (framing_done(&c->frame)) {
+        return 0;
+    }
+    rc = read(c->origin.fd, buf, n);
+    if (rc == 0) {
+        framing_eof(&c->frame);
+    } else if (rc > 0) {
+        used = framing_feed(&c->frame, buf, (size_t)rc);
+        if (used < (size_t)rc) {
+            /* Bytes past the response, the connection is out of step */
+            c->frame.reusable = false;
+            rc = (ssize_t)used;
+        }
+    }
+    if (rc > 0) {
+        metrics_origin_bytes(&c->metrics, (size_t)rc);
+    }
+    return rc;
+}
+
+/**
+ * @brief finds the end of the first request head held in a buffer
+ *
+ *
+ * @param[in]   *buf            NUL terminated client bytes
+ *
+ * @return      size_t          Length of the head including its empty line, 0
+ * while incomplete
+ */
+static size_t request_head_len(const char *buf) {
+    const char *crlf = strstr(buf, "\r\n\r\n");
+    const char *lf = strstr(buf, "\n\n");
+    if (lf != NULL && (crlf == NULL || lf < crlf)) {
+        return (size_t)(lf - buf) + 2;
+    }
+    return (crlf != NULL) ? (size_t)(crlf - buf) + 4 : 0;
+}
+
+/**
+ * @brief reads from the client until the request head is complete
+ *
+ *
+ * @param[in]   *loop           Owning event loop
+ * @param[in]   *c              Connection
+ *
+ * @return      bool            true if the connection advanced to a new state
+ */
+static bool read_request(event_loop *loop, conn_t *c) {
+    ssize_t n;
+
+    while (1) {
+        /* A pipelined request may already be complete */
+        if ((c->reqHeadLen = request_head_len(c->reqBuf)) > 0) {
+            handle_request(loop, c);
+            return true;
+        }
+        if (c->reqLen == REQUEST_BUF_SIZE - 1) {
+            respond_error(c, CLIENT_ERROR_OVERSIZED);
+            return true;
+        }
+        n = read(c->client.fd, c->reqBuf + c->reqLen,
+                 REQUEST_BUF_SIZE - 1 - c->reqLen);
+        if (n > 0) {
+            if (c->metrics.startUsec == 0) {
+                c->metrics.startUsec = metrics_now();
+            }
+            c->reqLen += (size_t)n;
+            c->reqBuf[c->reqLen] = '\0';
+        } else if (n == 0) {
+            /* Half-closed after a full request line still gets an answer */
+            if (strchr(c->reqBuf, '\n') != NULL) {
+                c->reqHeadLen = c->reqLen;
+                handle_request(loop, c);
+            } else {
+                conn_close(loop, c);
+            }
+            return true;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return false;
+        } else {
+            conn_close(loop, c);
+            return true;
+        }
+    }
+}
+
+/**
+ * @brief writes the bytes of buf between *off and len to a socket
+ *
+ *
+ * @param[in]   fd              Destination socket
+ * @param[in]   *buf            Data to write
+ * @param[in]   *off            Bytes already written, advanced as sent
+ * @param[in]   len             Bytes held in buf
+ *
+ * @return      int             1 when buf is drained, 0 on EAGAIN, -1 on error
+ */
+static int send_pending(int fd, const char *buf, size_t *off, size_t len) {
+    ssize_t n;
+
+    while (*off < len) {
+        n = send(fd, buf + *off, len - *off, MSG_NOSIGNAL);
+        if (n > 0) {
+            *off += (size_t)n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        } else {
+            return -1;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief writes pending outBuf bytes to a socket
+ *
+ *
+ * @param[in]   *c              Connection
+ * @param[in]   fd              Destination socket
+ *
+ * @return      int             1 when outBuf is drained, 0 on EAGAIN, -1 on
+ * error
+ */
+static int flush_out(conn_t *c, int fd) {
+    return send_pending(fd, c->outBuf, &c->outOff, c->outLen);
+}
+
+/**
+ * @brief send_pending() to the client, keeping track of whether it stalled
+ *
+ *
+ * @param[in]   *loop           Owning event loop
+ * @param[in]   *c              Connection
+ * @param[in]   *buf            Bytes to send
+ * @param[in]   *off            Bytes of buf already sent, advanced
+ * @param[in]   len             Bytes held in buf
+ *
+ * @return      int             1 when fully sent, 0 on EAGAIN, -1 on error
+ */
+static int send_client(event_loop *loop, conn_t *c, const char *buf,
+                       size_t *off, size_t len) {
+    size_t start = *off;
+    int rc = send_pending(c->client.fd, buf, off, len);
+    metrics_client_bytes(&c->metrics, *off - start);
+    if (rc == 0) {
+        client_blocked(loop, c, *off != start);
+    } else {
+        client_unblocked(loop, c);
+    }
+    return rc;
+}
+
+/**
+ * @brief sends the rest of the rewritten response head, if any, to the client
+ * and frees it once sent
+ *
+ *
+ * @param[in]   *loop           Owning event loop
+ * @param[in]   *c              Connection
+ *
+ * @return      int             1 when nothing is left, 0 on EAGAIN, -1 on
+ * error
+ */
+static int send_head(event_loop *loop, conn_t *c) {
+    int rc;
+
+    if (c->headBuf == NULL) {
+        return 1;
+    }
+    if ((rc = send_client(loop, c, c->headBuf, &c->headOff, c->headLen)) >
+        0) {
+        Free(c->headBuf);
+        c->headBuf = NULL;
+    }
+    return rc;
+}
+
+#if CACHE_USED
+/**
+ * @brief replaces the unsent rest of a cache hit by a private copy and drops
+ * the reference on the block, once the client stalled
+ *
+ *
+ * @param[in]   *c              Connection in CONN_WRITE_CLIENT
+ *
+ * @return      void
+ */
+static void detach_hit(conn_t *c) {
+    size_t rest = c->outLen - c->outOff;
+    char *copy;
+
+    if (c->hitBlock == NULL) {
+        return;
+    }
+    copy = Malloc(rest);
+    memcpy(copy, c->outBuf + c->outOff, rest);
+    cache_release(c->hitBlock);
+    c->hitBlock = NULL;
+    c->outBuf = copy;
+    c->outLen = rest;
+    c->outOff = 0;
+}
+#endif
+
+/**
+ * @brief completes a pending connect once the origin reported readiness,
+ * falling back to the next address on failure
+ *
+ *
+ * @param[in]   *loop           Owning event loop
+ * @param[in]   *c              Connection
+ *
+ * @return      bool            true if the connection advanced to a new state
+ */
+static bool finish_connect(event_loop *loop, conn_t *c) {
+    int err = 0;
+    socklen_t errLen = sizeof(err);
+    struct sockaddr_storage peer;
+    socklen_t peerLen = sizeof(peer);
+
+    if (!c->originReady) {
+        return false;
+    }
+    if (getsockopt(c->origin.fd, SOL_SOCKET, SO_ERROR, &err, &errLen) < 0) {
+        err = errno;
+    }
+    if (err != 0) {
+        /* Connect failed, try another */
+        close_origin(c);
+        c->nextAddr = c->nextAddr->ai_next;
+        if (start_connect(loop, c) < 0) {
+            log_printf(LOG_LEVEL_ERROR,
+                       "connection attempt to end server failed\n");
+            if (failover_origin(loop, c) < 0) {
+                conn_close(loop, c);
+            }
+        }
+        return true;
+    }
+    if (getpeername(c->origin.fd, (SA *)&peer, &peerLen) < 0) {
+        /* Readiness was stale, still connecting */
+        c->originReady = false;
+        return false;
+    }
+    dns_freeaddrinfo(c->addrList);
+    c->addrList = NULL;
+    c->nextAddr = NULL;
+    metrics_observe(METRICS_ORIGIN_CONNECT, c->metrics.connectUsec);
+    c->state = CONN_SEND_REQUEST;
+    return true;
+}
+
+#if CACHE_USED
+/**
+ * @brief relays end server bytes to the client through the reserved cache
+ * buffer while the response still fits in an object
+ *
+ * The origin is drained straight into the buffer before flushing, so its EOF
+ * is usually seen, and the buffer published into the cache, before the client
+ * receives the last byte; the rest is then written from the cached copy. The
+ * copy is published without the hop-by-hop headers of its head.
+ *
+ *
+ * @param[in]   *loop           Owning event loop
+ * @param[in]   *c              Connection
+ *
+ * @return      bool            false once the response outgrew the buffer and
+ * has to be relayed through outBuf instead
+ */
+static bool relay_fill(event_loop *loop, conn_t *c) {
+    ssize_t n;
+    int rc;
+    cache_block *reqCachePtr = NULL;
+    size_t maxObject = cache_max_object_size(), stripped;
+
+    while (1) {
+        n = 0;
+        while (c->fillSize < maxObject) {
+            n = read_origin(c, c->fillBuf + c->fillSize,
+                            maxObject - c->fillSize);
+            if (n > 0) {
+                c->fillSize += (size_t)n;
+            } else if (n == 0) {
+                if (retry_origin(loop, c)) {
+                    return true;
+                }
+                if (c->staleBlock != NULL && c->frame.status == 304) {
+                    /*not modified, serve the refreshed stale hit*/
+                    release_origin(loop, c);
+                    cache_refresh(c->staleBlock, c->fillBuf, c->fillSize);
+                    cache_fill_abandon(c->fillBuf);
+                    c->fillBuf = NULL;
+                    Free(c->outBuf);
+                    reqCachePtr = c->staleBlock;
+                    c->staleBlock = NULL;
+                    serve_hit(c, reqCachePtr);
+                    return true;
+                }
+                /*store it, the client is finished from the cached copy*/
+                release_origin(loop, c);
+                stripped = framing_strip_hop(c->fillBuf, c->fillSize);
+                if (c->headDone) {
+                    /* The head went out of headBuf */
+                    c->fillSent -= c->fillSize - stripped;
+                }
+                c->fillSize = stripped;
+                reqCachePtr =
+                    cache_fill_publish(c->uri, c->fillBuf, c->fillSize);
+                c->fillBuf = NULL;
+                end_flight(c);
+                Free(c->outBuf);
+                if (c->range.specCnt > 0) {
+                    serve_hit(c, reqCachePtr);
+                    return true;
+                }
+                c->hitBlock = reqCachePtr;
+                c->outBuf = reqCachePtr->cache_obj;
+                c->outLen = reqCachePtr->cache_obj_size;
+                if (!c->headDone) {
+                    c->persist =
+                        c->keepAlive && framing_delimited(&c->frame);
+                    c->fillSent = client_head(c, c->outBuf, c->outLen);
+                }
+                c->outOff = c->fillSent;
+                c->persist = c->persist && framing_keeps_alive(&c->frame);
+                c->state = CONN_WRITE_CLIENT;
+                return true;
+            } else if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            } else {
+                if (!retry_origin(loop, c)) {
+                    conn_close(loop, c);
+                }
+                return true;
+            }
+        }
+
+        if (c->staleBlock != NULL || c->range.specCnt > 0) {
+            /*
+             * Nothing goes out before the status shows whether it is a 304,
+             * or before the ranges can be cut out of the whole object
+             */
+            if (c->fillSize < maxObject) {
+                return true;
+            }
+            if (c->staleBlock != NULL) {
+                cache_release(c->staleBlock);
+                c->staleBlock = NULL;
+            }
+        }
+        if (!c->headDone) {
+            if (c->fillSize < maxObject &&
+                framing_head_len(c->fillBuf, c->fillSize) == 0) {
+                /* Nothing goes out before the head is complete */
+                return true;
+            }
+            c->persist = c->keepAlive && framing_delimited(&c->frame);
+            c->fillSent = client_head(c, c->fillBuf, c->fillSize);
+        }
+        if ((rc = send_head(loop, c)) > 0) {
+            rc = send_client(loop, c, c->fillBuf, &c->fillSent, c->fillSize);
+        }
+        if (rc <= 0) {
+            if (rc < 0) {
+                conn_close(loop, c);
+            }
+            return true;
+        }
+        if (n < 0) {
+            /* Origin has nothing more for now */
+            return true;
+        }
+        if (c->fillSize == maxObject) {
+            /* Too big to cache, waiters fetch it themselves */
+            cache_fill_abandon(c->fillBuf);
+            c->fillBuf = NULL;
+            end_flight(c);
+            return false;
+        }
+    }
+}
+#endif
+
+/**
+ * @brief relays end server bytes to the client with splice() through the
+ * connection's pipe, without copying them through user space
+ *
+ * splice() reports EAGAIN both when the origin has nothing and when the pipe
+ * is full, so the origin only counts as drained when it does so on an empty
+ * pipe.
+ *
+ *
+ * @param[in]   *loop           Owning event loop
+ * @param[in]   *c              Connection
+ *
+ * @return      bool            false when splice() is unusable and the
+ * response has to be relayed through outBuf instead
+ */
+static bool relay_pipe(event_loop *loop, conn_t *c) {
+    ssize_t n;
+    size_t room;
+    bool drained, progressed;
+
+    if (c->relayPipe[0] < 0 && relay_pipe_open(c->relayPipe, true) < 0) {
+        c->copyRelay = true;
+        return false;
+    }
+    while (1) {
+        drained = false;
+        while (c->origin.fd >= 0 && c->pipeLen < RELAY_PIPE_SIZE) {
+            room = RELAY_PIPE_SIZE - c->pipeLen;
+            if (c->frame.state == FRAMING_LENGTH &&
+                room > c->frame.remaining) {
+                room = c->frame.remaining;
+            }
+            n = relay_splice_in(c->origin.fd, c->relayPipe[1], room, true);
+            if (n > 0) {
+                metrics_origin_bytes(&c->metrics, (size_t)n);
+                c->pipeLen += (size_t)n;
+                c->spliced = true;
+                if (c->frame.state == FRAMING_LENGTH) {
+                    framing_skip(&c->frame, (size_t)n);
+                    if (framing_done(&c->frame)) {
+                        release_origin(loop, c);
+                    }
+                }
+            } else if (n == 0) {
+                framing_eof(&c->frame);
+                close_origin(c);
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                drained = c->pipeLen == 0;
+                break;
+            } else if (!c->spliced && (errno == EINVAL || errno == ENOSYS)) {
+                relay_pipe_close(c->relayPipe);
+                c->copyRelay = true;
+                return false;
+            } else {
+                conn_close(loop, c);
+                return true;
+            }
+        }
+
+        progressed = false;
+        while (c->pipeLen > 0) {
+            n = relay_splice_out(c->relayPipe[0], c->client.fd, c->pipeLen,
+                                 true);
+            if (n > 0) {
+                metrics_client_bytes(&c->metrics, (size_t)n);
+                c->pipeLen -= (size_t)n;
+                progressed = true;
+            } else {
+                if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                    conn_close(loop, c);
+                } else {
+                    client_blocked(loop, c, progressed);
+                }
+                return true;
+            }
+        }
+        client_unblocked(loop, c);
+        if (c->origin.fd < 0) {
+            /* Response complete and delivered */
+            c->persist = c->persist && framing_keeps_alive(&c->frame);
+            conn_finish(loop, c);
+            return true;
+        }
+        if (drained) {
+            /* Origin has nothing more for now */
+            return true;
+        }
+    }
+}
+
+/**
+ * @brief relays end server bytes to the client, through the reserved cache
+ * buffer while the response may still be cached, spliced after and through
+ * outBuf when splicing is unusable
+ *
+ *
+ * @param[in]   *loop           Owning event loop
+ * @param[in]   *c              Connection
+ *
+ * @return      void
+ */
+static void relay_response(event_loop *loop, conn_t *c) {
+    ssize_t n;
+    int rc;
+    size_t headLen;
+
+#if CACHE_USED
+    if (c->fillBuf != NULL && relay_fill(loop, c)) {
+        return;
+    }
+#endif
+    while (1) {
+        /*
+         * Splicing needs the head delivered and the end of the response
+         * known without reading it
+         */
+        if (!c->copyRelay && c->headDone && c->headBuf == NULL &&
+            c->outLen == 0 &&
+            (c->frame.state == FRAMING_LENGTH ||
+             c->frame.state == FRAMING_UNTIL_CLOSE) &&
+            relay_pipe(loop, c)) {
+            return;
+        }
+        n = 0;
+        while (c->origin.fd >= 0 && c->outLen < OUT_BUF_SIZE) {
+            n = read_origin(c, c->outBuf + c->outLen, OUT_BUF_SIZE - c->outLen);
+            if (n > 0) {
+                c->outLen += (size_t)n;
+            } else if (n == 0) {
+                if (retry_origin(loop, c)) {
+                    return;
+                }
+                release_origin(loop, c);
+            } else if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            } else {
+                if (!retry_origin(loop, c)) {
+                    conn_close(loop, c);
+                }
+                return;
+            }
+        }
+
+        if (!c->headDone) {
+            if (c->origin.fd >= 0 && c->outLen < OUT_BUF_SIZE &&
+                framing_head_len(c->outBuf, c->outLen) == 0) {
+                /* Nothing goes out before the head is complete */
+                return;
+            }
+            c->persist = c->keepAlive && framing_delimited(&c->frame);
+            headLen = client_head(c, c->outBuf, c->outLen);
+            c->outOff = headLen;
+        }
+        if ((rc = send_head(loop, c)) > 0) {
+            rc = send_client(loop, c, c->outBuf, &c->outOff, c->outLen);
+        }
+        if (rc <= 0) {
+            if (rc < 0) {
+                conn_close(loop, c);
+            }
+            return;
+        }
+        c->outLen = 0;
+        c->outOff = 0;
+        if (c->origin.fd < 0) {
+            /* Response complete and delivered */
+            c->persist = c->persist && framing_keeps_alive(&c->frame);
+            conn_finish(loop, c);
+            return;
+        }
+        if (n < 0) {
+            /* Origin has nothing more for now */
+            return;
+        }
+    }
+}
+
+/**
+ * @brief advances a connection's state machine until it has to wait for
+ * socket readiness or is closed
+ *
+ *
+ * @param[in]   *loop           Owning event loop
+ * @param[in]   *c              Connection
+ *
+ * @return      void
+ */
+static void conn_progress(event_loop *loop, conn_t *c) {
+    int rc;
+
+    while (1) {
+        switch (c->state) {
+        case CONN_READ_REQUEST:
+            if (!read_request(loop, c)) {
+                return;
+            }
+            break;
+        case CONN_WAIT_FLIGHT:
+        case CONN_RESOLVE:
+            /* Resumed by resume_woken() */
+            return;
+        case CONN_CONNECT:
+            if (!finish_connect(loop, c)) {
+                return;
+            }
+            break;
+        case CONN_SEND_REQUEST:
+            if ((rc = flush_out(c, c->origin.fd)) <= 0) {
+                if (rc < 0 && !retry_origin(loop, c)) {
+                    conn_close(loop, c);
+                }
+                return;
+            }
+            /* Request sent, outBuf now carries relay data */
+            c->metrics.sentUsec = metrics_now();
+            c->requestLen = c->outLen;
+            c->outLen = 0;
+            c->outOff = 0;
+            framing_init(&c->frame);
+#if CACHE_USED
+            /* The sibling caches what it owns, here it is only relayed */
+            c->fillBuf = (c->peer == NULL) ? cache_fill_reserve() : NULL;
+            c->fillSize = 0;
+            c->fillSent = 0;
+#endif
+            c->state = CONN_RELAY;
+            break;
+        case CONN_RELAY:
+            relay_response(loop, c);
+            if (c->state == CONN_RELAY) {
+                return;
+            }
+            break;
+        case CONN_WRITE_CLIENT:
+            if ((rc = send_head(loop, c)) > 0) {
+                rc = send_client(loop, c, c->outBuf, &c->outOff, c->outLen);
+            }
+            if (rc == 0) {
+#if CACHE_USED
+                detach_hit(c);
+#endif
+                return;
+            }
+            if (rc < 0) {
+                c->persist = false;
+            }
+            conn_finish(loop, c);
+            break;
+        case CONN_CLOSED:
+            return;
+        }
+    }
+}
+
+/**
+ * @brief registers the listening socket with the loop's epoll instance, only
+ * one of the loops sharing it woken per connection
+ *
+ *
+ * @param[in]   *loop           Event loop
+ *
+ * @return      int             0 on success, -1 on error
+ */
+static int watch_listener(event_loop *loop) {
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = NULL;
+    return epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->listenfd, &ev);
+}
+
+/**
+ * @brief stops accepting for at least ACCEPT_PAUSE_MSEC, new connections
+ * wait in the listen backlog or for a sibling loop meanwhile
+ *
+ *
+ * @param[in]   *loop           Event loop
+ *
+ * @return      void
+ */
+static void pause_accept(event_loop *loop) {
+    if (loop->acceptPausedAt == 0) {
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, loop->listenfd, NULL);
+    }
+    loop->acceptPausedAt = metrics_now();
+}
+
+/**
+ * @brief accepts again once the pause ran out and the proxy has room
+ *
+ *
+ * @param[in]   *loop           Event loop with accepting paused
+ *
+ * @return      void
+ */
+static void resume_accept(event_loop *loop) {
+    if (metrics_now() - loop->acceptPausedAt < ACCEPT_PAUSE_MSEC * 1000 ||
+        admit_full()) {
+        return;
+    }
+    if (watch_listener(loop) < 0) {
+        /* Try again after another pause */
+        loop->acceptPausedAt = metrics_now();
+        return;
+    }
+    loop->acceptPausedAt = 0;
+}
+
+/**
+ * @brief accepts every pending connection on the listening socket
+ *
+ *
+ * @param[in]   *loop           Owning event loop
+ *
+ * @return      void
+ */
+static void accept_connections(event_loop *loop) {
+    struct sockaddr_storage clientaddr;
+    socklen_t clientlen;
+    admit_client admitted;
+    uint64_t acceptedAt;
+    int connfd;
+    char *reqBuf;
+    conn_t *c;
+
+    while (1) {
+        /* Connections over the limit wait in the listen backlog */
+        if (admit_full()) {
+            pause_accept(loop);
+            return;
+        }
+        clientlen = sizeof(clientaddr);
+        connfd = admit_accept(loop->listenfd, (SA *)&clientaddr, &clientlen,
+                              &loop->reserveFd);
+        acceptedAt = metrics_now();
+        if (connfd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                pause_accept(loop);
+            }
+            return;
+        }
+        metrics_count(METRICS_ACCEPTED, 1);
+        log_accept((SA *)&clientaddr, clientlen);
+        if (!admit_client_begin((SA *)&clientaddr, &admitted)) {
+            admit_shed(connfd);
+            continue;
+        }
+
+        /* Out of memory sheds the connection rather than the proxy */
+        c = NULL;
+        reqBuf = NULL;
+        if (set_nonblocking(connfd) < 0 ||
+            (c = calloc(1, sizeof(conn_t))) == NULL ||
+            (reqBuf = malloc(REQUEST_BUF_SIZE)) == NULL) {
+            free(c);
+            admit_shed(connfd);
+            admit_client_end(&admitted);
+            continue;
+        }
+        c->admitted = admitted;
+        c->state = CONN_READ_REQUEST;
+        c->loop = loop;
+        c->client.conn = c;
+        c->client.fd = connfd;
+        c->origin.conn = c;
+        c->origin.fd = -1;
+        c->relayPipe[0] = -1;
+        c->relayPipe[1] = -1;
+        c->reqBuf = reqBuf;
+        c->reqBuf[0] = '\0';
+        metrics_request_begin(&c->metrics, acceptedAt);
+        if (watch_end(loop, &c->client) < 0) {
+            close(connfd);
+            admit_client_end(&c->admitted);
+            conn_free(c);
+            continue;
+        }
+        /* Requests often arrive together with the connection */
+        conn_progress(loop, c);
+    }
+}
+
+/**
+ * @brief drops every client that took no response bytes for
+ * CLIENT_WRITE_TIMEOUT_SECS, at most once a second
+ *
+ *
+ * @param[in]   *loop           Owning event loop
+ *
+ * @return      void
+ */
+static void sweep_stalled(event_loop *loop) {
+    time_t now = time(NULL);
+    conn_t *c, *next;
+
+    if (now == loop->lastSweep) {
+        return;
+    }
+    loop->lastSweep = now;
+    for (c = loop->stalledList; c != NULL; c = next) {
+        next = c->nextStalled;
+        if (now - c->stallSince >= CLIENT_WRITE_TIMEOUT_SECS) {
+            log_printf(LOG_LEVEL_ERROR,
+                       "dropping client that stopped reading\n");
+            conn_close(loop, c);
+        }
+    }
+}
+
+/**
+ * @brief thread routine running one event loop for the lifetime of the proxy
+ *
+ *
+ * @param[in]   vargp           event_loop_arg of the loop
+ *
+ * @return      void
+ */
+static void *event_loop_thread(void *vargp) {
+    event_loop_arg *arg = vargp;
+    event_loop loop;
+    struct epoll_event events[MAX_EVENTS], ev;
+    cpu_set_t cpus;
+    int i, nready;
+    conn_end *end;
+    conn_t *c;
+
+    if (arg->cpu >= 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET(arg->cpu, &cpus);
+        if ((errno = pthread_setaffinity_np(pthread_self(), sizeof(cpus),
+                                            &cpus)) != 0) {
+            fprintf(stderr, "Warning: pinning to cpu %d: %s\n", arg->cpu,
+                    strerror(errno));
+        }
+    }
+    loop.listenfd = arg->listenfd;
+    loop.closedList = NULL;
+    loop.wokenList = NULL;
+    loop.stalledList = NULL;
+    loop.lastSweep = 0;
+    loop.reserveFd = admit_reserve_fd();
+    loop.acceptPausedAt = 0;
+    if ((loop.epfd = epoll_create1(0)) < 0) {
+        posix_error(errno, "epoll_create1 error");
+    }
+    if (watch_listener(&loop) < 0) {
+        posix_error(errno, "epoll_ctl error");
+    }
+    memset(&ev, 0, sizeof(ev));
+    /* Other threads hand connections back through the eventfd */
+    if ((loop.wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        posix_error(errno, "eventfd error");
+    }
+    if ((pthread_mutex_init(&loop.wokenMutex, NULL)) != 0) {
+        fprintf(stderr, "Error: Initizing mutex");
+    }
+    loop.wakeEnd.conn = NULL;
+    loop.wakeEnd.fd = loop.wakefd;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &loop.wakeEnd;
+    if (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, loop.wakefd, &ev) < 0) {
+        posix_error(errno, "epoll_ctl error");
+    }
+
+    while (1) {
+        /* Wake up once a second while some client is stalled */
+        nready = epoll_wait(loop.epfd, events, MAX_EVENTS,
+                            (loop.acceptPausedAt != 0)    ? ACCEPT_PAUSE_MSEC
+                            : (loop.stalledList != NULL) ? 1000
+                                                         : -1);
+        if (nready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            posix_error(errno, "epoll_wait error");
+        }
+        for (i = 0; i < nready; i++) {
+            end = events[i].data.ptr;
+            if (end == NULL) {
+                accept_connections(&loop);
+                continue;
+            }
+            if (end == &loop.wakeEnd) {
+                resume_woken(&loop);
+                continue;
+            }
+            c = end->conn;
+            if (c->state == CONN_CLOSED || end->fd < 0) {
+                continue;
+            }
+            if (end == &c->origin && c->state == CONN_CONNECT) {
+                c->originReady = true;
+            }
+            conn_progress(&loop, c);
+        }
+        if (loop.stalledList != NULL) {
+            sweep_stalled(&loop);
+        }
+        if (loop.acceptPausedAt != 0) {
+            resume_accept(&loop);
+        }
+        /* Reclaim connections closed during this batch */
+        while (loop.closedList != NULL) {
+            c = loop.closedList;
+            loop.closedList = c->nextClosed;
+            conn_free(c);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief opens a listening socket on port that other sockets may bind to the
+ * same port with SO_REUSEPORT, after open_listenfd() of csapp.c
+ *
+ *
+ * @param[in]   *port           Port to listen on
+ *
+ * @return      int             Listening socket, -2 when the lookup failed, -1
+ * on other errors
+ */
+int event_open_listenfd(const char *port) {
+    struct addrinfo hints, *listp, *p;
+    int listenfd = -1, rc, optval = 1;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV;
+    if ((rc = getaddrinfo(NULL, port, &hints, &listp)) != 0) {
+        fprintf(stderr, "getaddrinfo failed (port %s): %s\n", port,
+                gai_strerror(rc));
+        return -2;
+    }
+    for (p = listp; p; p = p->ai_next) {
+        listenfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (listenfd < 0) {
+            continue;
+        }
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int));
+        if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &optval,
+                       sizeof(int)) == 0 &&
+            bind(listenfd, p->ai_addr, p->ai_addrlen) == 0) {
+            break;
+        }
+        close(listenfd);
+    }
+    freeaddrinfo(listp);
+    if (!p) {
+        return -1;
+    }
+    if (listen(listenfd, LISTENQ) < 0) {
+        close(listenfd);
+        return -1;
+    }
+    return listenfd;
+}
+
+/**
+ * @brief runs the event-driven front end on numLoops threads, never returns
+ *
+ *
+ * @param[in]   listenfd        Listening socket descriptor, from
+ * event_open_listenfd() when reusePort is given
+ * @param[in]   numLoops        Number of event loop threads
+ * @param[in]   *reusePort      Port every other loop opens a SO_REUSEPORT
+ * listener of its own on, each loop then pinned to a CPU; NULL to share
+ * listenfd among loops free to run anywhere
+ *
+ * @return      void
+ */
+void event_loop_run(int listenfd, int numLoops, const char *reusePort) {
+    event_loop_arg *args = Malloc((size_t)numLoops * sizeof(event_loop_arg));
+    int allowed[CPU_SETSIZE];
+    int i, cpu, numCpus = 0;
+    cpu_set_t cpus;
+    pthread_t tid;
+
+    /* Loops take the CPUs the proxy may run on in turn */
+    if (reusePort != NULL && sched_getaffinity(0, sizeof(cpus), &cpus) == 0) {
+        for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &cpus)) {
+                allowed[numCpus++] = cpu;
+            }
+        }
+    }
+    for (i = 0; i < numLoops; i++) {
+        args[i].listenfd = listenfd;
+        args[i].cpu = (numCpus > 0) ? allowed[i % numCpus] : -1;
+        /* Every listener is bound before any loop starts accepting */
+        if (reusePort != NULL && i > 0 &&
+            (args[i].listenfd = event_open_listenfd(reusePort)) < 0) {
+            fprintf(stderr, "Failed to listen on port: %s\n", reusePort);
+            exit(1);
+        }
+        if (set_nonblocking(args[i].listenfd) < 0) {
+            posix_error(errno, "fcntl error");
+        }
+    }
+    for (i = 1; i < numLoops; i++) {
+        Pthread_create(&tid, NULL, event_loop_thread, &args[i]);
+        Pthread_detach(tid);
+    }
+    event_loop_thread(&args[0]);
+}
@@ -0,0 +1,19 @@
+/**
+ * @file event.h
+ * @brief Header file for the event-driven (epoll) front end
+ *
+ * Description: An alternative to the worker pool in which each event loop
+ * thread multiplexes many client/origin connection pairs over one epoll
+ * instance using non-blocking sockets.
+ *
+ *
+ * @author Abhishek Basrithaya <abasrith@andrew.cmu.edu>
+ */
+#ifndef EVENT_H
+#define EVENT_H
+
+/* Function prototyping */
+int event_open_listenfd(const char *port);
+void event_loop_run(int listenfd, int numLoops, const char *reusePort);
+
+#endif /* EVENT_H */
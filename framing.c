@@ -0,0 +1,451 @@
+/**
+ * @file framing.c
+ * @brief Incremental parser finding where an end server response ends
+ *
+ * Description: Relayed bytes are fed through framing_feed() as they arrive,
+ * without being modified or buffered beyond the current line. The status line
+ * and headers decide how the body is delimited: no body for 1xx, 204 and 304,
+ * chunked transfer coding, Content-Length, or otherwise the end server closing
+ * the connection. The end server connection is only reusable when the
+ * response ended on its own framing and neither side asked to close: HTTP/1.1
+ * without "Connection: close", or HTTP/1.0 with "Connection: keep-alive".
+ * Those headers only concern the hop they came over: they are stripped from
+ * stored heads and the client gets the proxy's own Connection header instead,
+ * keeping its connection whenever it asked to and the body is self-delimiting.
+ *
+ *
+ * @author Abhishek Basrithaya <abasrith@andrew.cmu.edu>
+ */
+#include "framing.h"
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/**
+ * @brief Resets a parser for a new response
+ *
+ *
+ * @param[out]  *frame          Parser to reset
+ *
+ * @return      void
+ */
+void framing_init(http_framing *frame) {
+    memset(frame, 0, sizeof(http_framing));
+    frame->state = FRAMING_STATUS;
+}
+
+/**
+ * @brief Checks whether a comma separated header value lists a token
+ *
+ *
+ * @param[in]   *value          Header value
+ * @param[in]   *token          Token to look for, case insensitive
+ *
+ * @return      bool            true when the token is listed
+ */
+bool framing_header_has_token(const char *value, const char *token) {
+    size_t tokenLen = strlen(token), len;
+    while (*value != '\0') {
+        while (*value == ' ' || *value == '\t' || *value == ',') {
+            value++;
+        }
+        len = strcspn(value, ", \t\r\n");
+        if (len == tokenLen && strncasecmp(value, token, len) == 0) {
+            return true;
+        }
+        value += len;
+        len = strcspn(value, ",");
+        value += len;
+    }
+    return false;
+}
+
+/**
+ * @brief Returns the value of a header line when it carries the named header
+ *
+ *
+ * @param[in]   *line           Header line
+ * @param[in]   *name           Header name, case insensitive
+ *
+ * @return      const char*     Value without leading blanks, NULL if the line
+ * carries another header
+ */
+const char *framing_header_value(const char *line, const char *name) {
+    size_t nameLen = strlen(name);
+    if (strncasecmp(line, name, nameLen) != 0 || line[nameLen] != ':') {
+        return NULL;
+    }
+    line += nameLen + 1;
+    while (*line == ' ' || *line == '\t') {
+        line++;
+    }
+    return line;
+}
+
+/**
+ * @brief Chooses how the body is delimited once the headers are complete
+ *
+ *
+ * @param[in]   *frame          Parser
+ *
+ * @return      void
+ */
+static void framing_end_headers(http_framing *frame) {
+    frame->reusable =
+        frame->http11 ? !frame->connClose : frame->connKeepAlive;
+    frame->delimited = true;
+    if (frame->status >= 100 && frame->status < 200 && frame->status != 101) {
+        /* Interim response, the final one follows */
+        frame->state = FRAMING_STATUS;
+        frame->connClose = frame->connKeepAlive = false;
+        frame->chunked = frame->hasLength = false;
+    } else if (frame->status == 204 || frame->status == 304) {
+        frame->state = FRAMING_DONE;
+    } else if (frame->chunked) {
+        frame->state = FRAMING_CHUNK_SIZE;
+    } else if (frame->hasLength) {
+        frame->state =
+            (frame->remaining == 0) ? FRAMING_DONE : FRAMING_LENGTH;
+    } else {
+        frame->state = FRAMING_UNTIL_CLOSE;
+        frame->reusable = false;
+        frame->delimited = false;
+    }
+}
+
+/**
+ * @brief Interprets one complete line in the line oriented states
+ *
+ *
+ * @param[in]   *frame          Parser holding the line, CRLF stripped
+ *
+ * @return      void
+ */
+static void framing_line(http_framing *frame) {
+    const char *line = frame->line, *value;
+    char *end;
+    unsigned long long num;
+
+    switch (frame->state) {
+    case FRAMING_STATUS:
+        if (strncmp(line, "HTTP/1.", 7) != 0 || !isdigit(line[7]) ||
+            line[8] != ' ') {
+            /* Not a response we understand, relay it until close */
+            frame->state = FRAMING_UNTIL_CLOSE;
+            frame->reusable = false;
+            return;
+        }
+        frame->http11 = line[7] != '0';
+        frame->status = atoi(line + 9);
+        frame->state = FRAMING_HEADERS;
+        return;
+    case FRAMING_HEADERS:
+        if (*line == '\0') {
+            framing_end_headers(frame);
+        } else if ((value = framing_header_value(line, "Content-Length")) !=
+                   NULL) {
+            errno = 0;
+            num = strtoull(value, &end, 10);
+            if (errno != 0 || end == value ||
+                (frame->hasLength && frame->remaining != num)) {
+                /* Unusable or conflicting lengths, end at close instead */
+                frame->connClose = true;
+                frame->connKeepAlive = false;
+                frame->hasLength = false;
+            } else {
+                frame->hasLength = true;
+                frame->remaining = (size_t)num;
+            }
+        } else if ((value = framing_header_value(
+                        line, "Transfer-Encoding")) != NULL) {
+            frame->chunked = framing_header_has_token(value, "chunked");
+        } else if ((value = framing_header_value(line, "Connection")) !=
+                   NULL) {
+            frame->connClose |= framing_header_has_token(value, "close");
+            frame->connKeepAlive |=
+                framing_header_has_token(value, "keep-alive");
+        }
+        return;
+    case FRAMING_CHUNK_SIZE:
+        errno = 0;
+        num = strtoull(line, &end, 16);
+        if (errno != 0 || end == line) {
+            frame->state = FRAMING_UNTIL_CLOSE;
+            frame->reusable = false;
+        } else if (num == 0) {
+            frame->state = FRAMING_TRAILERS;
+        } else {
+            frame->remaining = (size_t)num;
+            frame->state = FRAMING_CHUNK_DATA;
+        }
+        return;
+    case FRAMING_CHUNK_END:
+        frame->state = FRAMING_CHUNK_SIZE;
+        return;
+    case FRAMING_TRAILERS:
+        if (*line == '\0') {
+            frame->state = FRAMING_DONE;
+        }
+        return;
+    default:
+        return;
+    }
+}
+
+/**
+ * @brief Consumes relayed response bytes up to the end of the response
+ *
+ *
+ * @param[in]   *frame          Parser
+ * @param[in]   *buf            Bytes received from the end server
+ * @param[in]   len             Bytes held in buf
+ *
+ * @return      size_t          Bytes belonging to the response, less than len
+ * only when the response ended inside buf
+ */
+size_t framing_feed(http_framing *frame, const char *buf, size_t len) {
+    size_t used = 0, take;
+    char ch;
+
+    while (used < len) {
+        switch (frame->state) {
+        case FRAMING_DONE:
+            frame->seen += used;
+            return used;
+        case FRAMING_UNTIL_CLOSE:
+            used = len;
+            break;
+        case FRAMING_LENGTH:
+        case FRAMING_CHUNK_DATA:
+            take = len - used;
+            if (take > frame->remaining) {
+                take = frame->remaining;
+            }
+            used += take;
+            frame->remaining -= take;
+            if (frame->remaining == 0) {
+                frame->state = (frame->state == FRAMING_LENGTH)
+                                   ? FRAMING_DONE
+                                   : FRAMING_CHUNK_END;
+            }
+            break;
+        default:
+            ch = buf[used++];
+            if (ch != '\n') {
+                if (frame->lineLen < FRAMING_LINE_SIZE - 1) {
+                    frame->line[frame->lineLen++] = ch;
+                }
+                break;
+            }
+            if (frame->lineLen > 0 && frame->line[frame->lineLen - 1] == '\r') {
+                frame->lineLen--;
+            }
+            frame->line[frame->lineLen] = '\0';
+            frame->lineLen = 0;
+            framing_line(frame);
+            break;
+        }
+    }
+    frame->seen += used;
+    return used;
+}
+
+/**
+ * @brief Accounts for body bytes relayed without being fed, e.g. spliced
+ *
+ *
+ * @param[in]   *frame          Parser in FRAMING_LENGTH
+ * @param[in]   len             Body bytes relayed, at most frame->remaining
+ *
+ * @return      void
+ */
+void framing_skip(http_framing *frame, size_t len) {
+    frame->remaining -= len;
+    frame->seen += len;
+    if (frame->remaining == 0) {
+        frame->state = FRAMING_DONE;
+    }
+}
+
+/**
+ * @brief Records that the end server closed the connection
+ *
+ *
+ * @param[in]   *frame          Parser
+ *
+ * @return      void
+ */
+void framing_eof(http_framing *frame) {
+    if (frame->state != FRAMING_DONE) {
+        /* Cut short, the client cannot tell where it ended either */
+        frame->delimited = false;
+    }
+    frame->reusable = false;
+    frame->state = FRAMING_DONE;
+}
+
+/**
+ * @brief Tells whether the headers were parsed and the body ends on its own
+ * framing rather than at the end server closing
+ *
+ *
+ * @param[in]   *frame          Parser
+ *
+ * @return      bool            true when the body is self-delimiting
+ */
+bool framing_delimited(const http_framing *frame) {
+    return frame->delimited;
+}
+
+/**
+ * @brief Tells whether the client connection the response was relayed to may
+ * carry another request: the response ended on its own framing
+ *
+ *
+ * @param[in]   *frame          Parser of the relayed response
+ *
+ * @return      bool            true when the connection stays open
+ */
+bool framing_keeps_alive(const http_framing *frame) {
+    return frame->state == FRAMING_DONE && frame->delimited;
+}
+
+/**
+ * @brief Tells whether a complete stored response, e.g. a cached object, lets
+ * the client connection it is written to carry another request
+ *
+ *
+ * @param[in]   *response       Response headers and body
+ * @param[in]   len             Bytes held in response
+ *
+ * @return      bool            true when the connection stays open
+ */
+bool framing_stored_keeps_alive(const char *response, size_t len) {
+    http_framing frame;
+    framing_init(&frame);
+    return framing_feed(&frame, response, len) == len &&
+           framing_keeps_alive(&frame);
+}
+
+/**
+ * @brief Finds the end of a response head
+ *
+ *
+ * @param[in]   *response       Response bytes
+ * @param[in]   len             Bytes held in response
+ *
+ * @return      size_t          Bytes of the head including its empty line, 0
+ * while the head is incomplete
+ */
+size_t framing_head_len(const char *response, size_t len) {
+    const char *line = response, *end = response + len, *eol;
+
+    while ((eol = memchr(line, '\n', (size_t)(end - line))) != NULL) {
+        if (eol == line || (eol == line + 1 && *line == '\r')) {
+            return (size_t)(eol + 1 - response);
+        }
+        line = eol + 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Tells whether a header line only concerns the hop it came over
+ *
+ *
+ * @param[in]   *line           Header line
+ *
+ * @return      bool            true for Connection, Proxy-Connection and
+ * Keep-Alive
+ */
+static bool framing_hop_header(const char *line) {
+    return framing_header_value(line, "Connection") != NULL ||
+           framing_header_value(line, "Proxy-Connection") != NULL ||
+           framing_header_value(line, "Keep-Alive") != NULL;
+}
+
+/**
+ * @brief Removes the hop-by-hop headers from a response head in place,
+ * moving the bytes after them down
+ *
+ *
+ * @param[in]   *response       Response bytes, left alone while the head is
+ * incomplete
+ * @param[in]   len             Bytes held in response
+ *
+ * @return      size_t          Bytes left in response
+ */
+size_t framing_strip_hop(char *response, size_t len) {
+    size_t headLen = framing_head_len(response, len), off, lineLen;
+    char *eol;
+
+    if (headLen == 0) {
+        return len;
+    }
+    /* The status line is kept */
+    off = (size_t)((char *)memchr(response, '\n', headLen) + 1 - response);
+    while (off < headLen) {
+        eol = memchr(response + off, '\n', headLen - off);
+        lineLen = (size_t)(eol + 1 - (response + off));
+        if (!framing_hop_header(response + off)) {
+            off += lineLen;
+            continue;
+        }
+        memmove(response + off, response + off + lineLen,
+                len - off - lineLen);
+        len -= lineLen;
+        headLen -= lineLen;
+    }
+    return len;
+}
+
+/**
+ * @brief Writes a response head for the client: the stored head without its
+ * hop-by-hop headers and with the proxy's own Connection header
+ *
+ *
+ * @param[in]   *head           Response head, framing_head_len() bytes
+ * @param[in]   headLen         Bytes held in head
+ * @param[out]  *out            Room for headLen + FRAMING_CONN_EXTRA bytes
+ * @param[in]   keepAlive       The client connection stays open afterwards
+ *
+ * @return      size_t          Bytes written to out
+ */
+size_t framing_client_head(const char *head, size_t headLen, char *out,
+                           bool keepAlive) {
+    const char *connHdr =
+        keepAlive ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+    const char *line = head, *end = head + headLen, *eol;
+    size_t len = 0, lineLen;
+
+    while ((eol = memchr(line, '\n', (size_t)(end - line))) != NULL) {
+        lineLen = (size_t)(eol + 1 - line);
+        if (eol + 1 == end) {
+            /* Empty line, the proxy's header goes before it */
+            len += (size_t)sprintf(out + len, "%s", connHdr);
+            memcpy(out + len, line, lineLen);
+            return len + lineLen;
+        }
+        if (line == head || !framing_hop_header(line)) {
+            memcpy(out + len, line, lineLen);
+            len += lineLen;
+        }
+        line = eol + 1;
+    }
+    return len;
+}
+
+/**
+ * @brief Tells whether the response is complete
+ *
+ *
+ * @param[in]   *frame          Parser
+ *
+ * @return      bool            true once the whole response was consumed
+ */
+bool framing_done(const http_framing *frame) {
+    return frame->state == FRAMING_DONE;
+}
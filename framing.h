@@ -0,0 +1,69 @@
+/**
+ * @file framing.h
+ * @brief Header file for the incremental end server response framing parser
+ *
+ * Description: Tracks where a relayed HTTP/1.x response ends, from its
+ * Content-Length, chunked transfer coding or the end server closing, and
+ * whether the connection may carry another request afterwards. Also rewrites
+ * response heads' hop-by-hop headers.
+ *
+ *
+ * @author Abhishek Basrithaya <abasrith@andrew.cmu.edu>
+ */
+#ifndef FRAMING_H
+#define FRAMING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Room framing_client_head() may add to a head for the Connection header */
+#define FRAMING_CONN_EXTRA 32
+
+/* Longest status, header or chunk size line inspected, the rest is skipped */
+#define FRAMING_LINE_SIZE 256
+
+typedef enum {
+    FRAMING_STATUS,      /* reading the status line */
+    FRAMING_HEADERS,     /* reading header lines */
+    FRAMING_LENGTH,      /* reading a Content-Length delimited body */
+    FRAMING_CHUNK_SIZE,  /* reading a chunk size line */
+    FRAMING_CHUNK_DATA,  /* reading chunk data */
+    FRAMING_CHUNK_END,   /* reading the line ending chunk data */
+    FRAMING_TRAILERS,    /* reading trailer lines after the last chunk */
+    FRAMING_UNTIL_CLOSE, /* body ends when the end server closes */
+    FRAMING_DONE         /* response complete */
+} framing_state;
+
+typedef struct {
+    framing_state state;
+    int status;                    /* response status code */
+    bool http11;                   /* end server speaks HTTP/1.1 */
+    bool connClose;                /* Connection: close seen */
+    bool connKeepAlive;            /* Connection: keep-alive seen */
+    bool chunked;                  /* Transfer-Encoding ends with chunked */
+    bool hasLength;                /* valid Content-Length seen */
+    bool reusable;                 /* connection may be reused once done */
+    bool delimited;                /* body ends on its own framing */
+    size_t remaining;              /* bytes left of the body or chunk */
+    size_t seen;                   /* bytes of the response consumed */
+    size_t lineLen;                /* bytes held in line */
+    char line[FRAMING_LINE_SIZE];  /* current line, truncated if longer */
+} http_framing;
+
+/* Function prototyping */
+void framing_init(http_framing *frame);
+size_t framing_feed(http_framing *frame, const char *buf, size_t len);
+void framing_skip(http_framing *frame, size_t len);
+void framing_eof(http_framing *frame);
+bool framing_done(const http_framing *frame);
+bool framing_delimited(const http_framing *frame);
+bool framing_keeps_alive(const http_framing *frame);
+bool framing_stored_keeps_alive(const char *response, size_t len);
+size_t framing_head_len(const char *response, size_t len);
+size_t framing_strip_hop(char *response, size_t len);
+size_t framing_client_head(const char *head, size_t headLen, char *out,
+                           bool keepAlive);
+const char *framing_header_value(const char *line, const char *name);
+bool framing_header_has_token(const char *value, const char *token);
+
+#endif /* FRAMING_H */
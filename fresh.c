@@ -0,0 +1,295 @@
+/**
+ * @file fresh.c
+ * @brief HTTP freshness and validator handling of cached responses
+ *
+ * Description: fresh_parse() walks the head of a stored response once. A
+ * response is only stored when its status is cacheable by default and its
+ * Cache-Control has neither no-store nor private. Its freshness lifetime is
+ * s-maxage, max-age, Expires minus Date, or without those a tenth of the time
+ * since Last-Modified, and FRESH_DEFAULT_SECS for a response carrying no hint
+ * at all. The age it already had on arrival is the larger of its Age header
+ * and the time since its Date. no-cache makes it stale at once, and
+ * stale-while-revalidate lets it be served stale for that long while it is
+ * revalidated, unless no-cache or must-revalidate forbid it.
+ *
+ * fresh_add_validators() turns ETag and Last-Modified of a stored response
+ * into If-None-Match and If-Modified-Since for the request revalidating it.
+ *
+ *
+ * @author Abhishek Basrithaya <abasrith@andrew.cmu.edu>
+ */
+#include "fresh.h"
+#include "framing.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/* Statuses a cache may store without explicit freshness information */
+static const int cacheableStatuses[] = {200, 203, 204, 300, 301, 308,
+                                        404, 405, 410, 414, 501};
+
+/**
+ * @brief Copies the next line of a response head, CRLF stripped and truncated
+ * to FRESH_LINE_SIZE
+ *
+ *
+ * @param[in]   *pos            Start of the line
+ * @param[in]   *end            End of the response
+ * @param[out]  *line           Line copy
+ *
+ * @return      const char*     Start of the following line, NULL when the
+ * response ended without a line feed
+ */
+static const char *fresh_next_line(const char *pos, const char *end,
+                                   char *line) {
+    const char *lf = memchr(pos, '\n', (size_t)(end - pos));
+    size_t len;
+
+    if (lf == NULL) {
+        return NULL;
+    }
+    len = (size_t)(lf - pos);
+    if (len > 0 && pos[len - 1] == '\r') {
+        len--;
+    }
+    if (len > FRESH_LINE_SIZE - 1) {
+        len = FRESH_LINE_SIZE - 1;
+    }
+    memcpy(line, pos, len);
+    line[len] = '\0';
+    return lf + 1;
+}
+
+/**
+ * @brief Converts a UTC calendar date to seconds since the epoch
+ *
+ *
+ * @param[in]   year            Year
+ * @param[in]   mon             Month, 1 to 12
+ * @param[in]   day             Day of the month
+ * @param[in]   secs            Seconds since midnight
+ *
+ * @return      time_t          Seconds since the epoch
+ */
+static time_t fresh_days_to_time(int year, int mon, int day, long secs) {
+    long era, yoe, doy, doe;
+
+    year -= mon <= 2;
+    era = (year >= 0 ? year : year - 399) / 400;
+    yoe = year - era * 400;
+    doy = (153 * (mon + (mon > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return (time_t)(era * 146097 + doe - 719468) * 86400 + secs;
+}
+
+/**
+ * @brief Parses an HTTP date, in the preferred or the obsolete RFC 850 and
+ * asctime formats
+ *
+ *
+ * @param[in]   *value          Header value
+ *
+ * @return      time_t          Seconds since the epoch, -1 if unparseable
+ */
+static time_t fresh_parse_date(const char *value) {
+    static const char *months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    char mon[4];
+    const char *found;
+    int day, year, hh, mm, ss;
+
+    if (sscanf(value, "%*[a-zA-Z], %d %3s %d %d:%d:%d", &day, mon, &year, &hh,
+               &mm, &ss) != 6 &&
+        sscanf(value, "%*[a-zA-Z], %d-%3s-%d %d:%d:%d", &day, mon, &year, &hh,
+               &mm, &ss) != 6 &&
+        sscanf(value, "%*[a-zA-Z] %3s %d %d:%d:%d %d", mon, &day, &hh, &mm,
+               &ss, &year) != 6) {
+        return -1;
+    }
+    if (strlen(mon) != 3 || (found = strstr(months, mon)) == NULL ||
+        (found - months) % 3 != 0) {
+        return -1;
+    }
+    if (year < 100) {
+        /* RFC 850 two digit years */
+        year += (year < 70) ? 2000 : 1900;
+    }
+    return fresh_days_to_time(year, (int)(found - months) / 3 + 1, day,
+                              hh * 3600L + mm * 60L + ss);
+}
+
+/**
+ * @brief Looks up a Cache-Control directive carrying a number of seconds
+ *
+ *
+ * @param[in]   *value          Cache-Control value
+ * @param[in]   *name           Directive name, case insensitive
+ * @param[out]  *secs           Directive value
+ *
+ * @return      bool            true when the directive is present and valid
+ */
+static bool fresh_directive_secs(const char *value, const char *name,
+                                 time_t *secs) {
+    size_t nameLen = strlen(name), len;
+    char *end;
+    long num;
+
+    while (*value != '\0') {
+        while (*value == ' ' || *value == '\t' || *value == ',') {
+            value++;
+        }
+        len = strcspn(value, ",");
+        if (strncasecmp(value, name, nameLen) == 0 && value[nameLen] == '=') {
+            num = strtol(value + nameLen + 1 + (value[nameLen + 1] == '"'),
+                         &end, 10);
+            if (end != value + nameLen + 1 && num >= 0) {
+                *secs = (time_t)num;
+                return true;
+            }
+        }
+        value += len;
+    }
+    return false;
+}
+
+/**
+ * @brief Reads the freshness information of a stored response
+ *
+ *
+ * @param[in]   *response       Response headers and body
+ * @param[in]   len             Bytes held in response
+ * @param[in]   receivedAt      When the response was received
+ * @param[out]  *info           Freshness information
+ *
+ * @return      void
+ */
+void fresh_parse(const char *response, size_t len, time_t receivedAt,
+                 fresh_info *info) {
+    const char *pos = response, *end = response + len, *value;
+    char line[FRESH_LINE_SIZE];
+    time_t date = -1, expires = -1, lastModified = -1, ageValue = 0;
+    time_t maxAge = -1, sMaxAge = -1, secs;
+    bool noStore = false, noCache = false, hasExpires = false;
+    size_t i;
+
+    memset(info, 0, sizeof(fresh_info));
+    if ((pos = fresh_next_line(pos, end, line)) == NULL ||
+        strncmp(line, "HTTP/1.", 7) != 0 || line[8] != ' ') {
+        return;
+    }
+    info->status = atoi(line + 9);
+    while ((pos = fresh_next_line(pos, end, line)) != NULL && *line != '\0') {
+        if ((value = framing_header_value(line, "Cache-Control")) != NULL) {
+            noStore |= framing_header_has_token(value, "no-store") ||
+                       framing_header_has_token(value, "private");
+            noCache |= framing_header_has_token(value, "no-cache");
+            info->mustRevalidate |=
+                framing_header_has_token(value, "must-revalidate") ||
+                framing_header_has_token(value, "proxy-revalidate");
+            if (fresh_directive_secs(value, "max-age", &secs))
+                maxAge = secs;
+            if (fresh_directive_secs(value, "s-maxage", &secs))
+                sMaxAge = secs;
+            if (fresh_directive_secs(value, "stale-while-revalidate", &secs))
+                info->staleSecs = secs;
+        } else if ((value = framing_header_value(line, "Pragma")) != NULL) {
+            noCache |= framing_header_has_token(value, "no-cache");
+        } else if ((value = framing_header_value(line, "Expires")) != NULL) {
+            /* An invalid Expires means already expired */
+            hasExpires = true;
+            expires = fresh_parse_date(value);
+        } else if ((value = framing_header_value(line, "Date")) != NULL) {
+            date = fresh_parse_date(value);
+        } else if ((value = framing_header_value(line, "Last-Modified")) !=
+                   NULL) {
+            lastModified = fresh_parse_date(value);
+        } else if ((value = framing_header_value(line, "Age")) != NULL) {
+            ageValue = (time_t)strtol(value, NULL, 10);
+        }
+    }
+    if (pos == NULL) {
+        /* Head never ended, nothing trustworthy to cache */
+        return;
+    }
+
+    for (i = 0; i < sizeof(cacheableStatuses) / sizeof(int); i++) {
+        info->cacheable |= info->status == cacheableStatuses[i];
+    }
+    info->cacheable &= !noStore;
+
+    if (sMaxAge >= 0 || maxAge >= 0) {
+        info->explicitLife = true;
+        info->lifetime = (sMaxAge >= 0) ? sMaxAge : maxAge;
+    } else if (hasExpires) {
+        info->explicitLife = true;
+        info->lifetime =
+            (expires < 0) ? 0 : expires - ((date >= 0) ? date : receivedAt);
+    } else if (lastModified >= 0) {
+        info->lifetime = (((date >= 0) ? date : receivedAt) - lastModified) /
+                         FRESH_HEURISTIC_DIVISOR;
+        if (info->lifetime > FRESH_HEURISTIC_MAX_SECS)
+            info->lifetime = FRESH_HEURISTIC_MAX_SECS;
+    } else {
+        info->lifetime = FRESH_DEFAULT_SECS;
+    }
+    if (info->lifetime < 0)
+        info->lifetime = 0;
+    if (noCache) {
+        info->explicitLife = true;
+        info->lifetime = 0;
+        info->mustRevalidate = true;
+    }
+    if (info->mustRevalidate)
+        info->staleSecs = 0;
+
+    info->age = (date >= 0 && receivedAt > date) ? receivedAt - date : 0;
+    if (ageValue > info->age)
+        info->age = ageValue;
+}
+
+/**
+ * @brief Adds If-None-Match and If-Modified-Since from the validators of a
+ * stored response to a request head ending with its empty line
+ *
+ *
+ * @param[in,out] *request      NUL terminated request head
+ * @param[in]   size            Room in request
+ * @param[in]   *response       Stored response headers and body
+ * @param[in]   len             Bytes held in response
+ *
+ * @return      size_t          New length of the request, unchanged if the
+ * response has no validator or the request has no room for them
+ */
+size_t fresh_add_validators(char *request, size_t size, const char *response,
+                            size_t len) {
+    const char *pos = response, *end = response + len, *value;
+    char line[FRESH_LINE_SIZE], conditions[3 * FRESH_LINE_SIZE];
+    size_t reqLen = strlen(request), condLen = 0;
+
+    if ((pos = fresh_next_line(pos, end, line)) == NULL) {
+        return reqLen;
+    }
+    while ((pos = fresh_next_line(pos, end, line)) != NULL && *line != '\0') {
+        if ((value = framing_header_value(line, "ETag")) != NULL) {
+            condLen += (size_t)snprintf(conditions + condLen,
+                                        sizeof(conditions) - condLen,
+                                        "If-None-Match: %s\r\n", value);
+        } else if ((value = framing_header_value(line, "Last-Modified")) !=
+                   NULL) {
+            condLen += (size_t)snprintf(conditions + condLen,
+                                        sizeof(conditions) - condLen,
+                                        "If-Modified-Since: %s\r\n", value);
+        }
+        if (condLen >= FRESH_LINE_SIZE) {
+            break;
+        }
+    }
+    if (condLen == 0 || reqLen < 2 || reqLen + condLen >= size) {
+        return reqLen;
+    }
+    /* Insert in front of the empty line ending the head */
+    memmove(request + reqLen - 2 + condLen, request + reqLen - 2, 3);
+    memcpy(request + reqLen - 2, conditions, condLen);
+    return reqLen + condLen;
+}
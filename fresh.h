@@ -0,0 +1,45 @@
+/**
+ * @file fresh.h
+ * @brief Header file for HTTP freshness and validator handling of cached
+ * responses
+ *
+ * Description: Reads Cache-Control, Expires, Date, Age, Last-Modified and
+ * ETag from a stored response to decide whether it may be cached, for how
+ * long it stays fresh and how to revalidate it, defines, structures and
+ * function prototypes.
+ *
+ *
+ * @author Abhishek Basrithaya <abasrith@andrew.cmu.edu>
+ */
+#ifndef FRESH_H
+#define FRESH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+/* Longest header line inspected, the rest is skipped */
+#define FRESH_LINE_SIZE 512
+/* Lifetime of a response without any freshness information or validator */
+#define FRESH_DEFAULT_SECS 300
+/* Heuristic lifetime from Last-Modified is a tenth of its age, capped */
+#define FRESH_HEURISTIC_DIVISOR 10
+#define FRESH_HEURISTIC_MAX_SECS (24 * 60 * 60)
+
+typedef struct {
+    int status;        /* response status code, 0 if unparseable */
+    bool cacheable;    /* a shared cache may store the response */
+    bool explicitLife; /* lifetime came from max-age, s-maxage or Expires */
+    bool mustRevalidate; /* no-cache or must-revalidate, never served stale */
+    time_t lifetime;   /* freshness lifetime in seconds */
+    time_t age;        /* age of the response when it was received */
+    time_t staleSecs;  /* stale-while-revalidate window in seconds */
+} fresh_info;
+
+/* Function prototyping */
+void fresh_parse(const char *response, size_t len, time_t receivedAt,
+                 fresh_info *info);
+size_t fresh_add_validators(char *request, size_t size, const char *response,
+                            size_t len);
+
+#endif /* FRESH_H */
@@ -0,0 +1,22 @@
+/**
+ * @file lineio.h
+ * @brief Header file for the buffered line reader used on client requests
+ *
+ * Description: A drop-in for rio_readlineb() that finds the end of a line
+ * with memchr() over the rio buffer and copies the whole line at once
+ * instead of going through rio_read() byte by byte, function prototypes.
+ *
+ *
+ * @author Abhishek Basrithaya <abasrith@andrew.cmu.edu>
+ */
+#ifndef LINEIO_H
+#define LINEIO_H
+
+#include "csapp.h"
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Function prototyping */
+ssize_t lineio_readline(rio_t *rp, char *usrbuf, size_t maxlen);
+
+#endif /* LINEIO_H */
@@ -0,0 +1,256 @@
+/**
+ * @file log.c
+ * @brief Asynchronous logger of the proxy
+ *
+ * Description: Each thread lazily gets its own log_ring, linked once into a
+ * global list under a mutex. The owner is the ring's only producer and the
+ * drain thread its only consumer, so a line is queued with one release store
+ * of the head and no lock; when the ring is full the line is dropped and
+ * counted rather than stalling the caller. The drain thread gathers the
+ * waiting lines of every ring into one buffer and writes it to stdout in a
+ * single call, sleeping LOG_DRAIN_USEC whenever it found nothing.
+ *
+ * Accepted connections are queued as raw addresses and only turned into
+ * text by the drain thread, numerically unless names were asked for, so the
+ * accept loops never wait on a reverse lookup.
+ *
+ *
+ * @author Abhishek Basrithaya <abasrith@andrew.cmu.edu>
+ */
+#include "log.h"
+#include "csapp.h"
+#include "proxy.h"
+#include <inttypes.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Lines above this level are not queued */
+static int logLevel = LOG_LEVEL_OFF;
+/* Accept lines carry host names instead of numeric addresses */
+static bool logResolve;
+/* Rings of every thread that logged something, newest first */
+static log_ring *logRings;
+static pthread_mutex_t logMutex = PTHREAD_MUTEX_INITIALIZER;
+/* Ring of the calling thread */
+static __thread log_ring *logLocal;
+
+/* Function prototyping */
+static void *log_thread(void *vargp);
+
+/**
+ * @brief Sets the verbosity and starts the drain thread
+ *
+ *
+ * @param[in]   level           One of LOG_LEVEL_*
+ * @param[in]   resolve         true to log client host names, which costs the
+ * drain thread a reverse lookup per connection
+ *
+ * @return      void
+ */
+void log_init(int level, bool resolve) {
+    pthread_t tid;
+
+    logLevel = level;
+    logResolve = resolve;
+    if (level > LOG_LEVEL_OFF) {
+        Pthread_create(&tid, NULL, log_thread, NULL);
+    }
+}
+
+/**
+ * @brief Tells whether lines of a level are logged
+ *
+ *
+ * @param[in]   level           One of LOG_LEVEL_*
+ *
+ * @return      bool            true if they are
+ */
+bool log_enabled(int level) {
+    return level <= logLevel;
+}
+
+/**
+ * @brief Returns the calling thread's ring, linking a new one on first use
+ *
+ *
+ * @return      log_ring*       Ring only this thread fills
+ */
+static log_ring *log_local(void) {
+    log_ring *ring = logLocal;
+
+    if (ring == NULL) {
+        ring = Calloc(1, sizeof(log_ring));
+        pthread_mutex_lock(&logMutex);
+        ring->next = logRings;
+        __atomic_store_n(&logRings, ring, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&logMutex);
+        logLocal = ring;
+    }
+    return ring;
+}
+
+/**
+ * @brief Returns the next free slot of the calling thread's ring
+ *
+ *
+ * @param[out]  **ringOut       Ring the slot belongs to
+ *
+ * @return      log_record*     Slot to fill, NULL when the ring is full and
+ * the line was counted as dropped
+ */
+static log_record *log_claim(log_ring **ringOut) {
+    log_ring *ring = log_local();
+    size_t head = ring->head;
+
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) ==
+        LOG_RING_SLOTS) {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    *ringOut = ring;
+    return &ring->slots[head & (LOG_RING_SLOTS - 1)];
+}
+
+/**
+ * @brief Hands the slot returned by log_claim() to the drain thread
+ *
+ *
+ * @param[in]   *ring           Ring of the calling thread
+ *
+ * @return      void
+ */
+static void log_publish(log_ring *ring) {
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Queues a formatted line
+ *
+ *
+ * @param[in]   level           One of LOG_LEVEL_*
+ * @param[in]   *fmt            printf format of the line, newline included
+ *
+ * @return      void
+ */
+void log_printf(int level, const char *fmt, ...) {
+    log_ring *ring;
+    log_record *rec;
+    va_list ap;
+    int len;
+
+    if (!log_enabled(level) || (rec = log_claim(&ring)) == NULL) {
+        return;
+    }
+    va_start(ap, fmt);
+    len = vsnprintf(rec->msg, LOG_MSG_SIZE, fmt, ap);
+    va_end(ap);
+    if (len >= LOG_MSG_SIZE) {
+        rec->msg[LOG_MSG_SIZE - 2] = '\n';
+    }
+    rec->addrLen = 0;
+    log_publish(ring);
+}
+
+/**
+ * @brief Queues the line of an accepted connection
+ *
+ *
+ * @param[in]   *addr           Client address returned by accept()
+ * @param[in]   addrLen         Size of addr
+ *
+ * @return      void
+ */
+void log_accept(const struct sockaddr *addr, socklen_t addrLen) {
+    log_ring *ring;
+    log_record *rec;
+
+    if (!log_enabled(LOG_LEVEL_INFO) || addrLen == 0 ||
+        addrLen > sizeof(struct sockaddr_storage) ||
+        (rec = log_claim(&ring)) == NULL) {
+        return;
+    }
+    memcpy(&rec->addr, addr, addrLen);
+    rec->addrLen = addrLen;
+    log_publish(ring);
+}
+
+/**
+ * @brief Appends the text of a record to the drain thread's buffer
+ *
+ *
+ * @param[in]   *rec            Record taken from a ring
+ * @param[out]  *out            Buffer with room for LOG_MSG_SIZE + 2 *
+ * MAXLINE more bytes
+ *
+ * @return      size_t          Bytes appended
+ */
+static size_t log_render(const log_record *rec, char *out) {
+    char hostname[MAXLINE], port[MAXLINE];
+    int flags = logResolve ? 0 : NI_NUMERICHOST | NI_NUMERICSERV;
+
+    if (rec->addrLen == 0) {
+        return strlen(strcpy(out, rec->msg));
+    }
+    if (getnameinfo((const struct sockaddr *)&rec->addr, rec->addrLen,
+                    hostname, MAXLINE, port, MAXLINE, flags) != 0) {
+        strcpy(hostname, "?");
+        strcpy(port, "?");
+    }
+    return (size_t)sprintf(out, "Accepted connection from (%s %s).\n",
+                           hostname, port);
+}
+
+/**
+ * @brief Drain thread, writes out the lines every ring holds for the
+ * lifetime of the proxy
+ *
+ *
+ * @param[in]   vargp           argument passed to thread handler (unused)
+ *
+ * @return      void*           never returns
+ */
+static void *log_thread(void *vargp) {
+    static char out[LOG_WRITE_SIZE + LOG_MSG_SIZE + 2 * MAXLINE];
+    struct timespec pause = {0, LOG_DRAIN_USEC * 1000};
+    size_t len, tail, head;
+    uint64_t dropped;
+    log_ring *ring;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        len = 0;
+        for (ring = __atomic_load_n(&logRings, __ATOMIC_ACQUIRE); ring != NULL;
+             ring = ring->next) {
+            tail = ring->tail;
+            head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+            for (; tail != head; tail++) {
+                len += log_render(&ring->slots[tail & (LOG_RING_SLOTS - 1)],
+                                  out + len);
+                if (len >= LOG_WRITE_SIZE) {
+                    rio_writen(STDOUT_FILENO, out, len);
+                    len = 0;
+                }
+            }
+            /* Slots are only reused once their text has been copied out */
+            __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+            dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+            if (dropped != ring->reported) {
+                len += (size_t)sprintf(out + len, "log: %" PRIu64
+                                       " lines dropped\n",
+                                       dropped - ring->reported);
+                ring->reported = dropped;
+            }
+        }
+        if (len > 0) {
+            rio_writen(STDOUT_FILENO, out, len);
+        } else {
+            nanosleep(&pause, NULL);
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,58 @@
+/**
+ * @file log.h
+ * @brief Header file for the proxy's asynchronous logger
+ *
+ * Description: Threads format their log lines into a ring of their own and
+ * a background thread writes them out in batches, so logging costs the
+ * front ends neither a system call nor a lock, defines, structures and
+ * function prototypes.
+ *
+ *
+ * @author Abhishek Basrithaya <abasrith@andrew.cmu.edu>
+ */
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/* Verbosity, each level logs everything the levels below it do */
+#define LOG_LEVEL_OFF 0   /* nothing */
+#define LOG_LEVEL_ERROR 1 /* failed requests and dropped clients */
+#define LOG_LEVEL_INFO 2  /* accepted connections too */
+#define DEFAULT_LOG_LEVEL LOG_LEVEL_INFO
+/* Lines a thread may have waiting, a power of two */
+#define LOG_RING_SLOTS 128
+/* Longest line kept, longer ones are cut short */
+#define LOG_MSG_SIZE 192
+/* Pause of the drain thread when every ring is empty */
+#define LOG_DRAIN_USEC 10000
+/* Bytes the drain thread gathers before a write */
+#define LOG_WRITE_SIZE (16 * 1024)
+
+typedef struct {
+    struct sockaddr_storage addr; /* client of an accept line */
+    socklen_t addrLen;            /* 0 for a formatted line */
+    char msg[LOG_MSG_SIZE];       /* formatted line, newline terminated */
+} log_record;
+
+/* Ring of one thread, filled only by it and emptied by the drain thread */
+typedef struct log_ring {
+    size_t head;                      /* next slot the owner fills */
+    uint64_t dropped;                 /* lines lost to a full ring */
+    log_record slots[LOG_RING_SLOTS]; /* waiting lines */
+    size_t tail;                      /* next slot the drain thread writes */
+    uint64_t reported;                /* drops the drain thread reported */
+    struct log_ring *next;            /* next thread's ring */
+} log_ring;
+
+/* Function prototyping */
+void log_init(int level, bool resolve);
+bool log_enabled(int level);
+void log_printf(int level, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+void log_accept(const struct sockaddr *addr, socklen_t addrLen);
+
+#endif /* LOG_H */
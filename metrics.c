@@ -0,0 +1,380 @@
+/**
+ * @file metrics.c
+ * @brief Counters and latency histograms of the proxy, rendered for scraping
+ *
+ * Description: Each thread lazily gets its own metrics_thread, linked once
+ * into a global list under a mutex and from then on only written by that
+ * thread, with plain relaxed atomic stores so counting never takes a lock or
+ * a locked instruction. A scrape walks the list and sums the slots with
+ * relaxed loads, so it is only as consistent as the proxy was quiet.
+ *
+ * Latencies are kept in microseconds in HDR-style log-linear buckets: every
+ * power of two is split into METRICS_SUB_CNT equal buckets, which bounds the
+ * relative error of a bucket whatever the magnitude. They are exported as
+ * cumulative Prometheus histograms in seconds, next to the request and byte
+ * counters and the hit, miss, eviction and occupancy figures of the cache.
+ *
+ *
+ * @author Abhishek Basrithaya <abasrith@andrew.cmu.edu>
+ */
+#include "metrics.h"
+#include "cache.h"
+#include "csapp.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/* Names of metrics_counter values, in enum order */
+static const char *counterNames[METRICS_COUNTER_CNT] = {
+    "proxy_connections_accepted_total", "proxy_requests_total",
+    "proxy_origin_bytes_total", "proxy_client_bytes_total"};
+static const char *counterHelp[METRICS_COUNTER_CNT] = {
+    "Client connections accepted.", "Client requests parsed.",
+    "Response bytes read from end servers.",
+    "Response bytes written to clients."};
+/* Label values of metrics_hist values, in enum order */
+static const char *histNames[METRICS_HIST_CNT] = {
+    "first_byte", "cache_lookup", "origin_connect", "origin_first_byte",
+    "relay"};
+
+/* Slots of every thread that counted something, newest first */
+static metrics_thread *metricsThreads;
+static pthread_mutex_t metricsMutex = PTHREAD_MUTEX_INITIALIZER;
+/* Slots of the calling thread */
+static __thread metrics_thread *metricsLocal;
+
+/* Response being rendered */
+typedef struct {
+    char *buf;  /* rendered bytes */
+    size_t len; /* bytes held in buf */
+    size_t cap; /* room in buf */
+} metrics_out;
+
+/**
+ * @brief Returns a monotonic timestamp
+ *
+ *
+ * @return      uint64_t        Microseconds since an arbitrary point
+ */
+uint64_t metrics_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief Returns the calling thread's slots, linking new ones on first use
+ *
+ *
+ * @return      metrics_thread* Slots only this thread writes
+ */
+static metrics_thread *metrics_local(void) {
+    metrics_thread *slots = metricsLocal;
+
+    if (slots == NULL) {
+        slots = Calloc(1, sizeof(metrics_thread));
+        pthread_mutex_lock(&metricsMutex);
+        slots->next = metricsThreads;
+        __atomic_store_n(&metricsThreads, slots, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&metricsMutex);
+        metricsLocal = slots;
+    }
+    return slots;
+}
+
+/**
+ * @brief Adds to a slot of the calling thread, a single writer needs no
+ * read-modify-write atomics
+ *
+ *
+ * @param[in,out] *slot         Slot of the calling thread
+ * @param[in]   n               Amount to add
+ *
+ * @return      void
+ */
+static void metrics_add(uint64_t *slot, uint64_t n) {
+    __atomic_store_n(slot, __atomic_load_n(slot, __ATOMIC_RELAXED) + n,
+                     __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Adds to a counter
+ *
+ *
+ * @param[in]   counter         One of METRICS_* counters
+ * @param[in]   n               Amount to add
+ *
+ * @return      void
+ */
+void metrics_count(metrics_counter counter, uint64_t n) {
+    metrics_add(&metrics_local()->counters[counter], n);
+}
+
+/**
+ * @brief Maps a latency to its histogram bucket
+ *
+ *
+ * @param[in]   usec            Latency in microseconds
+ *
+ * @return      size_t          Bucket index
+ */
+static size_t metrics_bucket(uint64_t usec) {
+    int exp;
+
+    if (usec < METRICS_SUB_CNT) {
+        return (size_t)usec;
+    }
+    exp = 63 - __builtin_clzll(usec);
+    if (exp >= METRICS_MAX_EXP) {
+        return METRICS_BUCKET_CNT - 1;
+    }
+    return METRICS_SUB_CNT +
+           (size_t)(exp - METRICS_SUB_BITS) * METRICS_SUB_CNT +
+           ((usec >> (exp - METRICS_SUB_BITS)) & (METRICS_SUB_CNT - 1));
+}
+
+/**
+ * @brief Returns the largest latency a bucket holds
+ *
+ *
+ * @param[in]   idx             Bucket index below METRICS_BUCKET_CNT - 1
+ *
+ * @return      uint64_t        Inclusive upper bound in microseconds
+ */
+static uint64_t metrics_bucket_max(size_t idx) {
+    size_t shift, sub;
+
+    if (idx < METRICS_SUB_CNT) {
+        return idx;
+    }
+    shift = (idx - METRICS_SUB_CNT) / METRICS_SUB_CNT;
+    sub = (idx - METRICS_SUB_CNT) % METRICS_SUB_CNT;
+    return ((uint64_t)(METRICS_SUB_CNT + sub + 1) << shift) - 1;
+}
+
+/**
+ * @brief Records the time elapsed since a timestamp in a histogram
+ *
+ *
+ * @param[in]   hist            One of METRICS_* histograms
+ * @param[in]   startUsec       metrics_now() when the stage started
+ *
+ * @return      void
+ */
+void metrics_observe(metrics_hist hist, uint64_t startUsec) {
+    metrics_thread *slots = metrics_local();
+    uint64_t now = metrics_now();
+    uint64_t usec = (now > startUsec) ? now - startUsec : 0;
+
+    metrics_add(&slots->buckets[hist][metrics_bucket(usec)], 1);
+    metrics_add(&slots->sums[hist], usec);
+}
+
+/**
+ * @brief Starts timing a request, 0 leaves it to the first request byte
+ *
+ *
+ * @param[out]  *req            Timestamps of the connection's request
+ * @param[in]   startUsec       metrics_now() at accept or request arrival
+ *
+ * @return      void
+ */
+void metrics_request_begin(metrics_request *req, uint64_t startUsec) {
+    memset(req, 0, sizeof(metrics_request));
+    req->startUsec = startUsec;
+}
+
+/**
+ * @brief Records the relay time of a request that got a response
+ *
+ *
+ * @param[in]   *req            Timestamps of the connection's request
+ *
+ * @return      void
+ */
+void metrics_request_end(metrics_request *req) {
+    if (req->firstByte && req->startUsec != 0) {
+        metrics_observe(METRICS_RELAY, req->startUsec);
+    }
+}
+
+/**
+ * @brief Counts response bytes written to a client, timing the first one
+ *
+ *
+ * @param[in,out] *req          Timestamps of the connection's request
+ * @param[in]   n               Bytes written
+ *
+ * @return      void
+ */
+void metrics_client_bytes(metrics_request *req, size_t n) {
+    if (n == 0) {
+        return;
+    }
+    if (!req->firstByte) {
+        req->firstByte = true;
+        if (req->startUsec != 0) {
+            metrics_observe(METRICS_FIRST_BYTE, req->startUsec);
+        }
+    }
+    metrics_count(METRICS_BYTES_OUT, n);
+}
+
+/**
+ * @brief Counts response bytes read from an end server, timing the first one
+ *
+ *
+ * @param[in,out] *req          Timestamps of the connection's request
+ * @param[in]   n               Bytes read
+ *
+ * @return      void
+ */
+void metrics_origin_bytes(metrics_request *req, size_t n) {
+    if (n == 0) {
+        return;
+    }
+    if (req->sentUsec != 0) {
+        metrics_observe(METRICS_ORIGIN_FIRST_BYTE, req->sentUsec);
+        req->sentUsec = 0;
+    }
+    metrics_count(METRICS_BYTES_IN, n);
+}
+
+/**
+ * @brief Appends formatted text to the response being rendered
+ *
+ *
+ * @param[in,out] *out          Response being rendered
+ * @param[in]   *fmt            printf() format
+ *
+ * @return      void
+ */
+static void metrics_printf(metrics_out *out, const char *fmt, ...) {
+    va_list ap;
+    int n;
+
+    while (1) {
+        va_start(ap, fmt);
+        n = vsnprintf(out->buf + out->len, out->cap - out->len, fmt, ap);
+        va_end(ap);
+        if (n >= 0 && (size_t)n < out->cap - out->len) {
+            out->len += (size_t)n;
+            return;
+        }
+        out->cap *= 2;
+        out->buf = Realloc(out->buf, out->cap);
+    }
+}
+
+/**
+ * @brief Appends one gauge or counter with its help and type lines
+ *
+ *
+ * @param[in,out] *out          Response being rendered
+ * @param[in]   *name           Metric name
+ * @param[in]   *type           "counter" or "gauge"
+ * @param[in]   *help           Help text
+ * @param[in]   value           Current value
+ *
+ * @return      void
+ */
+static void metrics_render_value(metrics_out *out, const char *name,
+                                 const char *type, const char *help,
+                                 uint64_t value) {
+    metrics_printf(out, "# HELP %s %s\n# TYPE %s %s\n%s %llu\n", name, help,
+                   name, type, name, (unsigned long long)value);
+}
+
+/**
+ * @brief Renders every metric in the Prometheus text format as a complete
+ * HTTP response
+ *
+ *
+ * @param[out]  *len            Bytes of the response
+ *
+ * @return      char*           Response, to be freed with Free()
+ */
+char *metrics_render(size_t *len) {
+    uint64_t counters[METRICS_COUNTER_CNT] = {0};
+    uint64_t buckets[METRICS_HIST_CNT][METRICS_BUCKET_CNT] = {{0}};
+    uint64_t sums[METRICS_HIST_CNT] = {0}, cumulative;
+    metrics_out out = {Malloc(METRICS_RENDER_SIZE), 0, METRICS_RENDER_SIZE};
+    metrics_thread *slots;
+    cache_stats stats;
+    size_t i, j, bytes, blocks, capacity;
+    char *response;
+
+    for (slots = __atomic_load_n(&metricsThreads, __ATOMIC_ACQUIRE);
+         slots != NULL; slots = slots->next) {
+        for (i = 0; i < METRICS_COUNTER_CNT; i++) {
+            counters[i] +=
+                __atomic_load_n(&slots->counters[i], __ATOMIC_RELAXED);
+        }
+        for (i = 0; i < METRICS_HIST_CNT; i++) {
+            for (j = 0; j < METRICS_BUCKET_CNT; j++) {
+                buckets[i][j] +=
+                    __atomic_load_n(&slots->buckets[i][j], __ATOMIC_RELAXED);
+            }
+            sums[i] += __atomic_load_n(&slots->sums[i], __ATOMIC_RELAXED);
+        }
+    }
+
+    for (i = 0; i < METRICS_COUNTER_CNT; i++) {
+        metrics_render_value(&out, counterNames[i], "counter", counterHelp[i],
+                             counters[i]);
+    }
+    metrics_printf(&out, "# HELP proxy_stage_latency_seconds Latency of each "
+                         "request handling stage.\n"
+                         "# TYPE proxy_stage_latency_seconds histogram\n");
+    for (i = 0; i < METRICS_HIST_CNT; i++) {
+        cumulative = 0;
+        for (j = 0; j < METRICS_BUCKET_CNT - 1; j++) {
+            cumulative += buckets[i][j];
+            metrics_printf(&out,
+                           "proxy_stage_latency_seconds_bucket{stage=\"%s\","
+                           "le=\"%.6f\"} %llu\n",
+                           histNames[i], metrics_bucket_max(j) / 1e6,
+                           (unsigned long long)cumulative);
+        }
+        cumulative += buckets[i][j];
+        metrics_printf(&out,
+                       "proxy_stage_latency_seconds_bucket{stage=\"%s\","
+                       "le=\"+Inf\"} %llu\n"
+                       "proxy_stage_latency_seconds_sum{stage=\"%s\"} %.6f\n"
+                       "proxy_stage_latency_seconds_count{stage=\"%s\"} "
+                       "%llu\n",
+                       histNames[i], (unsigned long long)cumulative,
+                       histNames[i], sums[i] / 1e6, histNames[i],
+                       (unsigned long long)cumulative);
+    }
+
+    cache_get_stats(&stats);
+    cache_get_occupancy(&bytes, &blocks, &capacity);
+    metrics_render_value(&out, "proxy_cache_lookups_total", "counter",
+                         "Cache lookups.", stats.lookups);
+    metrics_render_value(&out, "proxy_cache_hits_total", "counter",
+                         "Cache lookups that hit.", stats.hits);
+    metrics_render_value(&out, "proxy_cache_misses_total", "counter",
+                         "Cache lookups that missed.",
+                         stats.lookups - stats.hits);
+    metrics_render_value(&out, "proxy_cache_evictions_total", "counter",
+                         "Blocks evicted from the cache.", stats.evicted);
+    metrics_render_value(&out, "proxy_cache_bytes", "gauge",
+                         "Bytes of cached objects.", bytes);
+    metrics_render_value(&out, "proxy_cache_objects", "gauge",
+                         "Cached objects.", blocks);
+    metrics_render_value(&out, "proxy_cache_capacity_bytes", "gauge",
+                         "Max cache size.", capacity);
+
+    response = Malloc(out.len + MAXLINE);
+    *len = (size_t)sprintf(response,
+                           "HTTP/1.0 200 OK\r\n"
+                           "Content-Type: text/plain; version=0.0.4\r\n"
+                           "Content-Length: %zu\r\n\r\n",
+                           out.len);
+    memcpy(response + *len, out.buf, out.len);
+    *len += out.len;
+    Free(out.buf);
+    return response;
+}
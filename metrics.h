@@ -0,0 +1,77 @@
+/**
+ * @file metrics.h
+ * @brief Header file for the proxy's counters and latency histograms
+ *
+ * Description: Every thread counts into its own slots, which a scrape of
+ * METRICS_URI sums up and renders in the Prometheus text format together
+ * with the cache counters, defines, structures and function prototypes.
+ *
+ *
+ * @author Abhishek Basrithaya <abasrith@andrew.cmu.edu>
+ */
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Origin-form request target answered by the proxy itself */
+#define METRICS_URI "/metrics"
+/*
+ * Log-linear histogram buckets over microseconds: 2^METRICS_SUB_BITS
+ * buckets per power of two, one more for values of 2^METRICS_MAX_EXP and up
+ */
+#define METRICS_SUB_BITS 1
+#define METRICS_SUB_CNT (1 << METRICS_SUB_BITS)
+#define METRICS_MAX_EXP 25
+#define METRICS_BUCKET_CNT                                                     \
+    (METRICS_SUB_CNT +                                                         \
+     (METRICS_MAX_EXP - METRICS_SUB_BITS) * METRICS_SUB_CNT + 1)
+/* Room the rendered response starts with, grown as needed */
+#define METRICS_RENDER_SIZE (16 * 1024)
+
+typedef enum {
+    METRICS_ACCEPTED,  /* client connections accepted */
+    METRICS_REQUESTS,  /* client requests parsed */
+    METRICS_BYTES_IN,  /* response bytes read from end servers */
+    METRICS_BYTES_OUT, /* response bytes written to clients */
+    METRICS_COUNTER_CNT
+} metrics_counter;
+
+typedef enum {
+    METRICS_FIRST_BYTE,        /* accept or request arrival to first byte out */
+    METRICS_CACHE_LOOKUP,      /* cache_find() */
+    METRICS_ORIGIN_CONNECT,    /* connect to a new end server connection */
+    METRICS_ORIGIN_FIRST_BYTE, /* request sent to first response byte in */
+    METRICS_RELAY,             /* request arrival to response delivered */
+    METRICS_HIST_CNT
+} metrics_hist;
+
+/* Slots owned by one thread, only ever written by it */
+typedef struct metrics_thread {
+    uint64_t counters[METRICS_COUNTER_CNT];
+    uint64_t buckets[METRICS_HIST_CNT][METRICS_BUCKET_CNT];
+    uint64_t sums[METRICS_HIST_CNT]; /* microseconds observed */
+    struct metrics_thread *next;     /* next thread's slots */
+} metrics_thread;
+
+/* Timestamps of the request a connection is serving */
+typedef struct {
+    uint64_t startUsec;   /* accept or request arrival, 0 before it */
+    uint64_t connectUsec; /* connect to the end server started, 0 if none */
+    uint64_t sentUsec;    /* request sent to the end server, 0 once answered */
+    bool firstByte;       /* client got a response byte */
+} metrics_request;
+
+/* Function prototyping */
+uint64_t metrics_now(void);
+void metrics_count(metrics_counter counter, uint64_t n);
+void metrics_observe(metrics_hist hist, uint64_t startUsec);
+void metrics_request_begin(metrics_request *req, uint64_t startUsec);
+void metrics_request_end(metrics_request *req);
+void metrics_client_bytes(metrics_request *req, size_t n);
+void metrics_origin_bytes(metrics_request *req, size_t n);
+char *metrics_render(size_t *len);
+
+#endif /* METRICS_H */
@@ -0,0 +1,246 @@
+/**
+ * @file pool.c
+ * @brief Pool of idle keep-alive end server connections
+ *
+ * Description: Once a response ended on its own framing, the end server
+ * connection is parked here under its host:port instead of being closed, and
+ * the next miss for the same end server takes it back instead of resolving
+ * and connecting again. At most maxPerHost connections are kept per host,
+ * the most recently returned one is reused first, and connections idle for
+ * idleSecs are closed by a sweep run at most once a second from pool_get()
+ * and pool_put(). A connection the end server closed while idle is detected
+ * with a non-blocking peek before it is handed out. One mutex lock protects
+ * the pool; sockets are only closed or peeked at after releasing it.
+ *
+ *
+ * @author Abhishek Basrithaya <abasrith@andrew.cmu.edu>
+ */
+#include "pool.h"
+#include "csapp.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* Pool shared by every front end thread */
+static Pool pool;
+
+/**
+ * @brief Initialises an empty pool, a limit of 0 leaves pooling disabled
+ *
+ *
+ * @param[in]   maxPerHost      Idle connections kept per host:port
+ * @param[in]   idleSecs        Seconds an idle connection is kept
+ *
+ * @return      void
+ */
+void pool_init(size_t maxPerHost, unsigned int idleSecs) {
+    memset(&pool, 0, sizeof(Pool));
+    pool.maxPerHost = maxPerHost;
+    pool.idleSecs = idleSecs;
+    if ((pthread_mutex_init(&pool.mutex, NULL)) != 0) {
+        fprintf(stderr, "Error: Initizing pool mutex");
+    }
+}
+
+/**
+ * @brief Tells whether end server connections are kept alive
+ *
+ *
+ * @return      bool            true when pool_init() enabled pooling
+ */
+bool pool_enabled(void) {
+    return pool.maxPerHost > 0;
+}
+
+/**
+ * @brief Hashes a host:port key to its bucket, FNV-1a
+ *
+ *
+ * @param[in]   *key            "host:port"
+ *
+ * @return      size_t          Bucket index
+ */
+static size_t pool_bucket(const char *key) {
+    uint32_t hash = 2166136261u;
+    while (*key != '\0') {
+        hash ^= (unsigned char)*key++;
+        hash *= 16777619u;
+    }
+    return hash % POOL_HASH_BUCKETS;
+}
+
+/**
+ * @brief Finds the entry of a host, creating it on request
+ *
+ *
+ * @param[in]   *key            "host:port"
+ * @param[in]   create          Create a missing entry
+ *
+ * @return      pool_host*      Entry, NULL when missing and not created
+ */
+static pool_host *pool_find_host(const char *key, bool create) {
+    size_t bucket = pool_bucket(key);
+    pool_host *host;
+    for (host = pool.buckets[bucket]; host != NULL; host = host->hashNext) {
+        if (strcmp(host->key, key) == 0) {
+            return host;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    host = Calloc(1, sizeof(pool_host));
+    host->key = Malloc(strlen(key) + 1);
+    strcpy(host->key, key);
+    host->hashNext = pool.buckets[bucket];
+    pool.buckets[bucket] = host;
+    return host;
+}
+
+/**
+ * @brief Moves every connection idle for too long onto a list to be closed,
+ * at most once a second
+ *
+ *
+ * @param[in]   now             Current time
+ * @param[out]  **expired       List receiving the expired connections
+ *
+ * @return      void
+ */
+static void pool_sweep(time_t now, pool_conn **expired) {
+    size_t i;
+    pool_host *host;
+    pool_conn **link, *conn;
+
+    if (now == pool.lastSweep) {
+        return;
+    }
+    pool.lastSweep = now;
+    for (i = 0; i < POOL_HASH_BUCKETS; i++) {
+        for (host = pool.buckets[i]; host != NULL; host = host->hashNext) {
+            link = &host->idle;
+            while ((conn = *link) != NULL) {
+                if (now - conn->idleSince < (time_t)pool.idleSecs) {
+                    link = &conn->next;
+                    continue;
+                }
+                *link = conn->next;
+                host->idleCnt--;
+                conn->next = *expired;
+                *expired = conn;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Closes and frees a list of connections taken out of the pool
+ *
+ *
+ * @param[in]   *conn           List head
+ *
+ * @return      void
+ */
+static void pool_close_list(pool_conn *conn) {
+    pool_conn *next;
+    while (conn != NULL) {
+        next = conn->next;
+        close(conn->fd);
+        Free(conn);
+        conn = next;
+    }
+}
+
+/**
+ * @brief Takes an idle connection to an end server out of the pool
+ *
+ *
+ * @param[in]   *hostname       End server host
+ * @param[in]   *port           End server port
+ *
+ * @return      int             Connected socket, -1 when none is pooled
+ */
+int pool_get(const char *hostname, const char *port) {
+    char key[MAXLINE];
+    pool_host *host;
+    pool_conn *conn, *expired;
+    time_t now;
+    char peek;
+    int fd;
+
+    if (!pool_enabled()) {
+        return -1;
+    }
+    snprintf(key, sizeof(key), "%s:%s", hostname, port);
+    while (1) {
+        expired = NULL;
+        conn = NULL;
+        now = time(NULL);
+        pthread_mutex_lock(&pool.mutex);
+        pool_sweep(now, &expired);
+        if ((host = pool_find_host(key, false)) != NULL &&
+            host->idle != NULL) {
+            conn = host->idle;
+            host->idle = conn->next;
+            host->idleCnt--;
+        }
+        pthread_mutex_unlock(&pool.mutex);
+        pool_close_list(expired);
+        if (conn == NULL) {
+            return -1;
+        }
+        fd = conn->fd;
+        Free(conn);
+        /* Idle connections must have nothing to read, not even EOF */
+        if (recv(fd, &peek, 1, MSG_PEEK | MSG_DONTWAIT) < 0 &&
+            (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return fd;
+        }
+        close(fd);
+    }
+}
+
+/**
+ * @brief Returns a connection whose last response is complete to the pool,
+ * closing it when the host already has enough idle connections
+ *
+ *
+ * @param[in]   *hostname       End server host
+ * @param[in]   *port           End server port
+ * @param[in]   fd              Connected socket with nothing left to read
+ *
+ * @return      void
+ */
+void pool_put(const char *hostname, const char *port, int fd) {
+    char key[MAXLINE];
+    pool_host *host;
+    pool_conn *conn, *expired = NULL;
+    time_t now = time(NULL);
+
+    if (!pool_enabled()) {
+        close(fd);
+        return;
+    }
+    snprintf(key, sizeof(key), "%s:%s", hostname, port);
+    conn = Malloc(sizeof(pool_conn));
+    conn->fd = fd;
+    conn->idleSince = now;
+    pthread_mutex_lock(&pool.mutex);
+    pool_sweep(now, &expired);
+    host = pool_find_host(key, true);
+    if (host->idleCnt < pool.maxPerHost) {
+        conn->next = host->idle;
+        host->idle = conn;
+        host->idleCnt++;
+        conn = NULL;
+    }
+    pthread_mutex_unlock(&pool.mutex);
+    pool_close_list(expired);
+    if (conn != NULL) {
+        close(conn->fd);
+        Free(conn);
+    }
+}
@@ -0,0 +1,51 @@
+/**
+ * @file pool.h
+ * @brief Header file for the pool of idle keep-alive end server connections
+ *
+ * Description: Idle connections are kept per host:port, bounded per host and
+ * closed once idle for too long, defines, structures and function prototypes.
+ *
+ *
+ * @author Abhishek Basrithaya <abasrith@andrew.cmu.edu>
+ */
+#ifndef POOL_H
+#define POOL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+/* Pool defines, the limits are overridable from the command line */
+#define POOL_HASH_BUCKETS 64
+#define DEFAULT_POOL_MAX_PER_HOST 8
+#define DEFAULT_POOL_IDLE_SECS 30
+
+typedef struct pool_conn {
+    int fd;                 /* idle end server socket */
+    time_t idleSince;       /* when the connection was returned */
+    struct pool_conn *next; /* next idle connection of the host, older */
+} pool_conn;
+
+typedef struct pool_host {
+    char *key;                   /* "host:port" */
+    size_t idleCnt;              /* connections on the idle list */
+    pool_conn *idle;             /* idle connections, most recent first */
+    struct pool_host *hashNext;  /* next host in the same bucket */
+} pool_host;
+
+typedef struct {
+    pool_host *buckets[POOL_HASH_BUCKETS]; /* hosts ever pooled */
+    size_t maxPerHost;                     /* idle connections kept per host */
+    unsigned int idleSecs;                 /* idle timeout in seconds */
+    time_t lastSweep;                      /* last sweep for idle timeouts */
+    pthread_mutex_t mutex;                 /* protects the pool */
+} Pool;
+
+/* Function prototyping */
+void pool_init(size_t maxPerHost, unsigned int idleSecs);
+bool pool_enabled(void);
+int pool_get(const char *hostname, const char *port);
+void pool_put(const char *hostname, const char *port, int fd);
+
+#endif /* POOL_H */
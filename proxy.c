@@ -5,15 +5,36 @@
  * locally cached
  *
  * Description: Implemented a web proxy application capable of handling
- * concurrent client requests through multi-threading and caching of web pages.
+ * concurrent client requests through a pre-spawned pool of worker threads fed
+ * by a bounded connection queue, and caching of web pages. With -e the pool is
+ * replaced by the epoll based front end in event.c.
  *
  *
  * @author Abhishek Basrithaya <abasrith@andrew.cmu.edu>
  */
 
+#include "admit.h"
 #include "cache.h"
+#include "coalesce.h"
 #include "csapp.h"
+#include "disk.h"
+#include "dns.h"
+#include "encoding.h"
+#include "event.h"
+#include "framing.h"
+#include "fresh.h"
 #include "http_parser.h"
+#include "lineio.h"
+#include "log.h"
+#include "metrics.h"
+#include "pool.h"
+#include "proxy.h"
+#include "range.h"
+#include "relay.h"
+#include "revalidate.h"
+#include "sbuf.h"
+#include "snapshot.h"
+#include "upstream.h"
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
@@ -28,6 +49,7 @@
 #include <string.h>
 #include <strings.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
 
@@ -42,9 +64,14 @@
 #define dbg_assert(...)
 #define dbg_printf(...)
 #endif
-/* General defines */
-#define DEFAULT_PORT_NUM 80
-#define CACHE_USED 1
+/* Worker pool defaults, overridable from the command line */
+#define DEFAULT_WORKER_THREADS 64
+#define DEFAULT_QUEUE_SIZE 256
+/* Seconds a persistent client may stay silent between requests */
+#define CLIENT_IDLE_SECS 5
+/* One shard keeps strict LRU over the whole cache */
+#define DEFAULT_CACHE_SHARDS 1
+#define DEFAULT_CACHE_POLICY "lru"
 
 /* Typedef for convenience */
 typedef struct sockaddr SA;
@@ -55,6 +82,7 @@ static const char *user_hdr =
     "Firefox/63.0.1\r\n";
 static const char *conn_hdr = "Connection: close\r\n";
 static const char *prox_hdr = "Proxy-Connection: close\r\n";
+static const char *keepalive_conn_hdr = "Connection: keep-alive\r\n";
 static const char *endof_hdr = "\r\n";
 
 static const char *host_hdr_format = "Host: %s\r\n";
@@ -64,22 +92,34 @@ static const char *connection_key = "Connection";
 static const char *user_agent_key = "User-Agent";
 static const char *proxy_connection_key = "Proxy-Connection";
 static const char *host_key = "Host";
+static const char *upstream_hop_key = UPSTREAM_HOP_HEADER;
+
+/* Status, reason and explanation of every client_error */
+static const char *clientErrorText[CLIENT_ERROR_CNT][3] = {
+    {"400", "Bad Request", "Proxy received a malformed request"},
+    {"400", "Bad Request", "Proxy received an oversized request"},
+    {"501", "Not Implemented", "Proxy does not implement this method"},
+    {"503", "Service Unavailable", "Proxy is handling too many connections"}};
+/* Complete responses built from clientErrorText at startup */
+static char *clientErrors[CLIENT_ERROR_CNT];
+static size_t clientErrorLens[CLIENT_ERROR_CNT];
 
 /* Function prototyping */
-void clientRequestHandler(int connfd);
-void create_server_http_request(char *server_http_request, char *hostname,
-                                char *path, int port, rio_t *client_rio);
+void clientRequestHandler(int connfd, uint64_t acceptedAt);
+static bool serveRequest(int connfd, rio_t *rio, metrics_request *req);
+#if CACHE_USED
+static bool serve_cached(int connfd, cache_block *reqCachePtr, bool keepAlive,
+                         bool acceptsGzip, const range_request *range,
+                         metrics_request *req);
+#endif
 void *threadHandler(void *vargp);
-void clienterror(int fd, const char *errnum, const char *shortmsg,
-                 const char *longmsg);
-void Pthread_create(pthread_t *tidp, pthread_attr_t *attrp,
-                    void *(*routine)(void *), void *argp);
-void Pthread_detach(pthread_t tid);
-void posix_error(int code, char *msg);
 
 #if CACHE_USED
 extern Cache cache;
 #endif
+/* Connections accepted by main() and waiting for a free worker */
+static sbuf_t connQueue;
+
 /**
  * @brief sigpipe signal handler
  *
@@ -93,6 +133,34 @@ void sigpipe_handler(int sig) {
     return;
 }
 
+/**
+ * @brief prints the command line usage and exits
+ *
+ *
+ * @param[in]   *prog               Program name
+ *
+ * @return      void
+ */
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage :%s [-w workers] [-q queue size] [-e event loops] "
+            "[-s cache shards] [-k idle origin connections per host] "
+            "[-i origin idle timeout] [-c coalesce concurrent misses] "
+            "[-p lru|slru|wtinylfu|gdsf|lfuda eviction policy] "
+            "[-m max cache bytes] [-o max object bytes] "
+            "[-a size-aware admission bytes] [-d disk tier directory] "
+            "[-D disk tier bytes] [-v 0|1|2 log verbosity] "
+            "[-r log client host names] "
+            "[-R SO_REUSEPORT listener and pinned cpu per event loop] "
+            "[-C max client connections] [-P max connections per client] "
+            "[-z store compressible responses gzip coded] "
+            "[-S cache snapshot file] [-I snapshot interval seconds] "
+            "[-U sibling host:port list] [-N own host:port in the list] "
+            "<port> \n",
+            prog);
+    exit(1);
+}
+
 /**
  * @brief main
  *
@@ -103,273 +171,1051 @@ void sigpipe_handler(int sig) {
  * @return      void
  */
 int main(int argc, char **argv) {
-    int listenfd, *connfd = NULL;
+    int listenfd, connfd, opt, i;
+    int numWorkers = DEFAULT_WORKER_THREADS;
+    int queueSize = DEFAULT_QUEUE_SIZE;
+    int numEventLoops = 0;
+    int numCacheShards = DEFAULT_CACHE_SHARDS;
+    int poolMaxPerHost = 0;
+    int poolIdleSecs = DEFAULT_POOL_IDLE_SECS;
+    bool coalesce = false;
+    const char *cachePolicy = DEFAULT_CACHE_POLICY;
+    long maxCacheSize = DEFAULT_MAX_CACHE_SIZE;
+    long maxObjectSize = DEFAULT_MAX_OBJECT_SIZE;
+    long admitSize = 0;
+    const char *diskDir = NULL;
+    long diskSize = DEFAULT_DISK_SIZE;
+    int logLevel = DEFAULT_LOG_LEVEL;
+    bool logResolve = false;
+    bool reusePort = false;
+    int maxConns = 0;
+    int maxPerClient = 0;
+    bool compress = false;
+    const char *snapshotPath = NULL;
+    int snapshotSecs = DEFAULT_SNAPSHOT_SECS;
+    const char *peerList = NULL;
+    const char *peerSelf = NULL;
+    int reserveFd;
     socklen_t clientlen;
-    char hostname[MAXLINE], port[MAXLINE];
     pthread_t tid;
     struct sockaddr_storage clientaddr;
+    sbuf_item item;
 
     /* assign signal handler for Broken pipe */
     Signal(SIGPIPE, sigpipe_handler);
 
-    if (argc != 2) {
-        fprintf(stderr, "usage :%s <port> \n", argv[0]);
-        exit(1);
+    while ((opt = getopt(argc, argv,
+                         "w:q:e:s:k:i:cp:m:o:a:d:D:v:rRC:P:zS:I:U:N:")) !=
+           -1) {
+        switch (opt) {
+        case 'w':
+            numWorkers = atoi(optarg);
+            break;
+        case 'q':
+            queueSize = atoi(optarg);
+            break;
+        case 'e':
+            numEventLoops = atoi(optarg);
+            break;
+        case 's':
+            numCacheShards = atoi(optarg);
+            break;
+        case 'k':
+            poolMaxPerHost = atoi(optarg);
+            break;
+        case 'i':
+            poolIdleSecs = atoi(optarg);
+            break;
+        case 'c':
+            coalesce = true;
+            break;
+        case 'p':
+            cachePolicy = optarg;
+            break;
+        case 'm':
+            maxCacheSize = atol(optarg);
+            break;
+        case 'o':
+            maxObjectSize = atol(optarg);
+            break;
+        case 'a':
+            admitSize = atol(optarg);
+            break;
+        case 'd':
+            diskDir = optarg;
+            break;
+        case 'D':
+            diskSize = atol(optarg);
+            break;
+        case 'v':
+            logLevel = atoi(optarg);
+            break;
+        case 'r':
+            logResolve = true;
+            break;
+        case 'R':
+            reusePort = true;
+            break;
+        case 'C':
+            maxConns = atoi(optarg);
+            break;
+        case 'P':
+            maxPerClient = atoi(optarg);
+            break;
+        case 'z':
+            compress = true;
+            break;
+        case 'S':
+            snapshotPath = optarg;
+            break;
+        case 'I':
+            snapshotSecs = atoi(optarg);
+            break;
+        case 'U':
+            peerList = optarg;
+            break;
+        case 'N':
+            peerSelf = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if ((argc - optind) != 1 || numWorkers <= 0 || queueSize <= 0 ||
+        numEventLoops < 0 || numCacheShards <= 0 || poolMaxPerHost < 0 ||
+        poolIdleSecs <= 0 || cache_policy_by_name(cachePolicy) == NULL ||
+        maxObjectSize <= 0 || maxCacheSize < maxObjectSize || admitSize < 0 ||
+        diskSize <= 0 || logLevel < LOG_LEVEL_OFF ||
+        logLevel > LOG_LEVEL_INFO || (reusePort && numEventLoops == 0) ||
+        maxConns < 0 || maxPerClient < 0 || snapshotSecs < 0 ||
+        (peerSelf != NULL && peerList == NULL)) {
+        usage(argv[0]);
     }
 
-    listenfd = open_listenfd(argv[1]);
+    /* Per loop listeners bind the port again, the first must allow it */
+    listenfd = reusePort ? event_open_listenfd(argv[optind])
+                         : open_listenfd(argv[optind]);
     if (listenfd < 0) {
-        fprintf(stderr, "Failed to listen on port: %s\n", argv[1]);
+        fprintf(stderr, "Failed to listen on port: %s\n", argv[optind]);
         exit(1);
     }
+    /* Error responses are only formatted once */
+    clienterror_init();
+    /* Log lines are written out by a thread of their own */
+    log_init(logLevel, logResolve);
+    /* Connections over the limits are left waiting or shed, never fatal */
+    admit_init((size_t)maxConns, (size_t)maxPerClient);
 #if CACHE_USED
     /* Initialise cache here */
-    cache_init();
+    cache_init((size_t)numCacheShards, cache_policy_by_name(cachePolicy),
+               (size_t)maxCacheSize, (size_t)maxObjectSize, (size_t)admitSize,
+               compress);
+    /* Evicted objects only move to disk when given a directory */
+    disk_init(diskDir, (size_t)diskSize);
+    /* The previous run's cache is restored and this one's saved when asked */
+    snapshot_init(snapshotPath, (unsigned int)snapshotSecs);
+    if (snapshotPath != NULL) {
+        /* SIGTERM saves a last snapshot before exiting */
+        Signal(SIGTERM, snapshot_sigterm);
+    }
+    /* Concurrent misses on one uri only share a fetch when asked for */
+    coalesce_init(coalesce);
+    /* Hits served stale are revalidated in the background */
+    revalidate_init();
 #endif
+    /* End server connections are only kept alive when asked for */
+    pool_init((size_t)poolMaxPerHost, (unsigned int)poolIdleSecs);
+    /* End server lookups are cached and refreshed in the background */
+    dns_init();
+    /* Misses are only routed through siblings when given a list of them */
+    upstream_init(peerList, peerSelf);
+
+    /* Event-driven front end replaces the worker pool entirely */
+    if (numEventLoops > 0) {
+        event_loop_run(listenfd, numEventLoops,
+                       reusePort ? argv[optind] : NULL);
+    }
 
+    /* Pre-spawn the worker pool fed by the bounded connection queue */
+    sbuf_init(&connQueue, (size_t)queueSize);
+    for (i = 0; i < numWorkers; i++) {
+        Pthread_create(&tid, NULL, threadHandler, NULL);
+    }
+
+    reserveFd = admit_reserve_fd();
     while (1) {
+        /* Connections over the limit wait in the listen backlog */
+        if (admit_full()) {
+            admit_pause();
+            continue;
+        }
         clientlen = sizeof(clientaddr);
-        connfd = malloc(sizeof(int));
-        if (connfd == NULL) {
-            fprintf(stderr, "Failed to malloc: %ls\n", connfd);
-            exit(1);
+        connfd =
+            admit_accept(listenfd, (SA *)&clientaddr, &clientlen, &reserveFd);
+        if (connfd < 0) {
+            admit_pause();
+            continue;
         }
-        *connfd = accept(listenfd, (SA *)&clientaddr, &clientlen);
-        if (*connfd < 0) {
-            fprintf(stderr, "Failed to accept request on port: %s\n", argv[1]);
-            exit(1);
+        item.connfd = connfd;
+        item.acceptedAt = metrics_now();
+        metrics_count(METRICS_ACCEPTED, 1);
+        log_accept((SA *)&clientaddr, clientlen);
+        if (!admit_client_begin((SA *)&clientaddr, &item.client)) {
+            admit_shed(connfd);
+            continue;
         }
-        /*print accepted message*/
-        getnameinfo((SA *)&clientaddr, clientlen, hostname, MAXLINE, port,
-                    MAXLINE, 0);
-        sio_printf("Accepted connection from (%s %s).\n", hostname, port);
 
-        /*handle the client transaction by spawning threads */
-        Pthread_create(&tid, NULL, threadHandler, (void *)connfd);
+        /*hand the client transaction to the worker pool, blocks when full */
+        sbuf_insert(&connQueue, item);
     }
     /* never reach this position */
     return 0;
 }
 /**
- * @brief thread handler
+ * @brief thread handler for a pool worker, services connections taken from
+ * the connection queue for the lifetime of the proxy
  *
  *
- * @param[in]   vargp                argument passed to thread handler
+ * @param[in]   vargp                argument passed to thread handler (unused)
  *
  * @return      void
  */
 void *threadHandler(void *vargp) {
-    int connfd = *((int *)vargp);
+    sbuf_item item;
     Pthread_detach(pthread_self());
-    free(vargp);
-    clientRequestHandler(connfd);
-    close(connfd);
+    while (1) {
+        item = sbuf_remove(&connQueue);
+        clientRequestHandler(item.connfd, item.acceptedAt);
+        close(item.connfd);
+        admit_client_end(&item.client);
+    }
     return NULL;
 }
 
 /**
- * @brief handle the client HTTP transaction by parsing requests, error
+ * @brief reads whatever the end server has sent so far, up to n bytes,
+ * straight into the caller's buffer
+ *
+ * The response ends where its framing says, even though the end server
+ * keeps the connection open.
+ *
+ *
+ * @param[in]   fd                  end server connection fd
+ * @param[out]  *usrbuf             destination buffer
+ * @param[in]   n                   room left in usrbuf
+ * @param[in]   *frame              framing parser of the response
+ *
+ * @return      ssize_t             bytes read, 0 at the end of the response,
+ * -1 on error
+ */
+static ssize_t read_origin(int fd, char *usrbuf, size_t n,
+                           http_framing *frame) {
+    ssize_t rc;
+    size_t used;
+
+    if (framing_done(frame)) {
+        return 0;
+    }
+    while ((rc = read(fd, usrbuf, n)) < 0 && errno == EINTR)
+        ;
+    if (rc == 0) {
+        framing_eof(frame);
+    } else if (rc > 0) {
+        used = framing_feed(frame, usrbuf, (size_t)rc);
+        if (used < (size_t)rc) {
+            /* Bytes past the response, the connection is out of step */
+            frame->reusable = false;
+            rc = (ssize_t)used;
+        }
+    }
+    return rc;
+}
+
+/**
+ * @brief connects to the end server and sends it the request, over an idle
+ * pooled connection when there is one
+ *
+ * A pooled connection the end server closed in the meantime only shows when
+ * the response fails to arrive, so the request is then resent once over a
+ * fresh connection. Reads on either give up after ORIGIN_READ_TIMEOUT_SECS
+ * of silence.
+ *
+ *
+ * @param[in]   *hostname           end server host
+ * @param[in]   *portStr            end server port
+ * @param[in]   *request            rewritten request
+ * @param[in,out] *req              timestamps of the request, gets the
+ * connect timed and the time the request was sent
+ *
+ * @return      int                 end server connection fd, -1 on error
+ */
+static int send_origin_request(const char *hostname, const char *portStr,
+                               const char *request, metrics_request *req) {
+    size_t len = strlen(request);
+    struct timeval timeout = {ORIGIN_READ_TIMEOUT_SECS, 0};
+    int serverfd;
+    ssize_t rc;
+    char peek;
+
+    if ((serverfd = pool_get(hostname, portStr)) >= 0) {
+        setsockopt(serverfd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                   sizeof(timeout));
+        if (rio_writen(serverfd, request, len) == (ssize_t)len) {
+            req->sentUsec = metrics_now();
+            while ((rc = recv(serverfd, &peek, 1, MSG_PEEK)) < 0 &&
+                   errno == EINTR)
+                ;
+            if (rc > 0) {
+                return serverfd;
+            }
+            if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                /* Alive but silent, sending it again would not help */
+                close(serverfd);
+                return -1;
+            }
+        }
+        close(serverfd);
+    }
+    req->connectUsec = metrics_now();
+    serverfd = dns_open_clientfd(hostname, portStr);
+    if (serverfd < 0) {
+        return -1;
+    }
+    /* A stalled end server must not hold the worker, or its waiters */
+    setsockopt(serverfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    metrics_observe(METRICS_ORIGIN_CONNECT, req->connectUsec);
+    rio_writen(serverfd, request, len);
+    req->sentUsec = metrics_now();
+    return serverfd;
+}
+
+/**
+ * @brief returns the end server connection to the pool when its response
+ * ended on its own framing, closes it otherwise
+ *
+ *
+ * @param[in]   serverfd            end server connection fd
+ * @param[in]   *hostname           end server host
+ * @param[in]   *portStr            end server port
+ * @param[in]   *frame              framing parser of the response
+ *
+ * @return      void
+ */
+static void release_origin(int serverfd, const char *hostname,
+                           const char *portStr, const http_framing *frame) {
+    if (framing_done(frame) && frame->reusable) {
+        pool_put(hostname, portStr, serverfd);
+    } else {
+        close(serverfd);
+    }
+}
+
+/**
+ * @brief writes response bytes to the client, counting them
+ *
+ *
+ * @param[in]   connfd              client side connection fd
+ * @param[in]   *buf                response bytes
+ * @param[in]   len                 number of bytes
+ * @param[in,out] *req              timestamps of the request
+ *
+ * @return      bool                false when the client went away
+ */
+static bool client_write(int connfd, const char *buf, size_t len,
+                         metrics_request *req) {
+    if (rio_writen(connfd, buf, len) < 0) {
+        return false;
+    }
+    metrics_client_bytes(req, len);
+    return true;
+}
+
+/**
+ * @brief writes a response to the client up to a given byte, its head with
+ * the end server's hop-by-hop headers replaced by the proxy's own Connection
+ * header. Nothing is written while the head is incomplete unless forced.
+ *
+ *
+ * @param[in]   connfd              client side connection fd
+ * @param[in]   *response           response bytes
+ * @param[in]   upto                bytes of response to have written
+ * @param[in]   force               write response as is when it holds no
+ * complete head
+ * @param[in]   keepAlive           client connection stays open afterwards
+ * @param[in,out] *sent             bytes of response already written
+ * @param[in,out] *req              timestamps of the request
+ *
+ * @return      bool                false when the client went away
+ */
+static bool client_write_response(int connfd, const char *response,
+                                  size_t upto, bool force, bool keepAlive,
+                                  size_t *sent, metrics_request *req) {
+    size_t headLen;
+    char *head;
+    bool clientOk = true;
+
+    if (*sent == 0 && (headLen = framing_head_len(response, upto)) > 0) {
+        head = Malloc(headLen + FRAMING_CONN_EXTRA);
+        clientOk = client_write(
+            connfd, head,
+            framing_client_head(response, headLen, head, keepAlive), req);
+        Free(head);
+        *sent = headLen;
+    } else if (*sent == 0 && !force) {
+        return true;
+    }
+    if (upto > *sent) {
+        clientOk = clientOk && client_write(connfd, response + *sent,
+                                            upto - *sent, req);
+        *sent = upto;
+    }
+    return clientOk;
+}
+
+/**
+ * @brief handle the client HTTP transactions of a connection, one request
+ * after the other for as long as the client and the responses keep it alive.
+ * Pipelined requests wait in the client's rio buffer and are answered in
+ * order.
+ *
+ *
+ * @param[in]   connfd                client side connection fd
+ * @param[in]   acceptedAt            metrics_now() at accept
+ *
+ * @return      void
+ */
+void clientRequestHandler(int connfd, uint64_t acceptedAt) {
+    /*rio is client's rio, the server is read unbuffered */
+    rio_t rio;
+    struct timeval idle = {CLIENT_IDLE_SECS, 0};
+    struct timeval stall = {CLIENT_WRITE_TIMEOUT_SECS, 0};
+    bool idleSet = false;
+    metrics_request req;
+
+    /* A client that stops reading must not hold on to the worker either */
+    setsockopt(connfd, SOL_SOCKET, SO_SNDTIMEO, &stall, sizeof(stall));
+    /* Initialise client I/O */
+    rio_readinitb(&rio, connfd);
+    metrics_request_begin(&req, acceptedAt);
+    while (serveRequest(connfd, &rio, &req)) {
+        /* Later requests are timed from their arrival */
+        metrics_request_end(&req);
+        metrics_request_begin(&req, 0);
+        /* An idle persistent client must not hold on to the worker */
+        if (!idleSet) {
+            setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+            idleSet = true;
+        }
+    }
+    metrics_request_end(&req);
+}
+
+#if CACHE_USED
+/**
+ * @brief writes a cached object to the client and drops the reference
+ * cache_find() took on it
+ *
+ * Whatever the socket takes right away is sent straight from the cache block.
+ * A client that cannot keep up gets the rest from a private copy, so the
+ * block is released at once instead of staying pinned while the client
+ * drains it, and the write timeout drops the client if it stops reading.
+ * A gzip coded hit is decoded first for a client that does not accept gzip,
+ * and a range request is answered with the ranges cut out of the hit. The
+ * head always goes out as a copy carrying the proxy's Connection header.
+ *
+ *
+ * @param[in]   connfd                client side connection fd
+ * @param[in]   *reqCachePtr          cache hit
+ * @param[in]   keepAlive             client asked for a persistent connection
+ * @param[in]   acceptsGzip           client accepts a gzip coded response
+ * @param[in]   *range                ranges the client asked for
+ * @param[in,out] *req                timestamps of the request
+ *
+ * @return      bool                  true when the connection may carry the
+ * client's next request
+ */
+static bool serve_cached(int connfd, cache_block *reqCachePtr, bool keepAlive,
+                         bool acceptsGzip, const range_request *range,
+                         metrics_request *req) {
+    size_t len = reqCachePtr->cache_obj_size, sent = 0, headLen;
+    char *rest;
+    ssize_t n;
+    bool clientOk = true;
+
+    if ((rest = range_respond_stored(range, reqCachePtr->cache_obj, len,
+                                     reqCachePtr->compressed, &len)) !=
+            NULL ||
+        (reqCachePtr->compressed && !acceptsGzip &&
+         (rest = encoding_decompress(reqCachePtr->cache_obj, len, &len)) !=
+             NULL)) {
+        cache_release(reqCachePtr);
+        keepAlive = keepAlive && framing_stored_keeps_alive(rest, len);
+        clientOk = client_write_response(connfd, rest, len, true, keepAlive,
+                                         &sent, req);
+        Free(rest);
+        return keepAlive && clientOk;
+    }
+    /* Critical section reference has to be incremented by this point */
+    keepAlive = keepAlive &&
+                framing_stored_keeps_alive(reqCachePtr->cache_obj, len);
+    clientOk = client_write_response(
+        connfd, reqCachePtr->cache_obj,
+        framing_head_len(reqCachePtr->cache_obj, len), false, keepAlive,
+        &sent, req);
+    headLen = sent;
+    while (clientOk && sent < len) {
+        n = send(connfd, reqCachePtr->cache_obj + sent, len - sent,
+                 MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n > 0) {
+            sent += (size_t)n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            clientOk = n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+            break;
+        }
+    }
+    metrics_client_bytes(req, sent - headLen);
+    if (!clientOk || sent == len) {
+        cache_release(reqCachePtr);
+        return keepAlive && clientOk;
+    }
+    rest = Malloc(len - sent);
+    memcpy(rest, reqCachePtr->cache_obj + sent, len - sent);
+    cache_release(reqCachePtr);
+    /* Critical section reference has to be decremented by this point */
+    clientOk = client_write(connfd, rest, len - sent, req);
+    Free(rest);
+    return keepAlive && clientOk;
+}
+#endif
+
+/**
+ * @brief handle one client HTTP transaction by parsing the request, error
  * handling, cache search and relay, sending new requests to end server and
  * caching the reponses into an LRU cache, after which the reponses are
  * forwarded to client.
  *
  *
  * @param[in]   connfd                client side connection fd
+ * @param[in]   *rio                  client's rio, positioned at a request
+ * @param[in,out] *req                timestamps of the request
  *
- * @return      void
+ * @return      bool                  true when the connection may carry the
+ * client's next request
  */
-void clientRequestHandler(int connfd) {
+static bool serveRequest(int connfd, rio_t *rio, metrics_request *req) {
     int serverfd; /*the server file descriptor*/
 
     char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-    char server_http_request[MAXLINE];
+    char server_http_request[SERVER_REQUEST_SIZE], client_hdrs[MAXBUF];
 
     /*store the request line arguments*/
     char hostname[MAXLINE], path[MAXLINE];
     int port = DEFAULT_PORT_NUM;
-    parser_state parseClientLineState;
-    parser_t *parseClientLine = parser_new();
-
-    /*rio is client's rio, server_rio is server's rio */
-    rio_t rio, server_rio;
-    /* Initialise client I/O */
-    rio_readinitb(&rio, connfd);
+    bool keepAlive, clientOk = true;
+    int hdrRc;
 
     /* Read client I/O */
-    if (rio_readlineb(&rio, buf, MAXLINE) <= 0) {
-        /* Freeing parcer variable */
-        parser_free(parseClientLine);
-        return;
+    if (lineio_readline(rio, buf, MAXLINE) <= 0) {
+        return false;
+    }
+    if (req->startUsec == 0) {
+        req->startUsec = metrics_now();
     }
+    metrics_count(METRICS_REQUESTS, 1);
     /*parse request line */
     if (sscanf(buf, "%s %s HTTP/1.%c", method, uri, version) != 3 ||
         (*version != '0' && *version != '1')) {
-        clienterror(connfd, "400", "Bad Request",
-                    "Proxy received a malformed request");
-        /* Freeing parcer variable */
-        parser_free(parseClientLine);
-        return;
+        clienterror(connfd, CLIENT_ERROR_MALFORMED);
+        return false;
     }
 
     /* Returning on non GET methods */
     if (strcmp(method, "GET") != 0) {
-        clienterror(connfd, "501", "Not Implemented",
-                    "Proxy does not implement this method");
-        /* Freeing parcer variable */
-        parser_free(parseClientLine);
-        return;
+        clienterror(connfd, CLIENT_ERROR_NOT_IMPLEMENTED);
+        return false;
+    }
+
+    /* The whole request head is consumed before answering */
+    if ((hdrRc = read_client_headers(rio, client_hdrs)) < 0) {
+        if (hdrRc == -2) {
+            clienterror(connfd, CLIENT_ERROR_OVERSIZED);
+        }
+        return false;
+    }
+    keepAlive = client_keepalive(*version == '1', client_hdrs);
+
+    /* Scrapes of the proxy's own metrics never reach an end server */
+    if (strcmp(uri, METRICS_URI) == 0) {
+        size_t metricsLen;
+        char *metrics = metrics_render(&metricsLen);
+        client_write(connfd, metrics, metricsLen, req);
+        Free(metrics);
+        return false;
     }
 
 #if CACHE_USED
     /*search for url in cache */
-    cache_block *reqCachePtr = NULL;
-    /*in cache then return the cache content*/
+    bool acceptsGzip = encoding_accepts_gzip(client_hdrs);
+    range_request range;
+    range_parse(client_hdrs, &range);
+    cache_block *reqCachePtr = NULL, *stale = NULL;
+    /*in cache and still fresh enough then return the cache content*/
     if ((reqCachePtr = cache_find(uri)) != NULL) {
-        /* Critical section reference has to be incremented by this point */
-        rio_writen(connfd, reqCachePtr->cache_obj, reqCachePtr->cache_obj_size);
-        lockMutex(&cache.rwMutex);
-        reqCachePtr->readReferenceCnt--;
-        unLockMutex(&cache.rwMutex);
-        /* Critical section reference has to be decremented by this point */
-        /* Freeing parcer variable */
-        parser_free(parseClientLine);
-        return;
+        if (revalidate_hit(reqCachePtr)) {
+            return serve_cached(connfd, reqCachePtr, keepAlive, acceptsGzip,
+                                &range, req);
+        }
+        stale = reqCachePtr;
+    }
+    /* Wait for a fetch of the same uri in flight, then try the cache again */
+    coalesce_flight *flight = NULL;
+    if (stale == NULL && coalesce_enabled() &&
+        (flight = coalesce_begin(uri, NULL)) == NULL &&
+        (reqCachePtr = cache_find(uri)) != NULL) {
+        if (revalidate_hit(reqCachePtr)) {
+            return serve_cached(connfd, reqCachePtr, keepAlive, acceptsGzip,
+                                &range, req);
+        }
+        stale = reqCachePtr;
     }
 #endif
 
     /*parse the uri to get hostname,file path ,port*/
-    if ((parseClientLineState = parser_parse_line(parseClientLine, buf)) ==
-        ERROR) {
-        sio_printf("Client request parse error\n");
+    if (parse_request_target(buf, hostname, path, &port) < 0) {
+#if CACHE_USED
+        coalesce_end(flight);
+        if (stale != NULL)
+            cache_release(stale);
+#endif
+        return false;
+    }
+
+    /*
+     * A miss a sibling owns is sent to it as a proxy request and not cached
+     * here, moving on along the ring while siblings cannot be reached
+     */
+    char portStr[MAXLINE];
+    sprintf(portStr, "%d", port);
+    const char *serverHost = hostname, *serverPort = portStr;
+    upstream_peer *peer;
+    serverfd = -1;
+    while ((peer = upstream_route(uri, client_hdrs, connfd)) != NULL) {
+        build_server_http_request(server_http_request, SERVER_REQUEST_SIZE,
+                                  hostname, uri, client_hdrs);
+        upstream_add_hop(server_http_request, SERVER_REQUEST_SIZE);
+        if ((serverfd = send_origin_request(peer->host, peer->port,
+                                            server_http_request, req)) >= 0) {
+            serverHost = peer->host;
+            serverPort = peer->port;
+            break;
+        }
+        upstream_failed(peer);
+    }
+#if CACHE_USED
+    if (peer != NULL && stale != NULL) {
+        cache_release(stale);
+        stale = NULL;
+    }
+#endif
+
+    if (peer == NULL) {
+        /*build the http header which will send to the end server*/
+        build_server_http_request(server_http_request, SERVER_REQUEST_SIZE,
+                                  hostname, path, client_hdrs);
+#if CACHE_USED
+        /* The whole object is fetched, ranges are cut out of it */
+        range_strip(server_http_request);
+        /* A stale hit is only sent again if it changed */
+        if (stale != NULL) {
+            fresh_add_validators(server_http_request, SERVER_REQUEST_SIZE,
+                                 stale->cache_obj, stale->cache_obj_size);
+        }
+#endif
+        /*connect to the end server and write the http header to it*/
+        serverfd =
+            send_origin_request(hostname, portStr, server_http_request, req);
+    }
+    if (serverfd < 0) {
+#if CACHE_USED
+        coalesce_end(flight);
+        if (stale != NULL)
+            cache_release(stale);
+#endif
+        log_printf(LOG_LEVEL_ERROR, "connection attempt to %s at %s failed\n",
+                   hostname, portStr);
+        return false;
+    }
+    /*
+     * Responses end where their framing says, and the client connection only
+     * stays open when it asked to and the body is self-delimiting
+     */
+    http_framing frame;
+    framing_init(&frame);
+
+    /*
+     * receive message from destination server and send to the client. While
+     * the response may still be cached it is read straight into a reserved
+     * cache buffer and sent from there, and the newest chunk is held back
+     * until the next one arrives, so the object is cached before the client
+     * receives its last byte. While revalidating a stale hit nothing is sent
+     * before the status shows whether the hit is still current, and for a
+     * range request nothing before the ranges can be cut out of the object.
+     * Nothing at all is sent before the head is complete, so that its
+     * hop-by-hop headers can be replaced by the proxy's own Connection header.
+     */
+    ssize_t n = 0;
+    size_t sent = 0;
+#if CACHE_USED
+    char *fillBuf = cache_fill_reserve();
+    size_t sizebuf = 0, stripped, maxObject = cache_max_object_size();
+    /* The sibling caches what it owns, here it is only relayed */
+    if (peer != NULL) {
+        maxObject = 0;
+    }
+    while (sizebuf < maxObject &&
+           (n = read_origin(serverfd, fillBuf + sizebuf, maxObject - sizebuf,
+                            &frame)) > 0) {
+        metrics_origin_bytes(req, (size_t)n);
+        /* Write to client FD the chunks before the one just received */
+        if (stale == NULL && range.specCnt == 0) {
+            clientOk = clientOk &&
+                       client_write_response(
+                           connfd, fillBuf, sizebuf, false,
+                           keepAlive && framing_delimited(&frame), &sent, req);
+        }
+        sizebuf += (size_t)n;
+    }
+    if (sizebuf < maxObject && n == 0 && stale != NULL &&
+        frame.status == 304) {
+        /*not modified, serve the refreshed stale hit*/
+        release_origin(serverfd, serverHost, serverPort, &frame);
+        cache_refresh(stale, fillBuf, sizebuf);
+        cache_fill_abandon(fillBuf);
+        return serve_cached(connfd, stale, keepAlive, acceptsGzip, &range,
+                            req);
+    }
+    if (stale != NULL) {
+        cache_release(stale);
+    }
+    if (sizebuf < maxObject && n == 0) {
+        /*
+         * store it without its hop-by-hop headers, then send the held back
+         * tail from the cached copy
+         */
+        release_origin(serverfd, serverHost, serverPort, &frame);
+        stripped = framing_strip_hop(fillBuf, sizebuf);
+        if (sent > 0) {
+            /* The head already went out */
+            sent -= sizebuf - stripped;
+        }
+        sizebuf = stripped;
+        reqCachePtr = cache_fill_publish(uri, fillBuf, sizebuf);
+        coalesce_end(flight);
+        if (range.specCnt > 0) {
+            return serve_cached(connfd, reqCachePtr, keepAlive, acceptsGzip,
+                                &range, req);
+        }
+        clientOk = clientOk &&
+                   client_write_response(
+                       connfd, reqCachePtr->cache_obj, sizebuf, true,
+                       keepAlive && framing_delimited(&frame), &sent, req);
+        cache_release(reqCachePtr);
+        return keepAlive && clientOk && framing_keeps_alive(&frame);
+    }
+    /* Too big to cache or failed, waiters fetch it themselves */
+    coalesce_end(flight);
+    /* Relay the rest without a copy */
+    clientOk = clientOk && client_write_response(
+                               connfd, fillBuf, sizebuf, true,
+                               keepAlive && framing_delimited(&frame), &sent,
+                               req);
+    cache_fill_abandon(fillBuf);
+    if (n < 0 || !clientOk) {
+        close(serverfd);
+        return false;
+    }
+#endif
+    /* A response not read for the cache has its head gathered here */
+    size_t got = 0;
+    while (sent == 0 && clientOk && got < MAXLINE &&
+           (n = read_origin(serverfd, buf + got, MAXLINE - got, &frame)) > 0) {
+        metrics_origin_bytes(req, (size_t)n);
+        got += (size_t)n;
+        clientOk = client_write_response(
+            connfd, buf, got, got == MAXLINE,
+            keepAlive && framing_delimited(&frame), &sent, req);
+    }
+    if (sent == 0 && clientOk) {
+        /* Ended before a head, pass on what came */
+        clientOk = client_write_response(connfd, buf, got, true, false, &sent,
+                                         req);
+    }
+    /*
+     * Splice the uncacheable rest through a pipe when its end is known without
+     * looking at it, copying otherwise or when splicing is unusable
+     */
+    ssize_t spliced = -1;
+    if (!clientOk) {
+        /* Nothing more to relay */
+    } else if (frame.state == FRAMING_UNTIL_CLOSE) {
+        spliced = relay_splice(serverfd, connfd, SIZE_MAX);
+    } else if (frame.state == FRAMING_LENGTH) {
+        if ((spliced = relay_splice(serverfd, connfd, frame.remaining)) >= 0) {
+            framing_skip(&frame, (size_t)spliced);
+        }
+    }
+    if (spliced >= 0) {
+        metrics_origin_bytes(req, (size_t)spliced);
+        metrics_client_bytes(req, (size_t)spliced);
+    } else {
+        while (clientOk &&
+               (n = read_origin(serverfd, buf, MAXLINE, &frame)) > 0) {
+            /* Write to client FD the response received from server */
+            metrics_origin_bytes(req, (size_t)n);
+            clientOk = client_write(connfd, buf, (size_t)n, req);
+        }
+    }
+    release_origin(serverfd, serverHost, serverPort, &frame);
+    return keepAlive && clientOk && framing_keeps_alive(&frame);
+}
+/**
+ * @brief parses the target of a client request line into the hostname, path
+ * and port of the end server
+ *
+ *
+ * @param[in]   *requestLine                        client request line
+ * @param[out]  *hostname                           hostname retrieved from uri
+ * @param[out]  *path                               path retrieved from uri
+ * @param[out]  *port                               server port retrieved from
+ * uri, DEFAULT_PORT_NUM when absent
+ *
+ * @return      int                                 0 on success, -1 on error
+ */
+int parse_request_target(const char *requestLine, char *hostname, char *path,
+                         int *port) {
+    parser_t *parseClientLine = parser_new();
+    const char *portVal, *pathVal, *hostnameVal;
+
+    if (parser_parse_line(parseClientLine, requestLine) == ERROR) {
+        log_printf(LOG_LEVEL_ERROR, "Client request parse error\n");
         /* Freeing parcer variable */
         parser_free(parseClientLine);
-        return;
+        return -1;
     }
-    const char *portVal, *pathVal, *hostnameVal;
     if (parser_retrieve(parseClientLine, PORT, &portVal) < 0) {
-        sio_printf("Value parsing for port failed\n");
+        log_printf(LOG_LEVEL_ERROR, "Value parsing for port failed\n");
         /* Freeing parcer variable */
         parser_free(parseClientLine);
-        return;
+        return -1;
     }
     if (parser_retrieve(parseClientLine, PATH, &pathVal) < 0) {
-        sio_printf("Value parsing for path failed\n");
+        log_printf(LOG_LEVEL_ERROR, "Value parsing for path failed\n");
         /* Freeing parcer variable */
         parser_free(parseClientLine);
-        return;
+        return -1;
     }
     if (parser_retrieve(parseClientLine, HOST, &hostnameVal) < 0) {
-        sio_printf("Value parsing for host failed\n");
+        log_printf(LOG_LEVEL_ERROR, "Value parsing for host failed\n");
         /* Freeing parcer variable */
         parser_free(parseClientLine);
-        return;
+        return -1;
     }
     if (portVal == NULL)
-        port = DEFAULT_PORT_NUM;
+        *port = DEFAULT_PORT_NUM;
     else
-        port = atoi(portVal);
+        *port = atoi(portVal);
 
     strcpy(hostname, hostnameVal);
     strcpy(path, pathVal);
 
     /* Freeing parcer variable */
     parser_free(parseClientLine);
+    return 0;
+}
 
-    /*build the http header which will send to the end server*/
-    create_server_http_request(server_http_request, hostname, path, port, &rio);
+/**
+ * @brief reads the client request headers up to the terminating empty line
+ *
+ *
+ * @param[in]   *client_rio                         client side file to read
+ * @param[out]  *client_hdrs                        client header lines, at
+ * most MAXBUF bytes, without the terminating empty line
+ *
+ * @return      int                                 0 on success, -1 when the
+ * client went away before the empty line, -2 when the headers did not fit
+ * MAXBUF bytes; they are still read up to the empty line
+ */
+int read_client_headers(rio_t *client_rio, char *client_hdrs) {
+    char buf[MAXLINE];
+    size_t hdrLen = 0, lineLen;
+    bool oversized = false;
 
-    /*connect to the end server*/
-    char portStr[MAXLINE];
-    sprintf(portStr, "%d", port);
-    serverfd = open_clientfd(hostname, portStr);
-    if (serverfd < 0) {
-        sio_printf("connection attempt to %s at %s failed\n", hostname,
-                   portStr);
-        return;
+    /*collect the client request headers up to the empty line*/
+    client_hdrs[0] = '\0';
+    while (lineio_readline(client_rio, buf, MAXLINE) > 0) {
+        /*EOF*/
+        if (strcmp(buf, endof_hdr) == 0 || strcmp(buf, "\n") == 0)
+            return oversized ? -2 : 0;
+        lineLen = strlen(buf);
+        if (hdrLen + lineLen < MAXBUF) {
+            memcpy(client_hdrs + hdrLen, buf, lineLen + 1);
+            hdrLen += lineLen;
+        } else {
+            oversized = true;
+        }
     }
-    /* Initialise server I/O */
-    rio_readinitb(&server_rio, serverfd);
-    /*write the http header to destination server */
-    rio_writen(serverfd, server_http_request, strlen(server_http_request));
+    return -1;
+}
 
-    /* receive message from destination server and send to the client */
-    size_t n;
-#if CACHE_USED
-    size_t sizebuf = 0;
-    char ResponseObjectbuf[MAX_OBJECT_SIZE];
-#endif
-    while ((n = rio_readnb(&server_rio, buf, MAXLINE)) != 0) {
-/* Cache copy here */
-#if CACHE_USED
-        if (sizebuf < MAX_OBJECT_SIZE) {
-            memcpy(ResponseObjectbuf + sizebuf, buf, n);
+/**
+ * @brief tells whether the client asked to keep its connection open, through
+ * its HTTP version, Connection and Proxy-Connection headers
+ *
+ *
+ * @param[in]   http11                              client speaks HTTP/1.1
+ * @param[in]   *client_hdrs                        client header lines
+ *
+ * @return      bool                                true for a persistent
+ * client connection
+ */
+bool client_keepalive(bool http11, const char *client_hdrs) {
+    char buf[MAXLINE];
+    const char *linePtr = client_hdrs, *lineEnd, *value;
+    size_t lineLen;
+    bool connClose = false, connKeepAlive = false;
+
+    while (*linePtr != '\0') {
+        lineEnd = strchr(linePtr, '\n');
+        lineLen = (lineEnd != NULL) ? (size_t)(lineEnd - linePtr) + 1
+                                    : strlen(linePtr);
+        if (lineLen < MAXLINE) {
+            memcpy(buf, linePtr, lineLen);
+            buf[lineLen] = '\0';
+            if ((value = framing_header_value(buf, connection_key)) != NULL ||
+                (value = framing_header_value(buf, proxy_connection_key)) !=
+                    NULL) {
+                connClose |= framing_header_has_token(value, "close");
+                connKeepAlive |= framing_header_has_token(value, "keep-alive");
+            }
         }
-        sizebuf += n;
-#endif
-        /* Write to client FD the response received from server */
-        rio_writen(connfd, buf, n);
+        linePtr += lineLen;
     }
-    close(serverfd);
-#if CACHE_USED
-    /*store it*/
-    if ((sizebuf < MAX_OBJECT_SIZE) &&
-        ((reqCachePtr = cache_find(uri)) == NULL)) {
-        /* copy uri */
-        lockMutex();
-        char *cache_url = Malloc(sizeof(uri) / sizeof(uri[0]));
-        memcpy(cache_url, uri, sizeof(uri) / sizeof(uri[0]));
-        unLockMutex();
-        cache_uri(cache_url, ResponseObjectbuf, sizebuf);
+    return http11 ? !connClose : connKeepAlive;
+}
+
+/**
+ * @brief tells whether a header line carries a given field name, compared
+ * case-insensitively as HTTP field names are
+ *
+ *
+ * @param[in]   *line                               header line
+ * @param[in]   lineLen                             bytes of the line
+ * @param[in]   *key                                field name
+ *
+ * @return      bool                                true on a match
+ */
+static bool header_named(const char *line, size_t lineLen, const char *key) {
+    size_t keyLen = strlen(key);
+    return lineLen > keyLen && line[keyLen] == ':' &&
+           strncasecmp(line, key, keyLen) == 0;
+}
+
+/**
+ * @brief appends bytes to a request being built, if they fit
+ *
+ *
+ * @param[in,out] *request                          request being built
+ * @param[in]   size                                room in request
+ * @param[in,out] *len                              bytes already held
+ * @param[in]   *src                                bytes to append
+ * @param[in]   srcLen                              number of bytes
+ *
+ * @return      bool                                false when they do not fit
+ */
+static bool request_append(char *request, size_t size, size_t *len,
+                           const char *src, size_t srcLen) {
+    if (*len + srcLen >= size) {
+        return false;
     }
-#endif
+    memcpy(request + *len, src, srcLen);
+    *len += srcLen;
+    return true;
 }
+
 /**
- * @brief creating server http request
+ * @brief rewrites a block of client request headers into the request sent to
+ * the end server
  *
+ * The proxy's own request line, connection and User-Agent headers go first,
+ * then the client headers are copied over in a single pass in their original
+ * order, dropping the ones the proxy replaces by field name. A default Host
+ * header follows when the client sent none. Client lines that would not
+ * leave room for it are dropped.
  *
- * @param[in]   *server_http_request                final server request string
- * @param[in]   *hostname                           hostname to be retireved
- * from uri
- * @param[in]   *path                               path to be retireved from
- * uri
- * @param[in]   *client_rio                         client side file to read and
- * write contents
- * @param[in]   port                                server port to communicate
- * with
  *
- * @return      void
+ * @param[out]  *server_http_request                final server request string
+ * @param[in]   size                                room in server_http_request,
+ * SERVER_REQUEST_SIZE always holds every client header
+ * @param[in]   *hostname                           hostname retrieved from uri
+ * @param[in]   *path                               path retrieved from uri
+ * @param[in]   *client_hdrs                        client header lines, each
+ * terminated by a newline, without the terminating empty line
+ *
+ * @return      size_t                              length of the request
  */
+size_t build_server_http_request(char *server_http_request, size_t size,
+                                 const char *hostname, const char *path,
+                                 const char *client_hdrs) {
+    const char *linePtr = client_hdrs, *lineEnd;
+    /* Room kept for a default Host header and the empty line */
+    size_t room = size - strlen(host_hdr_format) - strlen(hostname);
+    size_t len, lineLen;
+    bool hasHost = false;
 
-void create_server_http_request(char *server_http_request, char *hostname,
-                                char *path, int port, rio_t *client_rio) {
-    char buf[MAXLINE], request_hdr[MAXLINE], other_hdr[MAXLINE],
-        host_hdr[MAXLINE];
-    /*request line*/
-    sprintf(request_hdr, requestlint_hdr_format, path);
-    /*get other request header for client rio and change it */
-    while (rio_readlineb(client_rio, buf, MAXLINE) > 0) {
-        /*EOF*/
-        if (strcmp(buf, endof_hdr) == 0)
-            break;
-        /*Host*/
-        if (strstr(buf, host_key) != NULL) {
-            strcpy(host_hdr, buf);
-            continue;
-        }
-        if (!strstr(buf, connection_key) &&
-            !strstr(buf, proxy_connection_key) &&
-            !strstr(buf, user_agent_key) && !strstr(buf, host_key)) {
-            strcat(other_hdr, buf);
+    /*request line and the headers the proxy sets itself*/
+    len = (size_t)snprintf(server_http_request, size, requestlint_hdr_format,
+                           path);
+    if (pool_enabled()) {
+        /*
+         * HTTP/1.0 keep-alive, so HTTP/1.1 end servers still delimit bodies
+         * with Content-Length rather than a chunked coding HTTP/1.0 clients
+         * cannot read
+         */
+        request_append(server_http_request, room, &len, keepalive_conn_hdr,
+                       strlen(keepalive_conn_hdr));
+    } else {
+        request_append(server_http_request, room, &len, conn_hdr,
+                       strlen(conn_hdr));
+        request_append(server_http_request, room, &len, prox_hdr,
+                       strlen(prox_hdr));
+    }
+    request_append(server_http_request, room, &len, user_hdr,
+                   strlen(user_hdr));
+    /*copy the other client headers over, the client's Host included*/
+    while (*linePtr != '\0') {
+        lineEnd = strchr(linePtr, '\n');
+        lineLen = (lineEnd != NULL) ? (size_t)(lineEnd - linePtr) + 1
+                                    : strlen(linePtr);
+        if (header_named(linePtr, lineLen, host_key)) {
+            hasHost = hasHost || request_append(server_http_request, room,
+                                                &len, linePtr, lineLen);
+        } else if (!header_named(linePtr, lineLen, connection_key) &&
+                   !header_named(linePtr, lineLen, proxy_connection_key) &&
+                   !header_named(linePtr, lineLen, user_agent_key) &&
+                   !header_named(linePtr, lineLen, upstream_hop_key)) {
+            request_append(server_http_request, room, &len, linePtr, lineLen);
         }
+        linePtr += lineLen;
     }
 
-    if (strlen(host_hdr) == 0) {
-        sprintf(host_hdr, host_hdr_format, hostname);
+    if (!hasHost) {
+        len += (size_t)sprintf(server_http_request + len, host_hdr_format,
+                               hostname);
     }
-
-    sprintf(server_http_request, "%s%s%s%s%s%s%s", request_hdr, host_hdr,
-            conn_hdr, prox_hdr, user_hdr, other_hdr, endof_hdr);
-    return;
+    strcpy(server_http_request + len, endof_hdr);
+    return len + strlen(endof_hdr);
 }
 
 /**************************
@@ -427,19 +1273,20 @@ void Pthread_detach(pthread_t tid) {
 }
 
 /**
- * @brief returns an error message to the client
+ * @brief formats a complete HTTP error response, headers followed by the
+ * body, into a caller supplied buffer
  *
  *
- * @param[in]   fd              Client file descriptor write the error message
+ * @param[out]  *buf            Buffer receiving the response
+ * @param[in]   bufSize         Size of the buffer
  * @param[in]   errnum          HTTP response ststus codes(error)
  * @param[in]   *shortmsg       Short message on error
  * @param[in]   *longmsg        long message on error
  *
- * @return      void
+ * @return      size_t          Length of the response, 0 on overflow
  */
-void clienterror(int fd, const char *errnum, const char *shortmsg,
-                 const char *longmsg) {
-    char buf[MAXLINE];
+size_t build_clienterror(char *buf, size_t bufSize, const char *errnum,
+                         const char *shortmsg, const char *longmsg) {
     char body[MAXBUF];
     size_t buflen;
     size_t bodylen;
@@ -456,28 +1303,70 @@ void clienterror(int fd, const char *errnum, const char *shortmsg,
                        "</body></html>\r\n",
                        errnum, shortmsg, longmsg);
     if (bodylen >= MAXBUF) {
-        return; // Overflow!
+        return 0; // Overflow!
     }
 
-    /* Build the HTTP response headers */
-    buflen = snprintf(buf, MAXLINE,
+    /* Build the HTTP response headers followed by the body */
+    buflen = snprintf(buf, bufSize,
                       "HTTP/1.0 %s %s\r\n"
                       "Content-Type: text/html\r\n"
-                      "Content-Length: %zu\r\n\r\n",
-                      errnum, shortmsg, bodylen);
-    if (buflen >= MAXLINE) {
-        return; // Overflow!
+                      "Content-Length: %zu\r\n\r\n"
+                      "%s",
+                      errnum, shortmsg, bodylen, body);
+    if (buflen >= bufSize) {
+        return 0; // Overflow!
     }
+    return buflen;
+}
 
-    /* Write the headers */
-    if (rio_writen(fd, buf, buflen) < 0) {
-        fprintf(stderr, "Error writing error response headers to client\n");
-        return;
+/**
+ * @brief builds every client_error response once, before any is sent
+ *
+ *
+ * @return      void
+ */
+void clienterror_init(void) {
+    char buf[MAXLINE + MAXBUF];
+    size_t len;
+    int err;
+
+    for (err = 0; err < CLIENT_ERROR_CNT; err++) {
+        len = build_clienterror(buf, sizeof(buf), clientErrorText[err][0],
+                                clientErrorText[err][1],
+                                clientErrorText[err][2]);
+        clientErrors[err] = Malloc(len);
+        memcpy(clientErrors[err], buf, len);
+        clientErrorLens[err] = len;
     }
+}
+
+/**
+ * @brief returns a prebuilt error response
+ *
+ *
+ * @param[in]   err             Error to answer
+ * @param[out]  *len            Length of the response
+ *
+ * @return      const char*     Headers and body of the response
+ */
+const char *clienterror_response(client_error err, size_t *len) {
+    *len = clientErrorLens[err];
+    return clientErrors[err];
+}
 
-    /* Write the body */
-    if (rio_writen(fd, body, bodylen) < 0) {
-        fprintf(stderr, "Error writing error response body to client\n");
+/**
+ * @brief returns an error message to the client
+ *
+ *
+ * @param[in]   fd              Client file descriptor write the error message
+ * @param[in]   err             Error to answer
+ *
+ * @return      void
+ */
+void clienterror(int fd, client_error err) {
+    /* Headers and body go out in a single write */
+    if (rio_writen(fd, clientErrors[err], clientErrorLens[err]) < 0) {
+        log_printf(LOG_LEVEL_ERROR, "Error writing error response to client\n");
         return;
     }
 }
@@ -0,0 +1,59 @@
+/**
+ * @file proxy.h
+ * @brief Header file for the request handling helpers shared by the threaded
+ * and the event-driven front ends of the proxy
+ *
+ * Description: Request line parsing, server request construction and client
+ * error formatting live in proxy.c and are reused by event.c, so both front
+ * ends rewrite requests and report errors identically.
+ *
+ *
+ * @author Abhishek Basrithaya <abasrith@andrew.cmu.edu>
+ */
+#ifndef PROXY_H
+#define PROXY_H
+
+#include "csapp.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/* General defines */
+#define DEFAULT_PORT_NUM 80
+#define CACHE_USED 1
+/* A client that takes no response bytes for this long is dropped */
+#define CLIENT_WRITE_TIMEOUT_SECS 10
+/* An end server that sends nothing for this long is given up on */
+#define ORIGIN_READ_TIMEOUT_SECS 30
+/* Room for a rewritten request carrying every header a client may send */
+#define SERVER_REQUEST_SIZE (MAXBUF + 2 * MAXLINE)
+
+/* Error responses of the proxy, prebuilt by clienterror_init() */
+typedef enum {
+    CLIENT_ERROR_MALFORMED,       /* 400, unparsable request line */
+    CLIENT_ERROR_OVERSIZED,       /* 400, request head too big */
+    CLIENT_ERROR_NOT_IMPLEMENTED, /* 501, method other than GET */
+    CLIENT_ERROR_UNAVAILABLE,     /* 503, over a connection limit */
+    CLIENT_ERROR_CNT
+} client_error;
+
+/* Function prototyping */
+int parse_request_target(const char *requestLine, char *hostname, char *path,
+                         int *port);
+int read_client_headers(rio_t *client_rio, char *client_hdrs);
+bool client_keepalive(bool http11, const char *client_hdrs);
+size_t build_server_http_request(char *server_http_request, size_t size,
+                                 const char *hostname, const char *path,
+                                 const char *client_hdrs);
+size_t build_clienterror(char *buf, size_t bufSize, const char *errnum,
+                         const char *shortmsg, const char *longmsg);
+void clienterror_init(void);
+const char *clienterror_response(client_error err, size_t *len);
+void clienterror(int fd, client_error err);
+void Pthread_create(pthread_t *tidp, pthread_attr_t *attrp,
+                    void *(*routine)(void *), void *argp);
+void Pthread_detach(pthread_t tid);
+void posix_error(int code, char *msg);
+
+#endif /* PROXY_H */
@@ -0,0 +1,442 @@
+/**
+ * @file range.c
+ * @brief Byte range responses built from cached objects
+ *
+ * Description: The cache only holds complete objects, so the Range and
+ * If-Range headers of a client are stripped from the request sent to the end
+ * server and the ranges are cut out of the complete response instead, on a
+ * miss once the response arrived and on every later hit. A complete
+ * identity framed 200 is answered with a 206 carrying one range, or a
+ * multipart/byteranges body for several, and with a 416 when no range
+ * overlaps the body. Anything else, an If-Range that does not match the
+ * stored ETag or Last-Modified, or overlapping ranges asking for more bytes
+ * than the body holds, is served whole as a 200, which a client has to
+ * accept in answer to a range request.
+ *
+ *
+ * @author Abhishek Basrithaya <abasrith@andrew.cmu.edu>
+ */
+#include "range.h"
+#include "csapp.h"
+#include "encoding.h"
+#include "framing.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/**
+ * @brief Copies the next line of a response head, CRLF stripped and truncated
+ * to RANGE_LINE_SIZE
+ *
+ *
+ * @param[in]   *pos            Start of the line
+ * @param[in]   *end            End of the response
+ * @param[out]  *line           Line copy
+ *
+ * @return      const char*     Start of the following line, NULL when the
+ * response ended without a line feed
+ */
+static const char *range_next_line(const char *pos, const char *end,
+                                   char *line) {
+    const char *lf = memchr(pos, '\n', (size_t)(end - pos));
+    size_t len;
+
+    if (lf == NULL) {
+        return NULL;
+    }
+    len = (size_t)(lf - pos);
+    if (len > 0 && pos[len - 1] == '\r') {
+        len--;
+    }
+    if (len > RANGE_LINE_SIZE - 1) {
+        len = RANGE_LINE_SIZE - 1;
+    }
+    memcpy(line, pos, len);
+    line[len] = '\0';
+    return lf + 1;
+}
+
+/**
+ * @brief Finds where the body of a response starts
+ *
+ *
+ * @param[in]   *response       Response headers and body
+ * @param[in]   len             Bytes held in response
+ *
+ * @return      size_t          Length of the head including the empty line
+ * ending it, 0 when the head is incomplete
+ */
+static size_t range_head_len(const char *response, size_t len) {
+    char line[RANGE_LINE_SIZE];
+    const char *pos = response, *end = response + len;
+
+    while ((pos = range_next_line(pos, end, line)) != NULL) {
+        if (line[0] == '\0' && pos - response > 2) {
+            return (size_t)(pos - response);
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Parses the value of a Range header into its specs
+ *
+ *
+ * @param[in]   *value          Range value, up to the end of the line
+ * @param[out]  *range          Receives the specs
+ *
+ * @return      bool            false when the value is not a valid byte range
+ * set or holds more than RANGE_MAX_PARTS specs
+ */
+static bool range_parse_specs(const char *value, range_request *range) {
+    range_spec *spec;
+    char *end;
+
+    if (strncasecmp(value, "bytes", 5) != 0) {
+        return false;
+    }
+    value += 5;
+    while (*value == ' ' || *value == '\t') {
+        value++;
+    }
+    if (*value++ != '=') {
+        return false;
+    }
+    while (1) {
+        /* Empty list elements are allowed */
+        while (*value == ' ' || *value == '\t' || *value == ',') {
+            value++;
+        }
+        if (*value == '\0' || *value == '\r' || *value == '\n') {
+            break;
+        }
+        if (range->specCnt == RANGE_MAX_PARTS) {
+            return false;
+        }
+        spec = &range->specs[range->specCnt];
+        if (*value == '-') {
+            /* Suffix: the last bytes of the body */
+            if (!isdigit((unsigned char)value[1])) {
+                return false;
+            }
+            spec->first = -1;
+            spec->last = strtol(value + 1, &end, 10);
+        } else {
+            if (!isdigit((unsigned char)*value)) {
+                return false;
+            }
+            spec->first = strtol(value, &end, 10);
+            if (*end++ != '-') {
+                return false;
+            }
+            spec->last = -1;
+            if (isdigit((unsigned char)*end)) {
+                spec->last = strtol(end, &end, 10);
+                if (spec->last < spec->first) {
+                    return false;
+                }
+            }
+        }
+        value = end;
+        while (*value == ' ' || *value == '\t') {
+            value++;
+        }
+        if (*value != ',' && *value != '\0' && *value != '\r' &&
+            *value != '\n') {
+            return false;
+        }
+        range->specCnt++;
+    }
+    return range->specCnt > 0;
+}
+
+/**
+ * @brief Reads the Range and If-Range headers of a client request. A Range
+ * that is not a valid byte range set is ignored, as if absent.
+ *
+ *
+ * @param[in]   *client_hdrs    Client header lines
+ * @param[out]  *range          Ranges asked for, specCnt 0 for none
+ *
+ * @return      void
+ */
+void range_parse(const char *client_hdrs, range_request *range) {
+    const char *line = client_hdrs, *value;
+    size_t len;
+
+    range->specCnt = 0;
+    range->hasIfRange = false;
+    range->ifRange[0] = '\0';
+    while (line != NULL && *line != '\0') {
+        if ((value = framing_header_value(line, "Range")) != NULL) {
+            /* The last Range counts, an invalid one is ignored */
+            range->specCnt = 0;
+            if (!range_parse_specs(value, range)) {
+                range->specCnt = 0;
+            }
+        } else if ((value = framing_header_value(line, "If-Range")) != NULL) {
+            range->hasIfRange = true;
+            len = strcspn(value, "\r\n");
+            while (len > 0 &&
+                   (value[len - 1] == ' ' || value[len - 1] == '\t')) {
+                len--;
+            }
+            if (len < RANGE_VALIDATOR_SIZE) {
+                memcpy(range->ifRange, value, len);
+                range->ifRange[len] = '\0';
+            }
+        }
+        if ((line = strchr(line, '\n')) != NULL) {
+            line++;
+        }
+    }
+}
+
+/**
+ * @brief Removes the Range and If-Range headers from a request head, so the
+ * end server sends the complete object
+ *
+ *
+ * @param[in,out] *request      NUL terminated request head
+ *
+ * @return      size_t          New length of the request
+ */
+size_t range_strip(char *request) {
+    char *line = request, *next;
+
+    while (*line != '\0') {
+        next = strchr(line, '\n');
+        next = (next != NULL) ? next + 1 : line + strlen(line);
+        if (framing_header_value(line, "Range") != NULL ||
+            framing_header_value(line, "If-Range") != NULL) {
+            memmove(line, next, strlen(next) + 1);
+        } else {
+            line = next;
+        }
+    }
+    return (size_t)(line - request);
+}
+
+/**
+ * @brief Copies the headers of a response, leaving out its status line, its
+ * Content-Length, its Content-Type when asked to and the empty line ending
+ * the head
+ *
+ *
+ * @param[in]   *response       Response whose head is complete
+ * @param[in]   headLen         Length from range_head_len()
+ * @param[in]   dropType        Leave out Content-Type as well
+ * @param[out]  *out            Destination
+ * @param[in]   size            Room in out
+ *
+ * @return      size_t          Bytes copied, 0 when out is too small
+ */
+static size_t range_copy_head(const char *response, size_t headLen,
+                              bool dropType, char *out, size_t size) {
+    char line[RANGE_LINE_SIZE];
+    const char *end = response + headLen, *pos, *next;
+    size_t copied = 0;
+
+    pos = range_next_line(response, end, line);
+    while ((next = range_next_line(pos, end, line)) != NULL &&
+           line[0] != '\0') {
+        if (framing_header_value(line, "Content-Length") == NULL &&
+            (!dropType || framing_header_value(line, "Content-Type") == NULL)) {
+            if (copied + (size_t)(next - pos) > size) {
+                return 0;
+            }
+            memcpy(out + copied, pos, (size_t)(next - pos));
+            copied += (size_t)(next - pos);
+        }
+        pos = next;
+    }
+    return copied;
+}
+
+/**
+ * @brief Formats the head of one part of a multipart/byteranges body
+ *
+ *
+ * @param[out]  *out            Destination, NULL to only measure
+ * @param[in]   size            Room in out
+ * @param[in]   *type           Content-Type of the object, empty for none
+ * @param[in]   first           First byte of the part
+ * @param[in]   last            Last byte of the part
+ * @param[in]   bodyLen         Length of the whole body
+ *
+ * @return      size_t          Length of the part head
+ */
+static size_t range_part_head(char *out, size_t size, const char *type,
+                              size_t first, size_t last, size_t bodyLen) {
+    return (size_t)snprintf(out, size,
+                            "\r\n--" RANGE_BOUNDARY "\r\n%s%s%s"
+                            "Content-Range: bytes %zu-%zu/%zu\r\n\r\n",
+                            *type != '\0' ? "Content-Type: " : "", type,
+                            *type != '\0' ? "\r\n" : "", first, last, bodyLen);
+}
+
+/**
+ * @brief Builds the response to a range request from a complete cached
+ * response
+ *
+ *
+ * @param[in]   *range          Ranges from range_parse()
+ * @param[in]   *response       Complete response headers and body
+ * @param[in]   len             Bytes held in response
+ * @param[out]  *outLen         Length of the built response
+ *
+ * @return      char*           Malloc'd 206 or 416 response, NULL when the
+ * complete response should be served instead
+ */
+char *range_respond(const range_request *range, const char *response,
+                    size_t len, size_t *outLen) {
+    char line[RANGE_LINE_SIZE], type[RANGE_LINE_SIZE];
+    const char *pos = response, *end = response + len, *value, *body;
+    size_t headLen = range_head_len(response, len), bodyLen, total = 0;
+    size_t first[RANGE_MAX_PARTS], last[RANGE_MAX_PARTS], cnt = 0, i;
+    size_t size, n, multiLen;
+    bool validatorMatch = !range->hasIfRange;
+    long contentLength = -1;
+    const range_spec *spec;
+    char *out;
+    int status;
+
+    if (range->specCnt == 0 || headLen == 0 ||
+        (pos = range_next_line(pos, end, line)) == NULL ||
+        sscanf(line, "HTTP/1.%*c %d", &status) != 1 || status != 200) {
+        return NULL;
+    }
+    type[0] = '\0';
+    while ((pos = range_next_line(pos, end, line)) != NULL &&
+           line[0] != '\0') {
+        if ((value = framing_header_value(line, "Content-Type")) != NULL) {
+            strcpy(type, value);
+        } else if ((value = framing_header_value(line, "Content-Length")) !=
+                   NULL) {
+            contentLength = strtol(value, NULL, 10);
+        } else if ((value = framing_header_value(line, "ETag")) != NULL) {
+            /* Only a strong validator may match */
+            validatorMatch |= range->ifRange[0] != '\0' &&
+                              strncmp(value, "W/", 2) != 0 &&
+                              strcmp(value, range->ifRange) == 0;
+        } else if ((value = framing_header_value(line, "Last-Modified")) !=
+                   NULL) {
+            validatorMatch |= range->ifRange[0] != '\0' &&
+                              strcmp(value, range->ifRange) == 0;
+        } else if (framing_header_value(line, "Transfer-Encoding") != NULL ||
+                   framing_header_value(line, "Content-Range") != NULL) {
+            return NULL;
+        }
+    }
+    bodyLen = len - headLen;
+    body = response + headLen;
+    if (!validatorMatch ||
+        (contentLength >= 0 && (size_t)contentLength != bodyLen)) {
+        return NULL;
+    }
+
+    /* Resolve the specs against the body, dropping unsatisfiable ones */
+    for (i = 0; i < range->specCnt; i++) {
+        spec = &range->specs[i];
+        if (spec->first < 0) {
+            if (spec->last == 0 || bodyLen == 0) {
+                continue;
+            }
+            first[cnt] = ((size_t)spec->last >= bodyLen)
+                             ? 0
+                             : bodyLen - (size_t)spec->last;
+            last[cnt] = bodyLen - 1;
+        } else {
+            if ((size_t)spec->first >= bodyLen) {
+                continue;
+            }
+            first[cnt] = (size_t)spec->first;
+            last[cnt] = (spec->last < 0 || (size_t)spec->last >= bodyLen)
+                            ? bodyLen - 1
+                            : (size_t)spec->last;
+        }
+        total += last[cnt] - first[cnt] + 1;
+        cnt++;
+    }
+    /* Overlapping ranges are not worth more than the whole body */
+    if (cnt > 1 && total > bodyLen) {
+        return NULL;
+    }
+
+    size = headLen + RANGE_HEAD_EXTRA + total +
+           cnt * (RANGE_LINE_SIZE + RANGE_HEAD_EXTRA);
+    out = Malloc(size);
+    /* Status line keeps the version the object was stored with */
+    n = (size_t)snprintf(out, size, "%.8s %s\r\n", response,
+                         cnt == 0 ? "416 Range Not Satisfiable"
+                                  : "206 Partial Content");
+    n += range_copy_head(response, headLen, cnt > 1, out + n, size - n);
+    if (cnt == 0) {
+        n += (size_t)snprintf(out + n, size - n,
+                              "Content-Range: bytes */%zu\r\n"
+                              "Content-Length: 0\r\n\r\n",
+                              bodyLen);
+    } else if (cnt == 1) {
+        n += (size_t)snprintf(out + n, size - n,
+                              "Content-Range: bytes %zu-%zu/%zu\r\n"
+                              "Content-Length: %zu\r\n\r\n",
+                              first[0], last[0], bodyLen, total);
+        memcpy(out + n, body + first[0], total);
+        n += total;
+    } else {
+        multiLen = total + strlen("\r\n--" RANGE_BOUNDARY "--\r\n");
+        for (i = 0; i < cnt; i++) {
+            multiLen += range_part_head(NULL, 0, type, first[i], last[i],
+                                        bodyLen);
+        }
+        n += (size_t)snprintf(out + n, size - n,
+                              "Content-Type: multipart/byteranges; "
+                              "boundary=" RANGE_BOUNDARY "\r\n"
+                              "Content-Length: %zu\r\n\r\n",
+                              multiLen);
+        for (i = 0; i < cnt; i++) {
+            n += range_part_head(out + n, size - n, type, first[i], last[i],
+                                 bodyLen);
+            memcpy(out + n, body + first[i], last[i] - first[i] + 1);
+            n += last[i] - first[i] + 1;
+        }
+        n += (size_t)snprintf(out + n, size - n,
+                              "\r\n--" RANGE_BOUNDARY "--\r\n");
+    }
+    *outLen = n;
+    return out;
+}
+
+/**
+ * @brief Builds the response to a range request from a cached object, over
+ * its identity coding when it is stored gzip coded
+ *
+ *
+ * @param[in]   *range          Ranges from range_parse()
+ * @param[in]   *obj            Cached response
+ * @param[in]   len             Bytes held in obj
+ * @param[in]   compressed      obj is stored gzip coded
+ * @param[out]  *outLen         Length of the built response
+ *
+ * @return      char*           Malloc'd 206 or 416 response, NULL when the
+ * object should be served as usual
+ */
+char *range_respond_stored(const range_request *range, const char *obj,
+                           size_t len, bool compressed, size_t *outLen) {
+    char *identity = NULL, *out;
+
+    if (range->specCnt == 0) {
+        return NULL;
+    }
+    if (compressed) {
+        if ((identity = encoding_decompress(obj, len, &len)) == NULL) {
+            return NULL;
+        }
+        obj = identity;
+    }
+    out = range_respond(range, obj, len, outLen);
+    Free(identity);
+    return out;
+}
@@ -0,0 +1,50 @@
+/**
+ * @file range.h
+ * @brief Header file for byte range responses built from cached objects
+ *
+ * Description: Reads the byte ranges a client asks for and cuts them out of
+ * a complete cached response as a 206 or 416 response, defines, structures
+ * and function prototypes.
+ *
+ *
+ * @author Abhishek Basrithaya <abasrith@andrew.cmu.edu>
+ */
+#ifndef RANGE_H
+#define RANGE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Requests with more ranges than this get the whole object */
+#define RANGE_MAX_PARTS 16
+/* Longest If-Range value kept, longer ones never match */
+#define RANGE_VALIDATOR_SIZE 128
+/* Longest header line inspected, the rest is skipped */
+#define RANGE_LINE_SIZE 512
+/* Room for the headers a range response adds, and for each part's head */
+#define RANGE_HEAD_EXTRA 256
+/* Separates the parts of a multipart/byteranges body */
+#define RANGE_BOUNDARY "PROXY_BYTE_RANGES"
+
+/* One range spec as requested, resolved against the length later */
+typedef struct {
+    long first; /* first byte, -1 for a suffix of last bytes */
+    long last;  /* last byte included, -1 when open ended */
+} range_spec;
+
+typedef struct {
+    range_spec specs[RANGE_MAX_PARTS];  /* requested ranges, in order */
+    size_t specCnt;                     /* 0 when no usable Range was sent */
+    bool hasIfRange;                    /* If-Range was sent */
+    char ifRange[RANGE_VALIDATOR_SIZE]; /* its value, empty if too long */
+} range_request;
+
+/* Function prototyping */
+void range_parse(const char *client_hdrs, range_request *range);
+size_t range_strip(char *request);
+char *range_respond(const range_request *range, const char *response,
+                    size_t len, size_t *outLen);
+char *range_respond_stored(const range_request *range, const char *obj,
+                           size_t len, bool compressed, size_t *outLen);
+
+#endif /* RANGE_H */
@@ -0,0 +1,137 @@
+/**
+ * @file relay.c
+ * @brief splice() based relay of end server responses to the client
+ *
+ * Description: splice() needs a pipe on one side, so bytes travel from the
+ * origin socket into a pipe and from the pipe into the client socket, and the
+ * kernel moves page references instead of copying through user space. The
+ * blocking relay_splice() serves the worker threads; the event loop drives
+ * relay_splice_in() and relay_splice_out() itself on non-blocking pipes. When
+ * the kernel refuses to splice a descriptor (EINVAL) before any byte moved,
+ * callers fall back to a read()/write() loop.
+ *
+ *
+ * @author Abhishek Basrithaya <abasrith@andrew.cmu.edu>
+ */
+#define _GNU_SOURCE
+#include "relay.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/**
+ * @brief Creates a relay pipe
+ *
+ *
+ * @param[out]  pipefd          Read end in pipefd[0], write end in pipefd[1]
+ * @param[in]   nonblocking     Put both ends in non-blocking mode
+ *
+ * @return      int             0 on success, -1 on error
+ */
+int relay_pipe_open(int pipefd[2], bool nonblocking) {
+    return pipe2(pipefd, O_CLOEXEC | (nonblocking ? O_NONBLOCK : 0));
+}
+
+/**
+ * @brief Closes both ends of a relay pipe, if open
+ *
+ *
+ * @param[in]   pipefd          Pipe from relay_pipe_open(), reset to -1
+ *
+ * @return      void
+ */
+void relay_pipe_close(int pipefd[2]) {
+    if (pipefd[0] >= 0) {
+        close(pipefd[0]);
+        pipefd[0] = -1;
+    }
+    if (pipefd[1] >= 0) {
+        close(pipefd[1]);
+        pipefd[1] = -1;
+    }
+}
+
+/**
+ * @brief Moves up to len bytes from a socket into a relay pipe
+ *
+ *
+ * @param[in]   fromfd          Source socket
+ * @param[in]   pipeWr          Write end of the relay pipe
+ * @param[in]   len             Room left in the pipe
+ * @param[in]   nonblocking     Do not wait for data or pipe room
+ *
+ * @return      ssize_t         Bytes moved, 0 on EOF, -1 on error
+ */
+ssize_t relay_splice_in(int fromfd, int pipeWr, size_t len, bool nonblocking) {
+    ssize_t n;
+    unsigned int flags = SPLICE_F_MOVE | (nonblocking ? SPLICE_F_NONBLOCK : 0);
+    while ((n = splice(fromfd, NULL, pipeWr, NULL, len, flags)) < 0 &&
+           errno == EINTR)
+        ;
+    return n;
+}
+
+/**
+ * @brief Moves up to len bytes from a relay pipe into a socket
+ *
+ *
+ * @param[in]   pipeRd          Read end of the relay pipe
+ * @param[in]   tofd            Destination socket
+ * @param[in]   len             Bytes held in the pipe
+ * @param[in]   nonblocking     Do not wait for socket room
+ *
+ * @return      ssize_t         Bytes moved, -1 on error
+ */
+ssize_t relay_splice_out(int pipeRd, int tofd, size_t len, bool nonblocking) {
+    ssize_t n;
+    unsigned int flags = SPLICE_F_MOVE | (nonblocking ? SPLICE_F_NONBLOCK : 0);
+    while ((n = splice(pipeRd, NULL, tofd, NULL, len, flags)) < 0 &&
+           errno == EINTR)
+        ;
+    return n;
+}
+
+/**
+ * @brief Relays what fromfd sends until EOF, or until limit bytes, to tofd
+ * through a pipe, blocking
+ *
+ *
+ * @param[in]   fromfd          End server socket
+ * @param[in]   tofd            Client socket
+ * @param[in]   limit           Bytes to relay at most, SIZE_MAX for no limit
+ *
+ * @return      ssize_t         Bytes relayed, -1 if splice() is unusable here
+ * and nothing was consumed from fromfd
+ */
+ssize_t relay_splice(int fromfd, int tofd, size_t limit) {
+    int pipefd[2];
+    ssize_t n = 0, m;
+    size_t pending, chunk;
+    ssize_t total = 0;
+
+    if (relay_pipe_open(pipefd, false) < 0) {
+        return -1;
+    }
+    while ((size_t)total < limit) {
+        chunk = limit - (size_t)total;
+        if (chunk > RELAY_PIPE_SIZE) {
+            chunk = RELAY_PIPE_SIZE;
+        }
+        if ((n = relay_splice_in(fromfd, pipefd[1], chunk, false)) <= 0) {
+            break;
+        }
+        for (pending = (size_t)n; pending > 0; pending -= (size_t)m) {
+            if ((m = relay_splice_out(pipefd[0], tofd, pending, false)) <= 0) {
+                /* Client went away, the rest is dropped */
+                relay_pipe_close(pipefd);
+                return total;
+            }
+            total += m;
+        }
+    }
+    relay_pipe_close(pipefd);
+    if (n < 0 && total == 0 && (errno == EINVAL || errno == ENOSYS)) {
+        return -1;
+    }
+    return total;
+}
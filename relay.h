@@ -0,0 +1,28 @@
+/**
+ * @file relay.h
+ * @brief Header file for the splice() based relay of uncacheable responses
+ *
+ * Description: Moves end server bytes to the client through a pipe with
+ * splice(), so responses too big for the cache never pass through user space.
+ *
+ *
+ * @author Abhishek Basrithaya <abasrith@andrew.cmu.edu>
+ */
+#ifndef RELAY_H
+#define RELAY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Bytes kept in flight in a relay pipe, the default pipe capacity */
+#define RELAY_PIPE_SIZE (64 * 1024)
+
+/* Function prototyping */
+int relay_pipe_open(int pipefd[2], bool nonblocking);
+void relay_pipe_close(int pipefd[2]);
+ssize_t relay_splice_in(int fromfd, int pipeWr, size_t len, bool nonblocking);
+ssize_t relay_splice_out(int pipeRd, int tofd, size_t len, bool nonblocking);
+ssize_t relay_splice(int fromfd, int tofd, size_t limit);
+
+#endif /* RELAY_H */
@@ -0,0 +1,192 @@
+/**
+ * @file revalidate.c
+ * @brief Revalidation of stale cache hits
+ *
+ * Description: revalidate_hit() sits between cache_find() and serving a hit.
+ * A fresh hit is served as is. A stale one still inside its
+ * stale-while-revalidate window is served too, and the first request to hit
+ * it queues it for a small pool of background threads, one of which asks the
+ * end server with the block's validators and either refreshes the block on
+ * 304 Not Modified or publishes the full response in its place. Any other
+ * stale hit is left to the caller, which revalidates it the same way before
+ * answering. The queue mirrors the DNS refresh thread of dns.c; connecting,
+ * sending and receiving each give up after REVALIDATE_TIMEOUT_SECS, so an
+ * unreachable end server holds one thread for a bounded time.
+ *
+ *
+ * @author Abhishek Basrithaya <abasrith@andrew.cmu.edu>
+ */
+#include "revalidate.h"
+#include "csapp.h"
+#include "dns.h"
+#include "framing.h"
+#include "fresh.h"
+#include "proxy.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+/* Queue shared by every front end thread */
+static Revalidator revalidator;
+
+/* Function prototyping */
+static void *revalidate_thread(void *vargp);
+
+/**
+ * @brief Initialises the empty queue and starts the revalidation threads
+ *
+ *
+ * @return      void
+ */
+void revalidate_init(void) {
+    pthread_t tid;
+    int i;
+    memset(&revalidator, 0, sizeof(Revalidator));
+    if ((pthread_mutex_init(&revalidator.mutex, NULL)) != 0 ||
+        (pthread_cond_init(&revalidator.ready, NULL)) != 0) {
+        fprintf(stderr, "Error: Initizing revalidation locks");
+    }
+    for (i = 0; i < REVALIDATE_THREADS; i++) {
+        Pthread_create(&tid, NULL, revalidate_thread, NULL);
+    }
+}
+
+/**
+ * @brief Tells whether a cache hit may be served now, queueing a background
+ * revalidation of a hit served stale
+ *
+ *
+ * @param[in]   *cacheBlock     Cache block returned by cache_find()
+ *
+ * @return      bool            true to serve the hit, false when it must be
+ * revalidated with the end server first
+ */
+bool revalidate_hit(cache_block *cacheBlock) {
+    revalidate_job *job;
+
+    switch (cache_block_freshness(cacheBlock)) {
+    case CACHE_FRESH:
+        return true;
+    case CACHE_STALE_OK:
+        if (cache_claim_revalidation(cacheBlock)) {
+            job = Malloc(sizeof(revalidate_job));
+            cache_retain(cacheBlock);
+            job->block = cacheBlock;
+            job->next = NULL;
+            pthread_mutex_lock(&revalidator.mutex);
+            if (revalidator.tail != NULL) {
+                revalidator.tail->next = job;
+            } else {
+                revalidator.head = job;
+            }
+            revalidator.tail = job;
+            /* Every job may need a thread of its own */
+            pthread_cond_signal(&revalidator.ready);
+            pthread_mutex_unlock(&revalidator.mutex);
+        }
+        return true;
+    default:
+        return false;
+    }
+}
+
+/**
+ * @brief Revalidates a block with the end server, refreshing it on 304 and
+ * publishing the response in its place otherwise
+ *
+ *
+ * @param[in]   *cacheBlock     Referenced stale block
+ *
+ * @return      void
+ */
+static void revalidate_fetch(cache_block *cacheBlock) {
+    char line[MAXLINE], request[SERVER_REQUEST_SIZE], hostname[MAXLINE];
+    char path[MAXLINE], portStr[MAXLINE];
+    struct timeval timeout = {REVALIDATE_TIMEOUT_SECS, 0};
+    size_t size = 0, maxObject = cache_max_object_size(), reqLen;
+    http_framing frame;
+    char *buf;
+    ssize_t n;
+    int port, serverfd;
+
+    if (snprintf(line, sizeof(line), "GET %s HTTP/1.0\r\n",
+                 cacheBlock->cache_uri_key) >= (int)sizeof(line) ||
+        parse_request_target(line, hostname, path, &port) < 0) {
+        return;
+    }
+    build_server_http_request(request, sizeof(request), hostname, path, "");
+    reqLen = fresh_add_validators(request, sizeof(request),
+                                  cacheBlock->cache_obj,
+                                  cacheBlock->cache_obj_size);
+    sprintf(portStr, "%d", port);
+    if ((serverfd = dns_open_clientfd_timeout(hostname, portStr, &timeout)) <
+        0) {
+        return;
+    }
+    if (rio_writen(serverfd, request, reqLen) < 0) {
+        close(serverfd);
+        return;
+    }
+
+    /* The request may ask for keep-alive, so read up to the framing's end */
+    framing_init(&frame);
+    buf = cache_fill_reserve();
+    while (size < maxObject && !framing_done(&frame)) {
+        n = read(serverfd, buf + size, maxObject - size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n == 0) {
+            framing_eof(&frame);
+        } else if (n < 0) {
+            break;
+        } else {
+            size += framing_feed(&frame, buf + size, (size_t)n);
+        }
+    }
+    close(serverfd);
+    if (!framing_done(&frame)) {
+        cache_fill_abandon(buf);
+    } else if (frame.status == 304) {
+        cache_refresh(cacheBlock, buf, size);
+        cache_fill_abandon(buf);
+    } else {
+        /* Hop-by-hop headers are not stored */
+        size = framing_strip_hop(buf, size);
+        cache_release(
+            cache_fill_publish(cacheBlock->cache_uri_key, buf, size));
+    }
+}
+
+/**
+ * @brief Revalidation thread, runs queued revalidations one at a time for
+ * the lifetime of the proxy, alongside the other threads of the pool
+ *
+ *
+ * @param[in]   vargp           argument passed to thread handler (unused)
+ *
+ * @return      void*           never returns
+ */
+static void *revalidate_thread(void *vargp) {
+    revalidate_job *job;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        pthread_mutex_lock(&revalidator.mutex);
+        while (revalidator.head == NULL) {
+            pthread_cond_wait(&revalidator.ready, &revalidator.mutex);
+        }
+        job = revalidator.head;
+        if ((revalidator.head = job->next) == NULL) {
+            revalidator.tail = NULL;
+        }
+        pthread_mutex_unlock(&revalidator.mutex);
+
+        revalidate_fetch(job->block);
+        cache_end_revalidation(job->block);
+        cache_release(job->block);
+        Free(job);
+    }
+    return NULL;
+}
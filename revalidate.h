@@ -0,0 +1,40 @@
+/**
+ * @file revalidate.h
+ * @brief Header file for the revalidation of stale cache hits
+ *
+ * Description: Decides whether a cache hit may be served as it is and
+ * revalidates stale-while-revalidate hits with the end server in the
+ * background, defines, structures and function prototypes.
+ *
+ *
+ * @author Abhishek Basrithaya <abasrith@andrew.cmu.edu>
+ */
+#ifndef REVALIDATE_H
+#define REVALIDATE_H
+
+#include "cache.h"
+#include <pthread.h>
+#include <stdbool.h>
+
+/* A background revalidation gives up on a silent end server after this */
+#define REVALIDATE_TIMEOUT_SECS 10
+/* Background revalidations run at once, a slow end server holds just one */
+#define REVALIDATE_THREADS 4
+
+typedef struct revalidate_job {
+    cache_block *block;          /* stale block, referenced and claimed */
+    struct revalidate_job *next; /* next job in the queue */
+} revalidate_job;
+
+typedef struct {
+    revalidate_job *head;  /* next job to run */
+    revalidate_job *tail;  /* last job queued */
+    pthread_mutex_t mutex; /* protects the queue */
+    pthread_cond_t ready;  /* a job was queued */
+} Revalidator;
+
+/* Function prototyping */
+void revalidate_init(void);
+bool revalidate_hit(cache_block *cacheBlock);
+
+#endif /* REVALIDATE_H */
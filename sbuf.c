@@ -0,0 +1,100 @@
+/**
+ * @file sbuf.c
+ * @brief Bounded connection queue feeding the worker thread pool
+ *
+ * Description: A circular buffer of connected descriptors guarded by a single
+ * mutex with two condition variables. The accepting thread blocks in
+ * sbuf_insert() when every slot is taken, which pushes backpressure onto the
+ * kernel listen queue instead of growing without bound, and workers block in
+ * sbuf_remove() while the queue is empty.
+ *
+ *
+ * @author Abhishek Basrithaya <abasrith@andrew.cmu.edu>
+ */
+#include "sbuf.h"
+#include "csapp.h"
+#include <stdio.h>
+
+/**
+ * @brief Initialises an empty bounded queue with the given number of slots
+ *
+ *
+ * @param[in]   *sp             Queue to initialise
+ * @param[in]   capacity        Maximum number of queued descriptors
+ *
+ * @return      void
+ */
+void sbuf_init(sbuf_t *sp, size_t capacity) {
+    sp->buf = Calloc(capacity, sizeof(sbuf_item));
+    sp->capacity = capacity;
+    sp->front = 0;
+    sp->rear = 0;
+    sp->count = 0;
+    if ((pthread_mutex_init(&sp->mutex, NULL)) != 0) {
+        fprintf(stderr, "Error: Initizing queue mutex");
+    }
+    if ((pthread_cond_init(&sp->notEmpty, NULL)) != 0 ||
+        (pthread_cond_init(&sp->notFull, NULL)) != 0) {
+        fprintf(stderr, "Error: Initizing queue condition variables");
+    }
+}
+
+/**
+ * @brief Releases the storage held by a queue
+ *
+ *
+ * @param[in]   *sp             Queue to release
+ *
+ * @return      void
+ */
+void sbuf_deinit(sbuf_t *sp) {
+    Free(sp->buf);
+    pthread_mutex_destroy(&sp->mutex);
+    pthread_cond_destroy(&sp->notEmpty);
+    pthread_cond_destroy(&sp->notFull);
+}
+
+/**
+ * @brief Appends a descriptor at the rear of the queue, blocking while the
+ * queue is full
+ *
+ *
+ * @param[in]   *sp             Queue to insert into
+ * @param[in]   item            Connected descriptor and its accept time
+ *
+ * @return      void
+ */
+void sbuf_insert(sbuf_t *sp, sbuf_item item) {
+    pthread_mutex_lock(&sp->mutex);
+    while (sp->count == sp->capacity) {
+        pthread_cond_wait(&sp->notFull, &sp->mutex);
+    }
+    sp->buf[sp->rear] = item;
+    sp->rear = (sp->rear + 1) % sp->capacity;
+    sp->count++;
+    pthread_cond_signal(&sp->notEmpty);
+    pthread_mutex_unlock(&sp->mutex);
+}
+
+/**
+ * @brief Removes the descriptor at the front of the queue, blocking while the
+ * queue is empty
+ *
+ *
+ * @param[in]   *sp             Queue to remove from
+ *
+ * @return      sbuf_item       Connected descriptor and its accept time
+ */
+sbuf_item sbuf_remove(sbuf_t *sp) {
+    sbuf_item item;
+    pthread_mutex_lock(&sp->mutex);
+    while (sp->count == 0) {
+        pthread_cond_wait(&sp->notEmpty, &sp->mutex);
+    }
+    item = sp->buf[sp->front];
+    sp->front = (sp->front + 1) % sp->capacity;
+    sp->count--;
+    pthread_cond_signal(&sp->notFull);
+    pthread_mutex_unlock(&sp->mutex);
+    return item;
+}
@@ -0,0 +1,42 @@
+/**
+ * @file sbuf.h
+ * @brief Header file for the bounded connection queue
+ *
+ * Description: A bounded FIFO of connected descriptors shared between the
+ * accepting thread (producer) and the pool of worker threads (consumers).
+ *
+ *
+ * @author Abhishek Basrithaya <abasrith@andrew.cmu.edu>
+ */
+#ifndef SBUF_H
+#define SBUF_H
+
+#include "admit.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    int connfd;          /* connected descriptor */
+    uint64_t acceptedAt; /* metrics_now() when it was accepted */
+    admit_client client; /* client as counted against the limits */
+} sbuf_item;
+
+typedef struct {
+    sbuf_item *buf;          /* Buffer array of connected descriptors */
+    size_t capacity;         /* Maximum number of slots */
+    size_t front;            /* buf[front] is the first item */
+    size_t rear;             /* buf[rear] is the next free slot */
+    size_t count;            /* Number of descriptors queued */
+    pthread_mutex_t mutex;   /* protects accesses to the queue */
+    pthread_cond_t notEmpty; /* signalled on insert */
+    pthread_cond_t notFull;  /* signalled on remove */
+} sbuf_t;
+
+/* Function prototyping */
+void sbuf_init(sbuf_t *sp, size_t capacity);
+void sbuf_deinit(sbuf_t *sp);
+void sbuf_insert(sbuf_t *sp, sbuf_item item);
+sbuf_item sbuf_remove(sbuf_t *sp);
+
+#endif /* SBUF_H */
@@ -0,0 +1,202 @@
+/**
+ * @file slab.c
+ * @brief Size-class slab allocator for cache blocks, keys and objects
+ *
+ * Description: Every request is rounded up to a power-of-two size class
+ * between SLAB_MIN_CHUNK and 1 << SLAB_MAX_SHIFT. Each class carves its chunks
+ * out of SLAB_ARENA_SIZE arenas reserved from the heap once and never given
+ * back, and recycles freed chunks through a LIFO free list, so a churning
+ * cache reuses the same memory instead of fragmenting the glibc heap. Callers
+ * pass the size of the allocation back to slab_free(), which keeps chunks free
+ * of headers. Requests above the largest class fall back to Malloc(). One
+ * mutex lock per class is utilised for thread synchronisation.
+ *
+ *
+ * @author Abhishek Basrithaya <abasrith@andrew.cmu.edu>
+ */
+#include "slab.h"
+#include "csapp.h"
+#include <stdio.h>
+#include <string.h>
+
+/* Size classes, index 0 holds SLAB_MIN_CHUNK byte chunks */
+static slab_class slabClasses[SLAB_CLASS_CNT];
+
+/**
+ * @brief Initialises the empty size classes, arenas are reserved on first use
+ *
+ *
+ * @return      void
+ */
+void slab_init(void) {
+    size_t i;
+    for (i = 0; i < SLAB_CLASS_CNT; i++) {
+        memset(&slabClasses[i], 0, sizeof(slab_class));
+        slabClasses[i].stats.chunkSize = (size_t)SLAB_MIN_CHUNK << i;
+        if ((pthread_mutex_init(&slabClasses[i].mutex, NULL)) != 0) {
+            fprintf(stderr, "Error: Initizing slab mutex");
+        }
+    }
+}
+
+/**
+ * @brief Maps an allocation size to the index of the smallest class holding it
+ *
+ *
+ * @param[in]   size            Requested size in bytes
+ *
+ * @return      size_t          Class index, SLAB_CLASS_CNT when too large
+ */
+static size_t slab_class_of(size_t size) {
+    size_t classIdx = 0;
+    size_t chunkSize = SLAB_MIN_CHUNK;
+    while (chunkSize < size && classIdx < SLAB_CLASS_CNT) {
+        chunkSize <<= 1;
+        classIdx++;
+    }
+    return classIdx;
+}
+
+/**
+ * @brief Allocates a chunk of at least size bytes
+ *
+ *
+ * @param[in]   size            Requested size in bytes
+ *
+ * @return      void*           Chunk, to be returned with slab_free()
+ */
+void *slab_alloc(size_t size) {
+    size_t classIdx = slab_class_of(size);
+    slab_class *sc;
+    void *chunk;
+
+    if (classIdx == SLAB_CLASS_CNT) {
+        return Malloc(size);
+    }
+    sc = &slabClasses[classIdx];
+    pthread_mutex_lock(&sc->mutex);
+    if (sc->freeList != NULL) {
+        chunk = sc->freeList;
+        sc->freeList = *(void **)chunk;
+    } else {
+        /* Reserve a new arena once the current one is carved up */
+        if (sc->arenaNext == sc->arenaEnd) {
+            sc->arenaNext = Malloc(SLAB_ARENA_SIZE);
+            sc->arenaEnd = sc->arenaNext + SLAB_ARENA_SIZE;
+            sc->stats.arenaCnt++;
+        }
+        chunk = sc->arenaNext;
+        sc->arenaNext += sc->stats.chunkSize;
+        sc->stats.chunkCnt++;
+    }
+    sc->stats.allocCnt++;
+    sc->stats.usedBytes += size;
+    if (++sc->stats.usedCnt > sc->stats.peakUsedCnt) {
+        sc->stats.peakUsedCnt = sc->stats.usedCnt;
+    }
+    pthread_mutex_unlock(&sc->mutex);
+    return chunk;
+}
+
+/**
+ * @brief Returns a chunk obtained from slab_alloc() to its class
+ *
+ *
+ * @param[in]   *ptr            Chunk to free, NULL is ignored
+ * @param[in]   size            Size passed to slab_alloc() for this chunk
+ *
+ * @return      void
+ */
+void slab_free(void *ptr, size_t size) {
+    size_t classIdx = slab_class_of(size);
+    slab_class *sc;
+
+    if (ptr == NULL) {
+        return;
+    }
+    if (classIdx == SLAB_CLASS_CNT) {
+        Free(ptr);
+        return;
+    }
+    sc = &slabClasses[classIdx];
+    pthread_mutex_lock(&sc->mutex);
+    *(void **)ptr = sc->freeList;
+    sc->freeList = ptr;
+    sc->stats.usedCnt--;
+    sc->stats.usedBytes -= size;
+    pthread_mutex_unlock(&sc->mutex);
+}
+
+/**
+ * @brief Shrinks a chunk to newSize bytes, moving it to a smaller class only
+ * when the data fits one, and reallocating it when above the largest class
+ *
+ *
+ * @param[in]   *ptr            Chunk obtained from slab_alloc(oldSize)
+ * @param[in]   oldSize         Size passed to slab_alloc() for this chunk
+ * @param[in]   newSize         Bytes of the chunk still in use, at most oldSize
+ *
+ * @return      void*           Chunk holding the first newSize bytes, to be
+ * returned with slab_free(ptr, newSize)
+ */
+void *slab_shrink(void *ptr, size_t oldSize, size_t newSize) {
+    size_t classIdx = slab_class_of(oldSize);
+    slab_class *sc;
+    void *chunk;
+
+    if (classIdx == slab_class_of(newSize)) {
+        if (classIdx == SLAB_CLASS_CNT && newSize < oldSize) {
+            /* Heap allocations above the largest class give back the rest */
+            return Realloc(ptr, newSize);
+        }
+        if (classIdx < SLAB_CLASS_CNT) {
+            sc = &slabClasses[classIdx];
+            pthread_mutex_lock(&sc->mutex);
+            sc->stats.usedBytes -= oldSize - newSize;
+            pthread_mutex_unlock(&sc->mutex);
+        }
+        return ptr;
+    }
+    chunk = slab_alloc(newSize);
+    memcpy(chunk, ptr, newSize);
+    slab_free(ptr, oldSize);
+    return chunk;
+}
+
+/**
+ * @brief Copies a consistent snapshot of one class's statistics
+ *
+ *
+ * @param[in]   classIdx        Class index below SLAB_CLASS_CNT
+ * @param[out]  *stats          Snapshot of the class
+ *
+ * @return      void
+ */
+void slab_get_stats(size_t classIdx, slab_class_stats *stats) {
+    slab_class *sc = &slabClasses[classIdx];
+    pthread_mutex_lock(&sc->mutex);
+    *stats = sc->stats;
+    pthread_mutex_unlock(&sc->mutex);
+}
+
+/**
+ * @brief Prints the occupancy of every size class that reserved an arena
+ *
+ *
+ * @return      void
+ */
+void slabPrint() {
+    slab_class_stats stats;
+    size_t i;
+    for (i = 0; i < SLAB_CLASS_CNT; i++) {
+        slab_get_stats(i, &stats);
+        if (stats.arenaCnt == 0) {
+            continue;
+        }
+        sio_printf("slab[%zu] chunk:%zu arenas:%zu chunks:%zu used:%zu "
+                   "peak:%zu bytes:%zu/%zu allocs:%zu\n",
+                   i, stats.chunkSize, stats.arenaCnt, stats.chunkCnt,
+                   stats.usedCnt, stats.peakUsedCnt, stats.usedBytes,
+                   stats.usedCnt * stats.chunkSize, stats.allocCnt);
+    }
+}
@@ -0,0 +1,53 @@
+/**
+ * @file slab.h
+ * @brief Header file for the size-class slab allocator backing the cache
+ *
+ * Description: Power-of-two size classes from SLAB_MIN_CHUNK up to the first
+ * power of two holding DEFAULT_MAX_OBJECT_SIZE, defines, per class occupancy
+ * statistics and function prototypes.
+ *
+ *
+ * @author Abhishek Basrithaya <abasrith@andrew.cmu.edu>
+ */
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+/* Smallest chunk handed out, a power of two */
+#define SLAB_MIN_SHIFT 6
+#define SLAB_MIN_CHUNK (1 << SLAB_MIN_SHIFT)
+/* Largest class, 128K holds any object below DEFAULT_MAX_OBJECT_SIZE */
+#define SLAB_MAX_SHIFT 17
+#define SLAB_CLASS_CNT (SLAB_MAX_SHIFT - SLAB_MIN_SHIFT + 1)
+/* Bytes reserved per arena, two chunks of the largest class */
+#define SLAB_ARENA_SIZE (256 * 1024)
+
+typedef struct {
+    size_t chunkSize;   /* bytes per chunk in this class */
+    size_t arenaCnt;    /* arenas reserved for this class */
+    size_t chunkCnt;    /* chunks carved out of the arenas */
+    size_t usedCnt;     /* chunks currently handed out */
+    size_t peakUsedCnt; /* highest usedCnt seen */
+    size_t usedBytes;   /* bytes requested by the chunks handed out */
+    size_t allocCnt;    /* slab_alloc() calls served by this class */
+} slab_class_stats;
+
+typedef struct {
+    slab_class_stats stats; /* occupancy of the class */
+    void *freeList;         /* free chunks, linked through their first word */
+    char *arenaNext;        /* next uncarved byte of the newest arena */
+    char *arenaEnd;         /* end of the newest arena */
+    pthread_mutex_t mutex;  /* protects accesses to the class */
+} slab_class;
+
+/* Function prototyping */
+void slab_init(void);
+void *slab_alloc(size_t size);
+void slab_free(void *ptr, size_t size);
+void *slab_shrink(void *ptr, size_t oldSize, size_t newSize);
+void slab_get_stats(size_t classIdx, slab_class_stats *stats);
+void slabPrint();
+
+#endif /* SLAB_H */
@@ -0,0 +1,411 @@
+/**
+ * @file snapshot.c
+ * @brief Cache snapshot saved across restarts
+ *
+ * Description: A background thread saves every cached object, with its URI
+ * key and freshness, to one file every intervalSecs seconds and once more on
+ * SIGTERM before the proxy exits. Objects are written shard by shard in the
+ * order the LRU family would evict them, and the file is written under a
+ * temporary name and renamed over the previous snapshot, so a crash midway
+ * leaves the last complete one in place. Writing only holds the shard locks
+ * while cache_collect() takes references, never while objects hit the disk.
+ *
+ * On startup the previous snapshot is mapped and only its record heads are
+ * read to index it by URI, which takes milliseconds. A restore thread then
+ * publishes the records in file order, rebuilding the saved recency, while
+ * a lookup missing in memory restores its object from the mapping straight
+ * away, so hits are served from the first request on. Every record is
+ * claimed once, by whichever comes first. The mapping is dropped once every
+ * record is restored.
+ *
+ *
+ * @author Abhishek Basrithaya <abasrith@andrew.cmu.edu>
+ */
+#include "snapshot.h"
+#include "cache.h"
+#include "csapp.h"
+#include "log.h"
+#include "proxy.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Snapshot of the cache, disabled while path is NULL */
+static Snapshot snapshot;
+
+/* Function prototyping */
+static void *snapshot_restore_thread(void *vargp);
+static void *snapshot_thread(void *vargp);
+
+/**
+ * @brief Rounds a record size up to the record alignment
+ *
+ *
+ * @param[in]   keyLen          Bytes of the key
+ * @param[in]   objLen          Bytes of the object
+ *
+ * @return      size_t          Bytes the record takes in the file
+ */
+static size_t snapshot_record_size(size_t keyLen, size_t objLen) {
+    size_t size = sizeof(snapshot_record) + keyLen + objLen;
+    return (size + SNAPSHOT_RECORD_ALIGN - 1) &
+           ~(size_t)(SNAPSHOT_RECORD_ALIGN - 1);
+}
+
+/**
+ * @brief Returns the record at an offset of the mapping
+ *
+ *
+ * @param[in]   offset          Record offset
+ *
+ * @return      snapshot_record* Record inside the mapping
+ */
+static snapshot_record *snapshot_record_at(size_t offset) {
+    return (snapshot_record *)(snapshot.map + offset);
+}
+
+/**
+ * @brief Maps the snapshot file and indexes its records by URI, stopping at
+ * the first record that does not fit the file
+ *
+ *
+ * @param[in]   *path           Snapshot file
+ *
+ * @return      bool            true if there is anything to restore
+ */
+static bool snapshot_map(const char *path) {
+    snapshot_header *hdr;
+    snapshot_record *rec;
+    snapshot_entry *entry;
+    struct stat st;
+    size_t offset, i, idx;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        if (errno != ENOENT) {
+            fprintf(stderr, "Warning: snapshot %s not restored: %s\n", path,
+                    strerror(errno));
+        }
+        return false;
+    }
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(snapshot_header) ||
+        (snapshot.map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE,
+                             fd, 0)) == MAP_FAILED) {
+        close(fd);
+        snapshot.map = NULL;
+        return false;
+    }
+    /* The mapping keeps the file alive, even once renamed over */
+    close(fd);
+    snapshot.mapLen = (size_t)st.st_size;
+    hdr = (snapshot_header *)snapshot.map;
+    if (hdr->magic != SNAPSHOT_MAGIC || hdr->version != SNAPSHOT_VERSION ||
+        hdr->recordCnt == 0 ||
+        hdr->recordCnt > snapshot.mapLen / sizeof(snapshot_record)) {
+        fprintf(stderr, "Warning: snapshot %s not restored: bad header\n",
+                path);
+        munmap(snapshot.map, snapshot.mapLen);
+        snapshot.map = NULL;
+        return false;
+    }
+
+    snapshot.entries = Calloc(hdr->recordCnt, sizeof(snapshot_entry));
+    offset = sizeof(snapshot_header);
+    for (i = 0; i < hdr->recordCnt; i++) {
+        rec = snapshot_record_at(offset);
+        if (snapshot.mapLen - offset < sizeof(snapshot_record) ||
+            rec->magic != SNAPSHOT_RECORD_MAGIC || rec->keyLen == 0 ||
+            rec->keyLen >= MAXLINE ||
+            snapshot.mapLen - offset <
+                snapshot_record_size(rec->keyLen, rec->objLen)) {
+            fprintf(stderr, "Warning: snapshot %s cut short after %zu of "
+                    "%zu records\n", path, i, (size_t)hdr->recordCnt);
+            break;
+        }
+        snapshot.entries[i].hash = rec->hash;
+        snapshot.entries[i].offset = offset;
+        offset += snapshot_record_size(rec->keyLen, rec->objLen);
+    }
+    snapshot.entryCnt = i;
+
+    snapshot.bucketCnt = 64;
+    while (snapshot.bucketCnt < snapshot.entryCnt) {
+        snapshot.bucketCnt *= 2;
+    }
+    snapshot.buckets = Calloc(snapshot.bucketCnt, sizeof(snapshot_entry *));
+    for (i = 0; i < snapshot.entryCnt; i++) {
+        entry = &snapshot.entries[i];
+        idx = entry->hash & (snapshot.bucketCnt - 1);
+        entry->hashNext = snapshot.buckets[idx];
+        snapshot.buckets[idx] = entry;
+    }
+    return snapshot.entryCnt > 0;
+}
+
+/**
+ * @brief Drops the mapping and the index once nothing is left to restore
+ *
+ *
+ * @return      void
+ */
+static void snapshot_unmap(void) {
+    pthread_rwlock_wrlock(&snapshot.mapLock);
+    munmap(snapshot.map, snapshot.mapLen);
+    __atomic_store_n(&snapshot.map, NULL, __ATOMIC_RELEASE);
+    Free(snapshot.entries);
+    Free(snapshot.buckets);
+    snapshot.entries = NULL;
+    snapshot.buckets = NULL;
+    snapshot.entryCnt = 0;
+    pthread_rwlock_unlock(&snapshot.mapLock);
+}
+
+/**
+ * @brief Publishes the object of a record into the cache unless another
+ * thread claimed the record first, with mapLock held shared
+ *
+ *
+ * @param[in]   *entry          Entry of the record
+ *
+ * @return      cache_block*    Restored block with a reference for the
+ * caller, NULL if the record was claimed already or is too big
+ */
+static cache_block *snapshot_restore(snapshot_entry *entry) {
+    snapshot_record *rec = snapshot_record_at(entry->offset);
+    char key[MAXLINE], *buf;
+
+    if (__atomic_exchange_n(&entry->claimed, 1, __ATOMIC_ACQ_REL) != 0 ||
+        rec->objLen >= cache_max_object_size()) {
+        return NULL;
+    }
+    memcpy(key, rec + 1, rec->keyLen);
+    key[rec->keyLen] = '\0';
+    buf = cache_fill_reserve();
+    memcpy(buf, (char *)(rec + 1) + rec->keyLen, rec->objLen);
+    return cache_restore(key, buf, rec->objLen, (time_t)rec->storedAt,
+                         (time_t)rec->freshUntil, (time_t)rec->staleUntil);
+}
+
+/**
+ * @brief Maps the snapshot of the previous run and starts restoring it,
+ * then starts saving the cache to the same file; a NULL path leaves
+ * snapshots disabled
+ *
+ *
+ * @param[in]   *path           Snapshot file
+ * @param[in]   intervalSecs    Seconds between snapshots, 0 to only save on
+ * SIGTERM
+ *
+ * @return      void
+ */
+void snapshot_init(const char *path, unsigned int intervalSecs) {
+    pthread_t tid;
+
+    memset(&snapshot, 0, sizeof(Snapshot));
+    if (path == NULL) {
+        return;
+    }
+    snapshot.path = path;
+    snapshot.intervalSecs = intervalSecs;
+    if ((pthread_rwlock_init(&snapshot.mapLock, NULL)) != 0 ||
+        sem_init(&snapshot.wake, 0, 0) != 0 ||
+        sem_init(&snapshot.restored, 0, 0) != 0) {
+        fprintf(stderr, "Error: Initizing snapshot locks");
+    }
+    if (snapshot_map(path)) {
+        Pthread_create(&tid, NULL, snapshot_restore_thread, NULL);
+    } else {
+        if (snapshot.map != NULL) {
+            snapshot_unmap();
+        }
+        sem_post(&snapshot.restored);
+    }
+    Pthread_create(&tid, NULL, snapshot_thread, NULL);
+}
+
+/**
+ * @brief Restores a URI missing in memory from the snapshot at once, while
+ * the restore thread has not got to it yet
+ *
+ *
+ * @param[in]   *uri            URL key
+ * @param[in]   hash            cache_hash() of the key
+ *
+ * @return      cache_block*    Restored block with a reference for the
+ * caller, NULL if the snapshot does not hold the URI (any longer)
+ */
+cache_block *snapshot_find(const char *uri, uint32_t hash) {
+    size_t keyLen = strlen(uri);
+    cache_block *cacheBlock = NULL;
+    snapshot_entry *entry;
+    snapshot_record *rec;
+
+    if (__atomic_load_n(&snapshot.map, __ATOMIC_ACQUIRE) == NULL) {
+        return NULL;
+    }
+    pthread_rwlock_rdlock(&snapshot.mapLock);
+    if (snapshot.map != NULL) {
+        entry = snapshot.buckets[hash & (snapshot.bucketCnt - 1)];
+        for (; entry != NULL; entry = entry->hashNext) {
+            rec = snapshot_record_at(entry->offset);
+            if (entry->hash == hash && rec->keyLen == keyLen &&
+                memcmp(rec + 1, uri, keyLen) == 0) {
+                cacheBlock = snapshot_restore(entry);
+                break;
+            }
+        }
+    }
+    pthread_rwlock_unlock(&snapshot.mapLock);
+    return cacheBlock;
+}
+
+/**
+ * @brief Restore thread, publishes every record not restored on demand yet
+ * in file order, then drops the mapping
+ *
+ *
+ * @param[in]   vargp           argument passed to thread handler (unused)
+ *
+ * @return      void*           NULL
+ */
+static void *snapshot_restore_thread(void *vargp) {
+    cache_block *cacheBlock;
+    size_t i, restored = 0;
+
+    Pthread_detach(pthread_self());
+    for (i = 0; i < snapshot.entryCnt; i++) {
+        pthread_rwlock_rdlock(&snapshot.mapLock);
+        if ((cacheBlock = snapshot_restore(&snapshot.entries[i])) != NULL) {
+            cache_release(cacheBlock);
+            restored++;
+        }
+        pthread_rwlock_unlock(&snapshot.mapLock);
+    }
+    log_printf(LOG_LEVEL_INFO, "Restored %zu of %zu objects from %s\n",
+               restored, snapshot.entryCnt, snapshot.path);
+    snapshot_unmap();
+    /* Saving before this would drop the records not restored yet */
+    sem_post(&snapshot.restored);
+    return NULL;
+}
+
+/**
+ * @brief Writes every cached object to a temporary file and renames it over
+ * the snapshot
+ *
+ *
+ * @return      bool            false when the snapshot could not be written
+ */
+static bool snapshot_save(void) {
+    static const char pad[SNAPSHOT_RECORD_ALIGN] = {0};
+    char tmpPath[MAXLINE];
+    snapshot_header hdr = {SNAPSHOT_MAGIC, SNAPSHOT_VERSION, 0};
+    snapshot_record rec;
+    cache_block **blocks, *cacheBlock;
+    size_t blockCnt, i, padLen;
+    bool ok;
+    FILE *fp;
+
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", snapshot.path);
+    if ((fp = fopen(tmpPath, "w")) == NULL) {
+        log_printf(LOG_LEVEL_ERROR, "Failed to save snapshot %s: %s\n",
+                   tmpPath, strerror(errno));
+        return false;
+    }
+    blocks = cache_collect(&blockCnt);
+    hdr.recordCnt = blockCnt;
+    ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1;
+    for (i = 0; i < blockCnt; i++) {
+        cacheBlock = blocks[i];
+        if (ok) {
+            memset(&rec, 0, sizeof(rec));
+            rec.magic = SNAPSHOT_RECORD_MAGIC;
+            rec.hash = cacheBlock->cache_uri_hash;
+            rec.keyLen = (uint32_t)strlen(cacheBlock->cache_uri_key);
+            rec.objLen = (uint32_t)cacheBlock->cache_obj_size;
+            rec.storedAt =
+                __atomic_load_n(&cacheBlock->storedAt, __ATOMIC_RELAXED);
+            rec.freshUntil =
+                __atomic_load_n(&cacheBlock->freshUntil, __ATOMIC_RELAXED);
+            rec.staleUntil =
+                __atomic_load_n(&cacheBlock->staleUntil, __ATOMIC_RELAXED);
+            padLen = snapshot_record_size(rec.keyLen, rec.objLen) -
+                     sizeof(rec) - rec.keyLen - rec.objLen;
+            ok = fwrite(&rec, sizeof(rec), 1, fp) == 1 &&
+                 fwrite(cacheBlock->cache_uri_key, 1, rec.keyLen, fp) ==
+                     rec.keyLen &&
+                 fwrite(cacheBlock->cache_obj, 1, rec.objLen, fp) ==
+                     rec.objLen &&
+                 fwrite(pad, 1, padLen, fp) == padLen;
+        }
+        cache_release(cacheBlock);
+    }
+    Free(blocks);
+    ok = ok && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok || rename(tmpPath, snapshot.path) < 0) {
+        log_printf(LOG_LEVEL_ERROR, "Failed to save snapshot %s: %s\n",
+                   snapshot.path, strerror(errno));
+        unlink(tmpPath);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief SIGTERM handler, wakes the snapshot thread to save and exit;
+ * installed by main() once snapshot_init() enabled snapshots
+ *
+ *
+ * @param[in]   sig             signal input
+ *
+ * @return      void
+ */
+void snapshot_sigterm(int sig) {
+    snapshot.terminating = 1;
+    sem_post(&snapshot.wake);
+}
+
+/**
+ * @brief Snapshot thread, saves the cache every intervalSecs seconds and
+ * once more on SIGTERM, after which it ends the proxy; no save starts before
+ * the previous snapshot is fully restored
+ *
+ *
+ * @param[in]   vargp           argument passed to thread handler (unused)
+ *
+ * @return      void*           never returns
+ */
+static void *snapshot_thread(void *vargp) {
+    struct timespec deadline;
+    bool restored = false;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        if (snapshot.intervalSecs > 0) {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += snapshot.intervalSecs;
+            while (sem_timedwait(&snapshot.wake, &deadline) < 0 &&
+                   errno == EINTR) {
+            }
+        } else {
+            while (sem_wait(&snapshot.wake) < 0 && errno == EINTR) {
+            }
+        }
+        if (!restored) {
+            while (sem_wait(&snapshot.restored) < 0 && errno == EINTR) {
+            }
+            restored = true;
+        }
+        snapshot_save();
+        if (snapshot.terminating) {
+            exit(0);
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,77 @@
+/**
+ * @file snapshot.h
+ * @brief Header file for the cache snapshot written across restarts
+ *
+ * Description: Saves every cached object with its freshness to a file
+ * periodically and on SIGTERM, and restores them from that file on startup,
+ * defines, file layout, structures and function prototypes.
+ *
+ *
+ * @author Abhishek Basrithaya <abasrith@andrew.cmu.edu>
+ */
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "cache.h"
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Seconds between snapshots, overridable from the command line */
+#define DEFAULT_SNAPSHOT_SECS 300
+#define SNAPSHOT_MAGIC 0x50534e50u        /* "PSNP" */
+#define SNAPSHOT_RECORD_MAGIC 0x50524543u /* "PREC" */
+#define SNAPSHOT_VERSION 1
+/* Records start on this alignment inside the file */
+#define SNAPSHOT_RECORD_ALIGN 8
+
+/* First bytes of the file */
+typedef struct {
+    uint32_t magic;     /* SNAPSHOT_MAGIC */
+    uint32_t version;   /* SNAPSHOT_VERSION */
+    uint64_t recordCnt; /* records following the header */
+} snapshot_header;
+
+/* Head of every record, followed by the URI key and then the object */
+typedef struct {
+    uint32_t magic;     /* SNAPSHOT_RECORD_MAGIC */
+    uint32_t hash;      /* cache_hash() of the key */
+    uint32_t keyLen;    /* bytes of the key, without terminator */
+    uint32_t objLen;    /* bytes of the object */
+    int64_t storedAt;   /* when the object was received or revalidated */
+    int64_t freshUntil; /* served as is until then */
+    int64_t staleUntil; /* served stale while revalidating until then */
+} snapshot_record;
+
+typedef struct snapshot_entry {
+    uint32_t hash;                   /* cache_hash() of the key */
+    size_t offset;                   /* offset of the record in the file */
+    int claimed;                     /* restored or being restored, atomic */
+    struct snapshot_entry *hashNext; /* next entry in the same bucket */
+} snapshot_entry;
+
+typedef struct {
+    const char *path;                  /* snapshot file, NULL when disabled */
+    unsigned int intervalSecs;         /* snapshot period, 0 for SIGTERM only */
+    char *map;                         /* mapping of the file restored from */
+    size_t mapLen;                     /* bytes mapped */
+    snapshot_entry *entries;           /* one per record, in file order */
+    size_t entryCnt;                   /* number of entries */
+    snapshot_entry **buckets;          /* index of the entries by URI */
+    size_t bucketCnt;                  /* number of buckets, a power of two */
+    pthread_rwlock_t mapLock;          /* unmapping waits for readers */
+    sem_t wake;                        /* posted by SIGTERM to save at once */
+    sem_t restored;                    /* posted once restoring is over */
+    volatile sig_atomic_t terminating; /* SIGTERM was received */
+} Snapshot;
+
+/* Function prototyping */
+void snapshot_init(const char *path, unsigned int intervalSecs);
+cache_block *snapshot_find(const char *uri, uint32_t hash);
+void snapshot_sigterm(int sig);
+
+#endif /* SNAPSHOT_H */
@@ -0,0 +1,499 @@
+/**
+ * @file upstream.c
+ * @brief Routing of misses across sibling proxies by consistent hashing
+ *
+ * Description: With a list of sibling proxies every miss is owned by exactly
+ * one of them, picked by hashing its URI onto a ring holding UPSTREAM_VNODES
+ * points per sibling, so each object is cached on one node only and adding a
+ * node only moves the objects of the arcs it takes over. A miss owned by this
+ * proxy, or by none when it is not in the list, goes to the end server as
+ * before; any other miss is sent as a proxy request to its owner, which marks
+ * it with UPSTREAM_HOP_HEADER so the owner fetches it itself instead of
+ * routing it again; the header is only honoured on connections from the
+ * address of a sibling, as last resolved by the health checks, so the request
+ * path never waits for a lookup. A background thread checks every sibling each
+ * UPSTREAM_CHECK_SECS by fetching its metrics page, and a sibling failing
+ * UPSTREAM_FALL checks in a row, or refusing a routed miss, is skipped until
+ * it passes a check again. Its misses fail over to the next sibling on the
+ * ring, and to the end server once no sibling is left.
+ *
+ *
+ * @author Abhishek Basrithaya <abasrith@andrew.cmu.edu>
+ */
+#include "upstream.h"
+#include "csapp.h"
+#include "dns.h"
+#include "framing.h"
+#include "log.h"
+#include "metrics.h"
+#include "proxy.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* Request a sibling is checked with and the status line it must answer */
+#define UPSTREAM_CHECK_REQUEST "GET " METRICS_URI " HTTP/1.0\r\n\r\n"
+#define UPSTREAM_STATUS_LEN 12
+
+/* Siblings shared by every front end thread, read-only once initialised */
+static Upstream upstream;
+
+/* Function prototyping */
+static struct addrinfo *upstream_resolve(upstream_peer *peer);
+static void *upstream_check_thread(void *vargp);
+
+/**
+ * @brief Hashes a key onto the ring, FNV-1a with a final mix so that keys
+ * differing in their last bytes only land far apart
+ *
+ *
+ * @param[in]   *key            URI or sibling point name
+ *
+ * @return      uint32_t        Position on the ring
+ */
+static uint32_t upstream_hash(const char *key) {
+    uint32_t hash = 2166136261u;
+    while (*key != '\0') {
+        hash ^= (unsigned char)*key++;
+        hash *= 16777619u;
+    }
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+/**
+ * @brief qsort() comparator ordering ring points by position
+ *
+ *
+ * @param[in]   *a              First upstream_vnode
+ * @param[in]   *b              Second upstream_vnode
+ *
+ * @return      int             Negative, zero or positive as a is before, at
+ * or after b
+ */
+static int upstream_vnode_cmp(const void *a, const void *b) {
+    uint32_t pointA = ((const upstream_vnode *)a)->point;
+    uint32_t pointB = ((const upstream_vnode *)b)->point;
+    return (pointA > pointB) - (pointA < pointB);
+}
+
+/**
+ * @brief Parses the sibling list and builds the ring, then starts the health
+ * check thread. A NULL list leaves routing disabled.
+ *
+ *
+ * @param[in]   *peerList       Comma separated host:port of every sibling
+ * @param[in]   *self           host:port of this proxy in the list, NULL when
+ * it only forwards to the siblings
+ *
+ * @return      void
+ */
+void upstream_init(const char *peerList, const char *self) {
+    char *list, *entry, *savePtr, *colon;
+    char point[MAXLINE];
+    upstream_peer *peer;
+    size_t i, j;
+    pthread_t tid;
+    bool selfFound = false;
+    struct addrinfo *addrs;
+
+    memset(&upstream, 0, sizeof(Upstream));
+    if (peerList == NULL) {
+        return;
+    }
+    list = Malloc(strlen(peerList) + 1);
+    strcpy(list, peerList);
+    upstream.peers = Calloc(UPSTREAM_MAX_PEERS, sizeof(upstream_peer));
+    for (entry = strtok_r(list, ",", &savePtr); entry != NULL;
+         entry = strtok_r(NULL, ",", &savePtr)) {
+        if ((colon = strrchr(entry, ':')) == NULL || colon == entry ||
+            colon[1] == '\0' || upstream.peerCnt == UPSTREAM_MAX_PEERS) {
+            fprintf(stderr, "Error: Initizing upstream sibling %s\n", entry);
+            exit(1);
+        }
+        peer = &upstream.peers[upstream.peerCnt++];
+        peer->self = self != NULL && strcmp(entry, self) == 0;
+        *colon = '\0';
+        peer->host = Malloc(strlen(entry) + 1);
+        strcpy(peer->host, entry);
+        peer->port = Malloc(strlen(colon + 1) + 1);
+        strcpy(peer->port, colon + 1);
+        peer->healthy = 1;
+        selfFound = selfFound || peer->self;
+    }
+    Free(list);
+    if (upstream.peerCnt == 0) {
+        fprintf(stderr, "Error: Initizing upstream, no sibling given\n");
+        exit(1);
+    }
+    if (self != NULL && !selfFound) {
+        fprintf(stderr, "Error: Initizing upstream, %s is not a sibling\n",
+                self);
+        exit(1);
+    }
+
+    /* Every node builds the same ring from the same list */
+    upstream.ring =
+        Malloc(upstream.peerCnt * UPSTREAM_VNODES * sizeof(upstream_vnode));
+    for (i = 0; i < upstream.peerCnt; i++) {
+        peer = &upstream.peers[i];
+        for (j = 0; j < UPSTREAM_VNODES; j++) {
+            snprintf(point, sizeof(point), "%s:%s#%zu", peer->host, peer->port,
+                     j);
+            upstream.ring[upstream.ringLen].point = upstream_hash(point);
+            upstream.ring[upstream.ringLen].peer = peer;
+            upstream.ringLen++;
+        }
+    }
+    qsort(upstream.ring, upstream.ringLen, sizeof(upstream_vnode),
+          upstream_vnode_cmp);
+    if ((pthread_mutex_init(&upstream.addrLock, NULL)) != 0) {
+        fprintf(stderr, "Error: Initizing upstream mutex");
+    }
+    /* Siblings are trusted from the first request on */
+    for (i = 0; i < upstream.peerCnt; i++) {
+        if (!upstream.peers[i].self &&
+            (addrs = upstream_resolve(&upstream.peers[i])) != NULL) {
+            dns_freeaddrinfo(addrs);
+        }
+    }
+    Pthread_create(&tid, NULL, upstream_check_thread, NULL);
+}
+
+/**
+ * @brief Points at the IP address of a socket address, IPv4 mapped IPv6
+ * addresses as plain IPv4
+ *
+ *
+ * @param[in]   *addr           Socket address
+ * @param[out]  *len            Bytes of the IP address
+ *
+ * @return      const uint8_t*  IP address, NULL for other families
+ */
+static const uint8_t *upstream_ip(const struct sockaddr *addr, size_t *len) {
+    const uint8_t *ip;
+
+    if (addr->sa_family == AF_INET) {
+        *len = 4;
+        return (const uint8_t *)&((const struct sockaddr_in *)addr)->sin_addr;
+    }
+    if (addr->sa_family != AF_INET6) {
+        return NULL;
+    }
+    ip = (const uint8_t *)&((const struct sockaddr_in6 *)addr)->sin6_addr;
+    if (IN6_IS_ADDR_V4MAPPED((const struct in6_addr *)ip)) {
+        *len = 4;
+        return ip + 12;
+    }
+    *len = 16;
+    return ip;
+}
+
+/**
+ * @brief Tells whether a connection comes from the address of a sibling, as
+ * resolved by the last health check
+ *
+ *
+ * @param[in]   clientfd        Client connection
+ *
+ * @return      bool            true when a sibling may have sent it
+ */
+static bool upstream_from_sibling(int clientfd) {
+    struct sockaddr_storage client;
+    socklen_t clientLen = sizeof(client);
+    const uint8_t *clientIp, *ip;
+    size_t clientIpLen, ipLen, i, j;
+    upstream_peer *peer;
+    bool found = false;
+
+    if (getpeername(clientfd, (struct sockaddr *)&client, &clientLen) < 0 ||
+        (clientIp = upstream_ip((struct sockaddr *)&client, &clientIpLen)) ==
+            NULL) {
+        return false;
+    }
+    pthread_mutex_lock(&upstream.addrLock);
+    for (i = 0; i < upstream.peerCnt && !found; i++) {
+        peer = &upstream.peers[i];
+        for (j = 0; j < peer->addrCnt && !found; j++) {
+            found = (ip = upstream_ip((struct sockaddr *)&peer->addrs[j],
+                                      &ipLen)) != NULL &&
+                    ipLen == clientIpLen && memcmp(ip, clientIp, ipLen) == 0;
+        }
+    }
+    pthread_mutex_unlock(&upstream.addrLock);
+    return found;
+}
+
+/**
+ * @brief Tells whether a request was already routed here by a sibling
+ *
+ *
+ * @param[in]   *client_hdrs    Request headers
+ * @param[in]   clientfd        Client connection
+ *
+ * @return      bool            true when the hop header is present and the
+ * connection comes from a sibling
+ */
+static bool upstream_hopped(const char *client_hdrs, int clientfd) {
+    const char *line = client_hdrs;
+    while (line != NULL && *line != '\0') {
+        if (framing_header_value(line, UPSTREAM_HOP_HEADER) != NULL) {
+            return upstream_from_sibling(clientfd);
+        }
+        if ((line = strchr(line, '\n')) != NULL) {
+            line++;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Picks the sibling a miss is fetched through
+ *
+ * The owner is the sibling of the first ring point at or after the hash of
+ * the URI. Siblings out of the ring are passed over in ring order, so their
+ * misses spread over the following siblings.
+ *
+ *
+ * @param[in]   *uri            Request URI, the cache key
+ * @param[in]   *client_hdrs    Request headers
+ * @param[in]   clientfd        Client connection, checked before honouring
+ * the hop header
+ *
+ * @return      upstream_peer*  Sibling to send the request to, NULL to fetch
+ * it from the end server
+ */
+upstream_peer *upstream_route(const char *uri, const char *client_hdrs,
+                              int clientfd) {
+    uint32_t hash;
+    size_t low, high, mid, i;
+    upstream_peer *peer;
+
+    if (upstream.peers == NULL || upstream_hopped(client_hdrs, clientfd)) {
+        return NULL;
+    }
+    hash = upstream_hash(uri);
+    low = 0;
+    high = upstream.ringLen;
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        if (upstream.ring[mid].point < hash) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    for (i = 0; i < upstream.ringLen; i++) {
+        peer = upstream.ring[(low + i) % upstream.ringLen].peer;
+        if (peer->self) {
+            return NULL;
+        }
+        if (__atomic_load_n(&peer->healthy, __ATOMIC_RELAXED)) {
+            return peer;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Takes a sibling that could not be reached out of the ring until it
+ * passes a health check again
+ *
+ *
+ * @param[in]   *peer           Sibling returned by upstream_route()
+ *
+ * @return      void
+ */
+void upstream_failed(upstream_peer *peer) {
+    if (__atomic_exchange_n(&peer->healthy, 0, __ATOMIC_RELAXED)) {
+        log_printf(LOG_LEVEL_ERROR, "sibling %s:%s unreachable, skipped\n",
+                   peer->host, peer->port);
+    }
+}
+
+/**
+ * @brief Adds the hop header to a request head ending with its empty line
+ *
+ *
+ * @param[in,out] *request      NUL terminated request head
+ * @param[in]   size            Room in request
+ *
+ * @return      size_t          New length of the request, unchanged if the
+ * request has no room for the header
+ */
+size_t upstream_add_hop(char *request, size_t size) {
+    static const char hop[] = UPSTREAM_HOP_HEADER ": 1\r\n";
+    size_t reqLen = strlen(request), hopLen = sizeof(hop) - 1;
+
+    if (reqLen < 2 || reqLen + hopLen >= size) {
+        return reqLen;
+    }
+    /* Insert in front of the empty line ending the head */
+    memmove(request + reqLen - 2 + hopLen, request + reqLen - 2, 3);
+    memcpy(request + reqLen - 2, hop, hopLen);
+    return reqLen + hopLen;
+}
+
+/**
+ * @brief Waits for a socket to become ready within the check timeout
+ *
+ *
+ * @param[in]   fd              Socket
+ * @param[in]   events          poll() events waited for
+ *
+ * @return      bool            true when ready in time
+ */
+static bool upstream_wait(int fd, short events) {
+    struct pollfd pfd;
+    int rc;
+
+    pfd.fd = fd;
+    pfd.events = events;
+    while ((rc = poll(&pfd, 1, UPSTREAM_CHECK_TIMEOUT_MS)) < 0 &&
+           errno == EINTR)
+        ;
+    return rc > 0;
+}
+
+/**
+ * @brief Fetches the metrics page of a sibling at one address, every step
+ * bounded by the check timeout
+ *
+ *
+ * @param[in]   *addr           Sibling address
+ *
+ * @return      bool            true when it answered with a 200 status
+ */
+static bool upstream_probe(const struct addrinfo *addr) {
+    char status[UPSTREAM_STATUS_LEN];
+    size_t got = 0;
+    ssize_t n;
+    int fd, err = 0;
+    socklen_t errLen = sizeof(err);
+    bool ok = false;
+
+    if ((fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol)) <
+        0) {
+        return false;
+    }
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) < 0 ||
+        (connect(fd, addr->ai_addr, addr->ai_addrlen) < 0 &&
+         errno != EINPROGRESS) ||
+        !upstream_wait(fd, POLLOUT) ||
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errLen) < 0 || err != 0 ||
+        write(fd, UPSTREAM_CHECK_REQUEST, strlen(UPSTREAM_CHECK_REQUEST)) !=
+            (ssize_t)strlen(UPSTREAM_CHECK_REQUEST)) {
+        close(fd);
+        return false;
+    }
+    while (got < sizeof(status) && upstream_wait(fd, POLLIN)) {
+        if ((n = read(fd, status + got, sizeof(status) - got)) <= 0) {
+            break;
+        }
+        got += (size_t)n;
+    }
+    /* "HTTP/1.x 200" */
+    ok = got == sizeof(status) && strncmp(status, "HTTP/1.", 7) == 0 &&
+         strncmp(status + 8, " 200", 4) == 0;
+    close(fd);
+    return ok;
+}
+
+/**
+ * @brief Resolves a sibling and remembers its addresses for
+ * upstream_from_sibling(), a failed lookup keeps the previous ones
+ *
+ *
+ * @param[in]   *peer           Sibling
+ *
+ * @return      struct addrinfo*    Addresses, freed with dns_freeaddrinfo(),
+ * NULL when the lookup failed
+ */
+static struct addrinfo *upstream_resolve(upstream_peer *peer) {
+    struct addrinfo *list, *addr;
+    size_t addrCnt = 0;
+
+    if (dns_getaddrinfo(peer->host, peer->port, &list) != 0) {
+        return NULL;
+    }
+    pthread_mutex_lock(&upstream.addrLock);
+    for (addr = list; addr != NULL && addrCnt < DNS_MAX_ADDRS;
+         addr = addr->ai_next) {
+        memcpy(&peer->addrs[addrCnt++], addr->ai_addr, addr->ai_addrlen);
+    }
+    peer->addrCnt = addrCnt;
+    pthread_mutex_unlock(&upstream.addrLock);
+    return list;
+}
+
+/**
+ * @brief Checks one sibling at each of its addresses until one answers
+ *
+ *
+ * @param[in]   *peer           Sibling
+ *
+ * @return      bool            true when the sibling is healthy
+ */
+static bool upstream_check(upstream_peer *peer) {
+    struct addrinfo *list, *addr;
+    bool ok = false;
+
+    if ((list = upstream_resolve(peer)) == NULL) {
+        return false;
+    }
+    for (addr = list; addr != NULL && !ok; addr = addr->ai_next) {
+        ok = upstream_probe(addr);
+    }
+    dns_freeaddrinfo(list);
+    return ok;
+}
+
+/**
+ * @brief Health check thread, checks every other sibling periodically and
+ * moves it in or out of the ring
+ *
+ *
+ * @param[in]   *vargp          Unused
+ *
+ * @return      void*           Never returns
+ */
+static void *upstream_check_thread(void *vargp) {
+    upstream_peer *peer;
+    size_t i;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        for (i = 0; i < upstream.peerCnt; i++) {
+            peer = &upstream.peers[i];
+            if (peer->self) {
+                continue;
+            }
+            if (upstream_check(peer)) {
+                peer->failures = 0;
+                if (!__atomic_exchange_n(&peer->healthy, 1,
+                                         __ATOMIC_RELAXED)) {
+                    log_printf(LOG_LEVEL_INFO, "sibling %s:%s is back\n",
+                               peer->host, peer->port);
+                }
+            } else if (++peer->failures >= UPSTREAM_FALL &&
+                       __atomic_exchange_n(&peer->healthy, 0,
+                                           __ATOMIC_RELAXED)) {
+                log_printf(LOG_LEVEL_ERROR,
+                           "sibling %s:%s failed its health checks\n",
+                           peer->host, peer->port);
+            }
+        }
+        sleep(UPSTREAM_CHECK_SECS);
+    }
+    return NULL;
+}
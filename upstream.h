@@ -0,0 +1,66 @@
+/**
+ * @file upstream.h
+ * @brief Header file for the routing of misses across sibling proxies
+ *
+ * Description: Misses are routed by consistent hashing of their URI to the
+ * sibling proxy that owns it, skipping siblings failing their health checks,
+ * defines, structures and function prototypes.
+ *
+ *
+ * @author Abhishek Basrithaya <abasrith@andrew.cmu.edu>
+ */
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+
+#include "dns.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/* Points every sibling gets on the hash ring */
+#define UPSTREAM_VNODES 100
+#define UPSTREAM_MAX_PEERS 64
+/* Seconds between health checks and milliseconds a check may take */
+#define UPSTREAM_CHECK_SECS 2
+#define UPSTREAM_CHECK_TIMEOUT_MS 1000
+/* Consecutive failed checks taking a sibling out of the ring */
+#define UPSTREAM_FALL 2
+/*
+ * Marks requests already routed by a sibling, they are never routed again;
+ * only honoured on connections from a sibling's address
+ */
+#define UPSTREAM_HOP_HEADER "X-Proxy-Peer"
+
+typedef struct {
+    char *host;                                   /* sibling host */
+    char *port;                                   /* sibling port */
+    bool self;                                    /* this proxy */
+    int healthy;                                  /* last check, atomic */
+    int failures;                                 /* failed checks in a row */
+    struct sockaddr_storage addrs[DNS_MAX_ADDRS]; /* addresses last resolved */
+    size_t addrCnt;                               /* addresses held */
+} upstream_peer;
+
+typedef struct {
+    uint32_t point;      /* position on the ring */
+    upstream_peer *peer; /* sibling owning the arc ending at point */
+} upstream_vnode;
+
+typedef struct {
+    upstream_peer *peers;     /* configured siblings, NULL when disabled */
+    size_t peerCnt;           /* number of siblings */
+    upstream_vnode *ring;     /* points of every sibling, sorted */
+    size_t ringLen;           /* number of points */
+    pthread_mutex_t addrLock; /* protects the addresses of every sibling */
+} Upstream;
+
+/* Function prototyping */
+void upstream_init(const char *peerList, const char *self);
+upstream_peer *upstream_route(const char *uri, const char *client_hdrs,
+                              int clientfd);
+void upstream_failed(upstream_peer *peer);
+size_t upstream_add_hop(char *request, size_t size);
+
+#endif /* UPSTREAM_H */